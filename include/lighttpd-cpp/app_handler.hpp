@@ -0,0 +1,392 @@
+/**
+ * Dynamic responses generated in process, for endpoints small enough that
+ * a FastCGI round trip would cost more than the work itself.
+ *
+ * A plugin derives from app_handler< MostDerived > as well as Plugin<>,
+ * and declares its routes in its constructor:
+ *
+ *  class mod_hello : public Plugin< mod_hello >, public app_handler< mod_hello >
+ *  {
+ *  public:
+ *  	mod_hello( server& srv ) : Plugin< mod_hello >( srv ), app_handler< mod_hello >( srv )
+ *  	{
+ *  		route( HTTP_METHOD_GET, "/health", &mod_hello::health );
+ *  		route( HTTP_METHOD_GET, "/users/", &mod_hello::user, PREFIX );
+ *  	}
+ *
+ *  	typedef app_handler< mod_hello >::handlers handlers;
+ *
+ *  	void health( app_request& req, app_response& res )
+ *  	{
+ *  		res.header( "Content-Type", "text/plain" );
+ *  		res << "ok\n";
+ *  	}
+ *  	...
+ *  };
+ *
+ * Routes are claimed in handle_start_backend by con.uri.path, exact ones
+ * first and then the longest matching prefix.  A path that matches with
+ * another method gets a 405 with an Allow header, one that doesn't match
+ * at all is left for the next plugin.  MostDerived can also define
+ * accepts( connection& ) to decline per context (i.e. on a config option).
+ *
+ * The handler runs once all of the request body has been read, so that
+ * app_request can hand it the whole of it: a request whose body is still
+ * arriving is taken and waits, and handle_send_request_content brings it
+ * back once the last of it is in.
+ *
+ * The response is written straight into con.write_queue through the
+ * response_builder app_response derives from, and the request is finished
+ * when the handler returns.  A handler that throws gets a 500.
+ */
+
+#ifndef _LIGHTTPD_APP_HANDLER_HPP_
+#define _LIGHTTPD_APP_HANDLER_HPP_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "plugin.hpp"
+#include "http_scanner.hpp"
+#include "response_builder.hpp"
+
+/**
+ * What the handler gets to see of the request.
+ */
+class app_request : boost::noncopyable
+{
+public:
+	app_request( connection& con )
+	 : con( con ), c( con.request_content_queue ? con.request_content_queue->first : 0 ), offset( 0 )
+	{}
+
+	http_method_t method( ) const { return con.request.http_method; }
+
+	http_span path( ) const { return span( con.uri.path ); }
+	http_span query( ) const { return span( con.uri.query ); }
+
+	// Empty if the request has no such header.
+	http_span header( const char* name ) const
+	{
+		data_string* ds = reinterpret_cast< data_string* >(
+			array_get_element( con.request.headers, name, std::strlen( name ) ) );
+		return ds ? span( ds->value ) : http_span( );
+	}
+
+	off_t content_length( ) const { return con.request.content_length; }
+
+	// The next up to n bytes of the body, 0 at its end.
+	std::size_t read( char* buf, std::size_t n )
+	{
+		for( ; c; c = c->next, offset = 0 )
+		{
+			off_t left = 0;
+			if( c->type == chunk::MEM_CHUNK )
+				left = c->mem->used ? c->mem->used - 1 - c->offset - offset : 0;
+			else if( c->type == chunk::FILE_CHUNK )
+				left = c->file.length - c->offset - offset;
+			if( left <= 0 ) continue;
+
+			std::size_t len = static_cast< std::size_t >( std::min( static_cast< off_t >( n ), left ) );
+
+			if( c->type == chunk::MEM_CHUNK )
+			{
+				std::memcpy( buf, c->mem->ptr + c->offset + offset, len );
+			}
+			else
+			{
+				// The chunkqueue closes it with the rest.
+				if( c->file.fd == -1 && -1 == ( c->file.fd = open( c->file.name->ptr, O_RDONLY | O_CLOEXEC ) ) )
+					return 0;
+
+				ssize_t r = pread( c->file.fd, buf, len, c->file.start + c->offset + offset );
+				if( r <= 0 ) return 0;
+				len = r;
+			}
+
+			offset += len;
+			return len;
+		}
+		return 0;
+	}
+
+	// The rest of the body in one go.
+	std::string body( )
+	{
+		std::string s;
+		char buf[ 4096 ];
+		for( std::size_t n; ( n = read( buf, sizeof( buf ) ) ); )
+			s.append( buf, n );
+		return s;
+	}
+
+	connection& con;
+
+private:
+	static http_span span( const buffer* b )
+	{
+		return b && b->used ? http_span( b->ptr, b->used - 1 ) : http_span( );
+	}
+
+	// Where read( ) is up to.
+	chunk* c;
+	off_t offset;
+};
+
+/**
+ * The status and headers of the response, and the body through the
+ * response_builder interface.
+ */
+class app_response : public response_builder
+{
+public:
+	app_response( server& srv, connection& con )
+	 : response_builder( con.write_queue ), srv( srv ), con( con ), code( 200 )
+	{}
+
+	app_response& status( int s )
+	{
+		code = s;
+		return *this;
+	}
+
+	int status( ) const { return code; }
+
+	// Added to, not replacing, any header of the same name.
+	app_response& header( const char* name, const char* value )
+	{
+		return header( name, std::strlen( name ), value, std::strlen( value ) );
+	}
+
+	app_response& header( const char* name, std::size_t name_len, const char* value, std::size_t value_len )
+	{
+		response_header_insert( &srv, &con, name, name_len, value, value_len );
+		return *this;
+	}
+
+private:
+	server& srv;
+	connection& con;
+	int code;
+};
+
+template < typename MostDerived >
+class app_handler : boost::noncopyable
+{
+public:
+	typedef boost::mpl::list< 	StartBackendHandler,
+								SendRequestContentHandler,
+								ConnectionResetHandler > handlers;
+	typedef void ( MostDerived::*handler_type )( app_request&, app_response& );
+
+	enum match_type { EXACT, PREFIX };
+
+	app_handler( server& srv ) : app_srv( srv ) {}
+
+	// method HTTP_METHOD_UNSET for any.
+	void route( http_method_t method, const std::string& path, handler_type handler, match_type match = EXACT )
+	{
+		route_type r = { path, method, handler };
+
+		if( match == EXACT )
+		{
+			exact.insert( std::upper_bound( exact.begin( ), exact.end( ), r, path_less( ) ), r );
+		}
+		else
+		{
+			// Longest first.
+			typename route_list::iterator i = prefixes.begin( );
+			while( i != prefixes.end( ) && i->path.size( ) >= path.size( ) ) ++i;
+			prefixes.insert( i, r );
+		}
+	}
+
+	// Everything, unless MostDerived says otherwise.
+	bool accepts( connection& con ) { return true; }
+
+	handler_t handle_start_backend( connection& con )
+	{
+		MostDerived& self = static_cast< MostDerived& >( *this );
+
+		// Ours, back with all of its body.
+		if( handler_type handler = waiting_on( con ) )
+		{
+			if( !body_read( con ) ) return HANDLER_WAIT_FOR_EVENT;
+
+			waiting[ con.ndx ] = 0;
+			return dispatch( con, handler );
+		}
+
+		if( con.mode != DIRECT || buffer_is_empty( con.uri.path ) ) return HANDLER_GO_ON;
+		if( !self.accepts( con ) ) return HANDLER_GO_ON;
+
+		const char* path = con.uri.path->ptr;
+		std::size_t len = con.uri.path->used - 1;
+		http_method_t method = con.request.http_method;
+
+		const route_type* found = 0;
+		std::string allow;
+
+		// Exact routes with this path, then the prefixes it starts with.
+		typename route_list::const_iterator i = std::lower_bound( exact.begin( ), exact.end( ), http_span( path, len ), path_less( ) );
+		for( ; i != exact.end( ) && i->path.size( ) == len && 0 == std::memcmp( i->path.data( ), path, len ); ++i )
+		{
+			if( match( *i, method, found, allow ) ) break;
+		}
+
+		for( i = prefixes.begin( ); !found && i != prefixes.end( ); ++i )
+		{
+			if( i->path.size( ) > len || 0 != std::memcmp( i->path.data( ), path, i->path.size( ) ) ) continue;
+			if( match( *i, method, found, allow ) ) break;
+		}
+
+		if( !found && allow.empty( ) ) return HANDLER_GO_ON;
+
+		if( !found )
+		{
+			response_header_overwrite( &app_srv, &con, CONST_STR_LEN( "Allow" ), allow.data( ), allow.size( ) );
+			con.http_status = 405;
+			return HANDLER_FINISHED;
+		}
+
+		if( !body_read( con ) )
+		{
+			std::size_t ndx = static_cast< std::size_t >( con.ndx );
+			if( ndx >= waiting.size( ) ) waiting.resize( ndx + 1, 0 );
+			waiting[ ndx ] = found->handler;
+
+			con.mode = static_cast< connection_type >( self.id( ) );
+			return HANDLER_WAIT_FOR_EVENT;
+		}
+
+		return dispatch( con, found->handler );
+	}
+
+	// More of the body is in, come back to a request waiting for the last
+	// of it.
+	handler_t handle_send_request_content( connection& con )
+	{
+		if( waiting_on( con ) && body_read( con ) ) joblist_append( &app_srv, &con );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t connection_reset( connection& con )
+	{
+		if( waiting_on( con ) ) waiting[ con.ndx ] = 0;
+		return HANDLER_GO_ON;
+	}
+
+	// Whether all of the request body has been read, or all there is going
+	// to be.
+	static bool body_read( const connection& con )
+	{
+		const chunkqueue* cq = con.request_content_queue;
+		return !cq || cq->is_closed || cq->bytes_in >= static_cast< off_t >( con.request.content_length );
+	}
+
+protected:
+	handler_t dispatch( connection& con, handler_type handler )
+	{
+		// Closed on us part way through the body.
+		const chunkqueue* cq = con.request_content_queue;
+		if( cq && cq->bytes_in < static_cast< off_t >( con.request.content_length ) ) return HANDLER_ERROR;
+
+		MostDerived& self = static_cast< MostDerived& >( *this );
+		app_request req( con );
+		app_response res( app_srv, con );
+		bool threw = false;
+		try
+		{
+			( self.*handler )( req, res );
+		}
+		catch( ... )
+		{
+			threw = true;
+		}
+
+		// Don't send half a body with an error.
+		if( threw || res.failed( ) )
+		{
+			chunkqueue_reset( con.write_queue );
+			res.status( 500 );
+		}
+
+		con.http_status = res.status( );
+		con.file_finished = 1;
+		return HANDLER_FINISHED;
+	}
+
+	// The handler a request on con is waiting to run, if any.
+	handler_type waiting_on( const connection& con ) const
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		return ndx < waiting.size( ) ? waiting[ ndx ] : 0;
+	}
+
+	struct route_type
+	{
+		std::string path;
+		http_method_t method;
+		handler_type handler;
+	};
+
+	typedef std::vector< route_type > route_list;
+
+	struct path_less
+	{
+		bool operator()( const route_type& a, const route_type& b ) const { return a.path < b.path; }
+
+		bool operator()( const route_type& a, const http_span& b ) const
+		{
+			return compare( a.path, b ) < 0;
+		}
+
+		bool operator()( const http_span& a, const route_type& b ) const
+		{
+			return compare( b.path, a ) > 0;
+		}
+
+		static int compare( const std::string& a, const http_span& b )
+		{
+			int c = std::memcmp( a.data( ), b.ptr, std::min( a.size( ), b.len ) );
+			if( c ) return c;
+			return a.size( ) < b.len ? -1 : a.size( ) > b.len ? 1 : 0;
+		}
+	};
+
+	// Does r take the request, noting its method for an Allow if not.
+	static bool match( const route_type& r, http_method_t method, const route_type*& found, std::string& allow )
+	{
+		if( r.method == HTTP_METHOD_UNSET || r.method == method || ( method == HTTP_METHOD_HEAD && r.method == HTTP_METHOD_GET ) )
+		{
+			found = &r;
+			return true;
+		}
+
+		if( !allow.empty( ) ) allow.append( ", " );
+		allow.append( get_http_method_name( r.method ) );
+		return false;
+	}
+
+	// Named so as not to clash with plugin_base::srv in MostDerived.
+	server& app_srv;
+
+	// Sorted by path.
+	route_list exact;
+
+	// Longest first.
+	route_list prefixes;
+
+	// By con.ndx, the handlers of requests waiting for their bodies.
+	std::vector< handler_type > waiting;
+};
+
+#endif // _LIGHTTPD_APP_HANDLER_HPP_
@@ -0,0 +1,456 @@
+/**
+ * Resumable backend handlers, so that plugins talking to a backend don't
+ * have to hand write the state machine around HANDLER_WAIT_FOR_EVENT,
+ * fdevent registration and the joblist.
+ *
+ * A plugin derives from async_backend< MostDerived, Task > as well as
+ * Plugin<>, and writes Task as a stackless coroutine (boost::asio's, no
+ * C++ coroutine support needed from the compiler) over the connection:
+ *
+ *  struct echo_task : async_task
+ *  {
+ *  	echo_task( mod_echo& p, connection& con ) : ... {}
+ *
+ *  	handler_t operator()( async_context& ctx )
+ *  	{
+ *  		BOOST_ASIO_CORO_REENTER( this )
+ *  		{
+ *  			...
+ *  			BOOST_ASIO_CORO_YIELD return ctx.writable( fd );
+ *  			...
+ *  			BOOST_ASIO_CORO_YIELD return ctx.readable( fd, 30 );
+ *  			if( ctx.timed_out( ) ) return HANDLER_ERROR;
+ *  			...
+ *  		}
+ *  		return HANDLER_FINISHED;
+ *  	}
+ *  };
+ *
+ * Anything the task needs across a yield has to be a member, locals don't
+ * survive.  Returning HANDLER_GO_ON before the first yield declines the
+ * request, as a plain handle_start_backend would.
+ *
+ * While suspended the fd is registered with srv->ev; the event (or the
+ * timeout, or an async_event being signalled) puts the connection on the
+ * joblist and the task is resumed when lighttpd calls handle_start_backend
+ * again.  Timeouts are checked from handle_trigger, so have a one second
+ * resolution.
+ *
+ * A request body may still be arriving when the task starts.  A task
+ * that wants the rest waits with ctx.request_body( ), which returns once
+ * the core has read more of it into con.request_content_queue (it calls
+ * handle_send_request_content for that).  The client going quiet is left
+ * to the core's read timeout, which resets the connection.
+ *
+ * A task filling con.write_queue faster than the client takes it waits
+ * with ctx.drained( n ), which returns once no more than n bytes are
+ * left to send.  The core puts the connection on the joblist as it
+ * writes to the client, and handle_joblist wakes the task from there.
+ *
+ * Task frames live in per-connection slots that are reused from request
+ * to request, so a busy keep-alive connection never allocates one.
+ */
+
+#ifndef _LIGHTTPD_ASYNC_HANDLER_HPP_
+#define _LIGHTTPD_ASYNC_HANDLER_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "plugin.hpp"
+
+class async_event;
+
+/**
+ * Per-connection state of a task: what it is waiting on and the memory its
+ * frame lives in.
+ */
+struct async_slot : boost::noncopyable
+{
+	enum wait_type { WAIT_NONE, WAIT_FD, WAIT_TIMER, WAIT_EVENT, WAIT_BODY, WAIT_DRAIN };
+
+	async_slot( server& srv, std::size_t frame_size )
+	 :	frame( ::operator new( frame_size ) ), live( false ),
+		srv( srv ), con( 0 ), sock( iosocket_init( ) ),
+		wait( WAIT_NONE ), events( 0 ), deadline( 0 ), event( 0 ), drain_below( 0 ),
+		ready( false ), revents( 0 ), timed_out( false )
+	{}
+
+	~async_slot( )
+	{
+		unwatch( );
+		iosocket_free( sock );
+		::operator delete( frame );
+	}
+
+	// Registered with fdevent while we wait on a fd.
+	static handler_t on_fdevent( void* s, void* ctx, int revents )
+	{
+		async_slot* slot = reinterpret_cast< async_slot* >( ctx );
+		slot->unwatch( );
+		slot->revents = revents;
+		slot->wake( );
+		return HANDLER_GO_ON;
+	}
+
+	void watch( int fd, int events )
+	{
+		sock->fd = fd;
+		fdevent_register( srv.ev, sock, &on_fdevent, this );
+		fdevent_event_add( srv.ev, sock, events );
+		wait = WAIT_FD;
+		this->events = events;
+	}
+
+	// Drop whatever we are waiting on.
+	inline void unwatch( );
+
+	// Waiting for the client to take enough of the write queue, and it has.
+	bool drained( ) const
+	{
+		return wait == WAIT_DRAIN
+			&& chunkqueue_length( con->write_queue ) - chunkqueue_written( con->write_queue ) <= drain_below;
+	}
+
+	// Runnable again, have lighttpd come back to the connection.
+	void wake( )
+	{
+		wait = WAIT_NONE;
+		deadline = 0;
+		ready = true;
+		joblist_append( &srv, con );
+	}
+
+	void* frame;
+	bool live;
+
+	server& srv;
+	connection* con;
+	iosocket* sock;
+
+	wait_type wait;
+	int events;
+	time_t deadline;
+	async_event* event;
+	off_t drain_below;
+
+	// Set when woken.
+	bool ready;
+	int revents;
+	bool timed_out;
+};
+
+/**
+ * Something tasks can wait on that other code signals, i.e. another
+ * handler finishing.  Must outlive its waiters.
+ */
+class async_event : boost::noncopyable
+{
+public:
+	~async_event( )
+	{
+		signal( );
+	}
+
+	// Wake everyone waiting.
+	void signal( )
+	{
+		std::vector< async_slot* > woken;
+		woken.swap( waiters );
+		for( std::vector< async_slot* >::iterator i = woken.begin( ); i != woken.end( ); ++i )
+		{
+			(*i)->event = 0;
+			(*i)->wake( );
+		}
+	}
+
+	std::size_t waiting( ) const { return waiters.size( ); }
+
+	void add( async_slot& slot )
+	{
+		waiters.push_back( &slot );
+		slot.event = this;
+		slot.wait = async_slot::WAIT_EVENT;
+	}
+
+	void remove( async_slot& slot )
+	{
+		waiters.erase( std::remove( waiters.begin( ), waiters.end( ), &slot ), waiters.end( ) );
+		slot.event = 0;
+	}
+
+private:
+	std::vector< async_slot* > waiters;
+};
+
+inline void async_slot::unwatch( )
+{
+	if( wait == WAIT_FD && sock->fd != -1 )
+	{
+		fdevent_event_del( srv.ev, sock );
+		fdevent_unregister( srv.ev, sock );
+	}
+
+	// The fd belongs to the task, don't let iosocket_free close it.
+	sock->fd = -1;
+
+	if( event ) event->remove( *this );
+
+	wait = WAIT_NONE;
+	deadline = 0;
+}
+
+/**
+ * Handed to a task each time it is resumed.  The waiting functions record
+ * what to wait on and return HANDLER_WAIT_FOR_EVENT, for the task to
+ * yield.  A timeout of 0 waits forever.
+ */
+class async_context
+{
+public:
+	async_context( async_slot& slot )
+	 : slot( slot ), con( *slot.con ), srv( slot.srv )
+	{}
+
+	handler_t readable( int fd, time_t timeout = 0 )
+	{
+		slot.watch( fd, FDEVENT_IN );
+		return expire( timeout );
+	}
+
+	handler_t writable( int fd, time_t timeout = 0 )
+	{
+		slot.watch( fd, FDEVENT_OUT );
+		return expire( timeout );
+	}
+
+	handler_t sleep( time_t seconds )
+	{
+		if( !seconds ) return yield( );
+		slot.wait = async_slot::WAIT_TIMER;
+		return expire( seconds );
+	}
+
+	handler_t wait( async_event& ev, time_t timeout = 0 )
+	{
+		ev.add( slot );
+		return expire( timeout );
+	}
+
+	// Until more of the request body is in.
+	handler_t request_body( time_t timeout = 0 )
+	{
+		slot.wait = async_slot::WAIT_BODY;
+		return expire( timeout );
+	}
+
+	// Until no more than below bytes of con.write_queue are left to send.
+	handler_t drained( off_t below, time_t timeout = 0 )
+	{
+		slot.wait = async_slot::WAIT_DRAIN;
+		slot.drain_below = below;
+		return expire( timeout );
+	}
+
+	// Let the rest of the server run, then carry on.
+	handler_t yield( )
+	{
+		return HANDLER_WAIT_FOR_EVENT;
+	}
+
+	// Why we were woken.
+	int revents( ) const { return slot.revents; }
+	bool timed_out( ) const { return slot.timed_out; }
+
+	async_slot& slot;
+	connection& con;
+	server& srv;
+
+private:
+	handler_t expire( time_t timeout )
+	{
+		slot.deadline = timeout ? srv.cur_ts + timeout : 0;
+		return HANDLER_WAIT_FOR_EVENT;
+	}
+};
+
+/**
+ * Base for tasks, the coroutine state is all we need.
+ */
+struct async_task : boost::asio::coroutine
+{
+};
+
+/**
+ * Mixin for plugins with resumable backend handlers.  Provides the
+ * handle_start_backend, handle_send_request_content, handle_joblist,
+ * connection_reset, handle_connection_close and handle_trigger hooks, see handlers below.  Task is constructed from
+ * ( MostDerived&, connection& ) at the start of each request.
+ */
+template < typename MostDerived, typename Task >
+class async_backend : boost::noncopyable
+{
+public:
+	typedef boost::mpl::list< 	StartBackendHandler,
+								SendRequestContentHandler,
+								JoblistHandler,
+								ConnectionResetHandler,
+								ConnectionCloseHandler,
+								TriggerHandler > handlers;
+
+	async_backend( server& srv ) : backend_srv( srv ) {}
+
+	virtual ~async_backend( )
+	{
+		for( typename slot_list::iterator i = slots.begin( ); i != slots.end( ); ++i )
+		{
+			if( !*i ) continue;
+			finish( **i );
+			delete *i;
+		}
+	}
+
+	handler_t handle_start_backend( connection& con )
+	{
+		MostDerived& self = static_cast< MostDerived& >( *this );
+
+		// Somebody else's backend.
+		if( con.mode != DIRECT && static_cast< std::size_t >( con.mode ) != self.id( ) )
+			return HANDLER_GO_ON;
+
+		async_slot& slot = slot_for( con );
+
+		if( !slot.live )
+		{
+			new( slot.frame ) Task( self, con );
+			slot.live = true;
+		}
+		else if( !slot.ready )
+		{
+			// Come back round for something other than our wakeup.
+			return HANDLER_WAIT_FOR_EVENT;
+		}
+
+		return run( slot );
+	}
+
+	// More of the body is in, for a task waiting on it.
+	handler_t handle_send_request_content( connection& con )
+	{
+		async_slot* s = slot( con );
+		if( s && s->live && s->wait == async_slot::WAIT_BODY ) s->wake( );
+		return HANDLER_GO_ON;
+	}
+
+	// Back on the joblist, i.e. the core wrote some of the response, for a
+	// task waiting on the write queue to drain.
+	handler_t handle_joblist( connection& con )
+	{
+		async_slot* s = slot( con );
+		if( s && s->live && s->drained( ) ) s->wake( );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t connection_reset( connection& con )
+	{
+		if( static_cast< std::size_t >( con.ndx ) < slots.size( ) && slots[ con.ndx ] )
+			finish( *slots[ con.ndx ] );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_connection_close( connection& con )
+	{
+		return connection_reset( con );
+	}
+
+	// Expire timeouts.
+	handler_t handle_trigger( )
+	{
+		for( typename slot_list::iterator i = slots.begin( ); i != slots.end( ); ++i )
+		{
+			async_slot* slot = *i;
+			if( !slot || !slot->live || !slot->deadline || slot->deadline > backend_srv.cur_ts ) continue;
+
+			slot->unwatch( );
+			slot->timed_out = true;
+			slot->wake( );
+		}
+		return HANDLER_GO_ON;
+	}
+
+	// The slot of a connection, for tests and for plugins that want to
+	// peek at what a task is waiting on.
+	async_slot* slot( const connection& con ) const
+	{
+		return static_cast< std::size_t >( con.ndx ) < slots.size( ) ? slots[ con.ndx ] : 0;
+	}
+
+protected:
+	typedef std::vector< async_slot* > slot_list;
+
+	async_slot& slot_for( connection& con )
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		if( ndx >= slots.size( ) ) slots.resize( ndx + 1, 0 );
+		if( !slots[ ndx ] ) slots[ ndx ] = new async_slot( backend_srv, sizeof( Task ) );
+
+		slots[ ndx ]->con = &con;
+		return *slots[ ndx ];
+	}
+
+	handler_t run( async_slot& slot )
+	{
+		Task& task = *reinterpret_cast< Task* >( slot.frame );
+		async_context ctx( slot );
+		handler_t r;
+
+		try
+		{
+			r = task( ctx );
+		}
+		catch( ... )
+		{
+			r = HANDLER_ERROR;
+		}
+
+		slot.ready = false;
+		slot.revents = 0;
+		slot.timed_out = false;
+
+		if( r != HANDLER_WAIT_FOR_EVENT )
+		{
+			finish( slot );
+			return r;
+		}
+
+		// Ours until the task is done.
+		slot.con->mode = static_cast< connection_type >( static_cast< MostDerived& >( *this ).id( ) );
+
+		// Yielded without waiting on anything, or on a write queue that is
+		// short enough already, come straight back.
+		if( ( slot.wait == async_slot::WAIT_NONE && !slot.deadline ) || slot.drained( ) ) slot.wake( );
+
+		return r;
+	}
+
+	void finish( async_slot& slot )
+	{
+		if( !slot.live ) return;
+
+		slot.unwatch( );
+		reinterpret_cast< Task* >( slot.frame )->~Task( );
+		slot.live = false;
+		slot.ready = false;
+	}
+
+	// Named so as not to clash with plugin_base::srv in MostDerived.
+	server& backend_srv;
+	slot_list slots;
+};
+
+#endif // _LIGHTTPD_ASYNC_HANDLER_HPP_
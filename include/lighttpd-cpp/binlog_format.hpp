@@ -0,0 +1,280 @@
+/**
+ * The binary access log written by mod_binlog, and reading it back.
+ * Nothing in here needs lighttpd, so binlog2text can convert logs away
+ * from the server.
+ *
+ * A log is a binlog_file_header followed by records, each a binlog_head
+ * and then its fields:
+ *
+ *  binlog_head   length of the whole record, status, timings and byte counts
+ *  field         uint8 id, uint16 length, that many bytes
+ *  ...
+ *
+ * Numbers are in the writing host's byte order, which the header's
+ * byte_order says (readers on another order just refuse).  Several
+ * workers append to one file, each in whole records, so records from
+ * different workers are interleaved and only roughly in time order.
+ * Each worker that finds the file empty writes the header before its
+ * first record, so a log starts with one but may have more further on;
+ * readers skip those.
+ */
+
+#ifndef _LIGHTTPD_BINLOG_FORMAT_HPP_
+#define _LIGHTTPD_BINLOG_FORMAT_HPP_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+
+#include <stdint.h>
+
+enum binlog_field
+{
+	BINLOG_METHOD,
+	BINLOG_REMOTE_ADDR,
+	BINLOG_HOST,
+	BINLOG_URI,
+	BINLOG_REFERER,
+	BINLOG_USER_AGENT,
+	BINLOG_FIELD_COUNT
+};
+
+// As in binlog.fields.
+inline const char* binlog_field_name( int id )
+{
+	static const char* names[ BINLOG_FIELD_COUNT ] = { "method", "remote-addr", "host", "uri", "referer", "user-agent" };
+	return id >= 0 && id < BINLOG_FIELD_COUNT ? names[ id ] : "";
+}
+
+// -1 for none.
+inline int binlog_field_id( const std::string& name )
+{
+	for( int i = 0; i < BINLOG_FIELD_COUNT; ++i )
+	{
+		if( name == binlog_field_name( i ) ) return i;
+	}
+	return -1;
+}
+
+struct binlog_file_header
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t byte_order;
+
+	static binlog_file_header make( )
+	{
+		binlog_file_header h;
+		std::memcpy( h.magic, "LTBINLOG", 8 );
+		h.version = 1;
+		h.byte_order = 0x01020304;
+		return h;
+	}
+
+	bool valid( ) const
+	{
+		return 0 == std::memcmp( magic, "LTBINLOG", 8 ) && version == 1 && byte_order == 0x01020304;
+	}
+};
+
+struct binlog_head
+{
+	uint16_t length;
+	uint16_t status;
+	uint32_t duration_us;
+	uint64_t start_us;
+	int64_t bytes_in;
+	int64_t bytes_out;
+	uint8_t http_minor;
+	uint8_t fields;
+	uint16_t reserved;
+	uint32_t reserved2;
+};
+
+/**
+ * Puts a record together in caller's memory, max_size bytes of it (no
+ * more than 64KB).  Fields are cut short to fit.
+ */
+class binlog_encoder
+{
+public:
+	// Longest a field gets.
+	static const std::size_t max_field = 2048;
+
+	binlog_encoder( char* buf, std::size_t max_size )
+	 : buf( buf ), max_size( max_size ), used( sizeof( binlog_head ) )
+	{
+		std::memset( &head, 0, sizeof( head ) );
+	}
+
+	void field( int id, const char* p, std::size_t len )
+	{
+		if( used + 3 > max_size ) return;
+		len = std::min( len, max_size - used - 3 );
+		if( len > max_field ) len = max_field;
+
+		buf[ used ] = static_cast< char >( id );
+		uint16_t l = static_cast< uint16_t >( len );
+		std::memcpy( buf + used + 1, &l, 2 );
+		std::memcpy( buf + used + 3, p, len );
+		used += 3 + len;
+		++head.fields;
+	}
+
+	// The head goes in last, with the length.  Returns the size of the
+	// record at the start of buf.
+	std::size_t finish( )
+	{
+		head.length = static_cast< uint16_t >( used );
+		std::memcpy( buf, &head, sizeof( head ) );
+		return used;
+	}
+
+	binlog_head head;
+
+private:
+	char* buf;
+	std::size_t max_size;
+	std::size_t used;
+};
+
+/**
+ * One record read back.
+ */
+struct binlog_record
+{
+	binlog_head head;
+	std::string fields[ BINLOG_FIELD_COUNT ];
+	bool present[ BINLOG_FIELD_COUNT ];
+};
+
+/**
+ * Reads records from a log file.
+ */
+class binlog_reader
+{
+public:
+	enum result { RECORD, END, BAD };
+
+	binlog_reader( std::FILE* in ) : in( in ), started( false ) {}
+
+	result next( binlog_record& r )
+	{
+		// The file header, and any more met between records.  A record
+		// can't start with the magic, its status would be 0x4942.
+		char* p = reinterpret_cast< char* >( &r.head );
+		for( ;; )
+		{
+			binlog_file_header h;
+			if( 1 != std::fread( &h, sizeof( h ), 1, in ) ) return END;
+			if( started && 0 != std::memcmp( h.magic, "LTBINLOG", 8 ) )
+			{
+				std::memcpy( p, &h, sizeof( h ) );
+				break;
+			}
+			if( !h.valid( ) ) return BAD;
+			started = true;
+		}
+
+		if( 1 != std::fread( p + sizeof( binlog_file_header ), sizeof( r.head ) - sizeof( binlog_file_header ), 1, in ) ) return END;
+		if( r.head.length < sizeof( r.head ) ) return BAD;
+
+		buf.resize( r.head.length - sizeof( r.head ) );
+		if( !buf.empty( ) && 1 != std::fread( &buf[0], buf.size( ), 1, in ) ) return BAD;
+
+		for( int i = 0; i < BINLOG_FIELD_COUNT; ++i )
+		{
+			r.fields[i].clear( );
+			r.present[i] = false;
+		}
+
+		std::size_t at = 0;
+		for( int f = 0; f < r.head.fields; ++f )
+		{
+			if( at + 3 > buf.size( ) ) return BAD;
+
+			int id = static_cast< unsigned char >( buf[ at ] );
+			uint16_t len;
+			std::memcpy( &len, &buf[ at + 1 ], 2 );
+			if( at + 3 + len > buf.size( ) ) return BAD;
+
+			// Fields of later versions are passed over.
+			if( id < BINLOG_FIELD_COUNT )
+			{
+				r.fields[ id ].assign( &buf[ at + 3 ], len );
+				r.present[ id ] = true;
+			}
+			at += 3 + len;
+		}
+
+		return RECORD;
+	}
+
+private:
+	std::FILE* in;
+	bool started;
+	std::vector< char > buf;
+};
+
+// "-" for a missing field, as mod_accesslog does.
+inline void binlog_append_field( std::string& out, const binlog_record& r, int id, bool quoted )
+{
+	if( quoted ) out += '"';
+	if( r.present[ id ] && !r.fields[ id ].empty( ) )
+	{
+		for( std::string::const_iterator i = r.fields[ id ].begin( ); i != r.fields[ id ].end( ); ++i )
+		{
+			unsigned char c = *i;
+			if( c < 0x20 || c >= 0x7f || c == '"' || c == '\\' )
+			{
+				char esc[ 8 ];
+				snprintf( esc, sizeof( esc ), "\\x%02x", c );
+				out += esc;
+			}
+			else out += *i;
+		}
+	}
+	else out += '-';
+	if( quoted ) out += '"';
+}
+
+/**
+ * A record in the Combined Log Format, followed by the host, the
+ * duration in microseconds and the bytes read.
+ */
+inline std::string binlog_text( const binlog_record& r )
+{
+	std::string out;
+	char buf[ 128 ];
+
+	binlog_append_field( out, r, BINLOG_REMOTE_ADDR, false );
+	out += " - - [";
+
+	time_t t = static_cast< time_t >( r.head.start_us / 1000000 );
+	struct tm tm;
+	gmtime_r( &t, &tm );
+	strftime( buf, sizeof( buf ), "%d/%b/%Y:%H:%M:%S +0000", &tm );
+	out += buf;
+	out += "] \"";
+
+	out += r.present[ BINLOG_METHOD ] ? r.fields[ BINLOG_METHOD ] : "-";
+	out += ' ';
+	binlog_append_field( out, r, BINLOG_URI, false );
+	snprintf( buf, sizeof( buf ), " HTTP/1.%u\" %u %lld ", r.head.http_minor, r.head.status, static_cast< long long >( r.head.bytes_out ) );
+	out += buf;
+
+	binlog_append_field( out, r, BINLOG_REFERER, true );
+	out += ' ';
+	binlog_append_field( out, r, BINLOG_USER_AGENT, true );
+	out += ' ';
+	binlog_append_field( out, r, BINLOG_HOST, false );
+
+	snprintf( buf, sizeof( buf ), " %u %lld", r.head.duration_us, static_cast< long long >( r.head.bytes_in ) );
+	out += buf;
+	return out;
+}
+
+#endif // _LIGHTTPD_BINLOG_FORMAT_HPP_
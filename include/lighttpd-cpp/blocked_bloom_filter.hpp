@@ -0,0 +1,177 @@
+/**
+ * A blocked bloom filter, i.e. a bloom filter split into cache line sized
+ * blocks where all of the bits for one key are set within a single block.
+ * Lookups then cost one cache miss rather than k of them, for a slightly
+ * worse false positive rate than a classic filter of the same size.
+ *
+ * Keys are given as 64 bit hashes, so that callers can mix in their own
+ * tags (see path_hash below) without us caring what the key looks like.
+ * There is no removal, a filter only ever says "definitely absent" or
+ * "maybe present", so anything removed from the underlying set has to
+ * wait for a rebuild to be forgotten.
+ */
+
+#ifndef _LIGHTTPD_BLOCKED_BLOOM_FILTER_HPP_
+#define _LIGHTTPD_BLOCKED_BLOOM_FILTER_HPP_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+// FNV-1a over the bytes, finished off with a murmur3 style mix so that the
+// high bits (which pick the block) are as good as the low ones.
+inline uint64_t path_hash( const char* s, std::size_t len, uint64_t seed = 0 )
+{
+	uint64_t h = 14695981039346656037ULL ^ seed;
+	for( std::size_t i = 0; i < len; ++i )
+	{
+		h ^= static_cast< unsigned char >( s[i] );
+		h *= 1099511628211ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+class blocked_bloom_filter : boost::noncopyable
+{
+public:
+	// One block is one 64 byte cache line.
+	static const std::size_t block_bits = 512;
+	static const std::size_t block_words = block_bits / 64;
+
+	// Size the filter for expected entries at bits_per_entry bits each,
+	// ~10 bits gives around a 1% false positive rate.
+	blocked_bloom_filter( std::size_t expected = 1024, std::size_t bits_per_entry = 10 )
+	 : blocks( 0 ), nblocks( 0 ), nhashes( 0 ), entries( 0 ), expected( 0 )
+	{
+		reset( expected, bits_per_entry );
+	}
+
+	~blocked_bloom_filter( )
+	{
+		std::free( blocks );
+	}
+
+	// Throw away everything and resize.
+	void reset( std::size_t expected_entries, std::size_t bits_per_entry )
+	{
+		if( expected_entries == 0 ) expected_entries = 1;
+		if( bits_per_entry == 0 ) bits_per_entry = 1;
+
+		std::size_t n = ( expected_entries * bits_per_entry + block_bits - 1 ) / block_bits;
+		if( n == 0 ) n = 1;
+
+		if( n != nblocks )
+		{
+			void* mem = 0;
+			if( 0 != posix_memalign( &mem, 64, n * sizeof( block ) ) )
+				throw std::bad_alloc( );
+
+			std::free( blocks );
+			blocks = reinterpret_cast< block* >( mem );
+			nblocks = n;
+		}
+
+		// k = ln 2 * m / n, the usual optimum.
+		nhashes = static_cast< std::size_t >( bits_per_entry * 0.693 + 0.5 );
+		nhashes = std::max< std::size_t >( 1, std::min< std::size_t >( nhashes, 16 ) );
+
+		std::memset( blocks, 0, nblocks * sizeof( block ) );
+		entries = 0;
+		expected = expected_entries;
+	}
+
+	void insert( uint64_t h )
+	{
+		block& b = blocks[ block_index( h ) ];
+
+		// Double hashing within the block, the high bits are already
+		// spent on picking the block so derive the step by remixing.
+		uint32_t h1 = static_cast< uint32_t >( h );
+		uint32_t h2 = step( h );
+		for( std::size_t i = 0; i < nhashes; ++i )
+		{
+			uint32_t bit = ( h1 + i * h2 ) % block_bits;
+			b.words[ bit / 64 ] |= uint64_t( 1 ) << ( bit % 64 );
+		}
+
+		++entries;
+	}
+
+	bool may_contain( uint64_t h ) const
+	{
+		const block& b = blocks[ block_index( h ) ];
+
+		uint32_t h1 = static_cast< uint32_t >( h );
+		uint32_t h2 = step( h );
+		for( std::size_t i = 0; i < nhashes; ++i )
+		{
+			uint32_t bit = ( h1 + i * h2 ) % block_bits;
+			if( !( b.words[ bit / 64 ] & ( uint64_t( 1 ) << ( bit % 64 ) ) ) )
+				return false;
+		}
+
+		return true;
+	}
+
+	void swap( blocked_bloom_filter& other )
+	{
+		std::swap( blocks, other.blocks );
+		std::swap( nblocks, other.nblocks );
+		std::swap( nhashes, other.nhashes );
+		std::swap( entries, other.entries );
+		std::swap( expected, other.expected );
+	}
+
+	// Number of inserts, duplicates included.
+	std::size_t size( ) const { return entries; }
+	std::size_t capacity( ) const { return expected; }
+	std::size_t hashes( ) const { return nhashes; }
+	std::size_t memory_usage( ) const { return nblocks * sizeof( block ); }
+
+	// The classic (1 - e^(-kn/m))^k estimate.  Blocking makes the real rate
+	// a little higher, this is good enough for reporting.
+	double false_positive_rate( ) const
+	{
+		double m = static_cast< double >( nblocks * block_bits );
+		double k = static_cast< double >( nhashes );
+		return std::pow( 1.0 - std::exp( -k * entries / m ), k );
+	}
+
+private:
+	struct block
+	{
+		uint64_t words[ block_words ];
+	};
+
+	std::size_t block_index( uint64_t h ) const
+	{
+		// Multiply-shift on the high bits rather than a modulo.
+		return static_cast< std::size_t >( ( ( h >> 32 ) * nblocks ) >> 32 );
+	}
+
+	static uint32_t step( uint64_t h )
+	{
+		return static_cast< uint32_t >( ( h * 0x9e3779b97f4a7c15ULL ) >> 32 ) | 1;
+	}
+
+	block* blocks;
+	std::size_t nblocks;
+	std::size_t nhashes;
+	std::size_t entries;
+	std::size_t expected;
+};
+
+#endif // _LIGHTTPD_BLOCKED_BLOOM_FILTER_HPP_
@@ -0,0 +1,225 @@
+/**
+ * Consistent hashing with bounded loads, for backends that want requests
+ * for the same key (a URI, a header) to keep going to the same upstream
+ * without a hot key melting it.
+ *
+ *  bounded_hash_ring ring;
+ *  ring.assign( upstream_names );                 // set_defaults
+ *  std::size_t n = ring.pick( bounded_hash_ring::hash( key, len ) );
+ *  ring.acquire( n );  ... ring.release( n );     // around the request
+ *
+ * Each upstream is put on the ring at points_per_node points.  A key goes
+ * to the first upstream clockwise of its hash, unless that one already has
+ * more than balance times the average number of requests in flight, in
+ * which case it carries on round the ring to the next one that doesn't.
+ * So no upstream ever has more than ceil( balance * average ) requests,
+ * and a key only leaves its home upstream while that is overloaded.
+ *
+ * The ring is a std::map, so assign( ) adding or removing an upstream
+ * touches only that upstream's points, O(log n) each, and everything else
+ * keeps its keys and its in-flight count.  Slot numbers are stable while
+ * an upstream is on the ring; one that is removed while requests are in
+ * flight keeps its slot until they are released.
+ */
+
+#ifndef _LIGHTTPD_BOUNDED_HASH_RING_HPP_
+#define _LIGHTTPD_BOUNDED_HASH_RING_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+class bounded_hash_ring : boost::noncopyable
+{
+public:
+	static const std::size_t points_per_node = 100;
+	static const std::size_t npos = static_cast< std::size_t >( -1 );
+
+	// Upstreams may carry balance times the average load, 0 for no bound
+	// (plain consistent hashing).
+	bounded_hash_ring( double balance = 1.25 )
+	 : balance( balance ), total( 0 ), live( 0 ), epoch( 0 )
+	{}
+
+	static uint64_t hash( const char* p, std::size_t len )
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for( std::size_t i = 0; i < len; ++i )
+			h = ( h ^ static_cast< unsigned char >( p[i] ) ) * 1099511628211ULL;
+		return mix( h );
+	}
+
+	// Make the ring hold exactly names, adding and removing the difference.
+	void assign( const std::vector< std::string >& names )
+	{
+		for( std::size_t s = 0; s < nodes.size( ); ++s )
+		{
+			if( nodes[s].alive && std::find( names.begin( ), names.end( ), nodes[s].name ) == names.end( ) )
+				remove( s );
+		}
+
+		for( std::vector< std::string >::const_iterator i = names.begin( ); i != names.end( ); ++i )
+		{
+			if( npos == find( *i ) ) add( *i );
+		}
+	}
+
+	std::size_t add( const std::string& name )
+	{
+		std::size_t s = find( name );
+		if( s != npos ) return s;
+
+		// A slot nobody is using any more, or a new one.
+		for( s = 0; s < nodes.size( ); ++s )
+		{
+			if( !nodes[s].alive && !nodes[s].load ) break;
+		}
+		if( s == nodes.size( ) ) nodes.push_back( node( ) );
+
+		nodes[s].name = name;
+		nodes[s].alive = true;
+		++live;
+
+		uint64_t h = hash( name.data( ), name.size( ) );
+		for( std::size_t i = 0; i < points_per_node; ++i )
+			points.insert( std::make_pair( point( h, i ), s ) );
+		return s;
+	}
+
+	void remove( std::size_t s )
+	{
+		if( s >= nodes.size( ) || !nodes[s].alive ) return;
+
+		// Where two points collided the first upstream kept it.
+		uint64_t h = hash( nodes[s].name.data( ), nodes[s].name.size( ) );
+		for( std::size_t i = 0; i < points_per_node; ++i )
+		{
+			ring_type::iterator p = points.find( point( h, i ) );
+			if( p != points.end( ) && p->second == s ) points.erase( p );
+		}
+
+		nodes[s].alive = false;
+		--live;
+		total -= nodes[s].load;
+	}
+
+	// The slot of name, npos if it isn't on the ring.
+	std::size_t find( const std::string& name ) const
+	{
+		for( std::size_t s = 0; s < nodes.size( ); ++s )
+		{
+			if( nodes[s].alive && nodes[s].name == name ) return s;
+		}
+		return npos;
+	}
+
+	// Where a request for key should go, npos if nowhere.
+	std::size_t pick( uint64_t key )
+	{
+		return pick( key, always( ) );
+	}
+
+	// As above, skipping slots for which usable( slot ) is false, i.e.
+	// upstreams that are down.
+	template < typename Usable >
+	std::size_t pick( uint64_t key, Usable usable )
+	{
+		if( points.empty( ) ) return npos;
+
+		// Counting the request being placed.
+		std::size_t capacity = npos;
+		if( balance > 0 )
+			capacity = static_cast< std::size_t >( balance * ( total + 1 ) / live + 0.999999 );
+
+		if( seen.size( ) < nodes.size( ) ) seen.resize( nodes.size( ), 0 );
+		if( !++epoch )
+		{
+			std::fill( seen.begin( ), seen.end( ), 0 );
+			epoch = 1;
+		}
+
+		ring_type::const_iterator p = points.lower_bound( key );
+		std::size_t tried = 0;
+
+		for( std::size_t steps = 0; steps < points.size( ) && tried < live; ++steps, ++p )
+		{
+			if( p == points.end( ) ) p = points.begin( );
+
+			std::size_t s = p->second;
+			if( seen[s] == epoch ) continue;
+			seen[s] = epoch;
+			++tried;
+
+			if( nodes[s].load < capacity && usable( s ) ) return s;
+		}
+		return npos;
+	}
+
+	void acquire( std::size_t s )
+	{
+		++nodes[s].load;
+		if( nodes[s].alive ) ++total;
+	}
+
+	void release( std::size_t s )
+	{
+		if( !nodes[s].load ) return;
+		--nodes[s].load;
+		if( nodes[s].alive ) --total;
+	}
+
+	const std::string& name( std::size_t s ) const { return nodes[s].name; }
+	std::size_t load( std::size_t s ) const { return nodes[s].load; }
+	std::size_t in_flight( ) const { return total; }
+	std::size_t size( ) const { return live; }
+
+	const double balance;
+
+private:
+	struct node
+	{
+		node( ) : load( 0 ), alive( false ) {}
+
+		std::string name;
+		std::size_t load;
+		bool alive;
+	};
+
+	struct always
+	{
+		bool operator()( std::size_t ) const { return true; }
+	};
+
+	typedef std::map< uint64_t, std::size_t > ring_type;
+
+	static uint64_t point( uint64_t h, std::size_t i )
+	{
+		return mix( h ^ ( ( i + 1 ) * 0x9e3779b97f4a7c15ULL ) );
+	}
+
+	static uint64_t mix( uint64_t h )
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	ring_type points;
+	std::vector< node > nodes;
+	std::size_t total;
+	std::size_t live;
+
+	// Which slots this pick has looked at already.
+	std::vector< unsigned > seen;
+	unsigned epoch;
+};
+
+#endif // _LIGHTTPD_BOUNDED_HASH_RING_HPP_
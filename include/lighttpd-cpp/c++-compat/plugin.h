@@ -10,6 +10,9 @@ extern "C"
 
 	// this will not include the original base.h
 #	include <lighttpd/plugin.h>
+
+	// counters shown by mod_status, for plugins to report on themselves
+#	include <lighttpd/status_counter.h>
 }
 
 #endif
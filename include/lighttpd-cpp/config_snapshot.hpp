@@ -0,0 +1,590 @@
+/**
+ * Precompiled config snapshots, so that a server with a huge config
+ * doesn't run config_insert_values_global for every option of every
+ * plugin in every conditional context on each start.
+ *
+ * With cpp.snapshot-dir set, the fully resolved values of every
+ * config_option of a plugin (validators and defaults setters applied) are
+ * written to <dir>/<plugin>.snapshot after they have been parsed.  The
+ * next start maps the file and, if it was made from the same config,
+ * fills the options straight from it.
+ *
+ * A snapshot records the files the config was read from: the -f file
+ * lighttpd was started with and everything it includes, each by path,
+ * inode, size and mtime.  A start where they all stat the same takes the
+ * snapshot without looking at the parsed config at all.  When the files
+ * alone don't say what the config is (include_shell, env.*, var.CWD or
+ * var.PID, an include we can't follow, a file changed as lighttpd read
+ * it) the snapshot is keyed on a hash of the whole parsed config tree
+ * instead, which costs a walk of the tree each start.  The plugin's name
+ * and version and the format version are in the key either way, and each
+ * option's key and type is checked as it is read back, so a snapshot from
+ * an older build of the plugin is refused rather than misread.
+ *
+ * A snapshot that is missing, stale, corrupt or for a plugin with option
+ * types we can't snapshot just means the config is parsed as before.
+ *
+ * The time taken and which path was used are published as status
+ * counters <plugin>.config-load-us and <plugin>.config-from-snapshot.
+ *
+ * Config:
+ *  cpp.snapshot-dir = "/var/cache/lighttpd"   # global, unset disables
+ */
+
+#ifndef _LIGHTTPD_CONFIG_SNAPSHOT_HPP_
+#define _LIGHTTPD_CONFIG_SNAPSHOT_HPP_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "datatype_helpers.hpp"
+#include "snapshot_traits.hpp"
+
+/**
+ * The files a config was read from and whether any has changed, found by
+ * following include from the main file the way lighttpd does: relative
+ * paths are taken from the main file's directory.
+ */
+class config_sources
+{
+public:
+	struct source
+	{
+		std::string path;
+		uint64_t dev;
+		uint64_t ino;
+		uint64_t size;
+		uint64_t mtime_ns;
+	};
+
+	typedef std::vector< source > list_type;
+
+	// The -f argument lighttpd was started with, empty when there is none.
+	static std::string main_file( )
+	{
+		std::ifstream in( "/proc/self/cmdline", std::ios::in | std::ios::binary );
+		std::string arg;
+		bool next_is_file = false;
+		while( std::getline( in, arg, '\0' ) )
+		{
+			if( next_is_file ) return arg;
+			if( arg.size( ) < 2 || arg[0] != '-' || arg[1] == '-' ) continue;
+
+			// -f file, or among other flags as in -Df file, or -ffile.
+			std::size_t f = arg.find( 'f', 1 );
+			if( f == std::string::npos ) continue;
+			if( f + 1 < arg.size( ) ) return arg.substr( f + 1 );
+			next_is_file = true;
+		}
+		return std::string( );
+	}
+
+	// main and what it includes, false when the files alone don't say
+	// what the config is.
+	static bool scan( const std::string& main, list_type& out )
+	{
+		out.clear( );
+
+		std::string path = real_path( main );
+		if( path.empty( ) ) return false;
+		return follow( path, path.substr( 0, path.rfind( '/' ) + 1 ), out, 0 );
+	}
+
+	// Whether main is the file list was scanned from and none has changed.
+	static bool unchanged( const list_type& list, const std::string& main )
+	{
+		if( list.empty( ) || real_path( main ) != list.front( ).path ) return false;
+
+		for( list_type::const_iterator i = list.begin( ); i != list.end( ); ++i )
+		{
+			struct stat st;
+			if( -1 == stat( i->path.c_str( ), &st ) ) return false;
+
+			source now = identity( i->path, st );
+			if( now.dev != i->dev || now.ino != i->ino || now.size != i->size || now.mtime_ns != i->mtime_ns )
+				return false;
+		}
+		return true;
+	}
+
+	// Whether none was modified from a second before since on, when
+	// lighttpd may have read it half way through a change.
+	static bool settled( const list_type& list, time_t since )
+	{
+		for( list_type::const_iterator i = list.begin( ); i != list.end( ); ++i )
+		{
+			if( static_cast< time_t >( i->mtime_ns / 1000000000ULL ) >= since - 1 ) return false;
+		}
+		return true;
+	}
+
+	static void write( snapshot_writer& out, const list_type& list )
+	{
+		out.put_u32( static_cast< uint32_t >( list.size( ) ) );
+		for( list_type::const_iterator i = list.begin( ); i != list.end( ); ++i )
+		{
+			out.put_string( i->path );
+			out.put_u64( i->dev );
+			out.put_u64( i->ino );
+			out.put_u64( i->size );
+			out.put_u64( i->mtime_ns );
+		}
+	}
+
+	static bool read( snapshot_reader& in, list_type& list )
+	{
+		uint32_t n;
+		if( !in.get_u32( n ) ) return false;
+
+		list.clear( );
+		for( uint32_t i = 0; i < n; ++i )
+		{
+			source s;
+			if( !in.get_string( s.path ) || !in.get_u64( s.dev ) || !in.get_u64( s.ino ) ||
+				!in.get_u64( s.size ) || !in.get_u64( s.mtime_ns ) )
+				return false;
+			list.push_back( s );
+		}
+		return in.left( ) == 0;
+	}
+
+private:
+	static std::string real_path( const std::string& path )
+	{
+		char* real = realpath( path.c_str( ), 0 );
+		if( !real ) return std::string( );
+
+		std::string r( real );
+		std::free( real );
+		return r;
+	}
+
+	static source identity( const std::string& path, const struct stat& st )
+	{
+		source s;
+		s.path = path;
+		s.dev = st.st_dev;
+		s.ino = st.st_ino;
+		s.size = st.st_size;
+		s.mtime_ns = uint64_t( st.st_mtim.tv_sec ) * 1000000000ULL + st.st_mtim.tv_nsec;
+		return s;
+	}
+
+	static bool follow( const std::string& path, const std::string& base, list_type& out, int depth )
+	{
+		// lighttpd gives up on include loops too.
+		if( depth > 16 ) return false;
+
+		int fd = open( path.c_str( ), O_RDONLY | O_CLOEXEC );
+		if( fd == -1 ) return false;
+
+		struct stat st;
+		std::string text;
+		bool ok = 0 == fstat( fd, &st );
+		if( ok )
+		{
+			text.resize( st.st_size );
+			std::size_t got = 0;
+			while( got < text.size( ) )
+			{
+				ssize_t n = ::read( fd, &text[ got ], text.size( ) - got );
+				if( n <= 0 ) break;
+				got += n;
+			}
+			ok = got == text.size( );
+		}
+		close( fd );
+		if( !ok ) return false;
+
+		out.push_back( identity( path, st ) );
+
+		std::vector< std::string > includes;
+		if( !includes_of( text, includes ) ) return false;
+
+		for( std::vector< std::string >::const_iterator i = includes.begin( ); i != includes.end( ); ++i )
+		{
+			if( !follow( (*i)[0] == '/' ? *i : base + *i, base, out, depth + 1 ) ) return false;
+		}
+		return true;
+	}
+
+	static bool word_char( char c )
+	{
+		return std::isalnum( static_cast< unsigned char >( c ) ) || c == '_' || c == '.' || c == '-';
+	}
+
+	// The files text includes, false for anything that makes the config
+	// more than its files.
+	static bool includes_of( const std::string& text, std::vector< std::string >& out )
+	{
+		bool want_path = false, had_path = false;
+
+		for( std::size_t i = 0; i < text.size( ); )
+		{
+			char c = text[i];
+
+			if( c == '#' )
+			{
+				i = text.find( '\n', i );
+				if( i == std::string::npos ) break;
+			}
+			else if( c == '"' )
+			{
+				std::string s;
+				for( ++i; i < text.size( ) && text[i] != '"'; ++i )
+				{
+					if( text[i] == '\\' && i + 1 < text.size( ) ) ++i;
+					s += text[i];
+				}
+				++i;
+
+				had_path = false;
+				if( want_path )
+				{
+					// Globs we would have to expand as lighttpd does.
+					if( s.empty( ) || s.find_first_of( "*?[" ) != std::string::npos ) return false;
+					out.push_back( s );
+					want_path = false;
+					had_path = true;
+				}
+			}
+			else if( word_char( c ) )
+			{
+				std::size_t end = i;
+				while( end < text.size( ) && word_char( text[ end ] ) ) ++end;
+				std::string word( text, i, end - i );
+				i = end;
+
+				// include of a variable.
+				if( want_path ) return false;
+
+				if( word == "include_shell" || word == "var.CWD" || word == "var.PID" || 0 == word.compare( 0, 4, "env." ) )
+					return false;
+				want_path = word == "include";
+				had_path = false;
+			}
+			else
+			{
+				// A path with more joined on.
+				if( c == '+' && had_path ) return false;
+				if( !std::isspace( static_cast< unsigned char >( c ) ) )
+				{
+					if( want_path ) return false;
+					had_path = false;
+				}
+				++i;
+			}
+		}
+		return !want_path;
+	}
+};
+
+class config_snapshot
+{
+public:
+	static const uint32_t format_version = 2;
+
+	// The config file lighttpd was started with, taken from the command
+	// line when empty.
+	static std::string config_file;
+
+	// Fill every config_option from the snapshot in dir if there is a
+	// current one, otherwise parse them and write one for next time.
+	static handler_t set_all_defaults( const server& srv, const std::string& name, std::size_t version, const std::string& dir )
+	{
+		uint64_t start = now_us( );
+
+		if( dir.empty( ) )
+		{
+			handler_t r = config_option_base::set_all_defaults( srv );
+			report( name, false, now_us( ) - start );
+			return r;
+		}
+
+		std::string path = dir + "/" + name + ".snapshot";
+
+		std::ostringstream salt;
+		salt << name << '\0' << version << '\0' << format_version;
+		std::string conf = config_file.empty( ) ? config_sources::main_file( ) : config_file;
+
+		bool loaded = load( srv, path, salt.str( ), conf );
+		if( !loaded )
+		{
+			if( config_option_base::set_all_defaults( srv ) != HANDLER_GO_ON )
+				return HANDLER_ERROR;
+
+			config_sources::list_type sources;
+			if( conf.empty( ) || !config_sources::scan( conf, sources ) ||
+				!config_sources::settled( sources, srv.startup_ts ? srv.startup_ts : time( 0 ) ) )
+				sources.clear( );
+
+			save( path, sources.empty( ) ? hash_config( srv, salt.str( ) ) : hash_salt( salt.str( ) ), sources );
+		}
+
+		report( name, loaded, now_us( ) - start );
+		return HANDLER_GO_ON;
+	}
+
+	// The parsed config, as far as it could affect option values.
+	static uint64_t hash_config( const server& srv, const std::string& salt )
+	{
+		uint64_t h = hash_salt( salt );
+		hash_array( h, srv.config_context );
+		return h;
+	}
+
+	// The key of a snapshot made from files that haven't changed.
+	static uint64_t hash_salt( const std::string& salt )
+	{
+		uint64_t h = 14695981039346656037ULL;
+		hash_bytes( h, salt.data( ), salt.size( ) );
+		return h;
+	}
+
+	// Fill every registered option from the snapshot at path, all or
+	// nothing.  conf is the config file, to check the snapshot's sources
+	// against.
+	static bool load( const server& srv, const std::string& path, const std::string& salt, const std::string& conf )
+	{
+		int fd = open( path.c_str( ), O_RDONLY | O_CLOEXEC );
+		if( fd == -1 ) return false;
+
+		struct stat st;
+		if( -1 == fstat( fd, &st ) || static_cast< std::size_t >( st.st_size ) < header_size )
+		{
+			close( fd );
+			return false;
+		}
+
+		void* map = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		if( map == MAP_FAILED ) return false;
+
+		bool ok = load( srv, static_cast< const char* >( map ), st.st_size, salt, conf );
+		munmap( map, st.st_size );
+		return ok;
+	}
+
+	static bool load( const server& srv, const char* data, std::size_t len, const std::string& salt, const std::string& conf )
+	{
+		typedef config_option_base::registry_iterator registry_iterator;
+		config_option_base::registry_type& registry = config_option_base::registry;
+
+		if( len < header_size || 0 != std::memcmp( data, magic, sizeof( magic ) ) ) return false;
+
+		snapshot_reader header( data + sizeof( magic ), header_size - sizeof( magic ) );
+		uint32_t version, count;
+		uint64_t hash_in, sources_len, payload_len, checksum;
+		header.get_u32( version );
+		header.get_u32( count );
+		header.get_u64( hash_in );
+		header.get_u64( sources_len );
+		header.get_u64( payload_len );
+		header.get_u64( checksum );
+
+		if( version != format_version || count != registry.size( ) ) return false;
+		if( sources_len > len - header_size || payload_len != len - header_size - sources_len ) return false;
+
+		uint64_t h = 14695981039346656037ULL;
+		hash_bytes( h, data + header_size, sources_len + payload_len );
+		if( h != checksum ) return false;
+
+		// The files unchanged, or failing that the parsed config the same.
+		config_sources::list_type sources;
+		snapshot_reader source_in( data + header_size, sources_len );
+		if( !config_sources::read( source_in, sources ) ) return false;
+		if( sources.empty( ) )
+		{
+			if( hash_in != hash_config( srv, salt ) ) return false;
+		}
+		else if( hash_in != hash_salt( salt ) || !config_sources::unchanged( sources, conf ) )
+		{
+			return false;
+		}
+
+		snapshot_reader in( data + header_size + sources_len, payload_len );
+		for( registry_iterator i = registry.begin( ); i != registry.end( ); ++i )
+		{
+			if( (*i)->prepare( srv, in ) ) continue;
+
+			for( registry_iterator j = registry.begin( ); j != registry.end( ); ++j )
+				(*j)->abort( );
+			return false;
+		}
+
+		for( registry_iterator i = registry.begin( ); i != registry.end( ); ++i )
+			(*i)->commit( );
+		return true;
+	}
+
+	// Write every registered option's current values to path, replacing
+	// whatever was there in one go.  With sources, hash is only checked
+	// once they are found unchanged.
+	static bool save( const std::string& path, uint64_t hash, const config_sources::list_type& sources )
+	{
+		typedef config_option_base::registry_const_iterator registry_iterator;
+		const config_option_base::registry_type& registry = config_option_base::registry;
+
+		std::string source_block;
+		snapshot_writer source_out( source_block );
+		config_sources::write( source_out, sources );
+
+		std::string payload;
+		snapshot_writer out( payload );
+		for( registry_iterator i = registry.begin( ); i != registry.end( ); ++i )
+		{
+			if( !(*i)->save( out ) ) return false;
+		}
+
+		std::string body = source_block + payload;
+		uint64_t checksum = 14695981039346656037ULL;
+		hash_bytes( checksum, body.data( ), body.size( ) );
+
+		std::string file( magic, sizeof( magic ) );
+		snapshot_writer header( file );
+		header.put_u32( format_version );
+		header.put_u32( static_cast< uint32_t >( registry.size( ) ) );
+		header.put_u64( hash );
+		header.put_u64( source_block.size( ) );
+		header.put_u64( payload.size( ) );
+		header.put_u64( checksum );
+		file.append( body );
+
+		// Written aside and renamed over, so a concurrent start never
+		// maps half a file.
+		std::ostringstream tmp;
+		tmp << path << ".tmp." << getpid( );
+
+		int fd = open( tmp.str( ).c_str( ), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+		if( fd == -1 ) return false;
+
+		std::size_t written = 0;
+		while( written < file.size( ) )
+		{
+			ssize_t n = write( fd, file.data( ) + written, file.size( ) - written );
+			if( n <= 0 ) break;
+			written += n;
+		}
+		close( fd );
+
+		if( written != file.size( ) || 0 != rename( tmp.str( ).c_str( ), path.c_str( ) ) )
+		{
+			unlink( tmp.str( ).c_str( ) );
+			return false;
+		}
+		return true;
+	}
+
+private:
+	static const char magic[ 8 ];
+	static const std::size_t header_size = 8 + 4 + 4 + 8 + 8 + 8 + 8;
+
+	static uint64_t now_us( )
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return uint64_t( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	static void report( const std::string& name, bool from_snapshot, uint64_t us )
+	{
+		last_from_snapshot = from_snapshot;
+		last_load_us = us;
+
+		std::string key = name + ".config-load-us";
+		status_counter_set( key.data( ), key.size( ), static_cast< int >( us ) );
+		key = name + ".config-from-snapshot";
+		status_counter_set( key.data( ), key.size( ), from_snapshot ? 1 : 0 );
+	}
+
+	// FNV-1a, with the length first so that "ab","c" and "a","bc" differ.
+	static void hash_bytes( uint64_t& h, const void* p, std::size_t len )
+	{
+		const unsigned char* c = static_cast< const unsigned char* >( p );
+		for( std::size_t i = 0; i < sizeof( len ); ++i )
+			h = ( h ^ ( ( len >> ( i * 8 ) ) & 0xff ) ) * 1099511628211ULL;
+		for( std::size_t i = 0; i < len; ++i )
+			h = ( h ^ c[i] ) * 1099511628211ULL;
+	}
+
+	static void hash_int( uint64_t& h, int64_t v )
+	{
+		hash_bytes( h, &v, sizeof( v ) );
+	}
+
+	static void hash_buffer( uint64_t& h, const buffer* b )
+	{
+		if( !b || !b->used )
+			hash_bytes( h, "", 0 );
+		else
+			hash_bytes( h, b->ptr, b->used - 1 );
+	}
+
+	static void hash_array( uint64_t& h, const array* a )
+	{
+		if( !a )
+		{
+			hash_int( h, -1 );
+			return;
+		}
+
+		hash_int( h, a->used );
+		for( std::size_t i = 0; i < a->used; ++i )
+		{
+			const data_unset* du = a->data[i];
+			hash_int( h, du->type );
+			hash_buffer( h, du->key );
+
+			switch( du->type )
+			{
+			case TYPE_STRING:
+				hash_buffer( h, reinterpret_cast< const data_string* >( du )->value );
+				break;
+			case TYPE_INTEGER:
+				hash_int( h, reinterpret_cast< const data_integer* >( du )->value );
+				break;
+			case TYPE_ARRAY:
+				hash_array( h, reinterpret_cast< const data_array* >( du )->value );
+				break;
+			case TYPE_CONFIG:
+			{
+				const data_config* dc = reinterpret_cast< const data_config* >( du );
+				hash_buffer( h, dc->comp_key );
+				hash_buffer( h, dc->op );
+				hash_int( h, dc->comp );
+				hash_int( h, dc->cond );
+				hash_array( h, dc->value );
+				break;
+			}
+			default:
+				break;
+			}
+		}
+	}
+
+public:
+	// How the last set_all_defaults went, for tests and benchmarks.
+	static bool last_from_snapshot;
+	static uint64_t last_load_us;
+};
+
+// Like config_option_base::registry, one of these per module.
+const char config_snapshot::magic[ 8 ] = { 'L', 'C', 'P', 'P', 'C', 'O', 'N', 'F' };
+std::string config_snapshot::config_file;
+bool config_snapshot::last_from_snapshot = false;
+uint64_t config_snapshot::last_load_us = 0;
+
+#endif // _LIGHTTPD_CONFIG_SNAPSHOT_HPP_
@@ -0,0 +1,177 @@
+/**
+ * Typed values that plugins hand each other through the connection,
+ * instead of through con.environment and strings.
+ *
+ *  struct mod_tenant ...
+ *  	mod_tenant( server& srv ) : ..., tenant_of( "tenant" ) {}
+ *  	handler_t uri_clean( connection& con ) { tenant_of.set( con, lookup( con ) ); ... }
+ *  	connection_attribute< tenant > tenant_of;
+ *
+ *  struct mod_auth ...
+ *  	mod_auth( server& srv ) : ..., tenant_of( "tenant" ) {}
+ *  	handler_t ... { if( const tenant* t = tenant_of[ con ] ) ... }
+ *  	connection_attribute< tenant > tenant_of;
+ *
+ * Each name gets a dense slot number when the first plugin declaring it is
+ * constructed (so at plugin_init), and every plugin declaring the same
+ * name gets the same slot.  Reading or writing one is then an index into
+ * the connection's slot vector.  Declaring a name already declared with
+ * another type throws, failing that plugin's init.
+ *
+ * Values are pointers the attribute doesn't own, the publishing plugin
+ * keeps the thing pointed to alive for the request.  A connection's slots
+ * are cleared when it goes on to its next request, which is checked with a
+ * request_pin on access rather than by hooking connection_reset, so no
+ * plugin has to remember to.  reset( ) clears them there and then.
+ *
+ * Modules are separate shared objects, each with its own copy of every
+ * static member, so the registry is a function local static of an inline
+ * function, which g++ makes one object per process (a "unique" symbol)
+ * however the modules are loaded.  Like the rest of the request flow, it
+ * is for the main thread only.
+ */
+
+#ifndef _LIGHTTPD_CONNECTION_ATTRIBUTES_HPP_
+#define _LIGHTTPD_CONNECTION_ATTRIBUTES_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <typeinfo>
+
+#include <sys/time.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "c++-compat/base.h"
+#include "c++-compat/plugin.h"
+
+// One request on a connection.  lighttpd reuses connection structs, so
+// the connection alone doesn't say which request it is on; its
+// request_count and start time do.
+struct request_pin
+{
+	request_pin( ) : con( 0 ), request_count( 0 )
+	{
+		start_tv.tv_sec = start_tv.tv_usec = 0;
+	}
+
+	bool holds( const connection& c ) const
+	{
+		return con == &c && request_count == c.request_count
+			&& start_tv.tv_sec == c.start_tv.tv_sec && start_tv.tv_usec == c.start_tv.tv_usec;
+	}
+
+	void assign( const connection& c )
+	{
+		con = &c;
+		request_count = c.request_count;
+		start_tv = c.start_tv;
+	}
+
+	const connection* con;
+	std::size_t request_count;
+	struct timeval start_tv;
+};
+
+class attribute_registry : boost::noncopyable
+{
+public:
+	static attribute_registry& instance( )
+	{
+		static attribute_registry r;
+		return r;
+	}
+
+	// The slot for name, which holds values of type type_name.
+	std::size_t slot( const std::string& name, const std::string& type_name )
+	{
+		std::map< std::string, std::size_t >::const_iterator i = slots.find( name );
+		if( i == slots.end( ) )
+		{
+			slots[ name ] = types.size( );
+			types.push_back( type_name );
+			return types.size( ) - 1;
+		}
+
+		if( types[ i->second ] != type_name )
+			throw std::logic_error( "connection attribute " + name + " already declared with another type" );
+		return i->second;
+	}
+
+	std::size_t size( ) const { return types.size( ); }
+
+	// con's slots for the request it is on.
+	void** values( const connection& con )
+	{
+		if( static_cast< std::size_t >( con.ndx ) >= connections.size( ) )
+			connections.resize( con.ndx + 1 );
+
+		slot_vector& s = connections[ con.ndx ];
+		if( !s.pin.holds( con ) )
+		{
+			s.pin.assign( con );
+			s.values.assign( types.size( ), 0 );
+		}
+		else if( s.values.size( ) < types.size( ) )
+		{
+			// Declared since, by a plugin loaded later.
+			s.values.resize( types.size( ), 0 );
+		}
+
+		return &s.values[0];
+	}
+
+	void reset( const connection& con )
+	{
+		if( static_cast< std::size_t >( con.ndx ) < connections.size( ) )
+			connections[ con.ndx ].pin.con = 0;
+	}
+
+private:
+	attribute_registry( ) {}
+
+	struct slot_vector
+	{
+		request_pin pin;
+		std::vector< void* > values;
+	};
+
+	std::map< std::string, std::size_t > slots;
+	std::vector< std::string > types;
+
+	// By con.ndx.
+	std::vector< slot_vector > connections;
+};
+
+template < typename T >
+class connection_attribute
+{
+public:
+	connection_attribute( const std::string& name )
+	 : slot( attribute_registry::instance( ).slot( name, typeid( T ).name( ) ) )
+	{}
+
+	// NULL when nothing was set for this request.
+	T* get( const connection& con ) const
+	{
+		return static_cast< T* >( attribute_registry::instance( ).values( con )[ slot ] );
+	}
+
+	T* operator[]( const connection& con ) const { return get( con ); }
+
+	void set( const connection& con, T* value ) const
+	{
+		attribute_registry::instance( ).values( con )[ slot ] = const_cast< void* >( static_cast< const void* >( value ) );
+	}
+
+	void clear( const connection& con ) const { set( con, 0 ); }
+
+	// Every attribute of con, not just this one.
+	static void reset( const connection& con ) { attribute_registry::instance( ).reset( con ); }
+
+	const std::size_t slot;
+};
+
+#endif // _LIGHTTPD_CONNECTION_ATTRIBUTES_HPP_
@@ -22,20 +22,27 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <cstring>
 
 #include "c++-compat/base.h"
 #include "c++-compat/plugin.h"
+#include "snapshot_traits.hpp"
+#include "pooled_buffer.hpp"
 
 // Something for all config_options to have in common.
 // From here we can call set_defaults for all config options
 // using the set_defaults static function.
+//
+// Loading is in two steps, prepare then commit, so that when one option
+// fails (a snapshot that doesn't fit, say) none of them are published
+// and the options can be loaded again another way.
 struct config_option_base
 {
 	typedef std::vector< config_option_base* > registry_type;
 	typedef registry_type::iterator registry_iterator;
 	typedef registry_type::const_iterator registry_const_iterator;
 
-	config_option_base( const char* key ) : key( key )
+	config_option_base( const char* key ) : key( key ), srv( 0 ), present( false )
 	{
 		registry.push_back( this );
 	}
@@ -45,22 +52,67 @@ struct config_option_base
 		registry.erase( std::find( registry.begin(), registry.end(), this ) );
 	}
 
-	virtual handler_t set_defaults( const server& s ) = 0;
-	//virtual handler_t set_defaults( ) = 0;
+	// Build our values from s, without publishing them.
+	virtual bool prepare( const server& s ) = 0;
 
+	// Publish what prepare built, in place of any values we had.
+	virtual void commit( ) = 0;
+
+	// Throw away what prepare built.
+	virtual void abort( ) = 0;
+
+	// Write our values to a config snapshot, false if our
+	// option type can't be snapshotted.
+	virtual bool save( snapshot_writer& out ) const = 0;
+
+	// As prepare, but from a snapshot rather than the config.
+	virtual bool prepare( const server& s, snapshot_reader& in ) = 0;
+
+	// Mark our key as used in srv.config_touched, as
+	// config_insert_values_global does, so that lighttpd doesn't warn
+	// about it being unknown when it came from a snapshot.
+	void touch( const server& s ) const
+	{
+		if( !present || !s.config_touched ) return;
+
+		data_string* touched = reinterpret_cast< data_string* >( array_get_unused_element( s.config_touched, TYPE_STRING ) );
+		if( !touched ) touched = data_string_init( );
+
+		buffer_copy_string_len( touched->value, CONST_STR_LEN( "" ) );
+		buffer_copy_string( touched->key, key );
+		array_insert_unique( s.config_touched, reinterpret_cast< data_unset* >( touched ) );
+	}
+
+	handler_t set_defaults( const server& s )
+	{
+		if( !prepare( s ) ) return HANDLER_ERROR;
+		commit( );
+		return HANDLER_GO_ON;
+	}
+
+	// Every option from srv's config contexts, all or none of them.
 	static handler_t set_all_defaults( const server& srv )
 	{
 		for( registry_iterator i = registry.begin( ); i != registry.end( ); ++i )
 		{
-			if( (*i)->set_defaults( srv ) != HANDLER_ERROR ) continue;
+			if( (*i)->prepare( srv ) ) continue;
+
+			for( registry_iterator j = registry.begin( ); j != registry.end( ); ++j )
+				(*j)->abort( );
 			return HANDLER_ERROR;
 		}
+
+		for( registry_iterator i = registry.begin( ); i != registry.end( ); ++i )
+			(*i)->commit( );
 		return HANDLER_GO_ON;
 	}
 
 	const char* key;
 	const server* srv;
 
+	// Whether any config context sets us at all.
+	bool present;
+
 	static registry_type registry;
 };
 
@@ -139,7 +191,7 @@ struct config_values_traits< T_CONFIG_STRING >
 		typedef value_type result;
 		static result* act( )
 		{
-			return buffer_init( );
+			return buffer_cache::local( ).get( );
 		}
 	};
 
@@ -148,7 +200,7 @@ struct config_values_traits< T_CONFIG_STRING >
 		typedef bool result;
 		static result act( value_type* pvalue )
 		{
-			buffer_free( pvalue );
+			buffer_cache::local( ).put( pvalue );
 			return true;
 		}
 	};
@@ -226,14 +278,15 @@ struct config_option_traits_base
 	typedef typename values_type_traits::value_type value_type;
 	typedef OptionType option_type;
 
-	// A default initializer.  We can do this in gcc, not sure if it
-	// is standard.
+	// A default initializer, for option types that can be constructed
+	// straight from the lighttpd value (i.e. int from int, bool from
+	// unsigned short).
 	struct initializer
 	{
 		typedef option_type result;
 		static result* act( const value_type* pvalue )
 		{
-			return new option_type;
+			return new option_type( *pvalue );
 		}
 	};
 };
@@ -294,7 +347,29 @@ struct config_option_traits< bool > : config_option_traits_base< bool, T_CONFIG_
 template <>
 struct config_option_traits< std::vector< std::string > >
  : config_option_traits_base< std::vector< std::string >, T_CONFIG_ARRAY >
-{};
+{
+	typedef config_option_traits_base< std::vector< std::string >, T_CONFIG_ARRAY > super_type;
+	typedef super_type::value_type value_type;
+	typedef super_type::values_type_traits values_type_traits;
+	typedef std::vector< std::string > option_type;
+
+	// Only the string members of the array are taken.
+	struct initializer
+	{
+		typedef option_type result;
+		static result* act( const value_type* arr )
+		{
+			option_type* option = new option_type;
+			for( std::size_t i = 0; i < arr->used; ++i )
+			{
+				if( arr->data[i]->type != TYPE_STRING ) continue;
+				const data_string* ds = reinterpret_cast< const data_string* >( arr->data[i] );
+				option->push_back( std::string( ds->value->ptr, ds->value->used ? ds->value->used - 1 : 0 ) );
+			}
+			return option;
+		}
+	};
+};
 
 // The config_option structures deal with condition decisions so we can write
 // option[ con ] where option is a L(config_option< SomeType >), con is a L(connection) 
@@ -312,20 +387,34 @@ struct config_option : public config_option_base
 	typedef bool (*validator_type)( const OptionType& );
 	typedef bool (*defaults_setter_type)( OptionType& );
 
+	// The values of every config context, as built by one load.
+	struct context_values
+	{
+		context_values( ) : contexts( 0 ) {}
+
+		~context_values( )
+		{
+			for( defaults_iterator i = values.begin( ); i != values.end( ); ++i )
+				delete *i;
+		}
+
+		const array* contexts;
+		defaults_list_type values;
+	};
+
 	config_option(	const char* key,
 					validator_type val = 0,
 					defaults_setter_type def = 0 )
-	 : config_option_base( key )
+	 : config_option_base( key ), validator( val ), defaults_setter( def ), pending( 0 ), current( 0 )
 	{ }
 
-	/*
-	virtual handler_t set_defaults( )
+	~config_option( )
 	{
-		return set_defaults( *srv );
+		abort( );
+		delete current;
 	}
-	*/
 
-	virtual handler_t set_defaults( const server& s )
+	virtual bool prepare( const server& s )
 	{
 		// initializer defines the method that the lighttpd
 		// config type should be created with, before it is
@@ -334,7 +423,6 @@ struct config_option : public config_option_base
 		typedef typename initializer::result initializer_result_type;
 
 		typedef typename values_type_traits::cleanup cleanup;
-		typedef typename cleanup::result cleanup_result_type;
 
 		// next be have information how the data structure created
 		// with the above should be converted to our chosen option type.
@@ -346,15 +434,24 @@ struct config_option : public config_option_base
 			{ NULL,	NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 		};
 
+		abort( );
+		context_values* g = new context_values;
+		g->contexts = s.config_context;
+		present = false;
+
 		for( std::size_t i = 0; i < s.config_context->used; i++ )
 		{
+			array* values = ((data_config *)srv->config_context->data[i])->value;
+			if( array_get_element( values, key, strlen( key ) ) ) present = true;
+
 			initializer_result_type* res = initializer::act();
 			cv[0].destination = reinterpret_cast< void* >( res );
 
-			if ( 0 != config_insert_values_global( const_cast< server* >( srv ), 
-							((data_config *)srv->config_context->data[i])->value, cv) )
+			if ( 0 != config_insert_values_global( const_cast< server* >( srv ), values, cv) )
 			{
-				return HANDLER_ERROR;
+				cleanup::act( res );
+				delete g;
+				return false;
 			}
 
 			// Initialize option, but don't take control of the 
@@ -362,46 +459,116 @@ struct config_option : public config_option_base
 			OptionType* option = option_initializer::act( res );
 			if( ( validator && defaults_setter ) && !validator( *option ) )
 				defaults_setter( *option );
-			defaults.push_back( option );
+			g->values.push_back( option );
 
-			// Although we don't do anything with the result,
-			// I'll keep the option available
-			cleanup_result_type cleanup_result = cleanup::act( res );
+			cleanup::act( res );
 		}
 
-		return HANDLER_GO_ON;
+		pending = g;
+		return true;
+	}
+
+	virtual bool save( snapshot_writer& out ) const
+	{
+		typedef config_snapshot_traits< OptionType > snapshot_traits;
+
+		if( !snapshot_traits::supported || !current ) return false;
+
+		out.put_string( key, strlen( key ) );
+		out.put_u32( snapshot_traits::tag );
+		out.put_u32( present );
+		out.put_u32( static_cast< uint32_t >( current->values.size( ) ) );
+		for( defaults_iterator i = current->values.begin( ); i != current->values.end( ); ++i )
+			snapshot_traits::write( out, **i );
+		return true;
+	}
+
+	virtual bool prepare( const server& s, snapshot_reader& in )
+	{
+		typedef config_snapshot_traits< OptionType > snapshot_traits;
+
+		std::string k;
+		uint32_t tag, was_present, count;
+		if( !snapshot_traits::supported || !in.get_string( k ) || k != key ) return false;
+		if( !in.get_u32( tag ) || tag != snapshot_traits::tag ) return false;
+		if( !in.get_u32( was_present ) || !in.get_u32( count ) || count != s.config_context->used ) return false;
+
+		srv = &s;
+		abort( );
+		context_values* g = new context_values;
+		g->contexts = s.config_context;
+
+		for( uint32_t i = 0; i < count; ++i )
+		{
+			const OptionType* option = snapshot_traits::read( in );
+			if( !option )
+			{
+				delete g;
+				return false;
+			}
+			g->values.push_back( option );
+		}
+
+		present = was_present != 0;
+		touch( s );
+		pending = g;
+		return true;
+	}
+
+	virtual void commit( )
+	{
+		if( !pending ) return;
+
+		delete current;
+		current = pending;
+		pending = 0;
+	}
+
+	virtual void abort( )
+	{
+		delete pending;
+		pending = 0;
+	}
+
+	// The values, one per config context with the global context first.
+	// For plugins working out their own state at set_defaults time.
+	const defaults_list_type& defaults( ) const
+	{
+		return current->values;
 	}
 
 	// Return the appropriate value for the options, depending on the 
 	// server and connection.
 	const OptionType& operator[]( const connection& con ) const
 	{
+		const context_values& g = *current;
+
 		// Lets start with the global context.  Front must exist.
 		// Plus I'd hope that config_context->used and the size of
 		// defaults are the same.
-		defaults_iterator di = defaults.begin();
+		defaults_iterator di = g.values.begin();
+		defaults_iterator end = g.values.begin() + std::min( g.values.size( ), static_cast< std::size_t >( g.contexts->used ) );
 		const OptionType* option = *di;
-		const data_config** dc = ++((data_config **)srv->config_context->data);
+		data_config** dc = reinterpret_cast< data_config** >( g.contexts->data );
+		const std::size_t key_len = strlen( key );
 
 		// skip the first, the global context
-		while( di != defaults.end() )
+		for( ++di, ++dc; di != end; ++di, ++dc )
 		{
 			// condition match
-			if( config_check_cond( srv, &con, *dc ) )	
+			if( !config_check_cond( const_cast< server* >( srv ), const_cast< connection* >( &con ), *dc ) )
+				continue;
+
+			// merge config
+			data_unset **du = (*dc)->value->data;
+			data_unset **du_end = du + (*dc)->value->used;
+			for( ; du != du_end; ++du )
 			{
-				// merge config
-				data_unset **du = (*dc)->value->data;
-				data_unset **du_end = du + (*dc)->value->used;
-				while( du++ != du_end )
+				if ( buffer_is_equal_string( (*du)->key, key, key_len ) )
 				{
-					if ( buffer_is_equal_string( (*du)->key, CONST_STR_LEN(key) ) )
-					{
-						option = *di;
-					}
+					option = *di;
 				}
 			}
-
-			++dc; ++di;
 		}
 
 		return *option;
@@ -409,8 +576,12 @@ struct config_option : public config_option_base
 
 	validator_type validator;
 	defaults_setter_type defaults_setter;
-	defaults_list_type defaults;
 
+private:
+	context_values* pending;
+	context_values* current;
+
+public:
 	static const config_scope_type_t config_scope;
 };
 
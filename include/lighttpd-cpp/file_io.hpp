@@ -0,0 +1,614 @@
+/**
+ * Asynchronous file reads and stats for plugins that need a file's
+ * content (templating, checksums, transforming it) without a blocking
+ * read() on the event loop.  lighttpd's own read and stat threads only
+ * serve the network backends and stat cache, so this is the plugins'.
+ *
+ * Reads and stats are queued for a connection, and handed over together
+ * by submit( ): with io_uring one io_uring_enter() for the lot, without
+ * it (no HAVE_IO_URING, or a kernel that won't set a ring up) one job
+ * each for a work_pool.  When a request completes its connection is put
+ * back on the joblist, or whichever task is waiting on its event is woken
+ * (which comes to the same):
+ *
+ *  handler_t handle_start_backend( connection& con )
+ *  {
+ *  	file_request_ptr& r = reads[ con.ndx ];
+ *  	if( r && !r->done( ) ) return HANDLER_WAIT_FOR_EVENT;
+ *  	if( r ) { ... r->data( ), r->result ...; r.reset( ); return HANDLER_FINISHED; }
+ *
+ *  	r = files.read( con, fd, 0, 4096 );
+ *  	files.submit( );
+ *  	return HANDLER_WAIT_FOR_EVENT;
+ *  }
+ *
+ * and from an async_backend task:
+ *
+ *  r = p.files.read( con, fd, 0, 4096 );
+ *  p.files.submit( );
+ *  BOOST_ASIO_CORO_YIELD return r->wait( ctx );
+ *
+ * Reads land in buffers of buffer_size from a pool allocated up front and
+ * registered with the ring, so the kernel doesn't map the pages in for
+ * every read.  Bigger reads, or ones made while every buffer is in use,
+ * get a buffer of their own.  A buffer goes back to the pool with the
+ * last file_request_ptr to its request, which must go before the file_io.
+ *
+ * Completions from the ring and the pool both come back through an
+ * eventfd registered with srv->ev.  One file_io per worker process, used
+ * from the event loop thread only.
+ */
+
+#ifndef _LIGHTTPD_FILE_IO_HPP_
+#define _LIGHTTPD_FILE_IO_HPP_
+
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+
+#ifdef HAVE_IO_URING
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "async_handler.hpp"
+#include "work_pool.hpp"
+
+class file_io;
+
+/**
+ * One read or stat.
+ */
+struct file_request : boost::noncopyable
+{
+	enum kind_type { READ, STAT };
+
+	file_request( file_io& owner, kind_type kind, connection& con )
+	 :	kind( kind ), con( &con ), fd( -1 ), offset( 0 ), length( 0 ), result( 0 ),
+		owner( owner ), buffer( 0 ), buffer_index( -1 ), done_( false ), cancelled( false )
+	{
+		std::memset( &st, 0, sizeof( st ) );
+	}
+
+	inline ~file_request( );
+
+	bool done( ) const { return done_; }
+
+	// What was read, result bytes of it.
+	const char* data( ) const { return buffer; }
+
+	// For async_backend tasks, yield on this until done.
+	handler_t wait( async_context& ctx, time_t timeout = 0 )
+	{
+		if( done_ ) return ctx.yield( );
+		return ctx.wait( event, timeout );
+	}
+
+	kind_type kind;
+	connection* con;
+
+	// READ
+	int fd;
+	off_t offset;
+	std::size_t length;
+
+	// STAT
+	std::string path;
+	struct stat st;
+
+	// Bytes read, or 0 for a stat, or -errno.
+	ssize_t result;
+
+	async_event event;
+
+private:
+	friend class file_io;
+
+	file_io& owner;
+	char* buffer;
+	int buffer_index;
+	std::vector< char > own;
+
+#ifdef HAVE_IO_URING
+	struct statx stx;
+#endif
+
+	bool done_;
+	bool cancelled;
+};
+
+typedef boost::shared_ptr< file_request > file_request_ptr;
+
+class file_io : boost::noncopyable
+{
+public:
+	// threads are for the work_pool, should there be no ring (or use_ring
+	// is false).
+	file_io( server& srv, std::size_t buffers = 64, std::size_t buffer_size = 64 * 1024, std::size_t threads = 4, bool use_ring = true )
+	 :	srv( srv ), buffer_size( buffer_size ), buffer_count( buffers ), arena( 0 ),
+		efd( -1 ), efd_sock( 0 ), registered( false ), ring_fd( -1 ), fixed( false ), flying( 0 ),
+		closing( false ), batches_( 0 ), completed_( 0 )
+	{
+		efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+		if( buffers && buffer_size )
+		{
+			void* p = mmap( 0, buffers * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+			if( p != MAP_FAILED ) arena = static_cast< char* >( p );
+		}
+
+		for( std::size_t i = arena ? buffers : 0; i > 0; --i )
+			free_buffers.push_back( static_cast< int >( i - 1 ) );
+
+#ifdef HAVE_IO_URING
+		if( use_ring ) setup_ring( static_cast< unsigned >( std::max< std::size_t >( buffers, 32 ) ) );
+#endif
+		if( ring_fd == -1 ) pool.reset( new work_pool( srv, threads ) );
+	}
+
+	// Waits for whatever is still in flight, the kernel or the pool may be
+	// writing to its buffers.
+	~file_io( )
+	{
+		closing = true;
+
+#ifdef HAVE_IO_URING
+		while( ring_fd != -1 && flying )
+		{
+			if( syscall( __NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 && errno != EINTR ) break;
+			reap( );
+		}
+#endif
+		// Jobs still queued in the pool never run.
+		pool.reset( );
+		complete( );
+		queued.clear( );
+		requests.clear( );
+
+		if( registered )
+		{
+			fdevent_event_del( srv.ev, efd_sock );
+			fdevent_unregister( srv.ev, efd_sock );
+		}
+		if( efd_sock )
+		{
+			efd_sock->fd = -1;
+			iosocket_free( efd_sock );
+		}
+		if( efd != -1 ) close( efd );
+
+#ifdef HAVE_IO_URING
+		teardown_ring( );
+#endif
+		if( arena ) munmap( arena, buffer_count * buffer_size );
+	}
+
+	// Read length bytes of fd from offset, once submitted.  fd must stay
+	// open until the request is done.
+	file_request_ptr read( connection& con, int fd, off_t offset, std::size_t length )
+	{
+		file_request_ptr r( new file_request( *this, file_request::READ, con ) );
+		r->fd = fd;
+		r->offset = offset;
+		r->length = length;
+
+		if( length <= buffer_size && !free_buffers.empty( ) )
+		{
+			r->buffer_index = free_buffers.back( );
+			free_buffers.pop_back( );
+			r->buffer = arena + std::size_t( r->buffer_index ) * buffer_size;
+		}
+		else
+		{
+			r->own.resize( std::max< std::size_t >( length, 1 ) );
+			r->buffer = &r->own[0];
+		}
+
+		queued.push_back( r );
+		return r;
+	}
+
+	// stat( ) path, once submitted.
+	file_request_ptr stat( connection& con, const std::string& path )
+	{
+		file_request_ptr r( new file_request( *this, file_request::STAT, con ) );
+		r->path = path;
+		queued.push_back( r );
+		return r;
+	}
+
+	// Hand everything queued over in one go.
+	void submit( )
+	{
+		listen( );
+		if( queued.empty( ) ) return;
+
+#ifdef HAVE_IO_URING
+		if( ring_fd != -1 )
+		{
+			submit_ring( );
+			return;
+		}
+#endif
+
+		for( ; !queued.empty( ); queued.pop_front( ) )
+		{
+			file_request_ptr& r = queued.front( );
+			fly( r );
+
+			// We wake the connection ourselves, once the request is marked
+			// done, rather than the pool.
+			pool->cancel( pool->submit( *r->con, boost::bind( &file_io::run_blocking, this, r.get( ) ) ) );
+		}
+		++batches_;
+	}
+
+	// The connection has gone, don't wake it.  The request still runs.
+	void cancel( const file_request_ptr& r )
+	{
+		if( r ) r->cancelled = true;
+	}
+
+	// Mark what has finished done and wake its connections.  Called from
+	// our eventfd handler, public for tests and plugins with their own loop.
+	void complete( )
+	{
+		uint64_t n;
+		while( efd != -1 && ::read( efd, &n, sizeof( n ) ) > 0 ) {}
+
+#ifdef HAVE_IO_URING
+		reap( );
+#endif
+
+		std::vector< file_request* > finished;
+		{
+			boost::mutex::scoped_lock l( finished_lock );
+			finished.swap( blocking_done );
+		}
+		for( std::vector< file_request* >::iterator i = finished.begin( ); i != finished.end( ); ++i )
+			finish( *i, (*i)->result );
+
+#ifdef HAVE_IO_URING
+		// Room in the ring again.
+		if( ring_fd != -1 && !queued.empty( ) && !closing ) submit_ring( );
+#endif
+	}
+
+	// Whether requests go through io_uring, and into registered buffers.
+	bool uring( ) const { return ring_fd != -1; }
+	bool fixed_buffers( ) const { return fixed; }
+
+	std::size_t in_flight( ) const { return flying; }
+	uint64_t batches( ) const { return batches_; }
+	uint64_t completed( ) const { return completed_; }
+
+	// Publish under prefix, i.e. "mod_thumb.files", from the main thread.
+	void report( const std::string& prefix )
+	{
+		set_counter( prefix + ".in-flight", flying );
+		set_counter( prefix + ".batches", batches_ );
+		set_counter( prefix + ".completed", completed_ );
+	}
+
+	static handler_t on_event( void* s, void* ctx, int revents )
+	{
+		reinterpret_cast< file_io* >( ctx )->complete( );
+		return HANDLER_GO_ON;
+	}
+
+private:
+	friend struct file_request;
+
+	static void set_counter( const std::string& key, uint64_t value )
+	{
+		status_counter_set( key.data( ), key.size( ), static_cast< int >( value ) );
+	}
+
+	// srv->ev doesn't exist yet when plugins are set up, so register the
+	// eventfd on first use.
+	void listen( )
+	{
+		if( registered || efd == -1 || !srv.ev ) return;
+
+		efd_sock = iosocket_init( );
+		efd_sock->fd = efd;
+		fdevent_register( srv.ev, efd_sock, &on_event, this );
+		fdevent_event_add( srv.ev, efd_sock, FDEVENT_IN );
+		registered = true;
+	}
+
+	void release( int index )
+	{
+		if( index >= 0 ) free_buffers.push_back( index );
+	}
+
+	// Kept alive by us until it completes, whoever else lets go of it.
+	void fly( const file_request_ptr& r )
+	{
+		requests[ r.get( ) ] = r;
+		++flying;
+	}
+
+	void finish( file_request* r, ssize_t result )
+	{
+		std::map< file_request*, file_request_ptr >::iterator i = requests.find( r );
+		if( i == requests.end( ) ) return;
+
+		file_request_ptr keep( i->second );
+		requests.erase( i );
+		--flying;
+		++completed_;
+
+		r->result = result;
+		r->done_ = true;
+		if( r->cancelled || closing ) return;
+
+		if( r->event.waiting( ) ) r->event.signal( );
+		else joblist_append( &srv, r->con );
+	}
+
+	// On a pool thread.
+	void run_blocking( file_request* r )
+	{
+		ssize_t result;
+		if( r->kind == file_request::READ )
+		{
+			do result = pread( r->fd, r->buffer, r->length, r->offset );
+			while( result < 0 && errno == EINTR );
+		}
+		else
+		{
+			result = ::stat( r->path.c_str( ), &r->st );
+		}
+		if( result < 0 ) result = -errno;
+
+		{
+			boost::mutex::scoped_lock l( finished_lock );
+			r->result = result;
+			blocking_done.push_back( r );
+		}
+
+		uint64_t one = 1;
+		if( efd != -1 && write( efd, &one, sizeof( one ) ) < 0 ) {}
+	}
+
+#ifdef HAVE_IO_URING
+	void setup_ring( unsigned entries )
+	{
+		struct io_uring_params p;
+		std::memset( &p, 0, sizeof( p ) );
+
+		int fd = syscall( __NR_io_uring_setup, entries, &p );
+		if( fd < 0 ) return;
+		ring_fd = fd;
+
+		sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+		cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+		single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+		if( single_mmap ) sq_len = cq_len = std::max( sq_len, cq_len );
+		sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+
+		sq_ptr = mmap( 0, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING );
+		cq_ptr = single_mmap ? sq_ptr : mmap( 0, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING );
+		void* s = mmap( 0, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES );
+		sqes = s == MAP_FAILED ? 0 : static_cast< struct io_uring_sqe* >( s );
+
+		if( sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || !sqes || !supported( ) )
+		{
+			teardown_ring( );
+			return;
+		}
+
+		char* sq = static_cast< char* >( sq_ptr );
+		char* cq = static_cast< char* >( cq_ptr );
+		sq_head = reinterpret_cast< unsigned* >( sq + p.sq_off.head );
+		sq_tail = reinterpret_cast< unsigned* >( sq + p.sq_off.tail );
+		sq_mask = *reinterpret_cast< unsigned* >( sq + p.sq_off.ring_mask );
+		sq_array = reinterpret_cast< unsigned* >( sq + p.sq_off.array );
+		cq_head = reinterpret_cast< unsigned* >( cq + p.cq_off.head );
+		cq_tail = reinterpret_cast< unsigned* >( cq + p.cq_off.tail );
+		cq_mask = *reinterpret_cast< unsigned* >( cq + p.cq_off.ring_mask );
+		cqes = reinterpret_cast< struct io_uring_cqe* >( cq + p.cq_off.cqes );
+		sq_entries = p.sq_entries;
+
+		if( efd != -1 ) syscall( __NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &efd, 1 );
+
+		// Pinned once rather than for every read.  Not fatal, i.e. over
+		// RLIMIT_MEMLOCK on older kernels, the reads just aren't fixed.
+		if( arena )
+		{
+			std::vector< struct iovec > iov( buffer_count );
+			for( std::size_t i = 0; i < buffer_count; ++i )
+			{
+				iov[i].iov_base = arena + i * buffer_size;
+				iov[i].iov_len = buffer_size;
+			}
+			fixed = 0 == syscall( __NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov[0], static_cast< unsigned >( iov.size( ) ) );
+		}
+	}
+
+	// The kernel has every operation we use.
+	bool supported( )
+	{
+		const unsigned ops = 64;
+		std::vector< char > buf( sizeof( struct io_uring_probe ) + ops * sizeof( struct io_uring_probe_op ), 0 );
+		struct io_uring_probe* probe = reinterpret_cast< struct io_uring_probe* >( &buf[0] );
+
+		if( 0 != syscall( __NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops ) ) return false;
+
+		const int needed[] = { IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_STATX };
+		for( std::size_t i = 0; i < sizeof( needed ) / sizeof( needed[0] ); ++i )
+		{
+			if( needed[i] > probe->last_op || !( probe->ops[ needed[i] ].flags & IO_URING_OP_SUPPORTED ) ) return false;
+		}
+		return true;
+	}
+
+	void teardown_ring( )
+	{
+		if( ring_fd == -1 ) return;
+
+		if( sqes ) munmap( sqes, sqes_len );
+		if( cq_ptr != MAP_FAILED && cq_ptr != sq_ptr ) munmap( cq_ptr, cq_len );
+		if( sq_ptr != MAP_FAILED ) munmap( sq_ptr, sq_len );
+		close( ring_fd );
+		ring_fd = -1;
+		fixed = false;
+	}
+
+	// As many of the queued as there is room for, and one io_uring_enter.
+	void submit_ring( )
+	{
+		unsigned tail = *sq_tail;
+		unsigned head = __atomic_load_n( sq_head, __ATOMIC_ACQUIRE );
+		unsigned n = 0;
+
+		// In flight kept to the ring's size, so completions can't overflow.
+		for( ; !queued.empty( ) && tail - head < sq_entries && flying < sq_entries; queued.pop_front( ), ++n )
+		{
+			file_request_ptr& r = queued.front( );
+			unsigned at = tail & sq_mask;
+			struct io_uring_sqe* sqe = &sqes[ at ];
+			std::memset( sqe, 0, sizeof( *sqe ) );
+
+			if( r->kind == file_request::READ )
+			{
+				sqe->opcode = fixed && r->buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+				sqe->fd = r->fd;
+				sqe->addr = reinterpret_cast< uintptr_t >( r->buffer );
+				sqe->len = static_cast< uint32_t >( r->length );
+				sqe->off = r->offset;
+				if( sqe->opcode == IORING_OP_READ_FIXED ) sqe->buf_index = static_cast< uint16_t >( r->buffer_index );
+			}
+			else
+			{
+				sqe->opcode = IORING_OP_STATX;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = reinterpret_cast< uintptr_t >( r->path.c_str( ) );
+				sqe->len = STATX_BASIC_STATS;
+				sqe->off = reinterpret_cast< uintptr_t >( &r->stx );
+			}
+			sqe->user_data = reinterpret_cast< uintptr_t >( r.get( ) );
+
+			sq_array[ at ] = at;
+			++tail;
+			fly( r );
+		}
+
+		if( !n ) return;
+
+		__atomic_store_n( sq_tail, tail, __ATOMIC_RELEASE );
+		while( syscall( __NR_io_uring_enter, ring_fd, n, 0, 0, NULL, 0 ) < 0 && errno == EINTR ) {}
+		++batches_;
+	}
+
+	void reap( )
+	{
+		if( ring_fd == -1 ) return;
+
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+
+		for( ; head != tail; ++head )
+		{
+			const struct io_uring_cqe& cqe = cqes[ head & cq_mask ];
+			file_request* r = reinterpret_cast< file_request* >( static_cast< uintptr_t >( cqe.user_data ) );
+			if( r->kind == file_request::STAT && cqe.res == 0 ) from_statx( r->stx, r->st );
+
+			// Let the slot go before waking anyone.
+			__atomic_store_n( cq_head, head + 1, __ATOMIC_RELEASE );
+			finish( r, cqe.res );
+		}
+	}
+
+	static void from_statx( const struct statx& x, struct stat& st )
+	{
+		std::memset( &st, 0, sizeof( st ) );
+		st.st_dev = makedev( x.stx_dev_major, x.stx_dev_minor );
+		st.st_ino = x.stx_ino;
+		st.st_mode = x.stx_mode;
+		st.st_nlink = x.stx_nlink;
+		st.st_uid = x.stx_uid;
+		st.st_gid = x.stx_gid;
+		st.st_rdev = makedev( x.stx_rdev_major, x.stx_rdev_minor );
+		st.st_size = x.stx_size;
+		st.st_blksize = x.stx_blksize;
+		st.st_blocks = x.stx_blocks;
+		st.st_atime = x.stx_atime.tv_sec;
+		st.st_mtime = x.stx_mtime.tv_sec;
+		st.st_ctime = x.stx_ctime.tv_sec;
+	}
+
+	void* sq_ptr;
+	void* cq_ptr;
+	std::size_t sq_len;
+	std::size_t cq_len;
+	std::size_t sqes_len;
+	bool single_mmap;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe* sqes;
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+#endif
+
+	server& srv;
+
+	// The registered buffers, and which are free.
+	std::size_t buffer_size;
+	std::size_t buffer_count;
+	char* arena;
+	std::vector< int > free_buffers;
+
+	int efd;
+	iosocket* efd_sock;
+	bool registered;
+
+	int ring_fd;
+	bool fixed;
+
+	// Not yet submitted, and submitted but not yet done.
+	std::deque< file_request_ptr > queued;
+	std::map< file_request*, file_request_ptr > requests;
+	std::size_t flying;
+
+	boost::scoped_ptr< work_pool > pool;
+	boost::mutex finished_lock;
+	std::vector< file_request* > blocking_done;
+
+	bool closing;
+	uint64_t batches_;
+	uint64_t completed_;
+};
+
+inline file_request::~file_request( )
+{
+	owner.release( buffer_index );
+}
+
+#endif // _LIGHTTPD_FILE_IO_HPP_
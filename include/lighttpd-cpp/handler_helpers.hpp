@@ -9,6 +9,15 @@
  *  - DocRootHandler
  *  - PhysicalHandler
  *  - StartBackendHandler
+ *  - ResponseHeaderHandler
+ *  - SendRequestContentHandler
+ *  - FilterResponseContentHandler
+ *  - ResponseDoneHandler
+ *  - JoblistHandler
+ *  - ConnectionResetHandler
+ *  - ConnectionCloseHandler
+ *  - TriggerHandler
+ *  - SighupHandler
  */
 
 #ifndef _LIGHTTPD_HANDLER_HELPERS_HPP_
@@ -81,7 +90,7 @@ struct handlers_setter_impl : handlers_setter_base< PluginType, HandlerList > {}
 		typedef handlers_setter_base< PluginType, HandlerList > super_type; \
 		static handler_t handler_wrapper( server* srv, connection* con, void* p ) \
 		{ \
-			PluginType* P = reinterpret_cast< PluginType* >( p ); \
+			PluginType* P = plugin_handle::get< PluginType >( p ); \
 			return P->handler_name( *con ); \
 		} \
 		static void set( plugin& p ) \
@@ -91,5 +100,26 @@ struct handlers_setter_impl : handlers_setter_base< PluginType, HandlerList > {}
 		} \
 	};
 
+// As above, but for the server wide hooks that are not given a connection,
+// i.e. handle_trigger and handle_sighup.
+#define MAKE_SERVER_HANDLER( TypedefHandle, handler_name ) \
+	struct TypedefHandle { handler_t handler_name( ); }; \
+	template < typename PluginType, typename HandlerList > \
+	struct handlers_setter_impl< PluginType, TypedefHandle, HandlerList > \
+	 : handlers_setter_base< PluginType, HandlerList > \
+	{ \
+		typedef handlers_setter_base< PluginType, HandlerList > super_type; \
+		static handler_t handler_wrapper( server* srv, void* p ) \
+		{ \
+			PluginType* P = plugin_handle::get< PluginType >( p ); \
+			return P->handler_name( ); \
+		} \
+		static void set( plugin& p ) \
+		{ \
+			p.handler_name = &handler_wrapper; \
+			super_type::next::set( p ); \
+		} \
+	};
+
 #endif // _LIGHTTPD_HANDLER_HELPERS_HPP_
 
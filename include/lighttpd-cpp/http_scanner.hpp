@@ -0,0 +1,296 @@
+/**
+ * A request-line and header scanner for the read_queue, an alternative to
+ * the lemon based http_request_parse_cq (see http_req.h).
+ *
+ * Rather than tokenizing byte by byte, each line is found by searching for
+ * CR/LF and each header name by searching for the colon with simd_find,
+ * 16 or 32 bytes at a time.
+ *
+ * The method, URI, protocol and header names and values found are spans
+ * straight into the read_queue's chunks, nothing is copied to find them.
+ * The odd line that is split across chunks, and folded header values, are
+ * joined into a copy owned by the scanner.  The spans are good until the
+ * read_queue is next changed, and fill() copies them into an http_req_t
+ * once at the end, as http_req_t owns its buffers.
+ *
+ * What is accepted:
+ *  - blank lines before the request line are skipped
+ *  - lines end in CRLF or a bare LF, a CR anywhere else is an error
+ *  - METHOD SP URI SP PROTOCOL, with runs of spaces allowed between
+ *  - unknown methods and protocols are an error
+ *  - header names may not be empty or contain whitespace
+ *  - header values are trimmed of spaces and tabs, continuation lines are
+ *    joined onto the previous value with a single space
+ *  - repeated headers are merged by array_insert_unique, as the lemon
+ *    parser does
+ *
+ * As with http_request_parse_cq, PARSE_NEED_MORE means the blank line
+ * ending the header hasn't arrived yet, and on PARSE_SUCCESS the header is
+ * marked as read in the chunkqueue, leaving any body behind it.
+ */
+
+#ifndef _LIGHTTPD_HTTP_SCANNER_HPP_
+#define _LIGHTTPD_HTTP_SCANNER_HPP_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <cstring>
+
+#include <boost/noncopyable.hpp>
+
+#include "c++-compat/base.h"
+#include "c++-compat/http_req.h"
+#include "simd_find.hpp"
+
+// Part of a request, not NUL terminated.
+struct http_span
+{
+	http_span( const char* ptr = 0, std::size_t len = 0 ) : ptr( ptr ), len( len ) {}
+
+	std::string str( ) const { return std::string( ptr, len ); }
+
+	bool equals( const char* s, std::size_t n ) const
+	{
+		return n == len && 0 == std::memcmp( ptr, s, n );
+	}
+
+	const char* ptr;
+	std::size_t len;
+};
+
+struct http_header_span
+{
+	http_span key;
+	http_span value;
+};
+
+class http_scanner : boost::noncopyable
+{
+public:
+	http_scanner( )
+	 : method_key( HTTP_METHOD_UNSET ), protocol_key( HTTP_VERSION_UNSET ), c( 0 ), offset( 0 )
+	{}
+
+	// Find the request line and headers at the front of cq, leaving cq as
+	// it is.
+	parse_status_t scan( chunkqueue& cq )
+	{
+		reset( );
+		c = cq.first;
+		offset = c ? c->offset : 0;
+
+		http_span line;
+		parse_status_t status;
+
+		do
+		{
+			if( PARSE_SUCCESS != ( status = next_line( line ) ) ) return status;
+		}
+		while( !line.len );
+
+		if( !request_line( line ) ) return PARSE_ERROR;
+
+		for( ;; )
+		{
+			if( PARSE_SUCCESS != ( status = next_line( line ) ) ) return status;
+			if( !line.len ) return PARSE_SUCCESS;
+			if( !header_line( line ) ) return PARSE_ERROR;
+		}
+	}
+
+	// Copy what scan() found into req.
+	void fill( http_req_t& req ) const
+	{
+		req.method = method_key;
+		req.protocol = protocol_key;
+		buffer_copy_string_len( req.uri_raw, uri.ptr, uri.len );
+
+		for( std::vector< http_header_span >::const_iterator i = headers.begin( ); i != headers.end( ); ++i )
+		{
+			data_string* ds = reinterpret_cast< data_string* >( array_get_unused_element( req.headers, TYPE_STRING ) );
+			if( !ds ) ds = data_string_init( );
+
+			buffer_copy_string_len( ds->key, i->key.ptr, i->key.len );
+			buffer_copy_string_len( ds->value, i->value.ptr, i->value.len );
+			array_insert_unique( req.headers, reinterpret_cast< data_unset* >( ds ) );
+		}
+	}
+
+	// Mark everything up to the end of the header as read.
+	void consume( chunkqueue& cq ) const
+	{
+		for( chunk* i = cq.first; i && i != c; i = i->next )
+			i->offset = i->mem->used ? i->mem->used - 1 : 0;
+		if( c ) c->offset = offset;
+
+		chunkqueue_remove_finished_chunks( &cq );
+	}
+
+	// A drop in for http_request_parse_cq.
+	parse_status_t parse( chunkqueue& cq, http_req_t& req )
+	{
+		parse_status_t status = scan( cq );
+		if( status != PARSE_SUCCESS ) return status;
+
+		fill( req );
+		consume( cq );
+		return PARSE_SUCCESS;
+	}
+
+	http_span method;
+	http_span uri;
+	http_span protocol;
+	std::vector< http_header_span > headers;
+
+	int method_key;
+	int protocol_key;
+
+private:
+	void reset( )
+	{
+		method = uri = protocol = http_span( );
+		headers.clear( );
+		copies.clear( );
+		method_key = HTTP_METHOD_UNSET;
+		protocol_key = HTTP_VERSION_UNSET;
+	}
+
+	// The next line without its line end, into a copy if it is spread
+	// over more than one chunk.
+	parse_status_t next_line( http_span& line )
+	{
+		std::string* joined = 0;
+
+		for( ; c; c = c->next, offset = c ? c->offset : 0 )
+		{
+			if( c->type != chunk::MEM_CHUNK ) return PARSE_ERROR;
+
+			const char* base = c->mem->ptr;
+			const char* start = base + offset;
+			const char* end = base + ( c->mem->used ? c->mem->used - 1 : 0 );
+			if( start >= end ) continue;
+
+			// A CR right at the end of the last chunk.
+			if( joined && !joined->empty( ) && *joined->rbegin( ) == '\r' )
+			{
+				if( *start != '\n' ) return PARSE_ERROR;
+
+				joined->erase( joined->size( ) - 1 );
+				offset += 1;
+				line = http_span( joined->data( ), joined->size( ) );
+				return PARSE_SUCCESS;
+			}
+
+			const char* p = simd_find( start, end, '\r', '\n' );
+			if( p != end && *p == '\r' && p + 1 != end && p[1] != '\n' ) return PARSE_ERROR;
+
+			if( p == end || ( p + 1 == end && *p == '\r' ) )
+			{
+				if( !joined ) joined = &*copies.insert( copies.end( ), std::string( ) );
+				joined->append( start, end - start );
+				continue;
+			}
+
+			offset = ( p - base ) + ( *p == '\r' ? 2 : 1 );
+
+			if( !joined )
+			{
+				line = http_span( start, p - start );
+			}
+			else
+			{
+				joined->append( start, p - start );
+				line = http_span( joined->data( ), joined->size( ) );
+			}
+			return PARSE_SUCCESS;
+		}
+
+		return PARSE_NEED_MORE;
+	}
+
+	bool request_line( const http_span& line )
+	{
+		const char* p = line.ptr;
+		const char* end = line.ptr + line.len;
+		http_span* parts[] = { &method, &uri, &protocol };
+
+		for( std::size_t i = 0; i < 3; ++i )
+		{
+			while( p != end && *p == ' ' ) ++p;
+			if( p == end ) return false;
+
+			const char* word = p;
+			p = simd_find( p, end, ' ', ' ' );
+			*parts[i] = http_span( word, p - word );
+		}
+
+		while( p != end && *p == ' ' ) ++p;
+		if( p != end ) return false;
+
+		char name[ 32 ];
+		if( method.len >= sizeof( name ) || protocol.len >= sizeof( name ) ) return false;
+
+		std::memcpy( name, method.ptr, method.len );
+		name[ method.len ] = '\0';
+		method_key = get_http_method_key( name );
+
+		std::memcpy( name, protocol.ptr, protocol.len );
+		name[ protocol.len ] = '\0';
+		protocol_key = get_http_version_key( name );
+
+		return method_key != HTTP_METHOD_UNSET && protocol_key != HTTP_VERSION_UNSET;
+	}
+
+	bool header_line( const http_span& line )
+	{
+		const char* end = line.ptr + line.len;
+
+		// Folded onto the value above.
+		if( is_space( *line.ptr ) )
+		{
+			if( headers.empty( ) ) return false;
+
+			http_span& value = headers.back( ).value;
+			http_span more = trim( line.ptr, end );
+
+			std::string& joined = *copies.insert( copies.end( ), std::string( ) );
+			joined.reserve( value.len + 1 + more.len );
+			joined.append( value.ptr, value.len );
+			if( value.len && more.len ) joined += ' ';
+			joined.append( more.ptr, more.len );
+
+			value = http_span( joined.data( ), joined.size( ) );
+			return true;
+		}
+
+		const char* colon = simd_find( line.ptr, end, ':', ':' );
+		if( colon == end || colon == line.ptr ) return false;
+		if( simd_find( line.ptr, colon, ' ', '\t' ) != colon ) return false;
+
+		http_header_span h;
+		h.key = http_span( line.ptr, colon - line.ptr );
+		h.value = trim( colon + 1, end );
+		headers.push_back( h );
+		return true;
+	}
+
+	static bool is_space( char ch ) { return ch == ' ' || ch == '\t'; }
+
+	static http_span trim( const char* p, const char* end )
+	{
+		while( p != end && is_space( *p ) ) ++p;
+		while( end != p && is_space( end[-1] ) ) --end;
+		return http_span( p, end - p );
+	}
+
+	// Lines that had to be put back together, a list so that spans into
+	// them stay put.
+	std::list< std::string > copies;
+
+	// Where scanning is up to, and after scan() where the header ends.
+	chunk* c;
+	off_t offset;
+};
+
+#endif // _LIGHTTPD_HTTP_SCANNER_HPP_
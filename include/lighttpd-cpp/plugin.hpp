@@ -12,6 +12,8 @@
 
 #include "handler_helpers.hpp"
 #include "datatype_helpers.hpp"
+#include "config_snapshot.hpp"
+#include "connection_attributes.hpp"
 
 // Tests to which we are friends.
 class lighttpd_tests;
@@ -46,9 +48,30 @@ class plugin_base_tests;
  * Serves as an easy method of sharing data between points of flow.  Perhaps
  * theres something in trying to abstract this shared data out, and removing
  * this hardcoded sharing within a plugin.  Don't know, just a gut feeling.
+ * (Between plugins, see connection_attribute.)
  *
  */
 
+class plugin_base;
+
+/**
+ * What lighttpd gets as plugin.data.  lighttpd treats plugin.data as a
+ * PLUGIN_DATA struct and writes the plugin id over its first size_t, which
+ * for a C++ plugin would be the vtable.  So it gets one of these instead,
+ * and the wrappers go through it to the plugin instance.
+ */
+struct plugin_handle
+{
+	std::size_t id; // PLUGIN_DATA, filled in by lighttpd after init.
+	plugin_base* instance;
+
+	template < typename PluginType >
+	static PluginType* get( void* p_d )
+	{
+		return static_cast< PluginType* >( reinterpret_cast< plugin_handle* >( p_d )->instance );
+	}
+};
+
 /**
  * Absolute base for plugins.
  */
@@ -57,11 +80,14 @@ class plugin_base
 protected:
 	// Sets up plugin generic settings
 	plugin_base( const std::string& name, const std::size_t& version, server& srv )
-	 : srv( srv ), name( name ), version( version )
+	 : srv( srv ), handle( 0 ), name( name ), version( version ), snapshot_dir( "cpp.snapshot-dir" )
 	{}
 
 	const server& srv;
 
+	// Set when created through Plugin::init, the only way lighttpd makes us.
+	plugin_handle* handle;
+
 public:
 	virtual ~plugin_base( ){ }
 
@@ -72,18 +98,33 @@ public:
 	const std::string& name;
 	const std::size_t& version;
 
+	// Our index in con.plugin_ctx and con.mode, as given by lighttpd.
+	// Only valid after init, and 0 when created outside of lighttpd.
+	std::size_t id( ) const
+	{
+		return handle ? handle->id : 0;
+	}
+
 	// For set defaults, we just call set defaults on all config_options
-	// in the current translation unit.
-	handler_t set_defaults( )
+	// in the current translation unit, or load them from a config snapshot
+	// if there is a current one (see config_snapshot.hpp).  Plugins that
+	// need to do work once their options are known (i.e. build indexes)
+	// override this and call down to here first.
+	virtual handler_t set_defaults( )
 	{
-		return config_option_base::set_all_defaults( srv );
+		if( snapshot_dir.set_defaults( srv ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		return config_snapshot::set_all_defaults( srv, name, version, *snapshot_dir.defaults( ).front( ) );
 	}
 
 	static handler_t set_defaults_wrapper( server* s, void* p_d )
 	{
-		plugin_base& p = reinterpret_cast< plugin_base& >( p_d );
-		return p.set_defaults( );
+		return plugin_handle::get< plugin_base >( p_d )->set_defaults( );
 	}
+
+	// Where config snapshots go, empty for none.
+	config_option< std::string, T_CONFIG_SCOPE_SERVER > snapshot_dir;
 };
 
 /**
@@ -155,8 +196,8 @@ public:
 	}
 
 	// To be called from lighttpd in its _init phase of plugin initialization.
-	// Creates a plugin instance of type MostDerived and returns it to be used
-	// as the lighttpd's plugin.data.
+	// Creates a plugin instance of type MostDerived and returns a handle to
+	// it to be used as the lighttpd's plugin.data.
 	static void* init( server* srv )
 	{
 		// Stop propagation to C code.
@@ -165,7 +206,21 @@ public:
 		{
 #endif
 			// Here the actual plugin instance is created.
-			return reinterpret_cast< void* >( new MostDerived( *srv ) );
+			plugin_handle* handle = new plugin_handle;
+			MostDerived* instance = 0;
+			try
+			{
+				instance = new MostDerived( *srv );
+			}
+			catch( ... )
+			{
+				delete handle;
+				throw;
+			}
+			handle->id = 0;
+			handle->instance = instance;
+			instance->handle = handle;
+			return reinterpret_cast< void* >( handle );
 #ifndef TESTING
 		}
 		catch( ... )
@@ -180,7 +235,9 @@ public:
 	{
 		try
 		{
-			delete reinterpret_cast< plugin_base* >( p_d );
+			plugin_handle* handle = reinterpret_cast< plugin_handle* >( p_d );
+			delete handle->instance;
+			delete handle;
 			return HANDLER_GO_ON;
 		}
 		catch( ... )
@@ -195,14 +252,26 @@ public:
 // The first argument specifies a typedef handle to the handler types,
 // the second specifies the handle name as seen in the plugin structure.
 // This macro is only for handlers that take just the connection.
-MAKE_HANDLER( UriRawHandler,       handle_uri_raw       );
-MAKE_HANDLER( UriCleanHandler,     handle_uri_clean     );
-MAKE_HANDLER( DocRootHandler,      handle_docroot       );
-MAKE_HANDLER( PhysicalHandler,     handle_physical      );
-MAKE_HANDLER( StartBackendHandler, handle_start_backend );
+MAKE_HANDLER( UriRawHandler,                 handle_uri_raw                 );
+MAKE_HANDLER( UriCleanHandler,               handle_uri_clean               );
+MAKE_HANDLER( DocRootHandler,                handle_docroot                 );
+MAKE_HANDLER( PhysicalHandler,               handle_physical                );
+MAKE_HANDLER( StartBackendHandler,           handle_start_backend           );
+MAKE_HANDLER( ResponseHeaderHandler,         handle_response_header         );
+MAKE_HANDLER( SendRequestContentHandler,     handle_send_request_content    );
+MAKE_HANDLER( FilterResponseContentHandler,  handle_filter_response_content );
+MAKE_HANDLER( ResponseDoneHandler,           handle_response_done           );
+MAKE_HANDLER( JoblistHandler,                handle_joblist                 );
+MAKE_HANDLER( ConnectionResetHandler,        connection_reset               );
+MAKE_HANDLER( ConnectionCloseHandler,        handle_connection_close        );
+
+// Server wide hooks, these take no connection.
+MAKE_SERVER_HANDLER( TriggerHandler, handle_trigger );
+MAKE_SERVER_HANDLER( SighupHandler,  handle_sighup  );
 
-// This is defined in handler_helpers.hpp .  It should not be used by derived plugins.
+// These are defined in handler_helpers.hpp .  They should not be used by derived plugins.
 #undef MAKE_HANDLER
+#undef MAKE_SERVER_HANDLER
 
 // Given your plugin name, this will create the entry point for lighttpd to use.
 // To be used in your plugins cpp file.
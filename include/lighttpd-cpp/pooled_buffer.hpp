@@ -0,0 +1,190 @@
+/**
+ * Scratch lighttpd buffers without a malloc per request.
+ *
+ *  pooled_buffer tmp;
+ *  buffer_copy_string_buffer( tmp.get( ), con.uri.path );
+ *  ...
+ *
+ * A pooled_buffer borrows a buffer from the calling thread's
+ * buffer_cache and gives it back when it goes out of scope, emptied but
+ * with its memory kept, so the next borrower on that thread doesn't
+ * allocate.  It can be moved (boost::move) but not copied, and goes back
+ * to the pool of whichever thread it is destroyed on.
+ *
+ * Each thread's cache keeps at most buffer_cache::max_buffers buffers,
+ * and doesn't keep any that have grown beyond max_capacity, so that one
+ * huge request doesn't pin its memory for good.  Anything over is freed.
+ */
+
+#ifndef _LIGHTTPD_POOLED_BUFFER_HPP_
+#define _LIGHTTPD_POOLED_BUFFER_HPP_
+
+#include <vector>
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/move/core.hpp>
+
+#include "c++-compat/plugin.h"
+
+struct buffer_cache_stats
+{
+	buffer_cache_stats( )
+	 : hits( 0 ), misses( 0 ), discarded( 0 ), pooled( 0 ), pooled_bytes( 0 )
+	{}
+
+	uint64_t hits;          // handed out from the pool
+	uint64_t misses;        // had to be allocated
+	uint64_t discarded;     // freed on return, over a limit
+	std::size_t pooled;
+	std::size_t pooled_bytes;
+};
+
+class buffer_cache : boost::noncopyable
+{
+public:
+	static std::size_t max_buffers;
+	static std::size_t max_capacity;
+
+	~buffer_cache( )
+	{
+		for( std::vector< buffer* >::iterator i = free_buffers.begin( ); i != free_buffers.end( ); ++i )
+			buffer_free( *i );
+	}
+
+	// The calling thread's cache, freed when the thread exits.
+	static buffer_cache& local( )
+	{
+		pthread_once( &key_once, make_key );
+
+		buffer_cache* c = static_cast< buffer_cache* >( pthread_getspecific( key ) );
+		if( !c )
+		{
+			c = new buffer_cache;
+			pthread_setspecific( key, c );
+		}
+		return *c;
+	}
+
+	// An empty buffer, to go back through put( ).
+	buffer* get( )
+	{
+		if( free_buffers.empty( ) )
+		{
+			++counters.misses;
+			return buffer_init( );
+		}
+
+		buffer* b = free_buffers.back( );
+		free_buffers.pop_back( );
+
+		++counters.hits;
+		--counters.pooled;
+		counters.pooled_bytes -= b->size;
+		return b;
+	}
+
+	void put( buffer* b )
+	{
+		if( !b ) return;
+
+		if( free_buffers.size( ) >= max_buffers || b->size > max_capacity )
+		{
+			++counters.discarded;
+			buffer_free( b );
+			return;
+		}
+
+		// Not buffer_reset, which lets go of big allocations.
+		b->used = 0;
+		if( b->size ) b->ptr[0] = '\0';
+
+		free_buffers.push_back( b );
+		++counters.pooled;
+		counters.pooled_bytes += b->size;
+	}
+
+	const buffer_cache_stats& stats( ) const { return counters; }
+
+	// As status counters, from the main thread's cache.
+	void report( ) const
+	{
+		status_counter_set( CONST_STR_LEN( "buffer-cache.hits" ), static_cast< int >( counters.hits ) );
+		status_counter_set( CONST_STR_LEN( "buffer-cache.misses" ), static_cast< int >( counters.misses ) );
+		status_counter_set( CONST_STR_LEN( "buffer-cache.discarded" ), static_cast< int >( counters.discarded ) );
+		status_counter_set( CONST_STR_LEN( "buffer-cache.pooled-bytes" ), static_cast< int >( counters.pooled_bytes ) );
+	}
+
+private:
+	static void make_key( ) { pthread_key_create( &key, destroy ); }
+	static void destroy( void* c ) { delete static_cast< buffer_cache* >( c ); }
+
+	static pthread_once_t key_once;
+	static pthread_key_t key;
+
+	std::vector< buffer* > free_buffers;
+	buffer_cache_stats counters;
+};
+
+// Like config_option_base::registry, one of these per module.
+std::size_t buffer_cache::max_buffers = 64;
+std::size_t buffer_cache::max_capacity = 64 * 1024;
+pthread_once_t buffer_cache::key_once = PTHREAD_ONCE_INIT;
+pthread_key_t buffer_cache::key;
+
+class pooled_buffer
+{
+	BOOST_MOVABLE_BUT_NOT_COPYABLE( pooled_buffer )
+
+public:
+	pooled_buffer( )
+	 : b( buffer_cache::local( ).get( ) )
+	{}
+
+	pooled_buffer( BOOST_RV_REF( pooled_buffer ) other )
+	 : b( other.b )
+	{
+		other.b = 0;
+	}
+
+	pooled_buffer& operator=( BOOST_RV_REF( pooled_buffer ) other )
+	{
+		if( this != &other )
+		{
+			reset( );
+			b = other.b;
+			other.b = 0;
+		}
+		return *this;
+	}
+
+	~pooled_buffer( )
+	{
+		reset( );
+	}
+
+	buffer* get( ) const { return b; }
+	buffer* operator->( ) const { return b; }
+	buffer& operator*( ) const { return *b; }
+
+	// Keep the buffer, it is then the caller's to buffer_free.
+	buffer* release( )
+	{
+		buffer* r = b;
+		b = 0;
+		return r;
+	}
+
+private:
+	void reset( )
+	{
+		if( b ) buffer_cache::local( ).put( b );
+		b = 0;
+	}
+
+	buffer* b;
+};
+
+#endif // _LIGHTTPD_POOLED_BUFFER_HPP_
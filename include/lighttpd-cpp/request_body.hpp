@@ -0,0 +1,391 @@
+/**
+ * Request bodies for plugins as they arrive, rather than once they are
+ * all in.
+ *
+ * The core reads the body into con.request_content_queue and calls
+ * handle_send_request_content of the backend handling the request each
+ * time more of it is there.  A plugin mixing in request_body_reader has
+ * that hook hand it the new bytes with
+ *
+ *  std::size_t request_body_data( connection& con, const char* p, std::size_t len );
+ *
+ * which returns how many it took.  What is taken is gone from the queue.
+ * Taking fewer than offered holds the rest back: the hook waits, and it is
+ * up to the plugin to joblist_append( ) the connection when it can take
+ * more.  Once all of it is taken the hook returns what
+ *
+ *  handler_t request_body_end( connection& con );
+ *
+ * does, once per request: a body of nothing ends at the first call, and
+ * one whose queue is closed only after the last of it was taken ends at
+ * the call that sees it closed.
+ *
+ * A request_body keeps what the plugin takes: in a pooled buffer up to a
+ * threshold, in a temporary file only past it.  Files of successive
+ * bodies go round server.upload-dirs, preallocated with fallocate() to
+ * the Content-Length so a big upload is laid out in one piece.
+ *
+ * The core may already have put part of a big body in its own temporary
+ * files; those are read back a piece at a time.
+ */
+
+#ifndef _LIGHTTPD_REQUEST_BODY_HPP_
+#define _LIGHTTPD_REQUEST_BODY_HPP_
+
+#include "plugin.hpp"
+#include "pooled_buffer.hpp"
+#include "response_builder.hpp"
+#include "connection_attributes.hpp"
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Directories for temporary files, each in turn.
+ */
+class tempdir_rotation
+{
+public:
+	tempdir_rotation( )
+	 : next( 0 )
+	{}
+
+	// server.upload-dirs.
+	void assign( const array* dirs )
+	{
+		names.clear( );
+		for( std::size_t i = 0; dirs && i < dirs->used; ++i )
+		{
+			if( dirs->data[i]->type != TYPE_STRING ) continue;
+			const data_string* ds = reinterpret_cast< const data_string* >( dirs->data[i] );
+			if( !buffer_is_empty( ds->value ) ) names.push_back( std::string( ds->value->ptr, ds->value->used - 1 ) );
+		}
+		next = 0;
+	}
+
+	void assign( const std::vector< std::string >& dirs )
+	{
+		names = dirs;
+		next = 0;
+	}
+
+	// The next directory, /var/tmp when there are none.
+	std::string pick( )
+	{
+		if( names.empty( ) ) return "/var/tmp";
+		return names[ next++ % names.size( ) ];
+	}
+
+	std::size_t size( ) const { return names.size( ); }
+
+private:
+	std::vector< std::string > names;
+	std::size_t next;
+};
+
+/**
+ * A request body being taken in, in memory until it grows past threshold,
+ * then in a file.  expected is the Content-Length, 0 when not known.
+ */
+class request_body : boost::noncopyable
+{
+public:
+	// Preallocated a step at a time when the length isn't known.
+	static const off_t allocate_step = 1024 * 1024;
+
+	request_body( std::size_t threshold, tempdir_rotation& dirs, off_t expected = 0 )
+	 :	threshold( threshold ), dirs( dirs ), expected( expected ),
+		total( 0 ), allocated( 0 ), fd( -1 ), error( false )
+	{}
+
+	~request_body( )
+	{
+		if( fd != -1 ) close( fd );
+		if( !path.empty( ) ) unlink( path.c_str( ) );
+	}
+
+	// false once anything couldn't be kept.
+	bool append( const char* p, std::size_t len )
+	{
+		if( error ) return false;
+
+		if( fd == -1 && std::size_t( total ) + len <= threshold )
+		{
+			buffer_append_string_len( memory.get( ), p, len );
+			total += len;
+			return true;
+		}
+
+		if( fd == -1 && !spill( ) ) return fail( );
+		if( !write_out( p, len, total ) ) return fail( );
+		total += len;
+		return true;
+	}
+
+	off_t size( ) const { return total; }
+	bool failed( ) const { return error; }
+	bool spilled( ) const { return fd != -1; }
+
+	// While not spilled.
+	const char* data( ) const { return memory->used ? memory->ptr : ""; }
+
+	// Once spilled.
+	int file( ) const { return fd; }
+	const std::string& file_name( ) const { return path; }
+
+	// All of it, read back from the file if need be.
+	bool read( std::string& out ) const
+	{
+		if( fd == -1 )
+		{
+			out.append( data( ), total );
+			return true;
+		}
+
+		std::size_t at = out.size( );
+		out.resize( at + total );
+		for( off_t done = 0; done < total; )
+		{
+			ssize_t n = pread( fd, &out[ at + done ], total - done, done );
+			if( n < 0 && errno == EINTR ) continue;
+			if( n <= 0 ) return false;
+			done += n;
+		}
+		return true;
+	}
+
+	// Queues all of it, the file by reference.
+	void queue( response_builder& out ) const
+	{
+		if( fd == -1 )
+		{
+			out.append( data( ), total );
+			return;
+		}
+
+		pooled_buffer name;
+		buffer_copy_string_len( name.get( ), path.data( ), path.size( ) );
+		out.file( fd, 0, total, name.get( ) );
+	}
+
+private:
+	bool fail( )
+	{
+		error = true;
+		return false;
+	}
+
+	// Moves what is in memory to a file in the next directory, trying each
+	// once.
+	bool spill( )
+	{
+		for( std::size_t tries = 0; tries < std::max< std::size_t >( dirs.size( ), 1 ); ++tries )
+		{
+			std::string name = dirs.pick( ) + "/lighttpd-upload-XXXXXX";
+			int f = mkstemp( &name[0] );
+			if( f == -1 ) continue;
+
+			fcntl( f, F_SETFD, FD_CLOEXEC );
+			fd = f;
+			path = name;
+
+			preallocate( expected > total ? expected : total + allocate_step );
+			if( !write_out( data( ), total, 0 ) ) return false;
+
+			// Lets a big allocation go.
+			buffer_reset( memory.get( ) );
+			return true;
+		}
+		return false;
+	}
+
+	// Not the file size, which stays what was written.  Filesystems without
+	// it just go without.
+	void preallocate( off_t length )
+	{
+		if( length <= allocated ) return;
+		if( 0 == fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, length ) ) allocated = length;
+		else allocated = std::numeric_limits< off_t >::max( );
+	}
+
+	bool write_out( const char* p, std::size_t len, off_t at )
+	{
+		if( at + off_t( len ) > allocated ) preallocate( std::max( at + off_t( len ), allocated + allocate_step ) );
+
+		for( std::size_t done = 0; done < len; )
+		{
+			ssize_t n = pwrite( fd, p + done, len - done, at + done );
+			if( n < 0 && errno == EINTR ) continue;
+			if( n <= 0 ) return false;
+			done += n;
+		}
+		return true;
+	}
+
+	std::size_t threshold;
+	tempdir_rotation& dirs;
+	off_t expected;
+
+	pooled_buffer memory;
+	off_t total;
+	off_t allocated;
+	int fd;
+	std::string path;
+	bool error;
+};
+
+enum request_body_feed_result
+{
+	BODY_FED,       // the sink took all that was queued
+	BODY_STALLED,   // the sink took less than offered
+	BODY_FAILED     // a file chunk couldn't be read
+};
+
+/**
+ * Offers sink what is queued in cq in order, as sink( p, len ), which
+ * returns how much it took, and takes that out of the queue.  Stops at
+ * the first piece not taken whole.  taken is added to.
+ */
+template < typename Sink >
+request_body_feed_result request_body_feed( chunkqueue* cq, Sink& sink, off_t& taken )
+{
+	request_body_feed_result r = BODY_FED;
+	off_t before = taken;
+
+	for( chunk* c = cq ? cq->first : 0; c && r == BODY_FED; c = c->next )
+	{
+		if( c->type == chunk::MEM_CHUNK )
+		{
+			if( !c->mem->used || std::size_t( c->offset ) >= c->mem->used - 1 ) continue;
+
+			std::size_t len = c->mem->used - 1 - c->offset;
+			std::size_t n = sink( c->mem->ptr + c->offset, len );
+			c->offset += n;
+			taken += n;
+			if( n < len ) r = BODY_STALLED;
+		}
+		else if( c->type == chunk::FILE_CHUNK )
+		{
+			// The chunkqueue closes it with the rest.
+			if( c->file.fd == -1 && -1 == ( c->file.fd = open( c->file.name->ptr, O_RDONLY | O_CLOEXEC ) ) )
+			{
+				r = BODY_FAILED;
+				break;
+			}
+
+			char piece[ 16 * 1024 ];
+			while( c->offset < c->file.length )
+			{
+				ssize_t got = pread( c->file.fd, piece, std::min< off_t >( sizeof( piece ), c->file.length - c->offset ),
+					c->file.start + c->offset );
+				if( got < 0 && errno == EINTR ) continue;
+				if( got <= 0 )
+				{
+					r = BODY_FAILED;
+					break;
+				}
+
+				std::size_t n = sink( piece, got );
+				c->offset += n;
+				taken += n;
+				if( n < std::size_t( got ) )
+				{
+					r = BODY_STALLED;
+					break;
+				}
+			}
+		}
+	}
+
+	if( cq )
+	{
+		cq->bytes_out += taken - before;
+		chunkqueue_remove_finished_chunks( cq );
+	}
+	return r;
+}
+
+/**
+ * Mixed in by a backend plugin to take request bodies as they arrive.
+ * handlers is to be joined with the plugin's own.
+ */
+template < typename MostDerived >
+class request_body_reader
+{
+public:
+	typedef boost::mpl::list< SendRequestContentHandler > handlers;
+
+	handler_t handle_send_request_content( connection& con )
+	{
+		MostDerived& self = static_cast< MostDerived& >( *this );
+
+		// Somebody else's backend.
+		if( static_cast< std::size_t >( con.mode ) != self.id( ) || !con.request_content_queue )
+			return HANDLER_GO_ON;
+
+		sink s( self, con );
+		off_t taken = 0;
+		switch( request_body_feed( con.request_content_queue, s, taken ) )
+		{
+		case BODY_FAILED:
+			return HANDLER_ERROR;
+		case BODY_STALLED:
+			return HANDLER_WAIT_FOR_EVENT;
+		case BODY_FED:
+			break;
+		}
+
+		// Ended once, by whichever call first finds all of it taken.
+		if( !complete( con ) || ended( con ) ) return HANDLER_GO_ON;
+		ends[ con.ndx ].assign( con );
+		return self.request_body_end( con );
+	}
+
+	// Whether all of the body has been taken.
+	static bool complete( const connection& con )
+	{
+		const chunkqueue* cq = con.request_content_queue;
+		if( !cq ) return true;
+		if( con.request.content_length && cq->bytes_out >= off_t( con.request.content_length ) ) return true;
+		return cq->is_closed && !cq->first;
+	}
+
+private:
+	// Whether con's body has been ended, for the request it is on.
+	bool ended( const connection& con )
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		if( ndx >= ends.size( ) ) ends.resize( ndx + 1 );
+		return ends[ ndx ].holds( con );
+	}
+
+	// By connection, the request whose body was last ended.
+	std::vector< request_pin > ends;
+
+	struct sink
+	{
+		sink( MostDerived& self, connection& con )
+		 : self( self ), con( con )
+		{}
+
+		std::size_t operator()( const char* p, std::size_t len )
+		{
+			return std::min( len, self.request_body_data( con, p, len ) );
+		}
+
+		MostDerived& self;
+		connection& con;
+	};
+};
+
+#endif // _LIGHTTPD_REQUEST_BODY_HPP_
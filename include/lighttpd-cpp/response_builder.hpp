@@ -0,0 +1,229 @@
+/**
+ * Building a response body straight in a chunkqueue (usually
+ * con.write_queue), rather than in std::strings that are then copied in.
+ *
+ *  response_builder out( con.write_queue );
+ *  out << "<html><body>" << title << "</body></html>";
+ *  out.file( fd, 0, st.st_size, path );
+ *  out.fragment( *footer );
+ *
+ * What each piece costs:
+ *  - text is copied once, into the buffer of the last chunk we appended
+ *    while it has room, so a run of small pieces ends up in one chunk and
+ *    goes out as one iovec.  lighttpd's chunks own their buffers, a chunk
+ *    can't point at memory that isn't its own, so this one copy is as
+ *    close as we can get to appending by reference.
+ *  - reserve( )/commit( ) hands out room in such a buffer to render into
+ *    directly.  The buffers come from the chunkqueue's own pool of unused
+ *    chunks.
+ *  - file( ) appends a file chunk for (fd, offset, length) that the
+ *    network backend sendfile()s.  The chunk gets a dup of fd, as the core
+ *    closes a chunk's fd once it is sent.
+ *  - file_by_name( ) appends one that holds no fd, for the core to open
+ *    when it comes to send it.  For a file queued to many responses at
+ *    once, which would otherwise cost each of them a descriptor.
+ *  - fragment( ) appends a pre-rendered shared_fragment.  Small ones are
+ *    copied as text, big ones are written once to a temporary file and go
+ *    out with sendfile() as a file chunk.  Each chunk holds its own dup of
+ *    the file's fd, so the kernel keeps the file around for as long as any
+ *    response still has it queued, even after the fragment is gone.
+ *
+ * Should the fd of a file range not be dup()ed, failed( ) says so and the
+ * response is short, it's for the caller to give up on it.
+ */
+
+#ifndef _LIGHTTPD_RESPONSE_BUILDER_HPP_
+#define _LIGHTTPD_RESPONSE_BUILDER_HPP_
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "c++-compat/base.h"
+#include "pooled_buffer.hpp"
+
+/**
+ * A piece of output rendered once and sent by many responses, a common
+ * header or footer say.  Immutable once made, share it by shared_ptr.
+ */
+class shared_fragment : boost::noncopyable
+{
+public:
+	// Below this it is cheaper to copy the bytes than to have the network
+	// backend make another sendfile() call.
+	static const std::size_t sendfile_threshold = 16 * 1024;
+
+	shared_fragment( const std::string& content, const std::string& tempdir = "/tmp" )
+	 : content( content ), fd( -1 )
+	{
+		if( content.size( ) >= sendfile_threshold ) make_file( tempdir );
+	}
+
+	~shared_fragment( )
+	{
+		if( fd != -1 ) close( fd );
+		if( !path.empty( ) ) unlink( path.c_str( ) );
+	}
+
+	const std::string& data( ) const { return content; }
+	std::size_t size( ) const { return content.size( ); }
+
+	// -1 when the fragment is sent by copying.
+	int file( ) const { return fd; }
+	const std::string& file_name( ) const { return path; }
+
+private:
+	// The file stays under its name while we live, in case a network
+	// backend opens file chunks by name rather than by fd.
+	void make_file( const std::string& tempdir )
+	{
+		std::string name = tempdir + "/lighttpd-fragment-XXXXXX";
+		std::vector< char > templ( name.begin( ), name.end( ) );
+		templ.push_back( '\0' );
+
+		int f = mkstemp( &templ[0] );
+		if( f == -1 ) return;
+
+		std::size_t written = 0;
+		while( written < content.size( ) )
+		{
+			ssize_t n = write( f, content.data( ) + written, content.size( ) - written );
+			if( n <= 0 ) break;
+			written += n;
+		}
+
+		if( written != content.size( ) )
+		{
+			close( f );
+			unlink( &templ[0] );
+			return;
+		}
+
+		fcntl( f, F_SETFD, FD_CLOEXEC );
+		fd = f;
+		path = &templ[0];
+	}
+
+	const std::string content;
+	int fd;
+	std::string path;
+};
+
+typedef boost::shared_ptr< const shared_fragment > shared_fragment_ptr;
+
+class response_builder : boost::noncopyable
+{
+public:
+	// Each new chunk's buffer is at least this big, so that small pieces
+	// have somewhere to go.
+	static const std::size_t block_size = 8 * 1024;
+
+	response_builder( chunkqueue* cq )
+	 : cq( cq ), tail( 0 ), appended( 0 ), error( false )
+	{}
+
+	response_builder& append( const char* p, std::size_t len )
+	{
+		if( !len ) return *this;
+
+		std::memcpy( reserve( len ), p, len );
+		return commit( len );
+	}
+
+	response_builder& operator<<( const std::string& s ) { return append( s.data( ), s.size( ) ); }
+	response_builder& operator<<( const char* s ) { return append( s, std::strlen( s ) ); }
+	response_builder& operator<<( const buffer* b ) { return append( CONST_BUF_LEN( b ) ); }
+
+	// Room for at least len bytes at the end of the last chunk, to be
+	// followed by commit( ) with how much was actually used.
+	char* reserve( std::size_t len )
+	{
+		if( !tail || cq->last != tail || tail->mem->size - tail->mem->used < len )
+		{
+			buffer* b = chunkqueue_get_append_buffer( cq );
+			buffer_prepare_copy( b, len + 1 > block_size ? len + 1 : block_size );
+			b->ptr[0] = '\0';
+			b->used = 1;
+			tail = cq->last;
+		}
+
+		return tail->mem->ptr + tail->mem->used - 1;
+	}
+
+	response_builder& commit( std::size_t len )
+	{
+		tail->mem->used += len;
+		tail->mem->ptr[ tail->mem->used - 1 ] = '\0';
+		appended += len;
+		return *this;
+	}
+
+	// length bytes of fd from offset, sent with sendfile().  name is what
+	// the chunk is known as in logs and to backends that open by name.
+	response_builder& file( int fd, off_t offset, off_t length, buffer* name )
+	{
+		if( length <= 0 ) return *this;
+
+		int dup_fd = dup( fd );
+		if( dup_fd == -1 )
+		{
+			error = true;
+			return *this;
+		}
+		fcntl( dup_fd, F_SETFD, FD_CLOEXEC );
+
+		chunkqueue_append_file( cq, name, offset, length );
+		cq->last->file.fd = dup_fd;
+
+		tail = 0;
+		appended += length;
+		return *this;
+	}
+
+	// As file( ), but the core opens name when it comes to send the
+	// chunk, and closes it once sent.  name has to be there until then.
+	response_builder& file_by_name( buffer* name, off_t offset, off_t length )
+	{
+		if( length <= 0 ) return *this;
+
+		chunkqueue_append_file( cq, name, offset, length );
+		cq->last->file.fd = -1;
+
+		tail = 0;
+		appended += length;
+		return *this;
+	}
+
+	response_builder& fragment( const shared_fragment& f )
+	{
+		if( f.file( ) == -1 ) return append( f.data( ).data( ), f.size( ) );
+
+		pooled_buffer name;
+		buffer_copy_string_len( name.get( ), f.file_name( ).data( ), f.file_name( ).size( ) );
+		return file( f.file( ), 0, f.size( ), name.get( ) );
+	}
+
+	// Everything appended through us, for a Content-Length.
+	off_t length( ) const { return appended; }
+
+	bool failed( ) const { return error; }
+
+private:
+	chunkqueue* cq;
+
+	// The mem chunk we last appended, which we may carry on filling.
+	chunk* tail;
+	off_t appended;
+	bool error;
+};
+
+#endif // _LIGHTTPD_RESPONSE_BUILDER_HPP_
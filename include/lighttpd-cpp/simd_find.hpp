@@ -0,0 +1,45 @@
+/**
+ * Searching for one or two byte values, 32 bytes at a time with AVX2 or
+ * 16 with SSE2 and a scalar tail, or scalar throughout where neither is
+ * available.  Which one is picked at compile time, as with the rest of
+ * lighttpd there is no runtime dispatch.
+ */
+
+#ifndef _LIGHTTPD_SIMD_FIND_HPP_
+#define _LIGHTTPD_SIMD_FIND_HPP_
+
+#if defined( __AVX2__ )
+#	include <immintrin.h>
+#elif defined( __SSE2__ )
+#	include <emmintrin.h>
+#endif
+
+// The first a or b in [p, end), or end.
+inline const char* simd_find( const char* p, const char* end, char a, char b )
+{
+#if defined( __AVX2__ )
+	const __m256i wa = _mm256_set1_epi8( a ), wb = _mm256_set1_epi8( b );
+	for( ; end - p >= 32; p += 32 )
+	{
+		__m256i v = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( p ) );
+		unsigned m = _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( v, wa ), _mm256_cmpeq_epi8( v, wb ) ) );
+		if( m ) return p + __builtin_ctz( m );
+	}
+#endif
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+	const __m128i va = _mm_set1_epi8( a ), vb = _mm_set1_epi8( b );
+	for( ; end - p >= 16; p += 16 )
+	{
+		__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i* >( p ) );
+		unsigned m = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, va ), _mm_cmpeq_epi8( v, vb ) ) );
+		if( m ) return p + __builtin_ctz( m );
+	}
+#endif
+	for( ; p != end; ++p )
+	{
+		if( *p == a || *p == b ) return p;
+	}
+	return end;
+}
+
+#endif // _LIGHTTPD_SIMD_FIND_HPP_
@@ -0,0 +1,462 @@
+/**
+ * Coalescing of identical requests running at once: only the first goes
+ * to the backend, the rest wait for its response and are sent the same,
+ * so that a popular object expiring doesn't bring a stampede down on the
+ * backend.
+ *
+ * For the tasks of an async_backend (see async_handler.hpp).  The plugin
+ * keeps a single_flight, and each task a flight_ticket it joins with the
+ * request's key before going upstream:
+ *
+ *  role = ticket.join( p.flights, flight_key( spec, con ), max_waiters );
+ *  if( role == flight_ticket::FOLLOW )
+ *  {
+ *  	while( ( r = ticket.replay( srv, con ) ) == flight_ticket::MORE )
+ *  	{
+ *  		BOOST_ASIO_CORO_YIELD return ticket.wait( ctx, timeout );
+ *  		...
+ *  	}
+ *  	...
+ *  }
+ *  // The leader (or ALONE, over max_waiters) goes upstream as usual,
+ *  // telling the ticket the response as it comes.
+ *  ticket.head( status, con.response.headers, length );
+ *  ticket.append( p, n );
+ *  ticket.complete( );
+ *
+ * Followers park on the flight's async_event, and are woken through the
+ * joblist as the leader gets more of the response.
+ *
+ * The body is shared as shared_fragments published to the followers as
+ * the leader reads it.  lighttpd's chunks own their buffers, so can't be
+ * shared between connections: a small fragment is copied into each
+ * follower's write queue, and a big one is written once to a temporary
+ * file each follower sends with sendfile().  While no follower is waiting
+ * the leader only keeps what it reads, in case one turns up.  Once a
+ * response passes max_shared bytes its flight stops taking followers, and
+ * each fragment is let go of as soon as the followers already there have
+ * queued it.
+ *
+ * A leader that goes away without complete( ) fails its flight.  Followers
+ * that haven't been sent anything yet are told to RETRY, join again and
+ * one of them becomes the leader; the others can only give up.  So does
+ * a leader whose response is only for its own client, one that sets a
+ * cookie or says Cache-Control private or no-store.
+ *
+ * Flights belong to the plugin instance, so each worker process has its
+ * own and there is nothing to lock.
+ */
+
+#ifndef _LIGHTTPD_SINGLE_FLIGHT_HPP_
+#define _LIGHTTPD_SINGLE_FLIGHT_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <cstring>
+#include <cstdio>
+
+#include <strings.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "plugin.hpp"
+#include "async_handler.hpp"
+#include "response_builder.hpp"
+
+#ifndef HTTP_CONTENT_LENGTH
+# define HTTP_CONTENT_LENGTH BV(1)
+#endif
+
+/**
+ * One key's request in progress: what its leader has of the response so
+ * far, and who is waiting for it.
+ */
+struct flight : boost::noncopyable
+{
+	flight( const std::string& key )
+	 :	key( key ), status( 0 ), content_length( -1 ), size( 0 ),
+		head_done( false ), done( false ), failed( false ), closed( false ), followers( 0 )
+	{}
+
+	std::string key;
+
+	int status;
+	std::vector< std::pair< std::string, std::string > > headers;
+	// -1 when the body runs to its end.
+	off_t content_length;
+
+	// The body published so far, and for each piece how many followers
+	// have yet to queue it.
+	std::vector< shared_fragment_ptr > blocks;
+	std::vector< std::size_t > unsent;
+
+	// Read while nobody was waiting, published when somebody is.
+	std::string pending;
+	std::size_t size;
+
+	bool head_done;
+	bool done;
+	bool failed;
+
+	// Not taking followers any more.
+	bool closed;
+	std::size_t followers;
+
+	async_event event;
+};
+
+typedef boost::shared_ptr< flight > flight_ptr;
+
+/**
+ * The flights in progress, by key.
+ */
+class single_flight : boost::noncopyable
+{
+public:
+	single_flight( std::size_t max_shared = 1024 * 1024, const std::string& tempdir = "/tmp" )
+	 : max_shared( max_shared ), tempdir( tempdir ), led( 0 ), joined( 0 ), overflowed( 0 )
+	{}
+
+	std::size_t size( ) const { return flights.size( ); }
+
+	// Requests that went upstream for a flight, ones that waited for
+	// another's response, and ones that went alone as too many already were.
+	unsigned long leaders( ) const { return led; }
+	unsigned long followers( ) const { return joined; }
+	unsigned long overflows( ) const { return overflowed; }
+
+	// Bodies bigger than this stop taking followers.
+	std::size_t max_shared;
+
+	// Where big fragments are written.
+	std::string tempdir;
+
+private:
+	friend class flight_ticket;
+
+	typedef std::map< std::string, flight_ptr > flight_map;
+
+	// Requests for f's key start a new flight from now on.
+	void close( flight& f )
+	{
+		if( f.closed ) return;
+		f.closed = true;
+
+		flight_map::iterator i = flights.find( f.key );
+		if( i != flights.end( ) && i->second.get( ) == &f ) flights.erase( i );
+
+		for( std::size_t b = 0; b < f.blocks.size( ); ++b )
+		{
+			if( !f.unsent[b] ) f.blocks[b].reset( );
+		}
+	}
+
+	flight_map flights;
+	unsigned long led;
+	unsigned long joined;
+	unsigned long overflowed;
+};
+
+/**
+ * A task's part in a flight, left when the task goes.
+ */
+class flight_ticket : boost::noncopyable
+{
+public:
+	enum role_type { NONE, LEAD, FOLLOW, ALONE };
+	enum replay_result { MORE, DONE, FAILED, RETRY };
+
+	flight_ticket( ) : flights( 0 ), role_( NONE ), next( 0 ), started_( false ), chunked( false ) {}
+
+	~flight_ticket( )
+	{
+		leave( );
+	}
+
+	// max_waiters 0 for no limit.
+	role_type join( single_flight& s, const std::string& key, std::size_t max_waiters )
+	{
+		leave( );
+		flights = &s;
+
+		single_flight::flight_map::iterator i = s.flights.find( key );
+		if( i == s.flights.end( ) )
+		{
+			f.reset( new flight( key ) );
+			s.flights.insert( std::make_pair( key, f ) );
+			++s.led;
+			return role_ = LEAD;
+		}
+
+		if( max_waiters && i->second->followers >= max_waiters )
+		{
+			++s.overflowed;
+			return role_ = ALONE;
+		}
+
+		f = i->second;
+		++f->followers;
+		for( std::vector< std::size_t >::iterator u = f->unsent.begin( ); u != f->unsent.end( ); ++u )
+			++*u;
+
+		++s.joined;
+		return role_ = FOLLOW;
+	}
+
+	role_type role( ) const { return role_; }
+
+	// Whether a follower has been sent any of the response.
+	bool started( ) const { return started_; }
+
+	// Leader: the status and headers of the response, and its length if
+	// known (-1 if not).
+	void head( int status, const array* headers, off_t content_length )
+	{
+		if( role_ != LEAD ) return;
+
+		f->status = status;
+		f->content_length = content_length;
+		f->headers.clear( );
+		for( std::size_t i = 0; headers && i < headers->used; ++i )
+		{
+			const data_string* ds = reinterpret_cast< const data_string* >( headers->data[i] );
+			if( buffer_is_empty( ds->key ) ) continue;
+			f->headers.push_back( std::make_pair( std::string( CONST_BUF_LEN( ds->key ) ),
+				ds->value && ds->value->used ? std::string( CONST_BUF_LEN( ds->value ) ) : std::string( ) ) );
+		}
+
+		// Not to be handed to anyone else, the followers go on their own.
+		if( personal( headers ) )
+		{
+			fail( );
+			return;
+		}
+
+		f->head_done = true;
+		if( f->event.waiting( ) ) f->event.signal( );
+	}
+
+	// Leader: n more bytes of body.
+	void append( const char* p, std::size_t n )
+	{
+		if( role_ != LEAD || !n || f->failed ) return;
+		if( f->closed && !f->followers ) return;
+
+		f->size += n;
+		if( f->size > flights->max_shared )
+		{
+			flights->close( *f );
+			if( !f->followers )
+			{
+				std::string( ).swap( f->pending );
+				return;
+			}
+		}
+
+		f->pending.append( p, n );
+		if( f->event.waiting( ) ) publish( );
+	}
+
+	// Leader: that was all of it.
+	void complete( )
+	{
+		if( role_ != LEAD || f->done || f->failed ) return;
+
+		if( f->followers ) publish( );
+		std::string( ).swap( f->pending );
+		f->done = true;
+		flights->close( *f );
+		f->event.signal( );
+	}
+
+	// Follower: what is new of the response into con.  MORE is for
+	// waiting again, RETRY for joining again as the leader gave up before
+	// anything was sent.
+	replay_result replay( server& srv, connection& con )
+	{
+		if( role_ != FOLLOW ) return FAILED;
+		if( f->failed ) return started_ ? FAILED : RETRY;
+		if( !f->head_done ) return MORE;
+
+		if( !started_ ) start( srv, con );
+
+		response_builder out( con.write_queue );
+		for( ; next < f->blocks.size( ); ++next )
+		{
+			const shared_fragment& b = *f->blocks[ next ];
+			if( chunked )
+			{
+				char size[ 24 ];
+				out.append( size, snprintf( size, sizeof( size ), "%lx\r\n", static_cast< unsigned long >( b.size( ) ) ) );
+			}
+			out.fragment( b );
+			if( chunked ) out.append( "\r\n", 2 );
+
+			sent( next );
+		}
+
+		if( out.failed( ) ) return FAILED;
+		if( !f->done ) return MORE;
+
+		if( chunked ) out.append( "0\r\n\r\n", 5 );
+		con.file_finished = 1;
+		return DONE;
+	}
+
+	// Follower: park until the leader has more.
+	handler_t wait( async_context& ctx, time_t timeout = 0 )
+	{
+		return ctx.wait( f->event, timeout );
+	}
+
+	// Done with the flight.  A leader that hasn't completed fails it.
+	void leave( )
+	{
+		if( f && role_ == LEAD && !f->done && !f->failed ) fail( );
+
+		if( f && role_ == FOLLOW )
+		{
+			for( ; next < f->blocks.size( ); ++next ) sent( next );
+			--f->followers;
+		}
+
+		f.reset( );
+		role_ = NONE;
+		next = 0;
+		started_ = false;
+		chunked = false;
+	}
+
+private:
+	// Leader: the followers are on their own, RETRY if nothing was sent.
+	void fail( )
+	{
+		f->failed = true;
+		std::string( ).swap( f->pending );
+		flights->close( *f );
+		f->event.signal( );
+	}
+
+	// Does the response set a cookie, or say it is for this client only?
+	static bool personal( const array* headers )
+	{
+		for( std::size_t i = 0; headers && i < headers->used; ++i )
+		{
+			const data_string* ds = reinterpret_cast< const data_string* >( headers->data[i] );
+			if( buffer_is_empty( ds->key ) ) continue;
+
+			if( 0 == strcasecmp( ds->key->ptr, "Set-Cookie" ) ) return true;
+			if( 0 == strcasecmp( ds->key->ptr, "Cache-Control" ) && ds->value && ds->value->used
+				&& ( directive( ds->value->ptr, "private" ) || directive( ds->value->ptr, "no-store" ) ) ) return true;
+		}
+		return false;
+	}
+
+	// Is name one of the comma separated directives of value, with or
+	// without an argument?
+	static bool directive( const char* value, const char* name )
+	{
+		std::size_t n = std::strlen( name );
+		for( const char* p = value; *p; )
+		{
+			while( *p == ' ' || *p == '\t' || *p == ',' ) ++p;
+			if( 0 == strncasecmp( p, name, n ) && ( !p[n] || p[n] == ',' || p[n] == '=' || p[n] == ' ' || p[n] == '\t' ) )
+				return true;
+			while( *p && *p != ',' ) ++p;
+		}
+		return false;
+	}
+
+	// What has been read goes out to the followers.
+	void publish( )
+	{
+		if( f->pending.empty( ) ) return;
+
+		f->blocks.push_back( shared_fragment_ptr( new shared_fragment( f->pending, flights->tempdir ) ) );
+		f->unsent.push_back( f->followers );
+		std::string( ).swap( f->pending );
+		f->event.signal( );
+	}
+
+	void start( server& srv, connection& con )
+	{
+		con.http_status = f->status;
+		for( std::size_t i = 0; i < f->headers.size( ); ++i )
+		{
+			const std::pair< std::string, std::string >& h = f->headers[i];
+			response_header_insert( &srv, &con, h.first.data( ), h.first.size( ), h.second.data( ), h.second.size( ) );
+		}
+
+		if( f->content_length >= 0 )
+		{
+			con.parsed_response |= HTTP_CONTENT_LENGTH;
+			con.response.content_length = f->content_length;
+		}
+		else
+		{
+			chunked = con.response.transfer_encoding == response_t::HTTP_TRANSFER_ENCODING_CHUNKED;
+		}
+
+		con.file_started = 1;
+		started_ = true;
+	}
+
+	// Block b is queued, or never will be by us.
+	void sent( std::size_t b )
+	{
+		if( !--f->unsent[b] && f->closed ) f->blocks[b].reset( );
+	}
+
+	single_flight* flights;
+	flight_ptr f;
+	role_type role_;
+
+	// The next block to queue.
+	std::size_t next;
+	bool started_;
+	bool chunked;
+};
+
+/**
+ * The key of con's request for a coalescing spec of space separated
+ * parts: "host", "uri" (with its query string) or "header:Name".  The
+ * method is always part of it.  Empty for an empty spec, i.e. off.
+ */
+inline std::string flight_key( const std::string& spec, connection& con )
+{
+	std::string key;
+	if( spec.empty( ) ) return key;
+
+	key.append( get_http_method_name( con.request.http_method ) );
+
+	for( std::size_t start = 0; start < spec.size( ); )
+	{
+		std::size_t end = spec.find( ' ', start );
+		if( end == std::string::npos ) end = spec.size( );
+		std::string part( spec, start, end - start );
+		start = end + 1;
+		if( part.empty( ) ) continue;
+
+		const buffer* b = 0;
+		if( part == "host" )
+			b = con.request.http_host;
+		else if( part == "uri" )
+			b = con.request.uri;
+		else if( 0 == part.compare( 0, 7, "header:" ) )
+		{
+			data_string* ds = reinterpret_cast< data_string* >(
+				array_get_element( con.request.headers, part.data( ) + 7, part.size( ) - 7 ) );
+			if( ds ) b = ds->value;
+		}
+
+		key.append( 1, '\0' );
+		if( !buffer_is_empty( const_cast< buffer* >( b ) ) ) key.append( CONST_BUF_LEN( b ) );
+	}
+
+	return key;
+}
+
+#endif // _LIGHTTPD_SINGLE_FLIGHT_HPP_
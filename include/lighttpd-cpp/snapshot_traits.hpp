@@ -0,0 +1,161 @@
+/**
+ * How config option values are written to and read back from a config
+ * snapshot, see config_snapshot.hpp.
+ *
+ * Values are laid out in native byte order, snapshots are only for the
+ * machine that wrote them.  Readers check every length against the end of
+ * the mapping, so a truncated or corrupt file fails to load rather than
+ * reading past it.
+ *
+ * Option types without a specialization of config_snapshot_traits can't
+ * be snapshotted, a plugin with any such option always parses its config.
+ */
+
+#ifndef _LIGHTTPD_SNAPSHOT_TRAITS_HPP_
+#define _LIGHTTPD_SNAPSHOT_TRAITS_HPP_
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <stdint.h>
+
+class snapshot_writer
+{
+public:
+	snapshot_writer( std::string& out ) : out( out ) {}
+
+	void put_u32( uint32_t v ) { out.append( reinterpret_cast< const char* >( &v ), sizeof( v ) ); }
+	void put_u64( uint64_t v ) { out.append( reinterpret_cast< const char* >( &v ), sizeof( v ) ); }
+
+	void put_string( const char* p, std::size_t len )
+	{
+		put_u32( static_cast< uint32_t >( len ) );
+		out.append( p, len );
+	}
+
+	void put_string( const std::string& s ) { put_string( s.data( ), s.size( ) ); }
+
+	std::string& out;
+};
+
+class snapshot_reader
+{
+public:
+	snapshot_reader( const char* p, std::size_t len ) : p( p ), end( p + len ) {}
+
+	bool get_u32( uint32_t& v ) { return get( &v, sizeof( v ) ); }
+	bool get_u64( uint64_t& v ) { return get( &v, sizeof( v ) ); }
+
+	bool get_string( std::string& s )
+	{
+		uint32_t len;
+		if( !get_u32( len ) || len > left( ) ) return false;
+		s.assign( p, len );
+		p += len;
+		return true;
+	}
+
+	std::size_t left( ) const { return end - p; }
+
+private:
+	bool get( void* v, std::size_t len )
+	{
+		if( len > left( ) ) return false;
+		std::memcpy( v, p, len );
+		p += len;
+		return true;
+	}
+
+	const char* p;
+	const char* end;
+};
+
+// Each supported type has its own tag, so a snapshot written before an
+// option changed type is refused.
+template < typename OptionType >
+struct config_snapshot_traits
+{
+	static const bool supported = false;
+	static const uint32_t tag = 0;
+
+	static void write( snapshot_writer& out, const OptionType& v ) {}
+	static OptionType* read( snapshot_reader& in ) { return 0; }
+};
+
+// int, short and bool all go as a u32.
+template < typename OptionType, uint32_t Tag >
+struct config_snapshot_traits_integral
+{
+	static const bool supported = true;
+	static const uint32_t tag = Tag;
+
+	static void write( snapshot_writer& out, const OptionType& v )
+	{
+		out.put_u32( static_cast< uint32_t >( v ) );
+	}
+
+	static OptionType* read( snapshot_reader& in )
+	{
+		uint32_t v;
+		return in.get_u32( v ) ? new OptionType( static_cast< OptionType >( static_cast< int32_t >( v ) ) ) : 0;
+	}
+};
+
+template <>
+struct config_snapshot_traits< int > : config_snapshot_traits_integral< int, 1 > {};
+
+template <>
+struct config_snapshot_traits< short > : config_snapshot_traits_integral< short, 2 > {};
+
+template <>
+struct config_snapshot_traits< bool > : config_snapshot_traits_integral< bool, 3 > {};
+
+template <>
+struct config_snapshot_traits< std::string >
+{
+	static const bool supported = true;
+	static const uint32_t tag = 4;
+
+	static void write( snapshot_writer& out, const std::string& v )
+	{
+		out.put_string( v );
+	}
+
+	static std::string* read( snapshot_reader& in )
+	{
+		std::string v;
+		return in.get_string( v ) ? new std::string( v ) : 0;
+	}
+};
+
+template <>
+struct config_snapshot_traits< std::vector< std::string > >
+{
+	static const bool supported = true;
+	static const uint32_t tag = 5;
+
+	static void write( snapshot_writer& out, const std::vector< std::string >& v )
+	{
+		out.put_u32( static_cast< uint32_t >( v.size( ) ) );
+		for( std::vector< std::string >::const_iterator i = v.begin( ); i != v.end( ); ++i )
+			out.put_string( *i );
+	}
+
+	static std::vector< std::string >* read( snapshot_reader& in )
+	{
+		uint32_t n;
+		if( !in.get_u32( n ) || n > in.left( ) / sizeof( uint32_t ) ) return 0;
+
+		std::vector< std::string >* v = new std::vector< std::string >( n );
+		for( uint32_t i = 0; i < n; ++i )
+		{
+			if( in.get_string( (*v)[i] ) ) continue;
+			delete v;
+			return 0;
+		}
+		return v;
+	}
+};
+
+#endif // _LIGHTTPD_SNAPSHOT_TRAITS_HPP_
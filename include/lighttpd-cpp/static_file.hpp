@@ -0,0 +1,55 @@
+/**
+ * Telling a static file from something a backend is to answer, for
+ * plugins that answer for files ahead of mod_staticfile.
+ *
+ * A request is only a static file's when no backend has taken it
+ * (con.mode is still DIRECT) and its path doesn't end in an excluded
+ * extension.  A backend matching on extension may not have taken the
+ * request yet when we look, so an exclude list that isn't set means
+ * the extensions scripts usually have: answering for a .php file with
+ * its bytes would hand out its source.
+ */
+
+#ifndef _LIGHTTPD_STATIC_FILE_HPP_
+#define _LIGHTTPD_STATIC_FILE_HPP_
+
+#include "c++-compat/plugin.h"
+
+#include <string>
+#include <vector>
+
+// What exclude lists default to.
+inline const std::vector< std::string >& script_extensions( )
+{
+	static const char* const names[] =
+	{
+		".php", ".php3", ".php4", ".php5", ".phtml", ".pl", ".py", ".rb",
+		".cgi", ".fcgi", ".sh", ".asp", ".aspx", ".jsp", ".shtml"
+	};
+	static const std::vector< std::string > exts( names, names + sizeof( names ) / sizeof( names[0] ) );
+	return exts;
+}
+
+// Whether path ends in one of exts, or of script_extensions( ) when exts
+// is empty.
+inline bool excluded_extension( const buffer* path, const std::vector< std::string >& exts )
+{
+	const std::vector< std::string >& list = exts.empty( ) ? script_extensions( ) : exts;
+	std::size_t len = path->used - 1;
+
+	for( std::vector< std::string >::const_iterator i = list.begin( ); i != list.end( ); ++i )
+	{
+		if( i->size( ) <= len && 0 == i->compare( 0, i->size( ), path->ptr + len - i->size( ), i->size( ) ) )
+			return true;
+	}
+	return false;
+}
+
+// Whether con is for a file nothing but mod_staticfile would answer.
+inline bool static_file_request( const connection& con, const std::vector< std::string >& exclude )
+{
+	if( con.mode != DIRECT || buffer_is_empty( con.physical.path ) ) return false;
+	return !excluded_extension( con.physical.path, exclude );
+}
+
+#endif // _LIGHTTPD_STATIC_FILE_HPP_
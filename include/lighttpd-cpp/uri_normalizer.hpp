@@ -0,0 +1,192 @@
+/**
+ * Percent-decoding and path simplification in place, giving exactly what
+ * buffer_urldecode_path followed by buffer_path_simplify give (the way
+ * lighttpd turns uri.path_raw into uri.path), byte for byte.
+ *
+ * Most paths need neither: no '%', and no '/' followed by '/' or '.'.
+ * That is checked 16 or 32 bytes at a time against the path and the path
+ * shifted by one, and such a path is left as it is without another pass.
+ *
+ * Otherwise escapes are found with simd_find and decoded through tables
+ * without branching on the hex digits, and the result is simplified a
+ * segment at a time, runs between slashes being found with simd_find and
+ * moved down in one go.  Paths that don't start with a '/' are rare
+ * enough (and grow by one byte, so can't be done in place) that they are
+ * handed to lighttpd's own functions.
+ *
+ * As with lighttpd, the path ends at the first NUL.
+ */
+
+#ifndef _LIGHTTPD_URI_NORMALIZER_HPP_
+#define _LIGHTTPD_URI_NORMALIZER_HPP_
+
+#include <cstring>
+
+#include "c++-compat/base.h"
+#include "simd_find.hpp"
+
+class uri_normalizer
+{
+public:
+	static void normalize( buffer* path )
+	{
+		if( !path || !path->ptr || !path->used || path->ptr[0] != '/' )
+		{
+			buffer_urldecode_path( path );
+			buffer_path_simplify( path, path );
+			return;
+		}
+
+		std::size_t len = path->used - 1;
+		if( is_normal( path->ptr, len ) ) return;
+
+		len = strnlen( path->ptr, len );
+		len = decode( path->ptr, len );
+		len = simplify( path->ptr, len );
+
+		path->ptr[ len ] = '\0';
+		path->used = len + 1;
+	}
+
+	// Would normalize leave this path alone?  p[len] must be readable, as
+	// it is in any buffer.
+	static bool is_normal( const char* p, std::size_t len )
+	{
+		if( !len || p[0] != '/' ) return false;
+
+		const char* end = p + len;
+#if defined( __AVX2__ )
+		const __m256i wpct = _mm256_set1_epi8( '%' ), wslash = _mm256_set1_epi8( '/' );
+		const __m256i wdot = _mm256_set1_epi8( '.' ), wnul = _mm256_setzero_si256( );
+		for( ; end - p >= 32; p += 32 )
+		{
+			__m256i v = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( p ) );
+			__m256i next = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( p + 1 ) );
+			__m256i bad = _mm256_or_si256( _mm256_cmpeq_epi8( v, wpct ), _mm256_cmpeq_epi8( v, wnul ) );
+			__m256i step = _mm256_or_si256( _mm256_cmpeq_epi8( next, wslash ), _mm256_cmpeq_epi8( next, wdot ) );
+			bad = _mm256_or_si256( bad, _mm256_and_si256( _mm256_cmpeq_epi8( v, wslash ), step ) );
+			if( _mm256_movemask_epi8( bad ) ) return false;
+		}
+#endif
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+		const __m128i vpct = _mm_set1_epi8( '%' ), vslash = _mm_set1_epi8( '/' );
+		const __m128i vdot = _mm_set1_epi8( '.' ), vnul = _mm_setzero_si128( );
+		for( ; end - p >= 16; p += 16 )
+		{
+			__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i* >( p ) );
+			__m128i next = _mm_loadu_si128( reinterpret_cast< const __m128i* >( p + 1 ) );
+			__m128i bad = _mm_or_si128( _mm_cmpeq_epi8( v, vpct ), _mm_cmpeq_epi8( v, vnul ) );
+			__m128i step = _mm_or_si128( _mm_cmpeq_epi8( next, vslash ), _mm_cmpeq_epi8( next, vdot ) );
+			bad = _mm_or_si128( bad, _mm_and_si128( _mm_cmpeq_epi8( v, vslash ), step ) );
+			if( _mm_movemask_epi8( bad ) ) return false;
+		}
+#endif
+		for( ; p != end; ++p )
+		{
+			if( *p == '%' || *p == '\0' ) return false;
+			if( *p == '/' && ( p[1] == '/' || p[1] == '.' ) ) return false;
+		}
+		return true;
+	}
+
+	// buffer_urldecode_path on p[0, len), returning the new length.
+	// p[len] must be a NUL.
+	static std::size_t decode( char* p, std::size_t len )
+	{
+		const tables& t = get_tables( );
+		const char* src = p;
+		const char* end = p + len;
+		char* dst = p;
+
+		for( ;; )
+		{
+			const char* pct = simd_find( src, end, '%', '%' );
+			if( dst != src ) std::memmove( dst, src, pct - src );
+			dst += pct - src;
+			src = pct;
+			if( src == end ) break;
+
+			// An invalid high digit makes us look at it again as the low
+			// one, so we never read past the NUL.
+			unsigned hi = t.hex[ static_cast< unsigned char >( src[1] ) ];
+			unsigned lo = t.hex[ static_cast< unsigned char >( src[ 1 + ( hi < 16 ) ] ) ];
+			unsigned ok = ( hi | lo ) < 16;
+
+			*dst++ = ok ? t.decoded[ ( ( hi << 4 ) | lo ) & 0xff ] : '%';
+			src += 1 + 2 * ok;
+		}
+		return dst - p;
+	}
+
+	// buffer_path_simplify on p[0, len) where p[0] is a '/', returning
+	// the new length.
+	static std::size_t simplify( char* p, std::size_t len )
+	{
+		// The '/' the current segment starts at, where its output goes and
+		// where it is read from.
+		std::size_t slash = 0, out = 1, in = 1;
+
+		for( ;; )
+		{
+			const char* next = simd_find( p + in, p + len, '/', '/' );
+			std::size_t n = next - ( p + in );
+			bool last = next == p + len;
+
+			if( n == 2 && p[ in ] == '.' && p[ in + 1 ] == '.' )
+			{
+				out = slash;
+				if( out > 0 )
+				{
+					--out;
+					while( out > 0 && p[ out ] != '/' ) --out;
+				}
+				if( last ) ++out;
+			}
+			else if( n == 0 || ( n == 1 && p[ in ] == '.' ) )
+			{
+				out = slash;
+				if( last ) ++out;
+			}
+			else
+			{
+				if( out != in ) std::memmove( p + out, p + in, n );
+				out += n;
+			}
+
+			if( last ) return out;
+
+			slash = out;
+			p[ out++ ] = '/';
+			in += n + 1;
+		}
+	}
+
+private:
+	struct tables
+	{
+		tables( )
+		{
+			for( int c = 0; c < 256; ++c )
+			{
+				hex[c] = 0xff;
+				if( c >= '0' && c <= '9' ) hex[c] = c - '0';
+				if( c >= 'a' && c <= 'f' ) hex[c] = c - 'a' + 10;
+				if( c >= 'A' && c <= 'F' ) hex[c] = c - 'A' + 10;
+
+				// Control characters are mapped out.
+				decoded[c] = ( c < 32 || c == 127 ) ? '_' : c;
+			}
+		}
+
+		unsigned char hex[ 256 ];
+		char decoded[ 256 ];
+	};
+
+	static const tables& get_tables( )
+	{
+		static const tables t;
+		return t;
+	}
+};
+
+#endif // _LIGHTTPD_URI_NORMALIZER_HPP_
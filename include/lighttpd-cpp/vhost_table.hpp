@@ -0,0 +1,671 @@
+/**
+ * The host to document root table mod_vhostmap maps, and building it.
+ * Nothing in here needs lighttpd, so vhostmap_compile can build tables
+ * away from the server.
+ *
+ * Tables are built from a text map, one host a line:
+ *
+ *  # host           docroot                  settings
+ *  example.com      /srv/www/example.com
+ *  *.example.com    /srv/www/example.com     server-name=example.com
+ *  static.example   /srv/static              follow-symlink=disable
+ *
+ * "*.example.com" is every name under example.com, however deep, but
+ * not example.com itself; an exact host wins over a wildcard, and a
+ * longer wildcard over a shorter one.  Hosts are compared without case,
+ * port or trailing dot.
+ *
+ * The table file, which is used where it is mapped, without being read
+ * into anything first:
+ *
+ *  vhost_table_header
+ *  host slots    open addressing, a vhost_slot per slot: the hash of an
+ *                exact host and where its record is
+ *  edge slots    the wildcards' trie of labels, right to left ("com",
+ *                then "example"), its edges in a second open addressing
+ *                table keyed on parent node and label
+ *  nodes         a uint32 per trie node, the record of the wildcard
+ *                ending there or none
+ *  records       uint16 lengths of host, docroot and server name, uint16
+ *                flags, then the three; and the edges' labels, a uint16
+ *                length then the label
+ *
+ * A lookup is a probe or two for the host and one for each of its
+ * labels, however many hosts there are.  Numbers are in the building
+ * host's byte order, which the header says.  Everything is checked once
+ * when a table is opened, so lookups need not.
+ */
+
+#ifndef _LIGHTTPD_VHOST_TABLE_HPP_
+#define _LIGHTTPD_VHOST_TABLE_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <istream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+struct vhost_table_header
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t hosts;
+	uint32_t wildcards;
+	uint32_t host_slots;
+	uint32_t edge_slots;
+	uint32_t nodes;
+	uint32_t reserved;
+	uint64_t host_slots_at;
+	uint64_t edge_slots_at;
+	uint64_t nodes_at;
+	uint64_t records_at;
+	uint64_t records_size;
+	uint64_t file_size;
+
+	static vhost_table_header make( )
+	{
+		vhost_table_header h;
+		std::memset( &h, 0, sizeof( h ) );
+		std::memcpy( h.magic, "LTVHOSTS", 8 );
+		h.version = 1;
+		h.byte_order = 0x01020304;
+		return h;
+	}
+
+	bool valid( ) const
+	{
+		return 0 == std::memcmp( magic, "LTVHOSTS", 8 ) && version == 1 && byte_order == 0x01020304;
+	}
+};
+
+// tag 0 is an empty slot.
+struct vhost_slot
+{
+	uint32_t tag;
+	uint32_t record;
+};
+
+struct vhost_edge
+{
+	uint32_t tag;
+	uint32_t parent;
+	uint32_t child;
+	uint32_t label;
+};
+
+enum
+{
+	VHOST_FOLLOW_SYMLINK_SET	= 1,
+	VHOST_FOLLOW_SYMLINK		= 2
+};
+
+/**
+ * One line of the map.  follow_symlink is -1 to leave it as configured.
+ */
+struct vhost_entry
+{
+	vhost_entry( ) : follow_symlink( -1 ) {}
+
+	std::string host;
+	std::string docroot;
+	std::string server_name;
+	int follow_symlink;
+};
+
+/**
+ * What a host maps to, pointing into the table, which has to be kept
+ * for as long as these are used.
+ */
+struct vhost_match
+{
+	const char* docroot;
+	std::size_t docroot_len;
+	const char* server_name;
+	std::size_t server_name_len;
+	int follow_symlink;
+	bool wildcard;
+};
+
+namespace vhost_hash
+{
+	static const uint32_t none = 0xffffffffu;
+
+	inline uint64_t bytes( const char* p, std::size_t len, uint64_t h = 0xcbf29ce484222325ULL )
+	{
+		for( std::size_t i = 0; i < len; ++i )
+		{
+			h ^= static_cast< unsigned char >( p[i] );
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+
+	inline uint64_t edge( uint32_t parent, const char* label, std::size_t len )
+	{
+		return bytes( label, len, 0xcbf29ce484222325ULL ^ ( uint64_t( parent ) * 0x9e3779b97f4a7c15ULL ) );
+	}
+
+	// Never 0, that's an empty slot.
+	inline uint32_t tag( uint64_t h )
+	{
+		return static_cast< uint32_t >( h >> 32 ) | 1;
+	}
+
+	/**
+	 * Host as looked up: lower case, without port or trailing dot, into
+	 * out (256 bytes).  0 when it isn't a name we'd have.
+	 */
+	inline std::size_t normalize( const char* host, std::size_t len, char* out )
+	{
+		std::size_t end = len;
+		if( len && host[0] == '[' )
+		{
+			const char* close = static_cast< const char* >( std::memchr( host, ']', len ) );
+			if( !close ) return 0;
+			end = close - host + 1;
+		}
+		else
+		{
+			const char* colon = static_cast< const char* >( std::memchr( host, ':', len ) );
+			if( colon ) end = colon - host;
+		}
+		if( end && host[ end - 1 ] == '.' ) --end;
+		if( !end || end > 255 ) return 0;
+
+		for( std::size_t i = 0; i < end; ++i )
+		{
+			char c = host[i];
+			if( c >= 'A' && c <= 'Z' ) c += 'a' - 'A';
+			else if( static_cast< unsigned char >( c ) <= ' ' || c == '/' || c == '*' ) return 0;
+			out[i] = c;
+		}
+		return end;
+	}
+}
+
+/**
+ * Reads a text map and puts the table file together.
+ */
+class vhost_table_builder
+{
+public:
+	vhost_table_builder( ) {}
+
+	bool add( const vhost_entry& e, std::string& error )
+	{
+		bool wildcard = e.host.size( ) > 2 && e.host[0] == '*' && e.host[1] == '.';
+		const char* name = e.host.data( ) + ( wildcard ? 2 : 0 );
+		std::size_t len = e.host.size( ) - ( wildcard ? 2 : 0 );
+
+		char buf[ 256 ];
+		std::size_t n = vhost_hash::normalize( name, len, buf );
+		if( !n || n != len - ( name[ len - 1 ] == '.' ? 1 : 0 ) || ( wildcard && buf[0] == '[' ) )
+		{
+			error = "not a host name: " + e.host;
+			return false;
+		}
+		for( std::size_t i = 0; i < n; ++i )
+		{
+			if( buf[i] == '.' && ( i == 0 || i + 1 == n || buf[ i + 1 ] == '.' ) )
+			{
+				error = "empty label in " + e.host;
+				return false;
+			}
+		}
+		if( e.docroot.empty( ) || e.docroot.size( ) > 0xffff || e.server_name.size( ) > 0xffff )
+		{
+			error = "no document root, or too long a one, for " + e.host;
+			return false;
+		}
+
+		vhost_entry normal( e );
+		normal.host.assign( buf, n );
+		if( !seen.insert( ( wildcard ? "*." : "" ) + normal.host ).second )
+		{
+			error = "listed twice: " + e.host;
+			return false;
+		}
+		( wildcard ? wildcards : hosts ).push_back( normal );
+		return true;
+	}
+
+	// Stops at the first bad line, which error says.
+	bool parse( std::istream& in, std::string& error )
+	{
+		std::string line;
+		for( int number = 1; std::getline( in, line ); ++number )
+		{
+			std::string::size_type hash = line.find( '#' );
+			if( hash != std::string::npos ) line.erase( hash );
+
+			std::istringstream words( line );
+			vhost_entry e;
+			if( !( words >> e.host ) ) continue;
+
+			std::string why;
+			if( !( words >> e.docroot ) ) why = "no document root for " + e.host;
+
+			std::string setting;
+			while( why.empty( ) && words >> setting )
+			{
+				if( 0 == setting.compare( 0, 12, "server-name=" ) ) e.server_name = setting.substr( 12 );
+				else if( setting == "follow-symlink=enable" ) e.follow_symlink = 1;
+				else if( setting == "follow-symlink=disable" ) e.follow_symlink = 0;
+				else why = "unknown setting " + setting;
+			}
+
+			if( why.empty( ) && add( e, why ) ) continue;
+
+			std::ostringstream out;
+			out << "line " << number << ": " << why;
+			error = out.str( );
+			return false;
+		}
+		return true;
+	}
+
+	std::size_t host_count( ) const { return hosts.size( ); }
+	std::size_t wildcard_count( ) const { return wildcards.size( ); }
+
+	// The whole file.
+	std::string image( ) const
+	{
+		std::string records;
+		std::vector< vhost_slot > host_slots( slots_for( hosts.size( ) ) );
+		std::memset( &host_slots[0], 0, host_slots.size( ) * sizeof( vhost_slot ) );
+
+		for( std::vector< vhost_entry >::const_iterator i = hosts.begin( ); i != hosts.end( ); ++i )
+		{
+			uint64_t h = vhost_hash::bytes( i->host.data( ), i->host.size( ) );
+			std::size_t s = place( host_slots, h );
+			host_slots[ s ].tag = vhost_hash::tag( h );
+			host_slots[ s ].record = append_record( *i, records );
+		}
+
+		// The trie, labels right to left from the root, node 0.
+		std::vector< uint32_t > nodes( 1, vhost_hash::none );
+		std::vector< vhost_edge > edges;
+		std::map< std::pair< uint32_t, std::string >, uint32_t > children;
+
+		for( std::vector< vhost_entry >::const_iterator i = wildcards.begin( ); i != wildcards.end( ); ++i )
+		{
+			uint32_t node = 0;
+			std::string::size_type end = i->host.size( );
+			while( true )
+			{
+				std::string::size_type dot = i->host.rfind( '.', end - 1 );
+				std::string::size_type start = dot == std::string::npos ? 0 : dot + 1;
+				std::string label = i->host.substr( start, end - start );
+
+				std::pair< std::map< std::pair< uint32_t, std::string >, uint32_t >::iterator, bool > c =
+					children.insert( std::make_pair( std::make_pair( node, label ), uint32_t( nodes.size( ) ) ) );
+				if( c.second )
+				{
+					vhost_edge e;
+					e.tag = 0;
+					e.parent = node;
+					e.child = static_cast< uint32_t >( nodes.size( ) );
+					e.label = append_label( label, records );
+					edges.push_back( e );
+					nodes.push_back( vhost_hash::none );
+				}
+				node = c.first->second;
+
+				if( !start ) break;
+				end = dot;
+			}
+			nodes[ node ] = append_record( *i, records );
+		}
+
+		std::vector< vhost_edge > edge_slots( slots_for( edges.size( ) ) );
+		std::memset( &edge_slots[0], 0, edge_slots.size( ) * sizeof( vhost_edge ) );
+		for( std::vector< vhost_edge >::const_iterator e = edges.begin( ); e != edges.end( ); ++e )
+		{
+			uint16_t len;
+			std::memcpy( &len, records.data( ) + e->label, 2 );
+			uint64_t h = vhost_hash::edge( e->parent, records.data( ) + e->label + 2, len );
+			std::size_t s = place( edge_slots, h );
+			edge_slots[ s ] = *e;
+			edge_slots[ s ].tag = vhost_hash::tag( h );
+		}
+
+		vhost_table_header head = vhost_table_header::make( );
+		head.hosts = static_cast< uint32_t >( hosts.size( ) );
+		head.wildcards = static_cast< uint32_t >( wildcards.size( ) );
+		head.host_slots = static_cast< uint32_t >( host_slots.size( ) );
+		head.edge_slots = static_cast< uint32_t >( edge_slots.size( ) );
+		head.nodes = static_cast< uint32_t >( nodes.size( ) );
+		head.host_slots_at = sizeof( head );
+		head.edge_slots_at = head.host_slots_at + host_slots.size( ) * sizeof( vhost_slot );
+		head.nodes_at = head.edge_slots_at + edge_slots.size( ) * sizeof( vhost_edge );
+		head.records_at = ( head.nodes_at + nodes.size( ) * sizeof( uint32_t ) + 7 ) & ~uint64_t( 7 );
+		head.records_size = records.size( );
+		head.file_size = head.records_at + records.size( );
+
+		std::string out( head.file_size, '\0' );
+		std::memcpy( &out[0], &head, sizeof( head ) );
+		std::memcpy( &out[ head.host_slots_at ], &host_slots[0], host_slots.size( ) * sizeof( vhost_slot ) );
+		std::memcpy( &out[ head.edge_slots_at ], &edge_slots[0], edge_slots.size( ) * sizeof( vhost_edge ) );
+		std::memcpy( &out[ head.nodes_at ], &nodes[0], nodes.size( ) * sizeof( uint32_t ) );
+		if( !records.empty( ) ) std::memcpy( &out[ head.records_at ], records.data( ), records.size( ) );
+		return out;
+	}
+
+	/**
+	 * Written beside path and renamed over it, so a server mapping the
+	 * old table keeps it whole and the next look finds the new one.
+	 */
+	bool write( const std::string& path, std::string& error ) const
+	{
+		std::string data = image( );
+		if( data.size( ) > 0xffffffffu )
+		{
+			error = "too many hosts for one table";
+			return false;
+		}
+
+		char pid[ 32 ];
+		std::snprintf( pid, sizeof( pid ), ".%d", static_cast< int >( getpid( ) ) );
+		std::string temp = path + pid;
+
+		int fd = ::open( temp.c_str( ), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		bool ok = fd != -1;
+		for( std::size_t done = 0; ok && done < data.size( ); )
+		{
+			ssize_t n = ::write( fd, data.data( ) + done, data.size( ) - done );
+			if( n < 0 && errno == EINTR ) continue;
+			ok = n > 0;
+			if( ok ) done += n;
+		}
+		if( ok ) ok = 0 == fsync( fd );
+		if( fd != -1 && 0 != close( fd ) ) ok = false;
+		if( ok ) ok = 0 == rename( temp.c_str( ), path.c_str( ) );
+
+		if( !ok )
+		{
+			error = temp + ": " + std::strerror( errno );
+			unlink( temp.c_str( ) );
+		}
+		return ok;
+	}
+
+private:
+	// Half full at most, so probes stay short.
+	static std::size_t slots_for( std::size_t n )
+	{
+		std::size_t slots = 8;
+		while( slots < n * 2 ) slots *= 2;
+		return slots;
+	}
+
+	template< typename T >
+	static std::size_t place( const std::vector< T >& slots, uint64_t h )
+	{
+		std::size_t mask = slots.size( ) - 1;
+		std::size_t s = static_cast< std::size_t >( h ) & mask;
+		while( slots[ s ].tag ) s = ( s + 1 ) & mask;
+		return s;
+	}
+
+	static uint32_t append_record( const vhost_entry& e, std::string& records )
+	{
+		uint32_t at = static_cast< uint32_t >( records.size( ) );
+		uint16_t head[ 4 ] =
+		{
+			static_cast< uint16_t >( e.host.size( ) ),
+			static_cast< uint16_t >( e.docroot.size( ) ),
+			static_cast< uint16_t >( e.server_name.size( ) ),
+			static_cast< uint16_t >( e.follow_symlink < 0 ? 0 : VHOST_FOLLOW_SYMLINK_SET | ( e.follow_symlink ? VHOST_FOLLOW_SYMLINK : 0 ) )
+		};
+		records.append( reinterpret_cast< const char* >( head ), sizeof( head ) );
+		records += e.host;
+		records += e.docroot;
+		records += e.server_name;
+		return at;
+	}
+
+	static uint32_t append_label( const std::string& label, std::string& records )
+	{
+		uint32_t at = static_cast< uint32_t >( records.size( ) );
+		uint16_t len = static_cast< uint16_t >( label.size( ) );
+		records.append( reinterpret_cast< const char* >( &len ), 2 );
+		records += label;
+		return at;
+	}
+
+	std::vector< vhost_entry > hosts;
+	std::vector< vhost_entry > wildcards;
+	std::set< std::string > seen;
+};
+
+class vhost_table;
+typedef boost::shared_ptr< const vhost_table > vhost_table_ptr;
+
+/**
+ * A table file mapped read only.  Replacing the file (by rename) leaves
+ * this mapping as it was; open the path again for the new one.
+ */
+class vhost_table : boost::noncopyable
+{
+public:
+	// Null, and why in error, when the file can't be mapped or isn't a
+	// whole table.
+	static vhost_table_ptr open( const std::string& path, std::string& error )
+	{
+		int fd = ::open( path.c_str( ), O_RDONLY | O_CLOEXEC );
+		if( fd == -1 )
+		{
+			error = path + ": " + std::strerror( errno );
+			return vhost_table_ptr( );
+		}
+
+		struct stat st;
+		void* p = MAP_FAILED;
+		if( 0 == fstat( fd, &st ) && st.st_size >= off_t( sizeof( vhost_table_header ) ) )
+			p = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		close( fd );
+
+		if( p == MAP_FAILED )
+		{
+			error = path + ": not a vhost table";
+			return vhost_table_ptr( );
+		}
+
+		boost::shared_ptr< vhost_table > t( new vhost_table( static_cast< const char* >( p ), st ) );
+		if( !t->check( ) )
+		{
+			error = path + ": not a vhost table, or a damaged one";
+			return vhost_table_ptr( );
+		}
+		return t;
+	}
+
+	~vhost_table( )
+	{
+		munmap( const_cast< char* >( base ), size );
+	}
+
+	bool find( const char* host, std::size_t len, vhost_match& m ) const
+	{
+		char name[ 256 ];
+		std::size_t n = vhost_hash::normalize( host, len, name );
+		if( !n ) return false;
+
+		uint64_t h = vhost_hash::bytes( name, n );
+		uint32_t tag = vhost_hash::tag( h );
+		uint32_t mask = head->host_slots - 1;
+		for( uint32_t s = static_cast< uint32_t >( h ) & mask; host_slots[ s ].tag; s = ( s + 1 ) & mask )
+		{
+			if( host_slots[ s ].tag != tag ) continue;
+
+			uint16_t r[ 4 ];
+			const char* p = record( host_slots[ s ].record, r );
+			if( r[0] == n && 0 == std::memcmp( p, name, n ) ) return fill( p, r, false, m );
+		}
+
+		// Labels right to left, remembering the last wildcard passed with
+		// some of the host still to its left.
+		uint32_t node = 0, best = vhost_hash::none;
+		std::size_t end = n;
+		while( true )
+		{
+			std::size_t start = end;
+			while( start && name[ start - 1 ] != '.' ) --start;
+
+			node = child( node, name + start, end - start );
+			if( node == vhost_hash::none ) break;
+			if( start && nodes[ node ] != vhost_hash::none ) best = nodes[ node ];
+
+			if( !start ) break;
+			end = start - 1;
+		}
+		if( best == vhost_hash::none ) return false;
+
+		uint16_t r[ 4 ];
+		const char* p = record( best, r );
+		return fill( p, r, true, m );
+	}
+
+	std::size_t hosts( ) const { return head->hosts; }
+	std::size_t wildcards( ) const { return head->wildcards; }
+
+	// Whether path still names the file this maps.
+	bool same_file( const struct stat& st ) const
+	{
+		return st.st_dev == file.st_dev && st.st_ino == file.st_ino && st.st_size == file.st_size && st.st_mtime == file.st_mtime;
+	}
+
+private:
+	vhost_table( const char* base, const struct stat& st )
+	 :	base( base ),
+		size( st.st_size ),
+		file( st ),
+		head( reinterpret_cast< const vhost_table_header* >( base ) ),
+		host_slots( 0 ),
+		edge_slots( 0 ),
+		nodes( 0 ),
+		records( 0 )
+	{}
+
+	// Everything in bounds, once, so find( ) needn't look.
+	bool check( )
+	{
+		const vhost_table_header& h = *head;
+		if( !h.valid( ) || h.file_size != size ) return false;
+		if( !h.host_slots || ( h.host_slots & ( h.host_slots - 1 ) ) || !h.edge_slots || ( h.edge_slots & ( h.edge_slots - 1 ) ) || !h.nodes )
+			return false;
+		if( h.host_slots < h.hosts || h.edge_slots < h.nodes - 1 ) return false;
+
+		if( ( h.host_slots_at | h.edge_slots_at | h.nodes_at ) & 3 ) return false;
+		if( h.host_slots_at < sizeof( h ) || h.host_slots_at + uint64_t( h.host_slots ) * sizeof( vhost_slot ) > size ) return false;
+		if( h.edge_slots_at + uint64_t( h.edge_slots ) * sizeof( vhost_edge ) > size ) return false;
+		if( h.nodes_at + uint64_t( h.nodes ) * sizeof( uint32_t ) > size ) return false;
+		if( h.records_at > size || h.records_size > size - h.records_at ) return false;
+
+		host_slots = reinterpret_cast< const vhost_slot* >( base + h.host_slots_at );
+		edge_slots = reinterpret_cast< const vhost_edge* >( base + h.edge_slots_at );
+		nodes = reinterpret_cast< const uint32_t* >( base + h.nodes_at );
+		records = base + h.records_at;
+
+		// An empty slot in each, or a miss would probe forever.
+		bool empty = false;
+		for( uint32_t s = 0; s < h.host_slots; ++s )
+		{
+			if( !host_slots[ s ].tag ) empty = true;
+			else if( !record_fits( host_slots[ s ].record ) ) return false;
+		}
+		if( !empty ) return false;
+
+		empty = false;
+		for( uint32_t s = 0; s < h.edge_slots; ++s )
+		{
+			const vhost_edge& e = edge_slots[ s ];
+			if( !e.tag ) empty = true;
+			else if( e.parent >= h.nodes || e.child >= h.nodes || !label_fits( e.label ) ) return false;
+		}
+		if( !empty ) return false;
+
+		for( uint32_t i = 0; i < h.nodes; ++i )
+		{
+			if( nodes[i] != vhost_hash::none && !record_fits( nodes[i] ) ) return false;
+		}
+		return true;
+	}
+
+	bool record_fits( uint32_t at ) const
+	{
+		if( uint64_t( at ) + 8 > head->records_size ) return false;
+		uint16_t r[ 4 ];
+		record( at, r );
+		return uint64_t( at ) + 8 + r[0] + r[1] + r[2] <= head->records_size;
+	}
+
+	bool label_fits( uint32_t at ) const
+	{
+		if( uint64_t( at ) + 2 > head->records_size ) return false;
+		uint16_t len;
+		std::memcpy( &len, records + at, 2 );
+		return uint64_t( at ) + 2 + len <= head->records_size;
+	}
+
+	// Lengths into r, and where the host starts.
+	const char* record( uint32_t at, uint16_t* r ) const
+	{
+		std::memcpy( r, records + at, 8 );
+		return records + at + 8;
+	}
+
+	uint32_t child( uint32_t parent, const char* label, std::size_t len ) const
+	{
+		uint64_t h = vhost_hash::edge( parent, label, len );
+		uint32_t tag = vhost_hash::tag( h );
+		uint32_t mask = head->edge_slots - 1;
+		for( uint32_t s = static_cast< uint32_t >( h ) & mask; edge_slots[ s ].tag; s = ( s + 1 ) & mask )
+		{
+			const vhost_edge& e = edge_slots[ s ];
+			if( e.tag != tag || e.parent != parent ) continue;
+
+			uint16_t l;
+			std::memcpy( &l, records + e.label, 2 );
+			if( l == len && 0 == std::memcmp( records + e.label + 2, label, len ) ) return e.child;
+		}
+		return vhost_hash::none;
+	}
+
+	static bool fill( const char* p, const uint16_t* r, bool wildcard, vhost_match& m )
+	{
+		m.docroot = p + r[0];
+		m.docroot_len = r[1];
+		m.server_name = p + r[0] + r[1];
+		m.server_name_len = r[2];
+		m.follow_symlink = ( r[3] & VHOST_FOLLOW_SYMLINK_SET ) ? ( r[3] & VHOST_FOLLOW_SYMLINK ? 1 : 0 ) : -1;
+		m.wildcard = wildcard;
+		return true;
+	}
+
+	const char* base;
+	std::size_t size;
+	struct stat file;
+	const vhost_table_header* head;
+	const vhost_slot* host_slots;
+	const vhost_edge* edge_slots;
+	const uint32_t* nodes;
+	const char* records;
+};
+
+#endif // _LIGHTTPD_VHOST_TABLE_HPP_
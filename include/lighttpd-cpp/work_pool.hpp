@@ -0,0 +1,372 @@
+/**
+ * A work stealing thread pool for taking CPU heavy work (hashing,
+ * signature checks, compression) off the event loop thread.
+ *
+ * A handler submits a job for its connection and returns
+ * HANDLER_WAIT_FOR_EVENT.  When the job has run the connection is put back
+ * on the joblist and lighttpd calls the handler again, which finds the
+ * ticket done and picks up the result:
+ *
+ *  handler_t handle_start_backend( connection& con )
+ *  {
+ *  	work_ticket_ptr& t = tickets[ con.ndx ];
+ *  	if( t && !t->done( ) ) return HANDLER_WAIT_FOR_EVENT;
+ *  	if( t ) { ... use the result ...; t.reset( ); return HANDLER_FINISHED; }
+ *
+ *  	t = pool.submit( con, boost::bind( &hash_file, path, result ) );
+ *  	return HANDLER_WAIT_FOR_EVENT;
+ *  }
+ *
+ * Jobs run on another thread, so they must not touch the connection, the
+ * server or anything else lighttpd owns.
+ *
+ * Each worker has its own deque, submissions are dealt round robin and an
+ * idle worker steals from the back of the others'.  Finished jobs go back
+ * to the main thread through a pipe of ours registered with srv->ev, with
+ * USE_GTHREAD too, so only the main thread looks at cancelled tickets.
+ *
+ * Queue depth and the time jobs wait before starting are kept for tuning,
+ * report( ) publishes them as status counters from the main thread.
+ */
+
+#ifndef _LIGHTTPD_WORK_POOL_HPP_
+#define _LIGHTTPD_WORK_POOL_HPP_
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <cerrno>
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "c++-compat/plugin.h"
+
+/**
+ * One submitted job.  Shared between the pool and the handler, so a
+ * connection that goes away mid job only has to cancel its ticket.
+ */
+struct work_ticket : boost::noncopyable
+{
+	enum state_type { QUEUED, RUNNING, DONE };
+
+	work_ticket( connection& con, const boost::function< void( ) >& job, uint64_t queued_at )
+	 : state( QUEUED ), con( &con ), job( job ), queued_at( queued_at ), cancelled( false )
+	{}
+
+	bool done( ) const
+	{
+		return state.load( boost::memory_order_acquire ) == DONE;
+	}
+
+	boost::atomic< int > state;
+	connection* con;
+	boost::function< void( ) > job;
+	uint64_t queued_at;
+
+	// Main thread only.
+	bool cancelled;
+};
+
+typedef boost::shared_ptr< work_ticket > work_ticket_ptr;
+
+class work_pool : boost::noncopyable
+{
+public:
+	// threads of 0 means one per CPU.
+	work_pool( server& srv, std::size_t threads = 0 )
+	 :	srv( srv ), next( 0 ), pending( 0 ), stopping( false ),
+		wakeup_sock( 0 ), registered( false ),
+		started( 0 ), completed( 0 ), stolen( 0 ), wait_total_us( 0 ), wait_max_us( 0 )
+	{
+		if( threads == 0 ) threads = boost::thread::hardware_concurrency( );
+		if( threads == 0 ) threads = 1;
+
+		wakeup[0] = wakeup[1] = -1;
+		if( 0 == pipe( wakeup ) )
+		{
+			for( int i = 0; i < 2; ++i )
+			{
+				fcntl( wakeup[i], F_SETFL, fcntl( wakeup[i], F_GETFL ) | O_NONBLOCK );
+				fcntl( wakeup[i], F_SETFD, FD_CLOEXEC );
+			}
+		}
+
+		for( std::size_t i = 0; i < threads; ++i )
+			workers.push_back( new worker );
+
+		for( std::size_t i = 0; i < threads; ++i )
+			pool.create_thread( boost::bind( &work_pool::run, this, i ) );
+	}
+
+	~work_pool( )
+	{
+		{
+			boost::mutex::scoped_lock l( idle_lock );
+			stopping = true;
+		}
+		idle.notify_all( );
+		pool.join_all( );
+
+		for( std::vector< worker* >::iterator i = workers.begin( ); i != workers.end( ); ++i )
+			delete *i;
+
+		if( registered )
+		{
+			fdevent_event_del( srv.ev, wakeup_sock );
+			fdevent_unregister( srv.ev, wakeup_sock );
+		}
+		if( wakeup_sock )
+		{
+			wakeup_sock->fd = -1;
+			iosocket_free( wakeup_sock );
+		}
+		if( wakeup[0] != -1 ) close( wakeup[0] );
+		if( wakeup[1] != -1 ) close( wakeup[1] );
+	}
+
+	// Queue job to run for con, con goes back on the joblist when it has.
+	work_ticket_ptr submit( connection& con, const boost::function< void( ) >& job )
+	{
+		listen( );
+
+		work_ticket_ptr t( new work_ticket( con, job, now_us( ) ) );
+
+		worker& w = *workers[ next++ % workers.size( ) ];
+		{
+			boost::mutex::scoped_lock l( w.lock );
+			w.jobs.push_back( t );
+		}
+
+		// Counted once it is there to take, so a worker that claims a count
+		// always finds a job.
+		{
+			boost::mutex::scoped_lock l( idle_lock );
+			++pending;
+		}
+		idle.notify_one( );
+
+		return t;
+	}
+
+	// The connection has gone, don't wake it when the job finishes.  The
+	// job itself still runs (or has run) to completion.
+	void cancel( const work_ticket_ptr& t )
+	{
+		if( t ) t->cancelled = true;
+	}
+
+	// Hand finished jobs back to the joblist.  Called from our wakeup
+	// handler, public for tests and plugins with their own loop.
+	void complete( )
+	{
+		char buf[ 64 ];
+		while( wakeup[0] != -1 && read( wakeup[0], buf, sizeof( buf ) ) > 0 ) {}
+
+		std::vector< work_ticket_ptr > finished;
+		{
+			boost::mutex::scoped_lock l( done_lock );
+			finished.swap( done );
+		}
+
+		for( std::vector< work_ticket_ptr >::iterator i = finished.begin( ); i != finished.end( ); ++i )
+		{
+			if( !(*i)->cancelled ) joblist_append( &srv, (*i)->con );
+		}
+	}
+
+	std::size_t threads( ) const { return workers.size( ); }
+
+	// Jobs submitted but not yet started.
+	std::size_t queue_depth( ) const { return pending.load( ); }
+
+	uint64_t jobs_started( ) const { return started.load( ); }
+	uint64_t jobs_completed( ) const { return completed.load( ); }
+	uint64_t jobs_stolen( ) const { return stolen.load( ); }
+
+	// Microseconds between submit and a worker picking the job up.
+	uint64_t mean_wait_us( ) const
+	{
+		uint64_t n = started.load( );
+		return n ? wait_total_us.load( ) / n : 0;
+	}
+	uint64_t max_wait_us( ) const { return wait_max_us.load( ); }
+
+	// Publish under prefix, i.e. "mod_thumb.pool", from the main thread.
+	void report( const std::string& prefix )
+	{
+		set_counter( prefix + ".queue-depth", queue_depth( ) );
+		set_counter( prefix + ".threads", threads( ) );
+		set_counter( prefix + ".started", jobs_started( ) );
+		set_counter( prefix + ".stolen", jobs_stolen( ) );
+		set_counter( prefix + ".wait-mean-us", mean_wait_us( ) );
+		set_counter( prefix + ".wait-max-us", max_wait_us( ) );
+		wait_max_us.store( 0 );
+	}
+
+	static handler_t on_wakeup( void* s, void* ctx, int revents )
+	{
+		reinterpret_cast< work_pool* >( ctx )->complete( );
+		return HANDLER_GO_ON;
+	}
+
+private:
+	struct worker
+	{
+		boost::mutex lock;
+		std::deque< work_ticket_ptr > jobs;
+	};
+
+	static uint64_t now_us( )
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return uint64_t( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	static void set_counter( const std::string& key, uint64_t value )
+	{
+		status_counter_set( key.data( ), key.size( ), static_cast< int >( value ) );
+	}
+
+	// srv->ev doesn't exist yet when plugins are set up, so register our
+	// end of the pipe on first use.
+	void listen( )
+	{
+		if( registered || wakeup[0] == -1 || !srv.ev ) return;
+
+		wakeup_sock = iosocket_init( );
+		wakeup_sock->fd = wakeup[0];
+		fdevent_register( srv.ev, wakeup_sock, &on_wakeup, this );
+		fdevent_event_add( srv.ev, wakeup_sock, FDEVENT_IN );
+		registered = true;
+	}
+
+	// Our own front first, then steal from the back of everyone else.
+	bool take( std::size_t self, work_ticket_ptr& t )
+	{
+		{
+			worker& w = *workers[ self ];
+			boost::mutex::scoped_lock l( w.lock );
+			if( !w.jobs.empty( ) )
+			{
+				t = w.jobs.front( );
+				w.jobs.pop_front( );
+				return true;
+			}
+		}
+
+		for( std::size_t i = 1; i < workers.size( ); ++i )
+		{
+			worker& w = *workers[ ( self + i ) % workers.size( ) ];
+			boost::mutex::scoped_lock l( w.lock );
+			if( !w.jobs.empty( ) )
+			{
+				t = w.jobs.back( );
+				w.jobs.pop_back( );
+				++stolen;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void run( std::size_t self )
+	{
+		for( ;; )
+		{
+			// Claim a job before looking for it, so that losing a race for
+			// one can't leave us spinning.
+			{
+				boost::mutex::scoped_lock l( idle_lock );
+				while( pending == 0 && !stopping ) idle.wait( l );
+				if( stopping ) return;
+				--pending;
+			}
+
+			// Ours is in some deque, another worker can only have taken a
+			// different one.
+			work_ticket_ptr t;
+			while( !take( self, t ) ) boost::this_thread::yield( );
+
+			account_wait( now_us( ) - t->queued_at );
+
+			t->state.store( work_ticket::RUNNING, boost::memory_order_relaxed );
+			try
+			{
+				t->job( );
+			}
+			catch( ... )
+			{
+			}
+			t->state.store( work_ticket::DONE, boost::memory_order_release );
+			++completed;
+
+			finished( t );
+		}
+	}
+
+	void account_wait( uint64_t us )
+	{
+		++started;
+		wait_total_us += us;
+
+		uint64_t max = wait_max_us.load( );
+		while( us > max && !wait_max_us.compare_exchange_weak( max, us ) ) {}
+	}
+
+	// Not joblist_append( ) nor, with USE_GTHREAD, joblist_queue: whether
+	// the ticket was cancelled is only known on the main thread.
+	void finished( const work_ticket_ptr& t )
+	{
+		bool first;
+		{
+			boost::mutex::scoped_lock l( done_lock );
+			first = done.empty( );
+			done.push_back( t );
+		}
+
+		// One byte per batch is enough to wake the loop.
+		if( first && wakeup[1] != -1 )
+		{
+			if( write( wakeup[1], " ", 1 ) ) {}
+		}
+	}
+
+	server& srv;
+
+	std::vector< worker* > workers;
+	boost::thread_group pool;
+	std::size_t next;
+
+	boost::mutex idle_lock;
+	boost::condition_variable idle;
+	boost::atomic< std::size_t > pending;
+	bool stopping;
+
+	boost::mutex done_lock;
+	std::vector< work_ticket_ptr > done;
+	int wakeup[2];
+	iosocket* wakeup_sock;
+	bool registered;
+
+	boost::atomic< uint64_t > started;
+	boost::atomic< uint64_t > completed;
+	boost::atomic< uint64_t > stolen;
+	boost::atomic< uint64_t > wait_total_us;
+	boost::atomic< uint64_t > wait_max_us;
+};
+
+#endif // _LIGHTTPD_WORK_POOL_HPP_
@@ -0,0 +1,54 @@
+/**
+ * Converts mod_binlog's binary access logs to text, one line per request
+ * (see binlog_text( ) in binlog_format.hpp).
+ *
+ *  binlog2text access.binlog [more.binlog ...] > access.log
+ *
+ * Reads standard input without arguments.
+ */
+
+#include <lighttpd-cpp/binlog_format.hpp>
+
+#include <cstdio>
+
+static int convert( std::FILE* in, const char* name )
+{
+	binlog_reader reader( in );
+	binlog_record r;
+	binlog_reader::result result;
+
+	while( binlog_reader::RECORD == ( result = reader.next( r ) ) )
+	{
+		std::string line = binlog_text( r );
+		line += '\n';
+		std::fwrite( line.data( ), 1, line.size( ), stdout );
+	}
+
+	if( result == binlog_reader::BAD )
+	{
+		std::fprintf( stderr, "binlog2text: %s is not a binlog, or is damaged\n", name );
+		return 1;
+	}
+	return 0;
+}
+
+int main( int argc, char** argv )
+{
+	if( argc < 2 ) return convert( stdin, "standard input" );
+
+	int status = 0;
+	for( int i = 1; i < argc; ++i )
+	{
+		std::FILE* in = std::fopen( argv[i], "rb" );
+		if( !in )
+		{
+			std::perror( argv[i] );
+			status = 1;
+			continue;
+		}
+
+		status |= convert( in, argv[i] );
+		std::fclose( in );
+	}
+	return status;
+}
@@ -0,0 +1,7 @@
+/**
+ * Example in-process dynamic responses, see mod_app_example.hpp.
+ */
+
+#include "mod_app_example.hpp"
+
+MAKE_PLUGIN( mod_app_example, "app_example", LIGHTTPD_VERSION_ID );
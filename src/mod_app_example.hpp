@@ -0,0 +1,125 @@
+/**
+ * An example of in-process dynamic responses using app_handler.hpp, the
+ * sort of small endpoints otherwise run as FastCGI.
+ *
+ *  GET  /app/health           "ok"
+ *  POST /app/echo             the request body back, with its Content-Type
+ *  GET  /app/headers          the request headers as a JSON object
+ *  GET  /app/header/<name>    one request header as JSON, 404 without it
+ *
+ * Config:
+ *  app-example.enable = "enable"   # per context
+ */
+
+#ifndef _MOD_APP_EXAMPLE_HPP_
+#define _MOD_APP_EXAMPLE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/app_handler.hpp>
+
+#include <string>
+#include <cstdio>
+
+class mod_app_example
+ : 	public Plugin< mod_app_example >,
+	public app_handler< mod_app_example >
+{
+public:
+	mod_app_example( server& srv )
+	 :	Plugin< mod_app_example >( srv ),
+		app_handler< mod_app_example >( srv ),
+		enable	( "app-example.enable" )
+	{
+		route( HTTP_METHOD_GET, "/app/health", &mod_app_example::health );
+		route( HTTP_METHOD_POST, "/app/echo", &mod_app_example::echo );
+		route( HTTP_METHOD_GET, "/app/headers", &mod_app_example::headers );
+		route( HTTP_METHOD_GET, "/app/header/", &mod_app_example::header, PREFIX );
+	}
+
+	virtual ~mod_app_example( ){ }
+
+	typedef app_handler< mod_app_example >::handlers handlers;
+
+	bool accepts( connection& con ) { return enable[ con ]; }
+
+	void health( app_request& req, app_response& res )
+	{
+		res.header( "Content-Type", "text/plain" );
+		res << "ok\n";
+	}
+
+	void echo( app_request& req, app_response& res )
+	{
+		http_span type = req.header( "Content-Type" );
+		if( type.len ) res.header( "Content-Type", 12, type.ptr, type.len );
+
+		char buf[ 4096 ];
+		for( std::size_t n; ( n = req.read( buf, sizeof( buf ) ) ); )
+			res.append( buf, n );
+	}
+
+	void headers( app_request& req, app_response& res )
+	{
+		res.header( "Content-Type", "application/json" );
+		res << "{";
+
+		const array* h = req.con.request.headers;
+		for( std::size_t i = 0; h && i < h->used; ++i )
+		{
+			const data_string* ds = reinterpret_cast< const data_string* >( h->data[i] );
+			if( i ) res << ",";
+			json_string( res, ds->key );
+			res << ":";
+			json_string( res, ds->value );
+		}
+
+		res << "}\n";
+	}
+
+	void header( app_request& req, app_response& res )
+	{
+		std::string name = req.path( ).str( ).substr( 12 );
+		http_span value = req.header( name.c_str( ) );
+
+		res.header( "Content-Type", "application/json" );
+		if( !value.len )
+		{
+			res.status( 404 ) << "null\n";
+			return;
+		}
+
+		json_string( res, value.ptr, value.len );
+		res << "\n";
+	}
+
+	static void json_string( response_builder& out, const buffer* b )
+	{
+		if( b && b->used ) json_string( out, b->ptr, b->used - 1 );
+		else out << "\"\"";
+	}
+
+	static void json_string( response_builder& out, const char* p, std::size_t len )
+	{
+		out << "\"";
+
+		// Runs of characters that need no escaping go in one piece.
+		std::size_t start = 0;
+		for( std::size_t i = 0; i < len; ++i )
+		{
+			unsigned char c = p[i];
+			if( c >= 0x20 && c != '"' && c != '\\' ) continue;
+
+			out.append( p + start, i - start );
+			char esc[ 8 ];
+			out.append( esc, snprintf( esc, sizeof( esc ), "\\u%04x", c ) );
+			start = i + 1;
+		}
+		out.append( p + start, len - start );
+
+		out << "\"";
+	}
+
+	config_option< bool > enable;
+};
+
+#endif // _MOD_APP_EXAMPLE_HPP_
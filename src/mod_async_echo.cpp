@@ -0,0 +1,7 @@
+/**
+ * Example resumable backend, see mod_async_echo.hpp.
+ */
+
+#include "mod_async_echo.hpp"
+
+MAKE_PLUGIN( mod_async_echo, "async_echo", LIGHTTPD_VERSION_ID );
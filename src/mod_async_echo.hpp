@@ -0,0 +1,141 @@
+/**
+ * An example backend using the resumable handlers of async_handler.hpp.
+ * Sends the request path to a backend listening on a Unix socket and
+ * answers with whatever comes back, i.e. point it at an echo server.
+ *
+ * Config:
+ *  async-echo.socket = "/tmp/echo.sock"   # per context, unset declines
+ *  async-echo.timeout = 10                # seconds per backend wait
+ */
+
+#ifndef _MOD_ASYNC_ECHO_HPP_
+#define _MOD_ASYNC_ECHO_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/async_handler.hpp>
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+class mod_async_echo;
+
+struct async_echo_task : async_task
+{
+	inline async_echo_task( mod_async_echo& p, connection& con );
+
+	~async_echo_task( )
+	{
+		if( fd != -1 ) close( fd );
+	}
+
+	inline handler_t operator()( async_context& ctx );
+
+	// Start a non-blocking connect, false if it failed outright.
+	bool connect_backend( )
+	{
+		struct sockaddr_un addr;
+		if( socket_path.size( ) >= sizeof( addr.sun_path ) ) return false;
+
+		std::memset( &addr, 0, sizeof( addr ) );
+		addr.sun_family = AF_UNIX;
+		std::memcpy( addr.sun_path, socket_path.c_str( ), socket_path.size( ) + 1 );
+
+		if( -1 == ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) ) return false;
+		fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+		fcntl( fd, F_SETFD, FD_CLOEXEC );
+
+		return 0 == connect( fd, reinterpret_cast< struct sockaddr* >( &addr ), sizeof( addr ) )
+			|| errno == EINPROGRESS || errno == EAGAIN;
+	}
+
+	connection& con;
+	std::string socket_path;
+	time_t timeout;
+
+	int fd;
+	std::string out;
+	std::size_t sent;
+	ssize_t n;
+};
+
+class mod_async_echo
+ : 	public Plugin< mod_async_echo >,
+	public async_backend< mod_async_echo, async_echo_task >
+{
+public:
+	mod_async_echo( server& srv )
+	 :	Plugin< mod_async_echo >( srv ),
+		async_backend< mod_async_echo, async_echo_task >( srv ),
+		socket	( "async-echo.socket" ),
+		timeout	( "async-echo.timeout" )
+	{}
+
+	virtual ~mod_async_echo( ){ }
+
+	typedef async_backend< mod_async_echo, async_echo_task >::handlers handlers;
+
+	config_option< std::string >	socket;
+	config_option< int >			timeout;
+};
+
+inline async_echo_task::async_echo_task( mod_async_echo& p, connection& con )
+ :	con( con ), socket_path( p.socket[ con ] ), timeout( p.timeout[ con ] ),
+	fd( -1 ), sent( 0 ), n( 0 )
+{
+	if( timeout <= 0 ) timeout = 10;
+}
+
+inline handler_t async_echo_task::operator()( async_context& ctx )
+{
+	BOOST_ASIO_CORO_REENTER( this )
+	{
+		if( socket_path.empty( ) ) return HANDLER_GO_ON;
+		if( !connect_backend( ) ) return HANDLER_ERROR;
+
+		out.assign( CONST_BUF_LEN( con.uri.path ) );
+		out.append( 1, '\n' );
+
+		while( sent < out.size( ) )
+		{
+			BOOST_ASIO_CORO_YIELD return ctx.writable( fd, timeout );
+			if( ctx.timed_out( ) ) return HANDLER_ERROR;
+
+			n = write( fd, out.data( ) + sent, out.size( ) - sent );
+			if( n < 0 && errno != EAGAIN && errno != EINTR ) return HANDLER_ERROR;
+			if( n > 0 ) sent += n;
+		}
+		shutdown( fd, SHUT_WR );
+
+		// Stream the reply into the write queue until the backend closes.
+		for( ;; )
+		{
+			BOOST_ASIO_CORO_YIELD return ctx.readable( fd, timeout );
+			if( ctx.timed_out( ) ) return HANDLER_ERROR;
+
+			{
+				// Queued only once there is something, an empty chunk would
+				// be left behind otherwise.
+				char buf[ 4096 ];
+				n = read( fd, buf, sizeof( buf ) );
+				if( n < 0 && ( errno == EAGAIN || errno == EINTR ) ) continue;
+				if( n < 0 ) return HANDLER_ERROR;
+				if( n == 0 ) break;
+
+				buffer_copy_string_len( chunkqueue_get_append_buffer( con.write_queue ), buf, n );
+			}
+		}
+
+		con.http_status = 200;
+		con.file_finished = 1;
+	}
+
+	return HANDLER_FINISHED;
+}
+
+#endif // _MOD_ASYNC_ECHO_HPP_
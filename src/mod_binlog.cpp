@@ -0,0 +1,8 @@
+/**
+ * Binary access log written in batches off the event loop, see
+ * mod_binlog.hpp.
+ */
+
+#include "mod_binlog.hpp"
+
+MAKE_PLUGIN( mod_binlog, "binlog", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,467 @@
+/**
+ * An access log that costs the event loop a memcpy per request.
+ *
+ * Each finished request is encoded as a compact binary record (see
+ * binlog_format.hpp) in handle_response_done and appended to a ring
+ * buffer.  A thread of our own empties the ring into the log file, all
+ * that is waiting in one writev() every flush-interval, or sooner once
+ * the ring is half full.  The event loop never waits on the writer: when
+ * the ring is full the record is dropped and counted (binlog.dropped in
+ * mod_status), as is a batch, or the rest of one, the file wouldn't take.
+ *
+ * The ring has a single producer and a single consumer, so the two only
+ * share a head and a tail index.  Every worker process has its own ring
+ * and writer, started with its first request, and they all append whole
+ * batches to one file opened with O_APPEND before the workers are forked.
+ * On SIGHUP the writer opens the file again by name, for log rotation.
+ *
+ * binlog2text turns a log into text, Combined Log Format followed by the
+ * host, the duration in microseconds and the bytes read.
+ *
+ * Config:
+ *  binlog.file = "/var/log/lighttpd/access.binlog"   # global, unset disables
+ *  binlog.fields = ( "method", "remote-addr", "host", "uri", "referer", "user-agent" )   # global, default all
+ *  binlog.buffer-size = 4194304    # global, bytes of ring per worker
+ *  binlog.flush-interval = 500     # global, milliseconds
+ */
+
+#ifndef _MOD_BINLOG_HPP_
+#define _MOD_BINLOG_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/binlog_format.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/**
+ * Bytes from the event loop to the writer thread.  The event loop appends
+ * whole records, the writer takes everything there is.
+ */
+class log_ring : boost::noncopyable
+{
+public:
+	// Rounded up to a power of two.
+	log_ring( std::size_t bytes )
+	 : size_( 4096 ), head( 0 ), tail( 0 ), dropped_( 0 )
+	{
+		while( size_ < bytes ) size_ <<= 1;
+		data.reset( new char[ size_ ] );
+	}
+
+	// Event loop: false, and counted, when there isn't room.
+	bool push( const char* p, std::size_t n )
+	{
+		uint64_t h = head.load( boost::memory_order_relaxed );
+		if( size_ - ( h - tail.load( boost::memory_order_acquire ) ) < n )
+		{
+			++dropped_;
+			return false;
+		}
+
+		std::size_t at = h & ( size_ - 1 );
+		std::size_t first = std::min( n, size_ - at );
+		std::memcpy( &data[ at ], p, first );
+		std::memcpy( &data[ 0 ], p + first, n - first );
+
+		head.store( h + n, boost::memory_order_release );
+		return true;
+	}
+
+	// Writer: what is waiting, in one or two pieces (count), which
+	// consume( ) then hands back.
+	std::size_t peek( struct iovec iov[2], int& count ) const
+	{
+		uint64_t t = tail.load( boost::memory_order_relaxed );
+		std::size_t n = head.load( boost::memory_order_acquire ) - t;
+
+		std::size_t at = t & ( size_ - 1 );
+		std::size_t first = std::min( n, size_ - at );
+		iov[0].iov_base = &data[ at ];
+		iov[0].iov_len = first;
+		iov[1].iov_base = &data[ 0 ];
+		iov[1].iov_len = n - first;
+		count = n > first ? 2 : 1;
+		return n;
+	}
+
+	void consume( std::size_t n )
+	{
+		tail.store( tail.load( boost::memory_order_relaxed ) + n, boost::memory_order_release );
+	}
+
+	std::size_t used( ) const
+	{
+		return head.load( boost::memory_order_relaxed ) - tail.load( boost::memory_order_relaxed );
+	}
+
+	std::size_t size( ) const { return size_; }
+
+	// Event loop only.
+	unsigned long dropped( ) const { return dropped_; }
+
+private:
+	std::size_t size_;
+	boost::scoped_array< char > data;
+
+	// Only ever increase, the ring index is these mod size_.  On their own
+	// cache lines, the event loop writes one and the writer the other.
+	char pad0[ 64 ];
+	boost::atomic< uint64_t > head;
+	char pad1[ 64 ];
+	boost::atomic< uint64_t > tail;
+	char pad2[ 64 ];
+
+	unsigned long dropped_;
+};
+
+/**
+ * The thread that empties a log_ring into the log file.
+ */
+class log_writer : boost::noncopyable
+{
+public:
+	// Takes fd, from open_log( ).
+	log_writer( log_ring& ring, const std::string& path, int fd, unsigned interval_ms )
+	 :	ring( ring ), path( path ), fd( fd ), interval_ms( interval_ms ? interval_ms : 500 ),
+		stopping( false ), reopening( false ), written_( 0 ), batches_( 0 ), failures_( 0 )
+	{
+		thread.reset( new boost::thread( boost::bind( &log_writer::run, this ) ) );
+	}
+
+	// Everything pushed so far is written first.
+	~log_writer( )
+	{
+		{
+			boost::mutex::scoped_lock l( lock );
+			stopping = true;
+		}
+		wake.notify_one( );
+		thread->join( );
+
+		if( fd != -1 ) close( fd );
+	}
+
+	// Write now rather than at the next interval.
+	void nudge( )
+	{
+		wake.notify_one( );
+	}
+
+	// Open the file again before the next batch.
+	void reopen( )
+	{
+		boost::mutex::scoped_lock l( lock );
+		reopening = true;
+	}
+
+	uint64_t written( ) const { return written_.load( boost::memory_order_relaxed ); }
+	uint64_t batches( ) const { return batches_.load( boost::memory_order_relaxed ); }
+	uint64_t failures( ) const { return failures_.load( boost::memory_order_relaxed ); }
+
+	// For appending, with the file header written if the file is new.  -1
+	// if it can't be.
+	static int open_log( const std::string& name )
+	{
+		int f = open( name.c_str( ), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+		if( f == -1 ) return -1;
+
+		struct stat st;
+		if( 0 != fstat( f, &st ) )
+		{
+			close( f );
+			return -1;
+		}
+
+		if( st.st_size == 0 )
+		{
+			binlog_file_header h = binlog_file_header::make( );
+			if( static_cast< ssize_t >( sizeof( h ) ) != write( f, &h, sizeof( h ) ) )
+			{
+				close( f );
+				return -1;
+			}
+		}
+
+		return f;
+	}
+
+private:
+	void run( )
+	{
+		for( bool last = false; !last; )
+		{
+			std::string name;
+			{
+				boost::mutex::scoped_lock l( lock );
+				if( !stopping ) wake.timed_wait( l, boost::posix_time::milliseconds( interval_ms ) );
+				last = stopping;
+
+				if( reopening ) name = path;
+				reopening = false;
+			}
+
+			// Keep the old file should the new one not open.
+			int f;
+			if( !name.empty( ) && -1 != ( f = open_log( name ) ) )
+			{
+				if( fd != -1 ) close( fd );
+				fd = f;
+			}
+
+			flush( );
+		}
+	}
+
+	void flush( )
+	{
+		struct iovec iov[2];
+		int count;
+
+		for( std::size_t n; ( n = ring.peek( iov, count ) ); )
+		{
+			ssize_t w = fd == -1 ? -1 : writev( fd, iov, count );
+			if( w < 0 && errno == EINTR ) continue;
+
+			if( w <= 0 )
+			{
+				// Dropped rather than hold up the event loop.
+				++failures_;
+				ring.consume( n );
+				return;
+			}
+
+			// Short only when the disk is full.  The rest of the batch goes
+			// too: written on its own, other workers' batches could land in
+			// between and leave a record in two pieces.
+			ring.consume( n );
+			written_ += w;
+			++batches_;
+			if( static_cast< std::size_t >( w ) < n )
+			{
+				++failures_;
+				return;
+			}
+		}
+	}
+
+	log_ring& ring;
+
+	// Guarded by lock.
+	std::string path;
+
+	// The writer thread's once it runs.
+	int fd;
+	unsigned interval_ms;
+
+	boost::mutex lock;
+	boost::condition_variable wake;
+	bool stopping;
+	bool reopening;
+
+	boost::atomic< uint64_t > written_;
+	boost::atomic< uint64_t > batches_;
+	boost::atomic< uint64_t > failures_;
+
+	boost::scoped_ptr< boost::thread > thread;
+};
+
+class mod_binlog : public Plugin< mod_binlog >
+{
+public:
+	// Longest a record gets.
+	static const std::size_t max_record = 8192;
+
+	mod_binlog( server& srv )
+	 :	Plugin< mod_binlog >( srv ),
+		file			( "binlog.file" ),
+		fields			( "binlog.fields" ),
+		buffer_size		( "binlog.buffer-size" ),
+		flush_interval	( "binlog.flush-interval" ),
+		fd( -1 )
+	{}
+
+	virtual ~mod_binlog( )
+	{
+		writer.reset( );
+		if( fd != -1 ) close( fd );
+	}
+
+	typedef boost::mpl::list< 	ResponseDoneHandler,
+								TriggerHandler,
+								SighupHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_binlog >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		return configure( ) ? HANDLER_GO_ON : HANDLER_ERROR;
+	}
+
+	bool configure( )
+	{
+		const std::vector< std::string >& names = *fields.defaults( ).front( );
+		for( std::size_t i = 0; i < names.size( ); ++i )
+		{
+			int id = binlog_field_id( names[i] );
+			if( id < 0 ) return false;
+			selected.push_back( id );
+		}
+		if( names.empty( ) )
+		{
+			for( int id = 0; id < BINLOG_FIELD_COUNT; ++id ) selected.push_back( id );
+		}
+
+		path = *file.defaults( ).front( );
+		if( path.empty( ) ) return true;
+
+		fd = log_writer::open_log( path );
+		if( fd == -1 ) return false;
+
+		int size = *buffer_size.defaults( ).front( );
+		ring.reset( new log_ring( size > 0 ? size : 4 * 1024 * 1024 ) );
+		return true;
+	}
+
+	handler_t handle_response_done( connection& con )
+	{
+		if( !ring ) return HANDLER_GO_ON;
+
+		char record[ max_record ];
+		std::size_t n = encode( con, record, sizeof( record ) );
+
+		// In the worker, not the process that forked it.
+		if( !writer )
+		{
+			int interval = *flush_interval.defaults( ).front( );
+			writer.reset( new log_writer( *ring, path, fd, interval > 0 ? interval : 500 ) );
+			fd = -1;
+		}
+
+		std::size_t before = ring->used( );
+		if( ring->push( record, n ) && before < ring->size( ) / 2 && before + n >= ring->size( ) / 2 )
+			writer->nudge( );
+
+		return HANDLER_GO_ON;
+	}
+
+	std::size_t encode( connection& con, char* buf, std::size_t len )
+	{
+		binlog_encoder out( buf, len );
+
+		struct timeval now;
+		gettimeofday( &now, NULL );
+		int64_t start = int64_t( con.start_tv.tv_sec ) * 1000000 + con.start_tv.tv_usec;
+		int64_t end = int64_t( now.tv_sec ) * 1000000 + now.tv_usec;
+
+		out.head.status = static_cast< uint16_t >( con.http_status );
+		out.head.start_us = start;
+		out.head.duration_us = static_cast< uint32_t >( std::max( end - start, int64_t( 0 ) ) );
+		out.head.bytes_in = con.bytes_read;
+		out.head.bytes_out = con.bytes_written;
+		out.head.http_minor = con.request.http_version == HTTP_VERSION_1_1 ? 1 : 0;
+
+		for( std::vector< int >::const_iterator i = selected.begin( ); i != selected.end( ); ++i )
+		{
+			switch( *i )
+			{
+			case BINLOG_METHOD:
+				{
+					const char* m = get_http_method_name( con.request.http_method );
+					out.field( *i, m, std::strlen( m ) );
+				}
+				break;
+			case BINLOG_REMOTE_ADDR:	field( out, *i, con.dst_addr_buf ); break;
+			case BINLOG_HOST:			field( out, *i, con.request.http_host ); break;
+			case BINLOG_URI:			field( out, *i, buffer_is_empty( con.request.orig_uri ) ? con.request.uri : con.request.orig_uri ); break;
+			case BINLOG_REFERER:		header( out, *i, con, "Referer" ); break;
+			case BINLOG_USER_AGENT:		header( out, *i, con, "User-Agent" ); break;
+			}
+		}
+
+		return out.finish( );
+	}
+
+	handler_t handle_trigger( )
+	{
+		if( !ring ) return HANDLER_GO_ON;
+
+		status_counter_set( CONST_STR_LEN( "binlog.dropped" ), static_cast< int >( ring->dropped( ) ) );
+		if( writer )
+		{
+			status_counter_set( CONST_STR_LEN( "binlog.batches" ), static_cast< int >( writer->batches( ) ) );
+			status_counter_set( CONST_STR_LEN( "binlog.failures" ), static_cast< int >( writer->failures( ) ) );
+		}
+		return HANDLER_GO_ON;
+	}
+
+	// Rotated, open it again.  Only the file, the config isn't read again
+	// so binlog.* keep their startup values.
+	handler_t handle_sighup( )
+	{
+		if( writer )
+		{
+			writer->reopen( );
+		}
+		else if( fd != -1 )
+		{
+			int f = log_writer::open_log( path );
+			if( f != -1 )
+			{
+				close( fd );
+				fd = f;
+			}
+		}
+		return HANDLER_GO_ON;
+	}
+
+	config_option< std::string >				file;
+	config_option< std::vector< std::string > >	fields;
+	config_option< int >						buffer_size;
+	config_option< int >						flush_interval;
+
+private:
+	static void field( binlog_encoder& out, int id, buffer* b )
+	{
+		if( !buffer_is_empty( b ) ) out.field( id, b->ptr, b->used - 1 );
+	}
+
+	static void header( binlog_encoder& out, int id, connection& con, const char* name )
+	{
+		data_string* ds = reinterpret_cast< data_string* >(
+			array_get_element( con.request.headers, name, std::strlen( name ) ) );
+		if( ds ) field( out, id, ds->value );
+	}
+
+	std::vector< int > selected;
+	std::string path;
+
+	// Until the writer takes it.
+	int fd;
+
+	boost::scoped_ptr< log_ring > ring;
+	boost::scoped_ptr< log_writer > writer;
+};
+
+#endif // _MOD_BINLOG_HPP_
@@ -0,0 +1,8 @@
+/**
+ * Serves directory listings rendered once and kept current with inotify,
+ * see mod_dircache.hpp.
+ */
+
+#include "mod_dircache.hpp"
+
+MAKE_PLUGIN( mod_dircache, "dircache", LIGHTTPD_VERSION_ID );
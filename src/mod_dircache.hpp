@@ -0,0 +1,745 @@
+/**
+ * Directory listings rendered once and kept, in place of mod_dirlisting
+ * reading the directory and stat()ing every entry on every request.
+ *
+ * Each listed directory is read once, with an inotify watch on it, and
+ * its entries kept sorted (directories first, then by name) along with
+ * each entry's row as rendered for every format asked for so far.  The
+ * body of a listing in a format, all its rows together, is a
+ * shared_fragment: written once, to a file in dircache.tempdir (shared
+ * memory by default) once it is big enough, and sent to everyone with
+ * sendfile().  Only the head, with the request's URI in it, is rendered
+ * per request.
+ *
+ * inotify events name the entry that changed.  That entry alone is
+ * stat()ed again and its row re-rendered, when the listing is next asked
+ * for, and the body put back together from the rows already rendered.
+ * The directory is only read again when the kernel's event queue
+ * overflowed, or so much changed that reading it is cheaper.  A listing
+ * whose directory goes away is dropped.
+ *
+ * Formats: HTML, or JSON when the query string is "format=json".
+ * Directories holding one of the index-file.names mod_indexfile would
+ * answer with are left for it.  Entries starting with a '.' are hidden
+ * unless dircache.show-dotfiles is enabled; a directory listed both ways
+ * is kept both ways, under the one watch.  Type columns come from the
+ * mimetypes of the request that first rendered a row.
+ *
+ * Config:
+ *  dircache.enable = "enable"                         # per context
+ *  dircache.show-dotfiles = "disable"                 # per context
+ *  dircache.max-directories = 256                     # global
+ *  dircache.tempdir = "/dev/shm"                      # global
+ */
+
+#ifndef _MOD_DIRCACHE_HPP_
+#define _MOD_DIRCACHE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/response_builder.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+
+#include <stdint.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+enum dirlist_format { DIRLIST_HTML, DIRLIST_JSON, DIRLIST_FORMATS };
+
+struct dir_entry
+{
+	dir_entry( const std::string& name = std::string( ), bool is_dir = false )
+	 : name( name ), is_dir( is_dir ), size( 0 ), mtime( 0 )
+	{}
+
+	// Directories first, then by name.
+	bool operator<( const dir_entry& o ) const
+	{
+		if( is_dir != o.is_dir ) return is_dir;
+		return name < o.name;
+	}
+
+	std::string name;
+	bool is_dir;
+	off_t size;
+	time_t mtime;
+
+	// Empty until rendered.
+	std::string rows[ DIRLIST_FORMATS ];
+};
+
+// Rows, and what goes around them.
+struct dirlist_render
+{
+	static void head( dirlist_format f, const char* uri, std::size_t len, std::string& out )
+	{
+		if( f == DIRLIST_JSON )
+		{
+			out += "[\n";
+			return;
+		}
+
+		std::string title;
+		escape_html( uri, len, title );
+		out += "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of ";
+		out += title;
+		out += "</title>\n</head>\n<body>\n<h2>Index of ";
+		out += title;
+		out += "</h2>\n<table>\n<thead><tr><th>Name</th><th>Last Modified</th><th>Size</th><th>Type</th></tr></thead>\n<tbody>\n"
+			"<tr><td><a href=\"../\">Parent Directory</a>/</td><td>&nbsp;</td><td>-</td><td>Directory</td></tr>\n";
+	}
+
+	static const char* foot( dirlist_format f )
+	{
+		return f == DIRLIST_JSON ? "\n]\n" : "</tbody>\n</table>\n</body>\n</html>\n";
+	}
+
+	// Between rows.
+	static const char* separator( dirlist_format f )
+	{
+		return f == DIRLIST_JSON ? ",\n" : "";
+	}
+
+	static void row( dirlist_format f, const dir_entry& e, const array* mimetypes, std::string& out )
+	{
+		char buf[ 96 ];
+		struct tm tm;
+		gmtime_r( &e.mtime, &tm );
+
+		if( f == DIRLIST_JSON )
+		{
+			out += "{\"name\":\"";
+			escape_json( e.name, out );
+			snprintf( buf, sizeof( buf ), "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%ld}",
+				e.is_dir ? "directory" : "file", static_cast< long long >( e.size ), static_cast< long >( e.mtime ) );
+			out += buf;
+			return;
+		}
+
+		out += "<tr><td><a href=\"";
+		escape_url( e.name, out );
+		if( e.is_dir ) out += '/';
+		out += "\">";
+		escape_html( e.name.data( ), e.name.size( ), out );
+		out += e.is_dir ? "</a>/</td><td>" : "</a></td><td>";
+
+		strftime( buf, sizeof( buf ), "%Y-%b-%d %H:%M:%S", &tm );
+		out += buf;
+		out += "</td><td>";
+
+		if( e.is_dir ) out += '-';
+		else human_size( e.size, out );
+		out += "</td><td>";
+
+		if( e.is_dir ) out += "Directory";
+		else escape_html( type_of( e.name, mimetypes ), out );
+		out += "</td></tr>\n";
+	}
+
+	static void escape_html( const char* p, std::size_t len, std::string& out )
+	{
+		for( const char* end = p + len; p != end; ++p )
+		{
+			switch( *p )
+			{
+				case '&': out += "&amp;"; break;
+				case '<': out += "&lt;"; break;
+				case '>': out += "&gt;"; break;
+				case '"': out += "&quot;"; break;
+				case '\'': out += "&#39;"; break;
+				default: out += *p;
+			}
+		}
+	}
+
+	static void escape_html( const std::string& s, std::string& out )
+	{
+		escape_html( s.data( ), s.size( ), out );
+	}
+
+	// Everything but the unreserved characters, for a relative link.
+	static void escape_url( const std::string& s, std::string& out )
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		for( std::string::const_iterator i = s.begin( ); i != s.end( ); ++i )
+		{
+			unsigned char c = *i;
+			if( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' )
+				|| c == '-' || c == '_' || c == '.' || c == '~' )
+			{
+				out += c;
+			}
+			else
+			{
+				out += '%';
+				out += hex[ c >> 4 ];
+				out += hex[ c & 15 ];
+			}
+		}
+	}
+
+	static void escape_json( const std::string& s, std::string& out )
+	{
+		for( std::string::const_iterator i = s.begin( ); i != s.end( ); ++i )
+		{
+			unsigned char c = *i;
+			if( c == '"' || c == '\\' )
+			{
+				out += '\\';
+				out += c;
+			}
+			else if( c < 0x20 )
+			{
+				char buf[ 8 ];
+				snprintf( buf, sizeof( buf ), "\\u%04x", c );
+				out += buf;
+			}
+			else out += c;
+		}
+	}
+
+	// As mod_dirlisting: bytes, then K, M, G and T to one place.
+	static void human_size( off_t size, std::string& out )
+	{
+		char buf[ 32 ];
+		if( size < 1024 )
+		{
+			snprintf( buf, sizeof( buf ), "%lld", static_cast< long long >( size ) );
+		}
+		else
+		{
+			const char* units = "KMGT";
+			double n = size / 1024.0;
+			while( n >= 1024 && units[1] )
+			{
+				n /= 1024;
+				++units;
+			}
+			snprintf( buf, sizeof( buf ), "%.1f%c", n, *units );
+		}
+		out += buf;
+	}
+
+	// The first mimetype whose suffix matches, as the stat cache does.
+	static std::string type_of( const std::string& name, const array* mimetypes )
+	{
+		for( std::size_t k = 0; mimetypes && k < mimetypes->used; ++k )
+		{
+			const data_string* ds = reinterpret_cast< const data_string* >( mimetypes->data[k] );
+			if( !ds->key->used || ds->key->used - 1 > name.size( ) ) continue;
+
+			if( 0 == strncasecmp( name.data( ) + name.size( ) - ( ds->key->used - 1 ), ds->key->ptr, ds->key->used - 1 ) )
+				return std::string( ds->value->ptr, ds->value->used ? ds->value->used - 1 : 0 );
+		}
+		return "application/octet-stream";
+	}
+};
+
+/**
+ * One directory's entries, rows and bodies.
+ */
+class dir_listing : boost::noncopyable
+{
+public:
+	dir_listing( const std::string& path, bool show_dotfiles = false )
+	 :	path( path ), show_dotfiles( show_dotfiles ), wd( -1 ), last_used( 0 ), full_loads( 0 ), updates( 0 ),
+		rows_rendered( 0 ), loaded( false )
+	{}
+
+	// inotify said name changed.
+	void touched( const char* name )
+	{
+		if( loaded ) dirty.insert( name );
+	}
+
+	// Read the whole directory again next time.
+	void invalidate( )
+	{
+		loaded = false;
+		dirty.clear( );
+	}
+
+	// Bring the listing up to date: the touched entries, or everything.
+	// False if the directory can't be read.
+	bool refresh( )
+	{
+		if( loaded && dirty.size( ) > entries.size( ) / 4 + 64 ) invalidate( );
+		if( !loaded ) return load( );
+		if( dirty.empty( ) ) return true;
+
+		int dir_fd = open( path.c_str( ), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		if( dir_fd == -1 ) return false;
+
+		for( std::set< std::string >::const_iterator i = dirty.begin( ); i != dirty.end( ); ++i )
+			update( dir_fd, *i );
+		close( dir_fd );
+
+		dirty.clear( );
+		++updates;
+		drop_bodies( );
+		return true;
+	}
+
+	// All the rows in format f, rendering the ones that aren't yet.
+	shared_fragment_ptr body( dirlist_format f, const array* mimetypes, const std::string& tempdir )
+	{
+		if( bodies[f] ) return bodies[f];
+
+		std::size_t size = 0;
+		for( std::vector< dir_entry >::iterator i = entries.begin( ); i != entries.end( ); ++i )
+		{
+			if( i->rows[f].empty( ) )
+			{
+				dirlist_render::row( f, *i, mimetypes, i->rows[f] );
+				++rows_rendered;
+			}
+			size += i->rows[f].size( ) + 2;
+		}
+
+		const char* separator = dirlist_render::separator( f );
+		std::string out;
+		out.reserve( size );
+		for( std::vector< dir_entry >::const_iterator i = entries.begin( ); i != entries.end( ); ++i )
+		{
+			if( i != entries.begin( ) ) out += separator;
+			out += i->rows[f];
+		}
+
+		bodies[f].reset( new shared_fragment( out, tempdir ) );
+		return bodies[f];
+	}
+
+	bool contains( const std::string& name ) const
+	{
+		return find( name ) != entries.end( );
+	}
+
+	std::size_t size( ) const { return entries.size( ); }
+	const std::vector< dir_entry >& list( ) const { return entries; }
+
+	const std::string path;
+	const bool show_dotfiles;
+	int wd;
+	uint64_t last_used;
+
+	uint64_t full_loads;
+	uint64_t updates;
+	uint64_t rows_rendered;
+
+private:
+	bool hidden( const char* name ) const
+	{
+		if( name[0] != '.' ) return false;
+		if( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) ) return true;
+		return !show_dotfiles;
+	}
+
+	bool load( )
+	{
+		DIR* d = opendir( path.c_str( ) );
+		if( !d ) return false;
+
+		std::vector< dir_entry > fresh;
+		while( struct dirent* e = readdir( d ) )
+		{
+			if( hidden( e->d_name ) ) continue;
+
+			dir_entry entry( e->d_name );
+			if( stat_entry( dirfd( d ), entry ) ) fresh.push_back( entry );
+		}
+		closedir( d );
+
+		std::sort( fresh.begin( ), fresh.end( ) );
+		entries.swap( fresh );
+		dirty.clear( );
+		loaded = true;
+		++full_loads;
+		drop_bodies( );
+		return true;
+	}
+
+	// Symlinks are listed as what they point at, as mod_dirlisting does.
+	static bool stat_entry( int dir_fd, dir_entry& entry )
+	{
+		struct stat st;
+		if( 0 != fstatat( dir_fd, entry.name.c_str( ), &st, 0 ) ) return false;
+
+		// A directory's own size says nothing about what it holds.
+		entry.is_dir = S_ISDIR( st.st_mode );
+		entry.size = entry.is_dir ? 0 : st.st_size;
+		entry.mtime = st.st_mtime;
+		return true;
+	}
+
+	// Gone, changed or new: out with the old, in with whatever is there now.
+	void update( int dir_fd, const std::string& name )
+	{
+		std::vector< dir_entry >::iterator old = find( name );
+		if( old != entries.end( ) ) entries.erase( old );
+		if( hidden( name.c_str( ) ) ) return;
+
+		dir_entry entry( name );
+		if( !stat_entry( dir_fd, entry ) ) return;
+
+		entries.insert( std::lower_bound( entries.begin( ), entries.end( ), entry ), entry );
+	}
+
+	std::vector< dir_entry >::iterator find( const std::string& name )
+	{
+		for( int is_dir = 0; is_dir < 2; ++is_dir )
+		{
+			dir_entry key( name, is_dir != 0 );
+			std::vector< dir_entry >::iterator i = std::lower_bound( entries.begin( ), entries.end( ), key );
+			if( i != entries.end( ) && i->is_dir == key.is_dir && i->name == name ) return i;
+		}
+		return entries.end( );
+	}
+
+	std::vector< dir_entry >::const_iterator find( const std::string& name ) const
+	{
+		return const_cast< dir_listing* >( this )->find( name );
+	}
+
+	void drop_bodies( )
+	{
+		for( int f = 0; f < DIRLIST_FORMATS; ++f )
+			bodies[f].reset( );
+	}
+
+	bool loaded;
+	std::vector< dir_entry > entries;
+	std::set< std::string > dirty;
+	shared_fragment_ptr bodies[ DIRLIST_FORMATS ];
+};
+
+/**
+ * The listings, kept current through one inotify descriptor.  A listing
+ * is of a directory with or without its dotfiles, both of them sharing
+ * the directory's watch.  The least recently used is dropped past
+ * max_directories.
+ */
+class dir_cache : boost::noncopyable
+{
+public:
+	typedef std::pair< std::string, bool > listing_key;
+	typedef std::map< listing_key, boost::shared_ptr< dir_listing > > listing_map;
+
+	static const uint32_t watch_mask =
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE
+		| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	dir_cache( std::size_t max_directories = 256 )
+	 :	max_directories( max_directories ), inotify_fd( inotify_init( ) ), clock( 0 ),
+		hits( 0 ), misses( 0 ), overflows( 0 ), dropped_loads( 0 ), dropped_updates( 0 )
+	{
+		if( inotify_fd != -1 )
+		{
+			fcntl( inotify_fd, F_SETFL, fcntl( inotify_fd, F_GETFL ) | O_NONBLOCK );
+			fcntl( inotify_fd, F_SETFD, FD_CLOEXEC );
+		}
+	}
+
+	~dir_cache( )
+	{
+		if( inotify_fd != -1 ) close( inotify_fd );
+	}
+
+	// The listing of the directory path, up to date, or 0 if it can't be
+	// read.  Without inotify nothing could be kept current, so nothing is
+	// cached and it is always 0.
+	dir_listing* get( const std::string& path, bool show_dotfiles )
+	{
+		drain( );
+
+		listing_map::iterator i = listings.find( listing_key( path, show_dotfiles ) );
+		if( i != listings.end( ) )
+		{
+			dir_listing& l = *i->second;
+			if( !l.refresh( ) )
+			{
+				drop( i );
+				return 0;
+			}
+
+			++hits;
+			l.last_used = ++clock;
+			return &l;
+		}
+
+		if( inotify_fd == -1 ) return 0;
+
+		// Watched before it is read, so nothing slips in between.  The
+		// other listing of the directory may have the watch already.
+		int wd = inotify_add_watch( inotify_fd, path.c_str( ), watch_mask );
+		if( wd == -1 ) return 0;
+
+		// Two paths to the one directory share a watch, keep the first.
+		std::map< int, std::string >::const_iterator w = watches.find( wd );
+		if( w != watches.end( ) && w->second != path ) return 0;
+
+		boost::shared_ptr< dir_listing > l( new dir_listing( path, show_dotfiles ) );
+		if( !l->refresh( ) )
+		{
+			if( w == watches.end( ) ) inotify_rm_watch( inotify_fd, wd );
+			return 0;
+		}
+
+		++misses;
+		l->wd = wd;
+		l->last_used = ++clock;
+		watches[ wd ] = path;
+		listings[ listing_key( path, show_dotfiles ) ] = l;
+
+		if( listings.size( ) > max_directories ) evict( );
+		return l.get( );
+	}
+
+	// Apply everything inotify has queued.  Cheap when there is nothing,
+	// a single read that fails with EAGAIN.
+	void drain( )
+	{
+		if( inotify_fd == -1 ) return;
+
+		char buf[ 16384 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+		ssize_t n;
+		while( ( n = read( inotify_fd, buf, sizeof( buf ) ) ) > 0 )
+		{
+			for( char* p = buf; p < buf + n; )
+			{
+				const struct inotify_event* ev = reinterpret_cast< const struct inotify_event* >( p );
+				handle_event( *ev );
+				p += sizeof( struct inotify_event ) + ev->len;
+			}
+		}
+	}
+
+	std::size_t size( ) const { return listings.size( ); }
+
+	// Over every listing, dropped ones included.
+	uint64_t full_loads( ) const { return sum( &dir_listing::full_loads ) + dropped_loads; }
+	uint64_t updates( ) const { return sum( &dir_listing::updates ) + dropped_updates; }
+
+	std::size_t max_directories;
+	int inotify_fd;
+
+	uint64_t clock;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t overflows;
+
+private:
+	uint64_t sum( uint64_t dir_listing::* counter ) const
+	{
+		uint64_t n = 0;
+		for( listing_map::const_iterator i = listings.begin( ); i != listings.end( ); ++i )
+			n += *i->second.*counter;
+		return n;
+	}
+
+	// The watch goes with the directory's last listing.
+	void drop( listing_map::iterator i )
+	{
+		dir_listing& l = *i->second;
+		dropped_loads += l.full_loads;
+		dropped_updates += l.updates;
+
+		if( l.wd != -1 && !listings.count( listing_key( l.path, !l.show_dotfiles ) ) )
+		{
+			inotify_rm_watch( inotify_fd, l.wd );
+			watches.erase( l.wd );
+		}
+		listings.erase( i );
+	}
+
+	void evict( )
+	{
+		listing_map::iterator oldest = listings.begin( );
+		for( listing_map::iterator i = listings.begin( ); i != listings.end( ); ++i )
+		{
+			if( i->second->last_used < oldest->second->last_used ) oldest = i;
+		}
+		drop( oldest );
+	}
+
+	void handle_event( const struct inotify_event& ev )
+	{
+		// The kernel queue overflowed, we have no idea what changed.
+		if( ev.mask & IN_Q_OVERFLOW )
+		{
+			++overflows;
+			for( listing_map::iterator i = listings.begin( ); i != listings.end( ); ++i )
+				i->second->invalidate( );
+			return;
+		}
+
+		std::map< int, std::string >::iterator w = watches.find( ev.wd );
+		if( w == watches.end( ) ) return;
+
+		// Copied, dropping the last listing erases w.
+		const std::string path = w->second;
+		for( int show = 0; show < 2; ++show )
+		{
+			listing_map::iterator l = listings.find( listing_key( path, show != 0 ) );
+			if( l == listings.end( ) ) continue;
+
+			// The directory itself went, or its watch did.
+			if( ev.mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT ) ) drop( l );
+			else if( ev.len && ev.name[0] ) l->second->touched( ev.name );
+			else l->second->invalidate( );
+		}
+	}
+
+	listing_map listings;
+	std::map< int, std::string > watches;
+	uint64_t dropped_loads;
+	uint64_t dropped_updates;
+};
+
+class mod_dircache : public Plugin< mod_dircache >
+{
+public:
+	mod_dircache( server& srv )
+	 :	Plugin< mod_dircache >( srv ),
+		enable			( "dircache.enable" ),
+		show_dotfiles	( "dircache.show-dotfiles" ),
+		index_files		( "index-file.names" ),
+		max_directories	( "dircache.max-directories" ),
+		tempdir			( "dircache.tempdir" ),
+		served( 0 )
+	{}
+
+	virtual ~mod_dircache( ){ }
+
+	typedef boost::mpl::list< 	PhysicalHandler,
+								TriggerHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_dircache >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		configure( );
+		return HANDLER_GO_ON;
+	}
+
+	void configure( )
+	{
+		int n = *max_directories.defaults( ).front( );
+		cache.max_directories = n > 0 ? n : 256;
+
+		shm_dir = *tempdir.defaults( ).front( );
+		if( shm_dir.empty( ) ) shm_dir = "/dev/shm";
+	}
+
+	handler_t handle_physical( connection& con )
+	{
+		if( !enable[ con ] || buffer_is_empty( con.physical.path ) || buffer_is_empty( con.uri.path ) ) return HANDLER_GO_ON;
+		if( con.request.http_method != HTTP_METHOD_GET && con.request.http_method != HTTP_METHOD_HEAD )
+			return HANDLER_GO_ON;
+
+		// Without the slash it is for the core to redirect.
+		const buffer* path = con.physical.path;
+		if( path->ptr[ path->used - 2 ] != '/' || con.uri.path->ptr[ con.uri.path->used - 2 ] != '/' ) return HANDLER_GO_ON;
+
+		std::string dir( path->ptr, path->used - 1 );
+		while( dir.size( ) > 1 && dir[ dir.size( ) - 1 ] == '/' ) dir.erase( dir.size( ) - 1 );
+
+		dir_listing* l = cache.get( dir, show_dotfiles[ con ] );
+		if( !l || has_index( con, *l ) ) return HANDLER_GO_ON;
+
+		dirlist_format f = DIRLIST_HTML;
+		if( !buffer_is_empty( con.uri.query ) && 0 == std::strcmp( con.uri.query->ptr, "format=json" ) ) f = DIRLIST_JSON;
+
+		shared_fragment_ptr body = l->body( f, con.conf.mimetypes, shm_dir );
+
+		std::string head;
+		dirlist_render::head( f, CONST_BUF_LEN( con.uri.path ), head );
+
+		response_builder out( con.write_queue );
+		out << head;
+		out.fragment( *body );
+		out << dirlist_render::foot( f );
+		if( out.failed( ) )
+		{
+			chunkqueue_reset( con.write_queue );
+			return HANDLER_GO_ON;
+		}
+
+		server* s = const_cast< server* >( &srv );
+		if( f == DIRLIST_JSON )
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Type" ), CONST_STR_LEN( "application/json" ) );
+		else
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Type" ), CONST_STR_LEN( "text/html; charset=utf-8" ) );
+
+		++served;
+		con.http_status = 200;
+		con.file_finished = 1;
+		return HANDLER_FINISHED;
+	}
+
+	handler_t handle_trigger( )
+	{
+		cache.drain( );
+		status_counter_set( CONST_STR_LEN( "dircache.served" ), static_cast< int >( served ) );
+		status_counter_set( CONST_STR_LEN( "dircache.directories" ), static_cast< int >( cache.size( ) ) );
+		status_counter_set( CONST_STR_LEN( "dircache.hits" ), static_cast< int >( cache.hits ) );
+		status_counter_set( CONST_STR_LEN( "dircache.misses" ), static_cast< int >( cache.misses ) );
+		status_counter_set( CONST_STR_LEN( "dircache.full-loads" ), static_cast< int >( cache.full_loads( ) ) );
+		status_counter_set( CONST_STR_LEN( "dircache.updates" ), static_cast< int >( cache.updates( ) ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< bool >						enable;
+	config_option< bool >						show_dotfiles;
+	config_option< std::vector< std::string > >	index_files;
+	config_option< int >						max_directories;
+	config_option< std::string >				tempdir;
+
+	dir_cache cache;
+	std::string shm_dir;
+	uint64_t served;
+
+private:
+	// Whether mod_indexfile would answer, from the entries without a
+	// stat().  A name starting with '/' is under the document root, for
+	// every directory, and is stat()ed there as mod_indexfile would.
+	bool has_index( connection& con, const dir_listing& l )
+	{
+		const std::vector< std::string >& names = index_files[ con ];
+		for( std::vector< std::string >::const_iterator i = names.begin( ); i != names.end( ); ++i )
+		{
+			if( i->empty( ) ) continue;
+			if( ( *i )[0] != '/' )
+			{
+				if( l.contains( *i ) ) return true;
+				continue;
+			}
+
+			if( buffer_is_empty( con.physical.doc_root ) ) continue;
+			std::string path( con.physical.doc_root->ptr, con.physical.doc_root->used - 1 );
+			path += *i;
+
+			struct stat st;
+			if( 0 == stat( path.c_str( ), &st ) && S_ISREG( st.st_mode ) ) return true;
+		}
+		return false;
+	}
+};
+
+#endif // _MOD_DIRCACHE_HPP_
@@ -0,0 +1,8 @@
+/**
+ * Answers requests for paths that definitely do not exist with a 404,
+ * see mod_pathfilter.hpp.
+ */
+
+#include "mod_pathfilter.hpp"
+
+MAKE_PLUGIN( mod_pathfilter, "pathfilter", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,509 @@
+/**
+ * Answers requests for paths that definitely do not exist under a
+ * document-root with a 404 straight away, without the stat() calls that
+ * handle_physical and the stat cache would otherwise make.
+ *
+ * Every document-root is walked once in set_defaults and each entry is
+ * put in a blocked bloom filter.  inotify keeps the filters current:
+ * creations are inserted as they happen, removals can't be taken out of
+ * a bloom filter so they are only counted, and once enough of a filter
+ * is stale it is rebuilt from scratch (one root per trigger, so a big
+ * server doesn't rebuild everything in a single tick).
+ *
+ * A filter can only be wrong in the "maybe present" direction, so the
+ * worst a stale or undersized filter does is send requests on to the
+ * normal stat path.  Three things would make a negative wrong and are
+ * handled explicitly:
+ *  - files created since the last event drain, so pending inotify events
+ *    are always drained before a 404 is given.
+ *  - PATH_INFO, i.e. /index.php/foo, where the path does not exist but a
+ *    prefix is a file.  Files are inserted a second time as "opaque", and
+ *    any opaque prefix lets the request through.
+ *  - subtrees we can't see into (symlinks, unreadable directories, no
+ *    inotify watch left), which are marked opaque the same way.
+ *
+ * A document-root that is removed or moved away stops answering until it
+ * can be walked again, which is tried each trigger.  So does one that is
+ * a symlink (i.e. deployed by swapping a "current" link) once the link
+ * points somewhere else.
+ *
+ * Config:
+ *  pathfilter.enable = "enable"         # per context, default off
+ *  pathfilter.bits-per-entry = 10       # global, ~1% false positives
+ *
+ * Memory, entry count and the estimated false positive rate (in parts per
+ * million) of all filters are published as status counters.
+ */
+
+#ifndef _MOD_PATHFILTER_HPP_
+#define _MOD_PATHFILTER_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/blocked_bloom_filter.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// The index of one document-root.
+class path_index : boost::noncopyable
+{
+public:
+	// Every entry is inserted with the present seed, files and anything we
+	// can't see beneath are inserted again with the opaque seed.
+	static const uint64_t present_seed = 0;
+	static const uint64_t opaque_seed = 0x6f70617175650000ULL;
+
+	path_index( const std::string& root, std::size_t bits_per_entry )
+	 : root( root ), bits_per_entry( bits_per_entry ), stale( 0 ), trusted( false ), watched( false )
+	{
+		// Compare without a trailing slash, physical.path always has one
+		// after the doc_root.
+		while( this->root.size( ) > 1 && this->root[ this->root.size( ) - 1 ] == '/' )
+			this->root.erase( this->root.size( ) - 1 );
+	}
+
+	// Does doc_root (as lighttpd has it in physical.doc_root) belong here?
+	bool is_root( const char* doc_root, std::size_t len ) const
+	{
+		while( len > 1 && doc_root[ len - 1 ] == '/' ) --len;
+		return len == root.size( ) && 0 == std::memcmp( doc_root, root.data( ), len );
+	}
+
+	// True only when path (a physical path under this root) can't exist.
+	bool definitely_absent( const char* path, std::size_t len ) const
+	{
+		if( !trusted ) return false;
+		if( len <= root.size( ) || 0 != std::memcmp( path, root.data( ), root.size( ) ) ) return false;
+		if( path[ root.size( ) ] != '/' ) return false;
+
+		// "/dir/" is the directory itself.
+		while( len > root.size( ) + 1 && path[ len - 1 ] == '/' ) --len;
+		if( len == root.size( ) + 1 ) return false;
+
+		if( filter.may_contain( path_hash( path, len, present_seed ) ) ) return false;
+
+		// Any opaque prefix (a file for PATH_INFO, or a subtree we can't
+		// index) means we don't know.
+		for( std::size_t i = root.size( ) + 1; i < len; ++i )
+		{
+			if( path[i] != '/' ) continue;
+			if( filter.may_contain( path_hash( path, i, opaque_seed ) ) ) return false;
+		}
+
+		return true;
+	}
+
+	// Walk the whole root into a fresh filter.  add_watch is called for
+	// every directory and returns false if it couldn't be watched.  Not
+	// trusted unless the root itself is watched.
+	template < typename AddWatch >
+	void build( AddWatch add_watch )
+	{
+		std::vector< uint64_t > hashes;
+		std::vector< std::string > pending;
+
+		target = resolve( root );
+		watched = walk_dir( root, hashes, pending, add_watch );
+
+		while( !pending.empty( ) )
+		{
+			std::string dir;
+			dir.swap( pending.back( ) );
+			pending.pop_back( );
+			walk_dir( dir, hashes, pending, add_watch );
+		}
+
+		// Leave room for what inotify adds before the next rebuild.
+		blocked_bloom_filter fresh( hashes.size( ) + hashes.size( ) / 4 + 1024, bits_per_entry );
+		for( std::vector< uint64_t >::const_iterator i = hashes.begin( ); i != hashes.end( ); ++i )
+			fresh.insert( *i );
+
+		filter.swap( fresh );
+		stale = 0;
+		trusted = watched;
+	}
+
+	// Something appeared in dir, directories are walked as they may have
+	// been moved in with contents.
+	template < typename AddWatch >
+	void created( const std::string& dir, const char* name, bool is_dir, AddWatch add_watch )
+	{
+		std::vector< uint64_t > hashes;
+		std::string path = dir + '/' + name;
+
+		hashes.push_back( path_hash( path.data( ), path.size( ), present_seed ) );
+		if( is_dir )
+		{
+			std::vector< std::string > pending( 1, path );
+			while( !pending.empty( ) )
+			{
+				std::string d;
+				d.swap( pending.back( ) );
+				pending.pop_back( );
+				walk_dir( d, hashes, pending, add_watch );
+			}
+		}
+		else
+		{
+			hashes.push_back( path_hash( path.data( ), path.size( ), opaque_seed ) );
+		}
+
+		for( std::vector< uint64_t >::const_iterator i = hashes.begin( ); i != hashes.end( ); ++i )
+			filter.insert( *i );
+	}
+
+	// Something went away, it stays in the filter until the next rebuild.
+	void removed( ) { ++stale; }
+
+	// Events were lost, stop answering until rebuilt.
+	void invalidate( ) { trusted = false; }
+
+	// The root is a symlink that now points somewhere else.
+	bool retargeted( ) const { return resolve( root ) != target; }
+
+	bool needs_rebuild( ) const
+	{
+		return !trusted
+			|| stale > filter.size( ) / 4
+			|| filter.size( ) > 2 * filter.capacity( );
+	}
+
+	std::string root;
+	std::size_t bits_per_entry;
+	std::size_t stale;
+	bool trusted;
+	bool watched;
+	blocked_bloom_filter filter;
+
+	// What the root was when last walked, empty if it wasn't there.
+	std::string target;
+
+private:
+	static std::string resolve( const std::string& path )
+	{
+		char* real = realpath( path.c_str( ), 0 );
+		if( !real ) return std::string( );
+		std::string s( real );
+		std::free( real );
+		return s;
+	}
+
+	// False if dir couldn't be watched or read.
+	template < typename AddWatch >
+	bool walk_dir( const std::string& dir, std::vector< uint64_t >& hashes,
+				   std::vector< std::string >& pending, AddWatch& add_watch )
+	{
+		DIR* d = 0;
+		if( !add_watch( *this, dir ) || 0 == ( d = opendir( dir.c_str( ) ) ) )
+		{
+			hashes.push_back( path_hash( dir.data( ), dir.size( ), opaque_seed ) );
+			return false;
+		}
+
+		std::string path;
+		while( struct dirent* e = readdir( d ) )
+		{
+			if( e->d_name[0] == '.' && ( e->d_name[1] == '\0' || ( e->d_name[1] == '.' && e->d_name[2] == '\0' ) ) )
+				continue;
+
+			path.assign( dir ).append( 1, '/' ).append( e->d_name );
+
+			unsigned char type = e->d_type;
+			if( type == DT_UNKNOWN )
+			{
+				struct stat st;
+				if( 0 != lstat( path.c_str( ), &st ) ) continue;
+				type = S_ISDIR( st.st_mode ) ? DT_DIR : S_ISLNK( st.st_mode ) ? DT_LNK : DT_REG;
+			}
+
+			hashes.push_back( path_hash( path.data( ), path.size( ), present_seed ) );
+
+			// Symlinks may point at directories we don't watch, so they
+			// are opaque along with files.
+			if( type == DT_DIR )
+				pending.push_back( path );
+			else
+				hashes.push_back( path_hash( path.data( ), path.size( ), opaque_seed ) );
+		}
+
+		closedir( d );
+		return true;
+	}
+};
+
+// All of the indexes, sharing the one inotify descriptor.
+class path_index_set : boost::noncopyable
+{
+public:
+	typedef std::vector< boost::shared_ptr< path_index > > index_list;
+	typedef std::map< int, std::pair< path_index*, std::string > > watch_map;
+
+	static const uint32_t watch_mask =
+		IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	path_index_set( )
+	 : inotify_fd( inotify_init( ) ), next_rebuild( 0 )
+	{
+		if( inotify_fd != -1 )
+		{
+			fcntl( inotify_fd, F_SETFL, fcntl( inotify_fd, F_GETFL ) | O_NONBLOCK );
+			fcntl( inotify_fd, F_SETFD, FD_CLOEXEC );
+		}
+	}
+
+	~path_index_set( )
+	{
+		if( inotify_fd != -1 ) close( inotify_fd );
+	}
+
+	// Index root, once.  Without inotify nothing can be kept current so
+	// nothing is indexed.
+	void add_root( const std::string& root, std::size_t bits_per_entry )
+	{
+		if( inotify_fd == -1 ) return;
+
+		boost::shared_ptr< path_index > index( new path_index( root, bits_per_entry ) );
+		if( find( index->root.data( ), index->root.size( ) ) ) return;
+
+		index->build( watcher( *this ) );
+		indexes.push_back( index );
+	}
+
+	path_index* find( const char* doc_root, std::size_t len ) const
+	{
+		for( index_list::const_iterator i = indexes.begin( ); i != indexes.end( ); ++i )
+		{
+			if( (*i)->is_root( doc_root, len ) ) return i->get( );
+		}
+		return 0;
+	}
+
+	// Apply everything inotify has queued.  Cheap when there is nothing,
+	// a single read that fails with EAGAIN.
+	void drain( )
+	{
+		if( inotify_fd == -1 ) return;
+
+		char buf[ 16384 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+		ssize_t n;
+		while( ( n = read( inotify_fd, buf, sizeof( buf ) ) ) > 0 )
+		{
+			for( char* p = buf; p < buf + n; )
+			{
+				const struct inotify_event* ev = reinterpret_cast< const struct inotify_event* >( p );
+				handle_event( *ev );
+				p += sizeof( struct inotify_event ) + ev->len;
+			}
+		}
+	}
+
+	// Rebuild at most one index that has gone stale, taking them in turn
+	// so a root that isn't there yet doesn't hold up the others.
+	bool rebuild_one( )
+	{
+		for( std::size_t n = 0; n < indexes.size( ); ++n )
+		{
+			path_index& index = *indexes[ next_rebuild++ % indexes.size( ) ];
+			if( index.retargeted( ) ) index.invalidate( );
+			if( !index.needs_rebuild( ) ) continue;
+
+			unwatch( index );
+			index.build( watcher( *this ) );
+			return true;
+		}
+		return false;
+	}
+
+	std::size_t memory_usage( ) const
+	{
+		std::size_t total = 0;
+		for( index_list::const_iterator i = indexes.begin( ); i != indexes.end( ); ++i )
+			total += (*i)->filter.memory_usage( );
+		return total;
+	}
+
+	std::size_t entries( ) const
+	{
+		std::size_t total = 0;
+		for( index_list::const_iterator i = indexes.begin( ); i != indexes.end( ); ++i )
+			total += (*i)->filter.size( );
+		return total;
+	}
+
+	// Worst estimated false positive rate over all filters.
+	double false_positive_rate( ) const
+	{
+		double worst = 0;
+		for( index_list::const_iterator i = indexes.begin( ); i != indexes.end( ); ++i )
+			worst = std::max( worst, (*i)->filter.false_positive_rate( ) );
+		return worst;
+	}
+
+	int inotify_fd;
+	index_list indexes;
+	watch_map watches;
+
+private:
+	// Drop index's watches before it is walked again, the directories
+	// may not be the ones it has now.
+	void unwatch( path_index& index )
+	{
+		for( watch_map::iterator i = watches.begin( ); i != watches.end( ); )
+		{
+			if( i->second.first != &index )
+			{
+				++i;
+				continue;
+			}
+			inotify_rm_watch( inotify_fd, i->first );
+			watches.erase( i++ );
+		}
+	}
+
+	// Functor handed to path_index to register watches with us.
+	struct watcher
+	{
+		watcher( path_index_set& set ) : set( set ) {}
+
+		bool operator()( path_index& index, const std::string& dir )
+		{
+			int wd = inotify_add_watch( set.inotify_fd, dir.c_str( ), watch_mask );
+			if( wd == -1 ) return false;
+			set.watches[ wd ] = std::make_pair( &index, dir );
+			return true;
+		}
+
+		path_index_set& set;
+	};
+
+	std::size_t next_rebuild;
+
+	void handle_event( const struct inotify_event& ev )
+	{
+		// The kernel queue overflowed, we have no idea what changed.
+		if( ev.mask & IN_Q_OVERFLOW )
+		{
+			for( index_list::iterator i = indexes.begin( ); i != indexes.end( ); ++i )
+				(*i)->invalidate( );
+			return;
+		}
+
+		watch_map::iterator w = watches.find( ev.wd );
+		if( w == watches.end( ) ) return;
+
+		path_index& index = *w->second.first;
+
+		// The root itself went away (deleted, moved, or its filesystem
+		// unmounted): nothing below it is known until it is walked again.
+		bool is_root = w->second.second == index.root;
+		if( is_root && ( ev.mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) ) )
+			index.invalidate( );
+
+		if( ev.mask & IN_IGNORED )
+		{
+			watches.erase( w );
+			return;
+		}
+		if( is_root && ( ev.mask & ( IN_DELETE_SELF | IN_MOVE_SELF ) ) ) return;
+
+		if( ev.mask & ( IN_CREATE | IN_MOVED_TO ) )
+		{
+			index.created( w->second.second, ev.name, ( ev.mask & IN_ISDIR ) != 0, watcher( *this ) );
+		}
+		else if( ev.mask & ( IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF ) )
+		{
+			index.removed( );
+		}
+	}
+};
+
+class mod_pathfilter : public Plugin< mod_pathfilter >
+{
+public:
+	mod_pathfilter( server& srv )
+	 :	Plugin< mod_pathfilter >( srv ),
+		enable			( "pathfilter.enable" ),
+		bits_per_entry	( "pathfilter.bits-per-entry" )
+	{}
+
+	virtual ~mod_pathfilter( ){ }
+
+	typedef boost::mpl::list< 	PhysicalHandler,
+								TriggerHandler > handlers;
+
+	// Index every document-root that has the filter enabled.
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_pathfilter >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		int bits = *bits_per_entry.defaults( ).front( );
+		if( bits <= 0 ) bits = 10;
+
+		for( std::size_t i = 0; i < srv.config_context->used; ++i )
+		{
+			const specific_config* s = srv.config_storage[i];
+			if( !s || !*enable.defaults( )[i] || buffer_is_empty( s->document_root ) ) continue;
+
+			indexes.add_root( std::string( s->document_root->ptr, s->document_root->used - 1 ), bits );
+		}
+
+		report( );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_physical( connection& con )
+	{
+		if( !enable[ con ] || buffer_is_empty( con.physical.path ) ) return HANDLER_GO_ON;
+
+		const path_index* index = indexes.find( CONST_BUF_LEN( con.physical.doc_root ) );
+		if( !index ) return HANDLER_GO_ON;
+
+		if( !index->definitely_absent( CONST_BUF_LEN( con.physical.path ) ) ) return HANDLER_GO_ON;
+
+		// It might have been created since we last looked.
+		indexes.drain( );
+		if( !index->definitely_absent( CONST_BUF_LEN( con.physical.path ) ) ) return HANDLER_GO_ON;
+
+		status_counter_inc( CONST_STR_LEN( "pathfilter.rejected" ) );
+		con.http_status = 404;
+		return HANDLER_FINISHED;
+	}
+
+	handler_t handle_trigger( )
+	{
+		indexes.drain( );
+		indexes.rebuild_one( );
+		report( );
+		return HANDLER_GO_ON;
+	}
+
+	void report( )
+	{
+		status_counter_set( CONST_STR_LEN( "pathfilter.memory-bytes" ), static_cast< int >( indexes.memory_usage( ) ) );
+		status_counter_set( CONST_STR_LEN( "pathfilter.entries" ), static_cast< int >( indexes.entries( ) ) );
+		status_counter_set( CONST_STR_LEN( "pathfilter.fp-rate-ppm" ),
+							static_cast< int >( indexes.false_positive_rate( ) * 1000000 ) );
+	}
+
+	config_option< bool >	enable;
+	config_option< int >	bits_per_entry;
+
+	path_index_set indexes;
+};
+
+#endif // _MOD_PATHFILTER_HPP_
@@ -0,0 +1,8 @@
+/**
+ * Reverse proxy with pooled keep-alive upstream connections, see
+ * mod_proxy_pool.hpp.
+ */
+
+#include "mod_proxy_pool.hpp"
+
+MAKE_PLUGIN( mod_proxy_pool, "proxy_pool", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,1206 @@
+/**
+ * A reverse proxy that keeps its upstream connections open between
+ * requests.
+ *
+ * Requests go to the context's upstreams round robin, skipping any that
+ * have failed max-fails times in a row until fail-timeout has passed.
+ * Or, with a balance key, by consistent hashing with bounded loads (see
+ * bounded_hash_ring.hpp) so that requests for the same URI or header
+ * value keep going to the same upstream, unless it has more than its
+ * share in flight.
+ * Each upstream keeps a stack of idle keep-alive connections, the most
+ * recently used handed out first (the one least likely to have been
+ * closed on us), and ones idle longer than idle-timeout closed from
+ * handle_trigger.  A connection taken from the pool is checked with a
+ * peek first, and should the upstream turn out to have closed it anyway
+ * an idempotent request is sent again on a new connection, once.  Others,
+ * a POST say, fail rather than risk being done twice.
+ *
+ * Host names are looked up once, at startup, and one that doesn't resolve
+ * is a configuration error.
+ *
+ * The pools belong to the plugin instance, so each worker process has
+ * its own and there is nothing to lock.
+ *
+ * The request line and headers go upstream as HTTP/1.1, hop-by-hop
+ * headers left out, followed by con.request_content_queue, passed on as
+ * the core reads it rather than once all of it is in.  The response
+ * headers become con's, and the body is read straight into the tail of
+ * con.write_queue as it arrives.  Chunked bodies are decoded (and encoded
+ * again should the core be sending chunked).  While more than
+ * high_water bytes are waiting to go to the client we stop reading, so
+ * a slow client holds up the upstream rather than filling memory.
+ *
+ * With a coalesce key, GET and HEAD requests that have the same key as one
+ * already on its way upstream wait for its response and are sent the
+ * same rather than going upstream themselves (see single_flight.hpp).
+ * Only for responses that are the same for everyone with the key, so the
+ * key should include any header the upstream varies the response on.  One
+ * that sets a cookie or is Cache-Control private or no-store goes to the
+ * leader's client only, and its waiters go upstream themselves.  A
+ * waiter whose leader takes longer than coalesce-timeout to answer gives
+ * up on it and goes upstream alone, as do those over coalesce-max-waiters.
+ *
+ * Upstreams are plain TCP or Unix sockets, no TLS.
+ *
+ * Config:
+ *  proxy-pool.upstreams = ( "127.0.0.1:8080", "unix:/tmp/app.sock" )  # per context, unset declines
+ *  proxy-pool.balance = "uri"       # per context, or "header:Name", default round robin
+ *  proxy-pool.timeout = 30          # seconds per upstream wait
+ *  proxy-pool.coalesce-key = "host uri header:Accept-Encoding"   # per context, unset doesn't coalesce
+ *  proxy-pool.coalesce-max-waiters = 100   # per context, default no limit
+ *  proxy-pool.coalesce-timeout = 10        # per context, seconds, default timeout
+ *  proxy-pool.max-idle = 32         # global, idle connections kept per upstream
+ *  proxy-pool.idle-timeout = 60     # global, seconds
+ *  proxy-pool.max-fails = 3         # global
+ *  proxy-pool.fail-timeout = 10     # global, seconds an upstream is left alone
+ */
+
+#ifndef _MOD_PROXY_POOL_HPP_
+#define _MOD_PROXY_POOL_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/async_handler.hpp>
+#include <lighttpd-cpp/response_builder.hpp>
+#include <lighttpd-cpp/bounded_hash_ring.hpp>
+#include <lighttpd-cpp/single_flight.hpp>
+
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifndef HTTP_CONTENT_LENGTH
+# define HTTP_CONTENT_LENGTH BV(1)
+#endif
+
+/**
+ * One upstream address, its idle connections and its health.
+ */
+struct upstream : boost::noncopyable
+{
+	// "unix:/path", "host:port" or "[v6 address]:port".
+	upstream( const std::string& name )
+	 : name( name ), addr_len( 0 ), fails( 0 ), down_until( 0 ), connects( 0 ), reuses( 0 )
+	{
+		std::memset( &addr, 0, sizeof( addr ) );
+
+		if( 0 == name.compare( 0, 5, "unix:" ) )
+		{
+			struct sockaddr_un* un = reinterpret_cast< struct sockaddr_un* >( &addr );
+			std::string path = name.substr( 5 );
+			if( path.empty( ) || path.size( ) >= sizeof( un->sun_path ) ) return;
+
+			un->sun_family = AF_UNIX;
+			std::memcpy( un->sun_path, path.c_str( ), path.size( ) + 1 );
+			addr_len = sizeof( *un );
+			return;
+		}
+
+		std::string::size_type colon = name.rfind( ':' );
+		if( colon == std::string::npos || colon == 0 ) return;
+
+		host = name.substr( 0, colon );
+		port = name.substr( colon + 1 );
+		if( host.size( ) > 2 && host[0] == '[' && host[ host.size( ) - 1 ] == ']' )
+			host = host.substr( 1, host.size( ) - 2 );
+
+		// Addresses only, this may be on the event loop.
+		lookup( AI_NUMERICHOST | AI_NUMERICSERV );
+	}
+
+	// Look up a host name, which blocks, so from configure only.  True if
+	// the upstream has an address.
+	bool resolve( )
+	{
+		if( !valid( ) && !host.empty( ) ) lookup( 0 );
+		return valid( );
+	}
+
+	~upstream( )
+	{
+		close_idle( );
+	}
+
+	bool valid( ) const { return addr_len != 0; }
+	bool healthy( time_t now ) const { return now >= down_until; }
+
+	// Start a non-blocking connect, -1 if it failed outright.
+	int connect_new( )
+	{
+		int fd = socket( addr.ss_family, SOCK_STREAM, 0 );
+		if( fd == -1 ) return -1;
+
+		fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+		fcntl( fd, F_SETFD, FD_CLOEXEC );
+		if( addr.ss_family != AF_UNIX )
+		{
+			int one = 1;
+			setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+		}
+
+		if( 0 != connect( fd, reinterpret_cast< struct sockaddr* >( &addr ), addr_len )
+			&& errno != EINPROGRESS && errno != EAGAIN )
+		{
+			close( fd );
+			return -1;
+		}
+
+		++connects;
+		return fd;
+	}
+
+	// The most recently used idle connection the upstream hasn't closed,
+	// -1 if there is none.
+	int take_idle( )
+	{
+		while( !idle.empty( ) )
+		{
+			int fd = idle.back( ).fd;
+			idle.pop_back( );
+
+			// Anything to read on an idle connection is either the close or
+			// something we don't want.
+			char c;
+			if( -1 == recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT ) && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			{
+				++reuses;
+				return fd;
+			}
+			close( fd );
+		}
+		return -1;
+	}
+
+	void lookup( int flags )
+	{
+		struct addrinfo hints, *res = 0;
+		std::memset( &hints, 0, sizeof( hints ) );
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = flags;
+		if( 0 != getaddrinfo( host.c_str( ), port.c_str( ), &hints, &res ) || !res ) return;
+
+		if( res->ai_addrlen <= sizeof( addr ) )
+		{
+			std::memcpy( &addr, res->ai_addr, res->ai_addrlen );
+			addr_len = res->ai_addrlen;
+		}
+		freeaddrinfo( res );
+	}
+
+	void close_idle( )
+	{
+		for( std::vector< idle_connection >::iterator i = idle.begin( ); i != idle.end( ); ++i )
+			close( i->fd );
+		idle.clear( );
+	}
+
+	struct idle_connection
+	{
+		int fd;
+		time_t since;
+	};
+
+	const std::string name;
+	std::string host, port;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	// Oldest first.
+	std::vector< idle_connection > idle;
+
+	// Failures in a row, and when we'll try again after too many.
+	unsigned fails;
+	time_t down_until;
+
+	std::size_t connects, reuses;
+};
+
+/**
+ * The upstreams of every context, by address, so contexts naming the same
+ * upstream share its connections.
+ */
+class upstream_pool : boost::noncopyable
+{
+public:
+	upstream_pool( )
+	 : max_idle( 32 ), idle_timeout( 60 ), max_fails( 3 ), fail_timeout( 10 ), next( 0 )
+	{}
+
+	~upstream_pool( )
+	{
+		for( upstream_map::iterator i = upstreams.begin( ); i != upstreams.end( ); ++i )
+			delete i->second;
+	}
+
+	upstream& get( const std::string& name )
+	{
+		upstream*& u = upstreams[ name ];
+		if( !u ) u = new upstream( name );
+		return *u;
+	}
+
+	// The next healthy one of names, round robin.  Should they all be down
+	// we try the one that is due back soonest rather than fail outright.
+	upstream* choose( const std::vector< std::string >& names, time_t now )
+	{
+		upstream* fallback = 0;
+		std::size_t start = next++;
+
+		for( std::size_t i = 0; i < names.size( ); ++i )
+		{
+			upstream& u = get( names[ ( start + i ) % names.size( ) ] );
+			if( !u.valid( ) ) continue;
+			if( u.healthy( now ) ) return &u;
+			if( !fallback || u.down_until < fallback->down_until ) fallback = &u;
+		}
+		return fallback;
+	}
+
+	// A connection finished with cleanly, kept if there is room.
+	void release( upstream& u, int fd, time_t now )
+	{
+		if( u.idle.size( ) >= max_idle )
+		{
+			close( fd );
+			return;
+		}
+
+		upstream::idle_connection c = { fd, now };
+		u.idle.push_back( c );
+	}
+
+	void failed( upstream& u, time_t now )
+	{
+		if( ++u.fails < max_fails ) return;
+
+		u.fails = 0;
+		u.down_until = now + fail_timeout;
+
+		// Whatever is idle is likely as broken.
+		u.close_idle( );
+	}
+
+	void succeeded( upstream& u )
+	{
+		u.fails = 0;
+		u.down_until = 0;
+	}
+
+	// Close connections idle for idle_timeout or more.
+	void reap( time_t now )
+	{
+		for( upstream_map::iterator i = upstreams.begin( ); i != upstreams.end( ); ++i )
+		{
+			std::vector< upstream::idle_connection >& idle = i->second->idle;
+
+			std::vector< upstream::idle_connection >::iterator fresh = idle.begin( );
+			while( fresh != idle.end( ) && fresh->since + idle_timeout <= now )
+				close( ( fresh++ )->fd );
+			idle.erase( idle.begin( ), fresh );
+		}
+	}
+
+	std::size_t idle_count( ) const
+	{
+		std::size_t n = 0;
+		for( upstream_map::const_iterator i = upstreams.begin( ); i != upstreams.end( ); ++i )
+			n += i->second->idle.size( );
+		return n;
+	}
+
+	std::size_t max_idle;
+	time_t idle_timeout;
+	unsigned max_fails;
+	time_t fail_timeout;
+
+private:
+	typedef std::map< std::string, upstream* > upstream_map;
+
+	upstream_map upstreams;
+	std::size_t next;
+};
+
+/**
+ * Undoes Transfer-Encoding: chunked a piece at a time, handing the body to
+ * a sink taking ( const char*, std::size_t ).
+ */
+class chunked_decoder
+{
+public:
+	enum result { MORE, DONE, BAD };
+
+	chunked_decoder( ) : state( SIZE ), remaining( 0 ), digits( 0 ) {}
+
+	// Everything of p[0, len) is used unless the body ends part way, in
+	// which case used says how much was.
+	template < typename Sink >
+	result feed( const char* p, std::size_t len, Sink& out, std::size_t& used )
+	{
+		const char* start = p;
+		const char* end = p + len;
+
+		while( p != end )
+		{
+			switch( state )
+			{
+			case SIZE:
+				{
+					int v = hex( *p );
+					if( v >= 0 )
+					{
+						if( ++digits > 15 ) return BAD;
+						remaining = remaining * 16 + v;
+					}
+					else if( *p == '\n' )
+					{
+						if( !size_line_done( ) ) return BAD;
+					}
+					else if( *p == ';' || *p == ' ' || *p == '\t' || *p == '\r' )
+					{
+						if( !digits ) return BAD;
+						state = EXTENSION;
+					}
+					else return BAD;
+					++p;
+				}
+				break;
+
+			case EXTENSION:
+				if( *p++ == '\n' ) size_line_done( );
+				break;
+
+			case DATA:
+				{
+					std::size_t n = std::min( static_cast< std::size_t >( end - p ), static_cast< std::size_t >( remaining ) );
+					out( p, n );
+					p += n;
+					remaining -= n;
+					if( !remaining ) state = DATA_CR;
+				}
+				break;
+
+			case DATA_CR:
+				if( *p == '\r' ) state = DATA_LF;
+				else if( *p == '\n' ) state = SIZE;
+				else return BAD;
+				++p;
+				break;
+
+			case DATA_LF:
+				if( *p++ != '\n' ) return BAD;
+				state = SIZE;
+				break;
+
+			case TRAILER_START:
+				if( *p == '\r' ) state = END_LF;
+				else if( *p == '\n' ) state = END;
+				else state = TRAILER;
+				++p;
+				break;
+
+			case TRAILER:
+				if( *p++ == '\n' ) state = TRAILER_START;
+				break;
+
+			case END_LF:
+				if( *p++ != '\n' ) return BAD;
+				state = END;
+				break;
+
+			case END:
+				break;
+			}
+
+			if( state == END ) break;
+		}
+
+		used = p - start;
+		return state == END ? DONE : MORE;
+	}
+
+private:
+	enum state_type { SIZE, EXTENSION, DATA, DATA_CR, DATA_LF, TRAILER_START, TRAILER, END_LF, END };
+
+	bool size_line_done( )
+	{
+		if( !digits ) return false;
+
+		state = remaining ? DATA : TRAILER_START;
+		digits = 0;
+		return true;
+	}
+
+	static int hex( char c )
+	{
+		if( c >= '0' && c <= '9' ) return c - '0';
+		if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+		if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+		return -1;
+	}
+
+	state_type state;
+	uint64_t remaining;
+	int digits;
+};
+
+class mod_proxy_pool;
+
+struct proxy_task : async_task
+{
+	inline proxy_task( mod_proxy_pool& p, connection& con );
+
+	~proxy_task( )
+	{
+		// Given up on part way, not fit to go back in the pool.
+		if( fd != -1 ) close( fd );
+		if( ring ) ring->release( slot );
+	}
+
+	inline handler_t operator()( async_context& ctx );
+
+	// Appends body bytes to the write queue, as chunks if the core is
+	// sending chunked, and shares them with any waiters.
+	struct body_sink
+	{
+		body_sink( response_builder& out, bool chunked, flight_ticket& share ) : out( out ), chunked( chunked ), share( share ) {}
+
+		void operator()( const char* p, std::size_t n )
+		{
+			if( !n ) return;
+			share.append( p, n );
+			if( chunked )
+			{
+				char size[ 24 ];
+				out.append( size, snprintf( size, sizeof( size ), "%lx\r\n", static_cast< unsigned long >( n ) ) );
+			}
+			out.append( p, n );
+			if( chunked ) out.append( "\r\n", 2 );
+		}
+
+		response_builder& out;
+		bool chunked;
+		flight_ticket& share;
+	};
+
+	enum framing_type { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE };
+
+	// Join the flight for the request's key, true if there is one to
+	// wait for.
+	inline bool coalesce( );
+
+	// Where this request goes next.
+	inline upstream* pick( );
+
+	// Request line and headers.
+	inline void build_request( );
+
+	// Some more of out and then the request body, false on error.
+	inline bool send_some( );
+
+	// How much of the request body the core has read so far.
+	off_t body_queued( ) const
+	{
+		chunkqueue* cq = con.request_content_queue;
+		return cq ? chunkqueue_length( cq ) - chunkqueue_written( cq ) : 0;
+	}
+
+	// Safe to send again, RFC 7231 4.2.2.
+	bool idempotent( ) const
+	{
+		switch( con.request.http_method )
+		{
+			case HTTP_METHOD_GET:
+			case HTTP_METHOD_HEAD:
+			case HTTP_METHOD_PUT:
+			case HTTP_METHOD_DELETE:
+			case HTTP_METHOD_OPTIONS:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	// Parse the status line and headers in head[0, head_len), false if
+	// they aren't HTTP.
+	inline bool parse_head( std::size_t head_len );
+
+	// Hand n bytes of body from p to the write queue, false if the
+	// upstream sent nonsense.
+	inline bool body( const char* p, std::size_t n );
+
+	// Pass upstream's failure on to the client.
+	handler_t fail( )
+	{
+		if( up ) pool( ).failed( *up, srv( ).cur_ts );
+		if( con.file_started ) return HANDLER_ERROR;
+
+		con.http_status = 502;
+		return HANDLER_FINISHED;
+	}
+
+	inline upstream_pool& pool( );
+	inline server& srv( );
+
+	mod_proxy_pool& p;
+	connection& con;
+	const std::vector< std::string >* names;
+	time_t timeout;
+	time_t wait_timeout;
+
+	flight_ticket ticket;
+	flight_ticket::replay_result replayed;
+	int joins;
+
+	upstream* up;
+	bounded_hash_ring* ring;
+	std::size_t slot;
+	int fd;
+	bool reused;
+	int attempts;
+
+	std::string out;
+	std::size_t sent;
+	off_t body_sent;
+
+	std::string head;
+	std::size_t head_end;
+	int status;
+	framing_type framing;
+	off_t remaining;
+	bool keep_alive;
+	bool reencode;
+	chunked_decoder chunks;
+	bool body_done;
+
+	ssize_t n;
+	std::vector< char > raw;
+};
+
+class mod_proxy_pool
+ : 	public Plugin< mod_proxy_pool >,
+	public async_backend< mod_proxy_pool, proxy_task >
+{
+public:
+	// Stop reading from upstream while more than this is waiting to go to
+	// the client.
+	static const off_t high_water = 256 * 1024;
+
+	mod_proxy_pool( server& srv )
+	 :	Plugin< mod_proxy_pool >( srv ),
+		async_backend< mod_proxy_pool, proxy_task >( srv ),
+		upstreams		( "proxy-pool.upstreams" ),
+		balance			( "proxy-pool.balance" ),
+		timeout			( "proxy-pool.timeout" ),
+		max_idle		( "proxy-pool.max-idle" ),
+		idle_timeout	( "proxy-pool.idle-timeout" ),
+		max_fails		( "proxy-pool.max-fails" ),
+		fail_timeout	( "proxy-pool.fail-timeout" ),
+		coalesce_key	( "proxy-pool.coalesce-key" ),
+		coalesce_max_waiters	( "proxy-pool.coalesce-max-waiters" ),
+		coalesce_timeout		( "proxy-pool.coalesce-timeout" )
+	{}
+
+	virtual ~mod_proxy_pool( )
+	{
+		// Tasks release their place on a ring, so go before the rings.
+		for( slot_list::iterator i = slots.begin( ); i != slots.end( ); ++i )
+		{
+			if( *i ) finish( **i );
+		}
+
+		for( std::vector< bounded_hash_ring* >::iterator i = rings.begin( ); i != rings.end( ); ++i )
+			delete *i;
+	}
+
+	typedef async_backend< mod_proxy_pool, proxy_task >::handlers handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_proxy_pool >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		return configure( ) ? HANDLER_GO_ON : HANDLER_ERROR;
+	}
+
+	// A ring for each context's upstreams, and their addresses looked up
+	// while blocking is fine.  False if one has none.
+	bool configure( )
+	{
+		int v;
+		if( ( v = *max_idle.defaults( ).front( ) ) > 0 ) pool.max_idle = v;
+		if( ( v = *idle_timeout.defaults( ).front( ) ) > 0 ) pool.idle_timeout = v;
+		if( ( v = *max_fails.defaults( ).front( ) ) > 0 ) pool.max_fails = v;
+		if( ( v = *fail_timeout.defaults( ).front( ) ) > 0 ) pool.fail_timeout = v;
+
+		const config_option< std::vector< std::string > >::defaults_list_type& lists = upstreams.defaults( );
+		for( std::size_t i = 0; i < lists.size( ); ++i )
+		{
+			if( i == rings.size( ) ) rings.push_back( new bounded_hash_ring );
+			rings[i]->assign( *lists[i] );
+			ring_of[ lists[i] ] = rings[i];
+
+			for( std::size_t n = 0; n < lists[i]->size( ); ++n )
+			{
+				if( !pool.get( ( *lists[i] )[n] ).resolve( ) ) return false;
+			}
+		}
+		return true;
+	}
+
+	// The ring for a request's upstreams.
+	bounded_hash_ring* ring_for( const std::vector< std::string >& names ) const
+	{
+		ring_map::const_iterator i = ring_of.find( &names );
+		return i == ring_of.end( ) ? 0 : i->second;
+	}
+
+	// Hash of what the request is balanced on, 0 for round robin.
+	uint64_t balance_key( connection& con ) const
+	{
+		const std::string& b = balance[ con ];
+
+		if( b == "uri" )
+			return buffer_is_empty( con.request.uri ) ? 0 : bounded_hash_ring::hash( CONST_BUF_LEN( con.request.uri ) );
+
+		if( 0 == b.compare( 0, 7, "header:" ) )
+		{
+			data_string* ds = reinterpret_cast< data_string* >(
+				array_get_element( con.request.headers, b.data( ) + 7, b.size( ) - 7 ) );
+			return ( ds && !buffer_is_empty( ds->value ) ) ? bounded_hash_ring::hash( CONST_BUF_LEN( ds->value ) ) : 0;
+		}
+
+		return 0;
+	}
+
+	// Timeouts of waiting tasks, and idle connections.
+	handler_t handle_trigger( )
+	{
+		async_backend< mod_proxy_pool, proxy_task >::handle_trigger( );
+		pool.reap( srv.cur_ts );
+
+		status_counter_set( CONST_STR_LEN( "proxy-pool.idle" ), static_cast< int >( pool.idle_count( ) ) );
+		status_counter_set( CONST_STR_LEN( "proxy-pool.coalesced" ), static_cast< int >( flights.followers( ) ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< std::vector< std::string > >	upstreams;
+	config_option< std::string >				balance;
+	config_option< int >						timeout;
+	config_option< int >						max_idle;
+	config_option< int >						idle_timeout;
+	config_option< int >						max_fails;
+	config_option< int >						fail_timeout;
+	config_option< std::string >				coalesce_key;
+	config_option< int >						coalesce_max_waiters;
+	config_option< int >						coalesce_timeout;
+
+	upstream_pool pool;
+	single_flight flights;
+
+private:
+	friend struct proxy_task;
+
+	typedef std::map< const std::vector< std::string >*, bounded_hash_ring* > ring_map;
+
+	// By config context, and by the context's upstreams value.
+	std::vector< bounded_hash_ring* > rings;
+	ring_map ring_of;
+};
+
+inline proxy_task::proxy_task( mod_proxy_pool& p, connection& con )
+ :	p( p ), con( con ), names( &p.upstreams[ con ] ), timeout( p.timeout[ con ] ), wait_timeout( p.coalesce_timeout[ con ] ),
+	replayed( flight_ticket::MORE ), joins( 0 ), up( 0 ), ring( 0 ), slot( 0 ), fd( -1 ), reused( false ), attempts( 0 ),
+	sent( 0 ), body_sent( 0 ), head_end( 0 ), status( 0 ), framing( BODY_NONE ), remaining( 0 ),
+	keep_alive( false ), reencode( false ), body_done( false ), n( 0 )
+{
+	if( timeout <= 0 ) timeout = 30;
+	if( wait_timeout <= 0 ) wait_timeout = timeout;
+}
+
+inline upstream_pool& proxy_task::pool( ) { return p.pool; }
+inline server& proxy_task::srv( ) { return const_cast< server& >( p.srv ); }
+
+inline handler_t proxy_task::operator()( async_context& ctx )
+{
+	BOOST_ASIO_CORO_REENTER( this )
+	{
+		if( names->empty( ) ) return HANDLER_GO_ON;
+
+		// Wait for the same request already on its way upstream rather than
+		// send another.
+		while( coalesce( ) )
+		{
+			while( flight_ticket::MORE == ( replayed = ticket.replay( srv( ), con ) ) )
+			{
+				BOOST_ASIO_CORO_YIELD return ticket.wait( ctx, wait_timeout );
+				if( ctx.timed_out( ) ) break;
+			}
+
+			if( replayed == flight_ticket::DONE ) return HANDLER_FINISHED;
+			if( replayed == flight_ticket::FAILED || ticket.started( ) ) return HANDLER_ERROR;
+
+			// The leader is taking too long, go ourselves.  Otherwise it gave
+			// up and we join again.
+			if( replayed == flight_ticket::MORE )
+			{
+				ticket.leave( );
+				break;
+			}
+		}
+
+		build_request( );
+
+		// Once, and again should a pooled connection turn out to be closed.
+		for( ;; )
+		{
+			if( !( up = pick( ) ) ) return fail( );
+
+			reused = -1 != ( fd = up->take_idle( ) );
+			if( !reused )
+			{
+				if( -1 == ( fd = up->connect_new( ) ) ) return fail( );
+
+				BOOST_ASIO_CORO_YIELD return ctx.writable( fd, timeout );
+				if( ctx.timed_out( ) ) return fail( );
+
+				int error = 0;
+				socklen_t len = sizeof( error );
+				if( 0 != getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &len ) || error ) return fail( );
+			}
+
+			sent = 0;
+			body_sent = 0;
+			status = 0;
+			head.clear( );
+
+			while( sent < out.size( ) || body_sent < static_cast< off_t >( con.request.content_length ) )
+			{
+				// Sent all of the body that is in so far.
+				if( sent == out.size( ) && body_sent >= body_queued( ) )
+				{
+					if( con.request_content_queue && con.request_content_queue->is_closed ) return HANDLER_ERROR;
+
+					BOOST_ASIO_CORO_YIELD return ctx.request_body( );
+					continue;
+				}
+
+				if( !send_some( ) ) break;
+				if( sent < out.size( ) || body_sent < static_cast< off_t >( con.request.content_length ) )
+				{
+					BOOST_ASIO_CORO_YIELD return ctx.writable( fd, timeout );
+					if( ctx.timed_out( ) ) return fail( );
+				}
+			}
+
+			// Read until the end of the response head.
+			while( sent == out.size( ) && body_sent == static_cast< off_t >( con.request.content_length ) )
+			{
+				if( std::string::npos != ( head_end = head.find( "\r\n\r\n" ) ) )
+				{
+					head_end += 4;
+					if( !parse_head( head_end ) ) return fail( );
+
+					// 100 Continue and the like, the real head follows.
+					if( status < 200 )
+					{
+						head.erase( 0, head_end );
+						continue;
+					}
+					break;
+				}
+				if( head.size( ) > 64 * 1024 ) return fail( );
+
+				BOOST_ASIO_CORO_YIELD return ctx.readable( fd, timeout );
+				if( ctx.timed_out( ) ) return fail( );
+
+				{
+					char buf[ 4096 ];
+					n = read( fd, buf, sizeof( buf ) );
+					if( n < 0 && ( errno == EAGAIN || errno == EINTR ) ) continue;
+					if( n <= 0 ) break;
+					head.append( buf, n );
+				}
+			}
+
+			if( status >= 200 ) break;
+
+			// Closed on us before a byte of response.  A pooled connection
+			// may have been closed just as we took it, so have another go on
+			// a new one, if the upstream may see the request twice.
+			close( fd );
+			fd = -1;
+			if( !reused || !idempotent( ) || status || !head.empty( ) || ++attempts > 1 ) return fail( );
+		}
+
+		pool( ).succeeded( *up );
+		con.http_status = status;
+		con.file_started = 1;
+		reencode = framing != BODY_LENGTH && con.response.transfer_encoding == response_t::HTTP_TRANSFER_ENCODING_CHUNKED;
+		ticket.head( status, con.response.headers, ( con.parsed_response & HTTP_CONTENT_LENGTH ) ? con.response.content_length : -1 );
+
+		if( head.size( ) > head_end && !body( head.data( ) + head_end, head.size( ) - head_end ) ) return HANDLER_ERROR;
+		head.clear( );
+
+		if( framing == BODY_CHUNKED ) raw.resize( 16 * 1024 );
+
+		while( !body_done )
+		{
+			// Let the client catch up, to half way so as not to be woken for
+			// every write.
+			if( chunkqueue_length( con.write_queue ) - chunkqueue_written( con.write_queue ) > mod_proxy_pool::high_water )
+			{
+				BOOST_ASIO_CORO_YIELD return ctx.drained( mod_proxy_pool::high_water / 2 );
+				continue;
+			}
+
+			BOOST_ASIO_CORO_YIELD return ctx.readable( fd, timeout );
+			if( ctx.timed_out( ) ) return HANDLER_ERROR;
+
+			if( framing == BODY_CHUNKED )
+			{
+				n = read( fd, &raw[0], raw.size( ) );
+				if( n > 0 && !body( &raw[0], n ) ) return HANDLER_ERROR;
+			}
+			else
+			{
+				// Straight into the write queue.
+				response_builder out( con.write_queue );
+				std::size_t want = 16 * 1024;
+				if( framing == BODY_LENGTH ) want = std::min( want, static_cast< std::size_t >( remaining ) );
+
+				char* at = out.reserve( want );
+				n = read( fd, at, want );
+				if( n > 0 )
+				{
+					out.commit( n );
+					ticket.append( at, n );
+					if( framing == BODY_LENGTH && !( remaining -= n ) ) body_done = true;
+				}
+			}
+
+			if( n < 0 && ( errno == EAGAIN || errno == EINTR ) ) continue;
+			if( n < 0 ) return HANDLER_ERROR;
+			if( n == 0 )
+			{
+				// Only a body that runs to the close may end there.
+				if( framing != BODY_CLOSE ) return HANDLER_ERROR;
+				keep_alive = false;
+				body_done = true;
+			}
+		}
+
+		if( reencode )
+		{
+			response_builder out( con.write_queue );
+			out.append( "0\r\n\r\n", 5 );
+		}
+
+		if( keep_alive )
+		{
+			pool( ).release( *up, fd, srv( ).cur_ts );
+			fd = -1;
+		}
+
+		ticket.complete( );
+		con.file_finished = 1;
+	}
+
+	return HANDLER_FINISHED;
+}
+
+inline bool proxy_task::coalesce( )
+{
+	// Once, and again should the leader give up on us.
+	if( ++joins > 2 )
+	{
+		ticket.leave( );
+		return false;
+	}
+
+	if( con.request.http_method != HTTP_METHOD_GET && con.request.http_method != HTTP_METHOD_HEAD ) return false;
+	if( con.request.content_length > 0 ) return false;
+
+	std::string key = flight_key( p.coalesce_key[ con ], con );
+	if( key.empty( ) ) return false;
+
+	int max_waiters = p.coalesce_max_waiters[ con ];
+	return flight_ticket::FOLLOW == ticket.join( p.flights, key, max_waiters > 0 ? max_waiters : 0 );
+}
+
+// Upstreams on a ring that are down are passed over.
+struct usable_upstream
+{
+	usable_upstream( upstream_pool& pool, const bounded_hash_ring& ring, time_t now )
+	 : pool( pool ), ring( ring ), now( now )
+	{}
+
+	bool operator()( std::size_t s ) const
+	{
+		const upstream& u = pool.get( ring.name( s ) );
+		return u.valid( ) && u.healthy( now );
+	}
+
+	upstream_pool& pool;
+	const bounded_hash_ring& ring;
+	time_t now;
+};
+
+inline upstream* proxy_task::pick( )
+{
+	// Our place on the ring from a try that didn't work out.
+	if( ring ) ring->release( slot );
+	ring = 0;
+
+	uint64_t key = p.balance_key( con );
+	bounded_hash_ring* r = key ? p.ring_for( *names ) : 0;
+	if( r )
+	{
+		std::size_t s = r->pick( key, usable_upstream( pool( ), *r, srv( ).cur_ts ) );
+		if( s != bounded_hash_ring::npos )
+		{
+			r->acquire( s );
+			ring = r;
+			slot = s;
+			return &pool( ).get( r->name( s ) );
+		}
+	}
+
+	return pool( ).choose( *names, srv( ).cur_ts );
+}
+
+inline void proxy_task::build_request( )
+{
+	// Not to be passed on, they are about this hop.
+	static const char* hop_by_hop[] =
+	{
+		"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authorization", "TE", "Trailer",
+		"Transfer-Encoding", "Upgrade", "Content-Length", "X-Forwarded-For"
+	};
+
+	out.clear( );
+	out.append( get_http_method_name( con.request.http_method ) );
+	out.append( 1, ' ' );
+	out.append( CONST_BUF_LEN( con.request.uri ) );
+	out.append( " HTTP/1.1\r\n" );
+
+	std::string forwarded_for;
+	for( std::size_t i = 0; con.request.headers && i < con.request.headers->used; ++i )
+	{
+		data_string* ds = reinterpret_cast< data_string* >( con.request.headers->data[i] );
+		if( buffer_is_empty( ds->key ) || buffer_is_empty( ds->value ) ) continue;
+
+		if( 0 == strcasecmp( ds->key->ptr, "X-Forwarded-For" ) )
+			forwarded_for.assign( CONST_BUF_LEN( ds->value ) );
+
+		bool skip = false;
+		for( std::size_t h = 0; h < sizeof( hop_by_hop ) / sizeof( hop_by_hop[0] ) && !skip; ++h )
+			skip = 0 == strcasecmp( ds->key->ptr, hop_by_hop[h] );
+		if( skip ) continue;
+
+		out.append( CONST_BUF_LEN( ds->key ) );
+		out.append( ": " );
+		out.append( CONST_BUF_LEN( ds->value ) );
+		out.append( "\r\n" );
+	}
+
+	if( !buffer_is_empty( con.dst_addr_buf ) )
+	{
+		if( !forwarded_for.empty( ) ) forwarded_for.append( ", " );
+		forwarded_for.append( CONST_BUF_LEN( con.dst_addr_buf ) );
+	}
+	if( !forwarded_for.empty( ) ) out.append( "X-Forwarded-For: " + forwarded_for + "\r\n" );
+
+	if( con.request.content_length )
+	{
+		char len[ 32 ];
+		snprintf( len, sizeof( len ), "%lu", static_cast< unsigned long >( con.request.content_length ) );
+		out.append( "Content-Length: " ).append( len ).append( "\r\n" );
+	}
+
+	out.append( "\r\n" );
+}
+
+inline bool proxy_task::send_some( )
+{
+	if( sent < out.size( ) )
+	{
+		n = write( fd, out.data( ) + sent, out.size( ) - sent );
+		if( n < 0 ) return errno == EAGAIN || errno == EINTR;
+		sent += n;
+		return true;
+	}
+
+	// The body, walked from the start each time rather than consumed, so
+	// it can be sent again on another connection.
+	off_t skip = body_sent;
+	for( chunk* c = con.request_content_queue ? con.request_content_queue->first : 0; c; c = c->next )
+	{
+		const char* p = 0;
+		off_t len = 0;
+		char buf[ 16 * 1024 ];
+
+		if( c->type == chunk::MEM_CHUNK )
+		{
+			len = c->mem->used ? c->mem->used - 1 - c->offset : 0;
+			if( skip >= len ) { skip -= len; continue; }
+			p = c->mem->ptr + c->offset + skip;
+			len -= skip;
+		}
+		else if( c->type == chunk::FILE_CHUNK )
+		{
+			len = c->file.length - c->offset;
+			if( skip >= len ) { skip -= len; continue; }
+
+			// The chunkqueue closes it with the rest.
+			if( c->file.fd == -1 && -1 == ( c->file.fd = open( c->file.name->ptr, O_RDONLY | O_CLOEXEC ) ) ) return false;
+
+			ssize_t r = pread( c->file.fd, buf, std::min( static_cast< off_t >( sizeof( buf ) ), len - skip ),
+				c->file.start + c->offset + skip );
+			if( r <= 0 ) return false;
+			p = buf;
+			len = r;
+		}
+		else continue;
+
+		n = write( fd, p, len );
+		if( n < 0 ) return errno == EAGAIN || errno == EINTR;
+		body_sent += n;
+		return true;
+	}
+
+	// The loop waits for more body rather than get here.
+	return false;
+}
+
+inline bool proxy_task::parse_head( std::size_t head_len )
+{
+	const char* p = head.data( );
+	const char* end = p + head_len;
+
+	const char* eol = std::find( p, end, '\n' );
+	if( eol - p < 12 || 0 != std::memcmp( p, "HTTP/1.", 7 ) || p[8] != ' ' ) return false;
+
+	status = std::atoi( p + 9 );
+	if( status < 100 || status > 999 ) return false;
+	if( status < 200 ) return true;
+
+	bool http10 = p[7] == '0';
+	keep_alive = !http10;
+	framing = BODY_CLOSE;
+	bool chunked = false, has_length = false;
+
+	for( p = eol + 1; p < end; p = eol + 1 )
+	{
+		eol = std::find( p, end, '\n' );
+		const char* line_end = eol;
+		if( line_end > p && line_end[-1] == '\r' ) --line_end;
+		if( line_end == p ) break;
+
+		const char* colon = std::find( p, line_end, ':' );
+		if( colon == line_end || colon == p ) return false;
+
+		const char* v = colon + 1;
+		while( v < line_end && ( *v == ' ' || *v == '\t' ) ) ++v;
+
+		std::string key( p, colon ), value( v, line_end );
+
+		if( 0 == strcasecmp( key.c_str( ), "Content-Length" ) )
+		{
+			char* e;
+			remaining = strtoll( value.c_str( ), &e, 10 );
+			if( *e || remaining < 0 ) return false;
+			has_length = true;
+		}
+		else if( 0 == strcasecmp( key.c_str( ), "Transfer-Encoding" ) )
+		{
+			chunked = 0 == strcasecmp( value.c_str( ), "chunked" );
+			if( !chunked ) return false;
+			continue;
+		}
+		else if( 0 == strcasecmp( key.c_str( ), "Connection" ) )
+		{
+			if( 0 == strcasecmp( value.c_str( ), "close" ) ) keep_alive = false;
+			if( 0 == strcasecmp( value.c_str( ), "keep-alive" ) ) keep_alive = true;
+			continue;
+		}
+		else if( 0 == strcasecmp( key.c_str( ), "Keep-Alive" ) || 0 == strcasecmp( key.c_str( ), "Trailer" )
+			|| 0 == strcasecmp( key.c_str( ), "Upgrade" ) || 0 == strcasecmp( key.c_str( ), "Proxy-Connection" ) )
+		{
+			continue;
+		}
+
+		response_header_insert( &srv( ), &con, key.data( ), key.size( ), value.data( ), value.size( ) );
+	}
+
+	if( con.request.http_method == HTTP_METHOD_HEAD || status == 204 || status == 304 )
+		framing = BODY_NONE;
+	else if( chunked )
+		framing = BODY_CHUNKED;
+	else if( has_length )
+		framing = BODY_LENGTH;
+
+	if( has_length && framing != BODY_CHUNKED )
+	{
+		con.parsed_response |= HTTP_CONTENT_LENGTH;
+		con.response.content_length = remaining;
+	}
+
+	if( framing == BODY_CLOSE ) keep_alive = false;
+	if( framing == BODY_NONE || ( framing == BODY_LENGTH && !remaining ) ) body_done = true;
+	return true;
+}
+
+inline bool proxy_task::body( const char* p, std::size_t len )
+{
+	response_builder out( con.write_queue );
+
+	if( framing == BODY_CHUNKED )
+	{
+		body_sink sink( out, reencode, ticket );
+		std::size_t used = 0;
+		chunked_decoder::result r = chunks.feed( p, len, sink, used );
+		if( r == chunked_decoder::BAD ) return false;
+		if( r == chunked_decoder::DONE )
+		{
+			body_done = true;
+			// Pipelined leftovers, the connection can't be trusted.
+			if( used != len ) keep_alive = false;
+		}
+		return true;
+	}
+
+	if( framing == BODY_LENGTH && static_cast< off_t >( len ) > remaining )
+	{
+		len = remaining;
+		keep_alive = false;
+	}
+
+	if( framing != BODY_NONE )
+	{
+		out.append( p, len );
+		ticket.append( p, len );
+	}
+	else if( len ) keep_alive = false;
+
+	if( framing == BODY_LENGTH && !( remaining -= len ) ) body_done = true;
+	return true;
+}
+
+#endif // _MOD_PROXY_POOL_HPP_
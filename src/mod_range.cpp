@@ -0,0 +1,8 @@
+/**
+ * Answers Range requests for static files from file chunks, see
+ * mod_range.hpp.
+ */
+
+#include "mod_range.hpp"
+
+MAKE_PLUGIN( mod_range, "range", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,476 @@
+/**
+ * Answers Range requests for static files at handle_physical, single and
+ * multi-range alike, without copying any of the file.
+ *
+ * Each range goes out as a file chunk that the network backend
+ * sendfile()s (or mmaps, as it sees fit).  A multi-range response is a
+ * multipart/byteranges body: the part header up to the numbers is
+ * rendered once per response, and each part only adds its Content-Range
+ * and its file chunk, so the only bytes copied are the part headers.
+ *
+ * Ranges that overlap or touch are merged, which also sorts them, as RFC
+ * 7233 allows.  A Range we can't parse, or one listing more than
+ * range.max-ranges ranges, is ignored and the whole file goes out the
+ * normal way; one where no range is inside the file gets a 416.  Requests
+ * with If-Range, If-None-Match, If-Modified-Since, If-Match or
+ * If-Unmodified-Since are left to mod_staticfile, which knows the
+ * validators it handed out and answers 304 and 412, and requests a backend
+ * has taken to the backend.  A 206 carries the same ETag and Last-Modified
+ * as mod_staticfile's 200 would.  Without an
+ * exclude list the usual script extensions are excluded (see
+ * static_file.hpp), so a script's source is never handed out a range at
+ * a time.
+ *
+ * Readers working through a file a range at a time (players, download
+ * managers) are spotted by their next range starting where the last one
+ * from the same address ended.  The kernel is then told to read ahead the
+ * next range.readahead bytes, so the next request finds them in the page
+ * cache.  The parts of a multi-range response are hinted the same way, as
+ * they are about to be read anyway.
+ *
+ * Config:
+ *  range.enable = "enable"                          # per context
+ *  range.exclude-extensions = ( ".php", ".pl" )     # per context, default
+ *                                                   # script extensions
+ *  range.max-ranges = 16                            # global
+ *  range.readahead = 1048576                        # global, bytes, 0 for
+ *                                                   # no hints
+ */
+
+#ifndef _MOD_RANGE_HPP_
+#define _MOD_RANGE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/response_builder.hpp>
+#include <lighttpd-cpp/static_file.hpp>
+#include <lighttpd-cpp/pooled_buffer.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// first to last, both inclusive, as in the header.
+struct byte_range
+{
+	byte_range( off_t first = 0, off_t last = 0 ) : first( first ), last( last ) {}
+
+	off_t length( ) const { return last - first + 1; }
+	bool operator<( const byte_range& o ) const { return first < o.first; }
+	bool operator==( const byte_range& o ) const { return first == o.first && last == o.last; }
+
+	off_t first;
+	off_t last;
+};
+
+// The ranges of a Range header that are inside a file.
+struct range_set
+{
+	enum result { IGNORE, UNSATISFIABLE, SATISFIABLE };
+
+	range_set( ) : requested( 0 ) {}
+
+	// IGNORE is for a header to be treated as if it wasn't there: not a
+	// bytes range, malformed, or asking for more than max_ranges ranges.
+	result parse( const char* header, off_t size, std::size_t max_ranges = 16 )
+	{
+		ranges.clear( );
+		requested = 0;
+
+		const char* p = header;
+		while( *p == ' ' || *p == '\t' ) ++p;
+		if( strncasecmp( p, "bytes", 5 ) ) return IGNORE;
+		p += 5;
+		while( *p == ' ' || *p == '\t' ) ++p;
+		if( *p++ != '=' ) return IGNORE;
+
+		for( ;; )
+		{
+			while( *p == ' ' || *p == '\t' || *p == ',' ) ++p;
+			if( !*p ) break;
+
+			off_t first = -1, last = -1;
+			if( *p != '-' && !number( p, first ) ) return IGNORE;
+			if( *p++ != '-' ) return IGNORE;
+			if( *p >= '0' && *p <= '9' && !number( p, last ) ) return IGNORE;
+
+			while( *p == ' ' || *p == '\t' ) ++p;
+			if( *p && *p != ',' ) return IGNORE;
+			if( first == -1 && last == -1 ) return IGNORE;
+			if( first != -1 && last != -1 && last < first ) return IGNORE;
+
+			if( ++requested > max_ranges ) return IGNORE;
+
+			// -n is the last n bytes.
+			if( first == -1 )
+			{
+				if( last == 0 || size == 0 ) continue;
+				first = last < size ? size - last : 0;
+				last = size - 1;
+			}
+			else if( first >= size ) continue;
+			else if( last == -1 || last >= size ) last = size - 1;
+
+			ranges.push_back( byte_range( first, last ) );
+		}
+
+		if( !requested ) return IGNORE;
+		if( ranges.empty( ) ) return UNSATISFIABLE;
+
+		merge( );
+		return SATISFIABLE;
+	}
+
+	// Bytes of the file in all ranges.
+	off_t total( ) const
+	{
+		off_t n = 0;
+		for( std::vector< byte_range >::const_iterator i = ranges.begin( ); i != ranges.end( ); ++i )
+			n += i->length( );
+		return n;
+	}
+
+	std::vector< byte_range > ranges;
+
+	// How many the header asked for, before merging.
+	std::size_t requested;
+
+private:
+	// Huge numbers are clamped rather than refused, they are just past
+	// the end of any file.
+	static bool number( const char*& p, off_t& n )
+	{
+		if( *p < '0' || *p > '9' ) return false;
+
+		const off_t max = ( ( off_t( 1 ) << ( sizeof( off_t ) * 8 - 2 ) ) - 1 ) * 2 + 1;
+		for( n = 0; *p >= '0' && *p <= '9'; ++p )
+			n = n > ( max - 9 ) / 10 ? max : n * 10 + ( *p - '0' );
+		return true;
+	}
+
+	void merge( )
+	{
+		std::sort( ranges.begin( ), ranges.end( ) );
+
+		std::vector< byte_range >::iterator out = ranges.begin( );
+		for( std::vector< byte_range >::iterator i = ranges.begin( ) + 1; i != ranges.end( ); ++i )
+		{
+			if( i->first <= out->last + 1 ) out->last = std::max( out->last, i->last );
+			else *++out = *i;
+		}
+		ranges.erase( out + 1, ranges.end( ) );
+	}
+};
+
+/**
+ * Writes the body of a 206.
+ */
+class range_body
+{
+public:
+	// "bytes first-last/size", what Content-Range says.
+	static std::size_t content_range( char* out, std::size_t len, const byte_range& r, off_t size )
+	{
+		return snprintf( out, len, "bytes %lld-%lld/%lld", static_cast< long long >( r.first ),
+			static_cast< long long >( r.last ), static_cast< long long >( size ) );
+	}
+
+	static std::string multipart_type( const std::string& boundary )
+	{
+		return "multipart/byteranges; boundary=" + boundary;
+	}
+
+	// The ranges of fd as file chunks: the one range on its own, or each
+	// as a part of a multipart/byteranges body.
+	static void write( response_builder& out, int fd, buffer* name, const range_set& set, off_t size,
+		const char* type, std::size_t type_len, const std::string& boundary )
+	{
+		const std::vector< byte_range >& ranges = set.ranges;
+		if( ranges.size( ) == 1 )
+		{
+			out.file( fd, ranges[0].first, ranges[0].length( ), name );
+			return;
+		}
+
+		std::string part;
+		part.reserve( boundary.size( ) + type_len + 48 );
+		part.append( "\r\n--" ).append( boundary ).append( "\r\nContent-Type: " );
+		part.append( type, type_len ).append( "\r\nContent-Range: " );
+
+		for( std::vector< byte_range >::const_iterator i = ranges.begin( ); i != ranges.end( ); ++i )
+		{
+			char* p = out.reserve( part.size( ) + 80 );
+			std::memcpy( p, part.data( ), part.size( ) );
+			std::size_t n = part.size( ) + content_range( p + part.size( ), 76, *i, size );
+			std::memcpy( p + n, "\r\n\r\n", 4 );
+			out.commit( n + 4 );
+
+			out.file( fd, i->first, i->length( ), name );
+		}
+
+		out << "\r\n--" << boundary << "--\r\n";
+	}
+};
+
+/**
+ * Spots readers going through a file in consecutive ranges: where each
+ * (client, file) is expected to carry on from, in a small direct-mapped
+ * table.  Clients sharing a slot only cost each other a hint.
+ */
+class readahead_tracker : boost::noncopyable
+{
+public:
+	readahead_tracker( std::size_t entries = 4096 )
+	 : sequential( 0 ), random( 0 )
+	{
+		resize( entries );
+	}
+
+	// Rounded up to a power of two.
+	void resize( std::size_t entries )
+	{
+		std::size_t n = 1;
+		while( n < entries ) n <<= 1;
+		slots.assign( n, slot( ) );
+	}
+
+	// Whether r starts where the client's last range of the file ended.
+	bool advance( const char* client, std::size_t client_len, const struct stat& st, const byte_range& r )
+	{
+		uint64_t key = 14695981039346656037ULL;
+		for( std::size_t i = 0; i < client_len; ++i ) key = ( key ^ static_cast< unsigned char >( client[i] ) ) * 1099511628211ULL;
+		key ^= ( static_cast< uint64_t >( st.st_ino ) ^ ( static_cast< uint64_t >( st.st_dev ) << 40 ) ) * 0x9e3779b97f4a7c15ULL;
+		key |= 1;
+
+		slot& s = slots[ ( key >> 32 ) & ( slots.size( ) - 1 ) ];
+		bool carries_on = s.key == key && s.next == r.first;
+		s.key = key;
+		s.next = r.last + 1;
+
+		++( carries_on ? sequential : random );
+		return carries_on;
+	}
+
+	uint64_t sequential;
+	uint64_t random;
+
+private:
+	struct slot
+	{
+		slot( ) : key( 0 ), next( 0 ) {}
+
+		uint64_t key;
+		off_t next;
+	};
+
+	std::vector< slot > slots;
+};
+
+class mod_range : public Plugin< mod_range >
+{
+public:
+	mod_range( server& srv )
+	 :	Plugin< mod_range >( srv ),
+		enable				( "range.enable" ),
+		exclude_extensions	( "range.exclude-extensions" ),
+		max_ranges			( "range.max-ranges" ),
+		readahead			( "range.readahead" ),
+		boundary			( make_boundary( ) ),
+		singles( 0 ), multis( 0 ), unsatisfiable( 0 )
+	{}
+
+	virtual ~mod_range( ){ }
+
+	typedef boost::mpl::list< 	PhysicalHandler,
+								TriggerHandler > handlers;
+
+	handler_t handle_physical( connection& con )
+	{
+		if( !enable[ con ] || !con.request.http_range ) return HANDLER_GO_ON;
+		if( con.request.http_method != HTTP_METHOD_GET && con.request.http_method != HTTP_METHOD_HEAD )
+			return HANDLER_GO_ON;
+		if( conditional( con ) ) return HANDLER_GO_ON;
+		if( !static_file_request( con, exclude_extensions[ con ] ) ) return HANDLER_GO_ON;
+
+		struct stat st;
+		if( !con.conf.follow_symlink && ( -1 == lstat( con.physical.path->ptr, &st ) || S_ISLNK( st.st_mode ) ) )
+			return HANDLER_GO_ON;
+		if( -1 == stat( con.physical.path->ptr, &st ) || !S_ISREG( st.st_mode ) ) return HANDLER_GO_ON;
+
+		int max = *max_ranges.defaults( ).front( );
+		range_set set;
+		range_set::result r = set.parse( con.request.http_range, st.st_size, max > 0 ? max : 16 );
+		if( r == range_set::IGNORE ) return HANDLER_GO_ON;
+
+		server* s = const_cast< server* >( &srv );
+		char line[ 96 ];
+
+		if( r == range_set::UNSATISFIABLE )
+		{
+			int n = snprintf( line, sizeof( line ), "bytes */%lld", static_cast< long long >( st.st_size ) );
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Range" ), line, n );
+
+			++unsatisfiable;
+			con.http_status = 416;
+			con.file_finished = 1;
+			return HANDLER_FINISHED;
+		}
+
+		int fd = open( con.physical.path->ptr, O_RDONLY | O_CLOEXEC );
+		if( fd == -1 ) return HANDLER_GO_ON;
+
+		const char* type;
+		std::size_t type_len;
+		content_type( con, type, type_len );
+
+		response_builder out( con.write_queue );
+		range_body::write( out, fd, con.physical.path, set, st.st_size, type, type_len, boundary );
+		if( out.failed( ) )
+		{
+			close( fd );
+			chunkqueue_reset( con.write_queue );
+			return HANDLER_GO_ON;
+		}
+
+		hint( con, fd, st, set );
+		close( fd );
+
+		if( set.ranges.size( ) == 1 )
+		{
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Type" ), type, type_len );
+			std::size_t n = range_body::content_range( line, sizeof( line ), set.ranges[0], st.st_size );
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Range" ), line, n );
+			++singles;
+		}
+		else
+		{
+			std::string multipart = range_body::multipart_type( boundary );
+			response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Type" ), multipart.data( ), multipart.size( ) );
+			++multis;
+		}
+
+		struct tm tm;
+		gmtime_r( &st.st_mtime, &tm );
+		std::size_t n = strftime( line, sizeof( line ), "%a, %d %b %Y %H:%M:%S GMT", &tm );
+		response_header_overwrite( s, &con, CONST_STR_LEN( "Last-Modified" ), line, n );
+		response_header_overwrite( s, &con, CONST_STR_LEN( "Accept-Ranges" ), CONST_STR_LEN( "bytes" ) );
+
+		if( con.etag_flags )
+		{
+			pooled_buffer raw, etag;
+			etag_create( raw.get( ), &st, con.etag_flags );
+			etag_mutate( etag.get( ), raw.get( ) );
+			if( !buffer_is_empty( etag.get( ) ) )
+				response_header_overwrite( s, &con, CONST_STR_LEN( "ETag" ), CONST_BUF_LEN( etag.get( ) ) );
+		}
+
+		con.http_status = 206;
+		con.file_finished = 1;
+		return HANDLER_FINISHED;
+	}
+
+	handler_t handle_trigger( )
+	{
+		status_counter_set( CONST_STR_LEN( "range.single" ), static_cast< int >( singles ) );
+		status_counter_set( CONST_STR_LEN( "range.multi" ), static_cast< int >( multis ) );
+		status_counter_set( CONST_STR_LEN( "range.unsatisfiable" ), static_cast< int >( unsatisfiable ) );
+		status_counter_set( CONST_STR_LEN( "range.sequential" ), static_cast< int >( readers.sequential ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< bool >						enable;
+	config_option< std::vector< std::string > >	exclude_extensions;
+	config_option< int >						max_ranges;
+	config_option< int >						readahead;
+
+	// Fixed per process, random enough never to turn up in a file.
+	const std::string boundary;
+
+	readahead_tracker readers;
+	uint64_t singles;
+	uint64_t multis;
+	uint64_t unsatisfiable;
+
+private:
+	// Preconditions of any kind, for mod_staticfile to weigh.
+	static bool conditional( connection& con )
+	{
+		static const char* names[] = { "If-Range", "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since" };
+
+		if( con.request.http_if_none_match || con.request.http_if_modified_since ) return true;
+		for( std::size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i )
+		{
+			if( array_get_element( con.request.headers, names[i], std::strlen( names[i] ) ) ) return true;
+		}
+		return false;
+	}
+
+	static std::string make_boundary( )
+	{
+		uint64_t r = 0;
+		int fd = open( "/dev/urandom", O_RDONLY | O_CLOEXEC );
+		if( fd == -1 || read( fd, &r, sizeof( r ) ) != static_cast< ssize_t >( sizeof( r ) ) )
+			r = ( static_cast< uint64_t >( time( 0 ) ) << 20 ) ^ getpid( );
+		if( fd != -1 ) close( fd );
+
+		char out[ 24 ];
+		snprintf( out, sizeof( out ), "%016llx", static_cast< unsigned long long >( r ) );
+		return out;
+	}
+
+	// As the stat cache picks it, the first suffix that matches.
+	static void content_type( connection& con, const char*& type, std::size_t& len )
+	{
+		const buffer* name = con.physical.path;
+		array* types = con.conf.mimetypes;
+
+		for( std::size_t k = 0; types && k < types->used; ++k )
+		{
+			data_string* ds = reinterpret_cast< data_string* >( types->data[k] );
+			if( !ds->key->used || ds->key->used > name->used ) continue;
+
+			if( 0 == strncasecmp( name->ptr + name->used - ds->key->used, ds->key->ptr, ds->key->used - 1 ) )
+			{
+				type = ds->value->ptr;
+				len = ds->value->used ? ds->value->used - 1 : 0;
+				return;
+			}
+		}
+
+		type = "application/octet-stream";
+		len = sizeof( "application/octet-stream" ) - 1;
+	}
+
+	// Have the kernel start reading what is about to be asked for.
+	void hint( connection& con, int fd, const struct stat& st, const range_set& set )
+	{
+		off_t window = *readahead.defaults( ).front( );
+		if( window <= 0 ) return;
+
+		if( set.ranges.size( ) > 1 )
+		{
+			for( std::vector< byte_range >::const_iterator i = set.ranges.begin( ); i != set.ranges.end( ); ++i )
+				posix_fadvise( fd, i->first, i->length( ), POSIX_FADV_WILLNEED );
+		}
+
+		if( buffer_is_empty( con.dst_addr_buf ) ) return;
+
+		byte_range span( set.ranges.front( ).first, set.ranges.back( ).last );
+		if( readers.advance( CONST_BUF_LEN( con.dst_addr_buf ), st, span ) && span.last + 1 < st.st_size )
+			posix_fadvise( fd, span.last + 1, std::min( window, st.st_size - span.last - 1 ), POSIX_FADV_WILLNEED );
+	}
+};
+
+#endif // _MOD_RANGE_HPP_
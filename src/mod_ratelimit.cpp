@@ -0,0 +1,7 @@
+/**
+ * Per-client token bucket rate limiting, see mod_ratelimit.hpp.
+ */
+
+#include "mod_ratelimit.hpp"
+
+MAKE_PLUGIN( mod_ratelimit, "ratelimit", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,409 @@
+/**
+ * Per-client rate limiting with token buckets, rejecting over-limit
+ * requests in handle_uri_raw before any file or backend work is done.
+ *
+ * Each client has two buckets: one of requests, refilled at
+ * requests-per-second up to burst, and one of bytes, refilled at
+ * bytes-per-second up to one second's worth.  A request is let through if
+ * there is a whole request token and the byte bucket isn't in debt.
+ * Bytes are charged once a second from every connection's
+ * bytes_written_cur_second (plugin triggers run before lighttpd zeroes
+ * it), and when a request ends for what it wrote since, so a client
+ * pulling a big file is cut off from starting more requests until its
+ * debt is paid back.
+ *
+ * Clients are keyed on their address (IPv6 on its /64, which is what a
+ * single client can trivially hop around in), on a request header such as
+ * an API key, or on the authenticated user.  Users aren't known until
+ * mod_auth has run, so that key is checked in handle_physical instead,
+ * which is still before any file is opened or backend started.
+ *
+ * Buckets live in one fixed size open addressing table allocated up
+ * front, so memory stays constant however many clients turn up.  A key
+ * lives within max_probe slots of its home, and when that window is full
+ * a CLOCK sweep over it evicts a bucket that hasn't been used since the
+ * hand last passed.  An evicted client just starts again with a full
+ * bucket, which only ever errs on the side of letting a request through.
+ * Handlers all run on the event loop thread, so there is nothing to lock.
+ *
+ * Config:
+ *  ratelimit.requests-per-second = 10      # per context, 0 is unlimited
+ *  ratelimit.burst = 20                    # per context, default rps
+ *  ratelimit.bytes-per-second = 1048576    # per context, 0 is unlimited
+ *  ratelimit.key = "address"               # per context, "address",
+ *                                          # "user" or "header:X-Api-Key"
+ *  ratelimit.status = 429                  # per context
+ *  ratelimit.table-size = 1048576          # global, buckets
+ */
+
+#ifndef _MOD_RATELIMIT_HPP_
+#define _MOD_RATELIMIT_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <stdint.h>
+#include <time.h>
+
+// One client's buckets, two to a cache line.
+struct rate_bucket
+{
+	uint64_t key;         // 0 is an empty slot
+	uint32_t stamp;       // ms clock of the last refill
+	uint32_t referenced;  // for CLOCK
+	int64_t requests;     // in thousandths of a request
+	int64_t bytes;        // in thousandths, may go negative, i.e. debt
+};
+
+// The limits a bucket is refilled against, taken from the request's
+// config context each time.
+struct rate_limits
+{
+	rate_limits( int64_t rps = 0, int64_t burst = 0, int64_t bps = 0 )
+	 : rps( rps ), burst( burst ? burst : rps ), bps( bps )
+	{}
+
+	int64_t rps;
+	int64_t burst;
+	int64_t bps;
+};
+
+class rate_table : boost::noncopyable
+{
+public:
+	// How far from its home slot a key may live.  Four cache lines.
+	static const std::size_t max_probe = 8;
+
+	rate_table( std::size_t entries = 1 << 20 )
+	 : evictions( 0 ), slots( 0 ), mask( 0 ), used( 0 ), hand( 0 )
+	{
+		resize( entries );
+	}
+
+	~rate_table( )
+	{
+		std::free( slots );
+	}
+
+	// Rounded up to a power of two, and empties the table.
+	void resize( std::size_t entries )
+	{
+		std::size_t n = max_probe;
+		while( n < entries ) n <<= 1;
+
+		void* p = 0;
+		if( posix_memalign( &p, 64, n * sizeof( rate_bucket ) ) ) throw std::bad_alloc( );
+		std::free( slots );
+		slots = static_cast< rate_bucket* >( p );
+		std::memset( slots, 0, n * sizeof( rate_bucket ) );
+
+		mask = n - 1;
+		used = 0;
+	}
+
+	// The bucket of key, refilled to now.  A new client gets full buckets,
+	// taking an empty slot or evicting one if it has to.
+	rate_bucket& find( uint64_t key, uint32_t now, const rate_limits& limits )
+	{
+		// Home from the key as it is, so that all slots are homes.
+		std::size_t home = key & mask;
+		key |= 1;
+
+		for( std::size_t i = 0; i < max_probe; ++i )
+		{
+			rate_bucket& b = slots[ ( home + i ) & mask ];
+			if( b.key == key )
+			{
+				b.referenced = 1;
+				refill( b, now, limits );
+				return b;
+			}
+			if( !b.key )
+			{
+				++used;
+				return fill( b, key, now, limits );
+			}
+		}
+
+		++evictions;
+		return fill( victim( home ), key, now, limits );
+	}
+
+	// Take a request token, false if there isn't one or the client owes
+	// bytes.
+	static bool admit( rate_bucket& b, const rate_limits& limits )
+	{
+		if( limits.bps && b.bytes < 0 ) return false;
+		if( !limits.rps ) return true;
+		if( b.requests < 1000 ) return false;
+
+		b.requests -= 1000;
+		return true;
+	}
+
+	// Whole seconds until admit could succeed.
+	static int retry_after( const rate_bucket& b, const rate_limits& limits )
+	{
+		int64_t ms = 0;
+		if( limits.bps && b.bytes < 0 ) ms = -b.bytes / limits.bps;
+		if( limits.rps && b.requests < 1000 ) ms = std::max( ms, ( 1000 - b.requests ) / limits.rps );
+		return static_cast< int >( ms / 1000 + 1 );
+	}
+
+	static void charge( rate_bucket& b, int64_t bytes )
+	{
+		b.bytes -= bytes * 1000;
+	}
+
+	static void refill( rate_bucket& b, uint32_t now, const rate_limits& limits )
+	{
+		// Unsigned, so it survives the ms clock wrapping.
+		int64_t elapsed = static_cast< uint32_t >( now - b.stamp );
+		b.stamp = now;
+
+		b.requests = std::min( b.requests + elapsed * limits.rps, limits.burst * 1000 );
+		b.bytes = std::min( b.bytes + elapsed * limits.bps, limits.bps * 1000 );
+	}
+
+	std::size_t capacity( ) const { return mask + 1; }
+	std::size_t size( ) const { return used; }
+	std::size_t memory_usage( ) const { return capacity( ) * sizeof( rate_bucket ); }
+
+	uint64_t evictions;
+
+private:
+	static rate_bucket& fill( rate_bucket& b, uint64_t key, uint32_t now, const rate_limits& limits )
+	{
+		b.key = key;
+		b.stamp = now;
+		b.referenced = 1;
+		b.requests = limits.burst * 1000;
+		b.bytes = limits.bps * 1000;
+		return b;
+	}
+
+	// Second chance over the probe window: referenced buckets lose their
+	// bit and are passed over, the first that has none goes.
+	rate_bucket& victim( std::size_t home )
+	{
+		for( std::size_t n = 0; n < 2 * max_probe; ++n )
+		{
+			rate_bucket& b = slots[ ( home + ( hand++ % max_probe ) ) & mask ];
+			if( !b.referenced ) return b;
+			b.referenced = 0;
+		}
+		return slots[ home ];
+	}
+
+	rate_bucket* slots;
+	std::size_t mask;
+	std::size_t used;
+	std::size_t hand;
+};
+
+class mod_ratelimit : public Plugin< mod_ratelimit >
+{
+public:
+	mod_ratelimit( server& srv )
+	 :	Plugin< mod_ratelimit >( srv ),
+		requests_per_second	( "ratelimit.requests-per-second" ),
+		burst				( "ratelimit.burst" ),
+		bytes_per_second	( "ratelimit.bytes-per-second" ),
+		key					( "ratelimit.key" ),
+		status				( "ratelimit.status" ),
+		table_size			( "ratelimit.table-size" ),
+		rejected			( 0 )
+	{}
+
+	virtual ~mod_ratelimit( ){ }
+
+	typedef boost::mpl::list< 	UriRawHandler,
+								PhysicalHandler,
+								ConnectionResetHandler,
+								TriggerHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_ratelimit >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		int n = *table_size.defaults( ).front( );
+		table.resize( n > 0 ? n : 1 << 20 );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_uri_raw( connection& con )
+	{
+		if( key[ con ] == "user" ) return HANDLER_GO_ON;
+		return check( con );
+	}
+
+	handler_t handle_physical( connection& con )
+	{
+		if( key[ con ] != "user" ) return HANDLER_GO_ON;
+		return check( con );
+	}
+
+	// The request is over: charge what it wrote since the last trigger,
+	// then the next request on the connection, or the next connection in
+	// its slot, is nobody's until check( ) says whose it is.
+	handler_t connection_reset( connection& con )
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		if( ndx >= clients.size( ) ) return HANDLER_GO_ON;
+
+		client& c = clients[ ndx ];
+		bill( con, c, now_ms( ) );
+		c.key = 0;
+		return HANDLER_GO_ON;
+	}
+
+	// Charge everyone for the last second's bytes.
+	handler_t handle_trigger( )
+	{
+		uint32_t now = now_ms( );
+
+		for( std::size_t i = 0; srv.conns && i < srv.conns->used; ++i )
+		{
+			const connection& con = *srv.conns->ptr[i];
+			std::size_t ndx = static_cast< std::size_t >( con.ndx );
+			if( ndx >= clients.size( ) ) continue;
+
+			// lighttpd zeroes the count once we're done.
+			bill( con, clients[ ndx ], now );
+			clients[ ndx ].billed = 0;
+		}
+
+		status_counter_set( CONST_STR_LEN( "ratelimit.rejected" ), static_cast< int >( rejected ) );
+		status_counter_set( CONST_STR_LEN( "ratelimit.clients" ), static_cast< int >( table.size( ) ) );
+		status_counter_set( CONST_STR_LEN( "ratelimit.evictions" ), static_cast< int >( table.evictions ) );
+		return HANDLER_GO_ON;
+	}
+
+	// Hash of whatever identifies the client, 0 if there is nothing to
+	// go on (i.e. no such header), which lets the request through.
+	uint64_t client_key( connection& con )
+	{
+		const std::string& k = key[ con ];
+
+		if( k.empty( ) || k == "address" )
+		{
+			const sock_addr& a = con.dst_addr;
+			if( a.plain.sa_family == AF_INET )
+				return hash( &a.ipv4.sin_addr, sizeof( a.ipv4.sin_addr ), AF_INET );
+			if( a.plain.sa_family == AF_INET6 )
+				return hash( &a.ipv6.sin6_addr, 8, AF_INET6 );
+			return 0;
+		}
+
+		if( k == "user" )
+		{
+			return buffer_is_empty( con.authed_user ) ? 0 : hash( con.authed_user->ptr, con.authed_user->used - 1, 'u' );
+		}
+
+		if( 0 == k.compare( 0, 7, "header:" ) )
+		{
+			data_string* ds = reinterpret_cast< data_string* >(
+				array_get_element( con.request.headers, k.data( ) + 7, k.size( ) - 7 ) );
+			return ( ds && !buffer_is_empty( ds->value ) ) ? hash( ds->value->ptr, ds->value->used - 1, 'h' ) : 0;
+		}
+
+		return 0;
+	}
+
+	static uint64_t hash( const void* p, std::size_t len, uint64_t seed )
+	{
+		const unsigned char* c = static_cast< const unsigned char* >( p );
+		uint64_t h = 14695981039346656037ULL ^ ( seed * 0x9e3779b97f4a7c15ULL );
+		for( std::size_t i = 0; i < len; ++i )
+			h = ( h ^ c[i] ) * 1099511628211ULL;
+
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static uint32_t now_ms( )
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+		return static_cast< uint32_t >( uint64_t( ts.tv_sec ) * 1000 + ts.tv_nsec / 1000000 );
+	}
+
+	config_option< int >			requests_per_second;
+	config_option< int >			burst;
+	config_option< int >			bytes_per_second;
+	config_option< std::string >	key;
+	config_option< int >			status;
+	config_option< int >			table_size;
+
+	rate_table table;
+	uint64_t rejected;
+
+private:
+	// Who each connection's current request belongs to, for charging its
+	// bytes from handle_trigger.
+	struct client
+	{
+		client( ) : key( 0 ), billed( 0 ) {}
+
+		uint64_t key;
+		rate_limits limits;
+
+		// How much of the connection's bytes_written_cur_second has been
+		// charged already, by an earlier request in the same second.
+		off_t billed;
+	};
+
+	// Charge c for what con has written and c hasn't been charged for.
+	void bill( const connection& con, client& c, uint32_t now )
+	{
+		off_t unbilled = con.bytes_written_cur_second - c.billed;
+		if( c.key && unbilled > 0 ) rate_table::charge( table.find( c.key, now, c.limits ), unbilled );
+		c.billed = con.bytes_written_cur_second;
+	}
+
+	handler_t check( connection& con )
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		if( ndx >= clients.size( ) ) clients.resize( ndx + 1 );
+		client& c = clients[ ndx ];
+		c.key = 0;
+
+		rate_limits limits( requests_per_second[ con ], burst[ con ], bytes_per_second[ con ] );
+		if( limits.rps <= 0 && limits.bps <= 0 ) return HANDLER_GO_ON;
+		if( limits.rps < 0 ) limits.rps = 0;
+		if( limits.bps < 0 ) limits.bps = 0;
+
+		c.key = client_key( con );
+		c.limits = limits;
+		if( !c.key ) return HANDLER_GO_ON;
+
+		rate_bucket& b = table.find( c.key, now_ms( ), limits );
+		if( rate_table::admit( b, limits ) ) return HANDLER_GO_ON;
+
+		char retry[ 16 ];
+		int len = snprintf( retry, sizeof( retry ), "%d", rate_table::retry_after( b, limits ) );
+		response_header_overwrite( const_cast< server* >( &srv ), &con, CONST_STR_LEN( "Retry-After" ), retry, len );
+
+		++rejected;
+		int s = status[ con ];
+		con.http_status = s > 0 ? s : 429;
+		return HANDLER_FINISHED;
+	}
+
+	std::vector< client > clients;
+};
+
+#endif // _MOD_RATELIMIT_HPP_
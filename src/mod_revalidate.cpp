@@ -0,0 +1,8 @@
+/**
+ * Answers conditional requests for unchanged static files with a 304,
+ * see mod_revalidate.hpp.
+ */
+
+#include "mod_revalidate.hpp"
+
+MAKE_PLUGIN( mod_revalidate, "revalidate", LIGHTTPD_VERSION_ID );
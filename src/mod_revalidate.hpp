@@ -0,0 +1,280 @@
+/**
+ * Answers conditional revalidations of static files with a 304 at
+ * handle_physical, before the stat cache, any file open or any backend
+ * gets a look in.
+ *
+ * The ETag and Last-Modified strings of each file version are formatted
+ * once and kept in a small direct-mapped table keyed by (device, inode,
+ * mtime, size) and con.etag_flags.  If-None-Match and If-Modified-Since
+ * are then compared straight against the cached strings, so a
+ * revalidation costs one stat() and a couple of string compares.  A file
+ * that changes gets a new mtime or size and so simply misses, and its
+ * new version overwrites the old one in the same slot.
+ *
+ * The ETags are the same strings mod_staticfile sends, so a validator
+ * handed out on a full response matches here and vice versa.
+ *
+ * Only GET and HEAD are answered.  If-None-Match wins over
+ * If-Modified-Since when both are given, as RFC 7232 says.  Anything we
+ * are unsure of (not a regular file, a symlink when they aren't followed,
+ * a request a backend has taken, an excluded extension) goes on to the
+ * normal path.  Without an exclude list the usual script extensions are
+ * excluded (see static_file.hpp), as a script's own mtime says nothing
+ * about the page it makes.
+ *
+ * Config:
+ *  revalidate.enable = "enable"                          # per context
+ *  revalidate.exclude-extensions = ( ".php", ".pl" )     # per context
+ *  revalidate.cache-entries = 4096                       # global
+ */
+
+#ifndef _MOD_REVALIDATE_HPP_
+#define _MOD_REVALIDATE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/static_file.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// The validators of one version of one file.
+struct file_validators
+{
+	file_validators( )
+	 : dev( 0 ), ino( 0 ), mtime( 0 ), size( -1 ), flags( -1 ), etag_len( 0 ), last_modified_len( 0 )
+	{
+		etag[0] = last_modified[0] = '\0';
+	}
+
+	bool same_version( const struct stat& st, int etag_flags ) const
+	{
+		return ino == st.st_ino && dev == st.st_dev && mtime == st.st_mtime
+			&& size == st.st_size && flags == etag_flags;
+	}
+
+	void assign( const struct stat& st, int etag_flags )
+	{
+		dev = st.st_dev;
+		ino = st.st_ino;
+		mtime = st.st_mtime;
+		size = st.st_size;
+		flags = etag_flags;
+
+		etag_len = format_etag( st, etag_flags, etag );
+		last_modified_len = format_http_date( st.st_mtime, last_modified );
+	}
+
+	// Any entity tag of an If-None-Match list, weak or strong, or "*".
+	bool etag_matches( const char* header ) const
+	{
+		if( !etag_len ) return false;
+
+		for( const char* p = header; *p; )
+		{
+			while( *p == ' ' || *p == '\t' || *p == ',' ) ++p;
+			if( !*p ) break;
+
+			const char* end = p;
+			while( *end && *end != ',' ) ++end;
+
+			const char* last = end;
+			while( last > p && ( last[-1] == ' ' || last[-1] == '\t' ) ) --last;
+
+			if( last - p == 1 && *p == '*' ) return true;
+			if( last - p > 2 && p[0] == 'W' && p[1] == '/' ) p += 2;
+			if( static_cast< std::size_t >( last - p ) == etag_len && 0 == std::memcmp( p, etag, etag_len ) )
+				return true;
+
+			p = end;
+		}
+		return false;
+	}
+
+	// If-Modified-Since, usually just our own Last-Modified echoed back.
+	bool unmodified_since( const char* header ) const
+	{
+		// Old Netscapes append "; length=...".
+		std::size_t len = std::strcspn( header, ";" );
+		while( len && header[ len - 1 ] == ' ' ) --len;
+
+		if( len == last_modified_len && 0 == std::memcmp( header, last_modified, len ) ) return true;
+
+		std::string date( header, len );
+		struct tm tm;
+		std::memset( &tm, 0, sizeof( tm ) );
+		const char* rest = strptime( date.c_str( ), "%a, %d %b %Y %H:%M:%S GMT", &tm );
+		if( !rest || *rest ) return false;
+
+		return mtime <= timegm( &tm );
+	}
+
+	// lighttpd's etag_create and etag_mutate: the enabled fields joined
+	// with '-', hashed and quoted.
+	static std::size_t format_etag( const struct stat& st, int flags, char* out )
+	{
+		if( !flags ) return 0;
+
+		char raw[ 64 ];
+		int n = 0;
+		if( flags & ETAG_USE_INODE ) n += snprintf( raw + n, sizeof( raw ) - n, "%lld-", static_cast< long long >( static_cast< off_t >( st.st_ino ) ) );
+		if( flags & ETAG_USE_SIZE ) n += snprintf( raw + n, sizeof( raw ) - n, "%lld-", static_cast< long long >( st.st_size ) );
+		if( flags & ETAG_USE_MTIME ) n += snprintf( raw + n, sizeof( raw ) - n, "%ld", static_cast< long >( st.st_mtime ) );
+
+		uint32_t h = 0;
+		for( int i = 0; i < n; ++i ) h = ( h << 5 ) ^ ( h >> 27 ) ^ raw[i];
+
+		return snprintf( out, etag_max, "\"%lu\"", static_cast< unsigned long >( h ) );
+	}
+
+	static std::size_t format_http_date( time_t t, char* out )
+	{
+		struct tm tm;
+		gmtime_r( &t, &tm );
+		return strftime( out, last_modified_max, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+	}
+
+	static const std::size_t etag_max = 16;
+	static const std::size_t last_modified_max = 32;
+
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	int flags;
+
+	char etag[ etag_max ];
+	unsigned char etag_len;
+	char last_modified[ last_modified_max ];
+	unsigned char last_modified_len;
+};
+
+// File versions to their validators, one entry per slot.
+class validator_cache : boost::noncopyable
+{
+public:
+	validator_cache( std::size_t entries = 4096 )
+	 : hits( 0 ), misses( 0 )
+	{
+		resize( entries );
+	}
+
+	// Rounded up to a power of two.
+	void resize( std::size_t entries )
+	{
+		std::size_t n = 1;
+		while( n < entries ) n <<= 1;
+		slots.assign( n, file_validators( ) );
+	}
+
+	std::size_t size( ) const { return slots.size( ); }
+
+	// Always succeeds, formatting the strings on a miss.
+	const file_validators& lookup( const struct stat& st, int etag_flags )
+	{
+		uint64_t h = ( static_cast< uint64_t >( st.st_ino ) ^ ( static_cast< uint64_t >( st.st_dev ) << 32 ) ) * 0x9e3779b97f4a7c15ULL;
+		file_validators& v = slots[ ( h >> 32 ) & ( slots.size( ) - 1 ) ];
+
+		if( v.same_version( st, etag_flags ) )
+		{
+			++hits;
+			return v;
+		}
+
+		++misses;
+		v.assign( st, etag_flags );
+		return v;
+	}
+
+	uint64_t hits;
+	uint64_t misses;
+
+private:
+	std::vector< file_validators > slots;
+};
+
+class mod_revalidate : public Plugin< mod_revalidate >
+{
+public:
+	mod_revalidate( server& srv )
+	 :	Plugin< mod_revalidate >( srv ),
+		enable				( "revalidate.enable" ),
+		exclude_extensions	( "revalidate.exclude-extensions" ),
+		cache_entries		( "revalidate.cache-entries" ),
+		not_modified		( 0 )
+	{}
+
+	virtual ~mod_revalidate( ){ }
+
+	typedef boost::mpl::list< 	PhysicalHandler,
+								TriggerHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_revalidate >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		configure( );
+		return HANDLER_GO_ON;
+	}
+
+	void configure( )
+	{
+		int n = *cache_entries.defaults( ).front( );
+		cache.resize( n > 0 ? n : 4096 );
+	}
+
+	handler_t handle_physical( connection& con )
+	{
+		if( !enable[ con ] ) return HANDLER_GO_ON;
+		if( con.request.http_method != HTTP_METHOD_GET && con.request.http_method != HTTP_METHOD_HEAD )
+			return HANDLER_GO_ON;
+
+		const char* inm = con.request.http_if_none_match;
+		const char* ims = con.request.http_if_modified_since;
+		if( !inm && !ims ) return HANDLER_GO_ON;
+		if( !static_file_request( con, exclude_extensions[ con ] ) ) return HANDLER_GO_ON;
+
+		struct stat st;
+		if( !con.conf.follow_symlink && ( -1 == lstat( con.physical.path->ptr, &st ) || S_ISLNK( st.st_mode ) ) )
+			return HANDLER_GO_ON;
+		if( -1 == stat( con.physical.path->ptr, &st ) || !S_ISREG( st.st_mode ) ) return HANDLER_GO_ON;
+
+		const file_validators& v = cache.lookup( st, con.etag_flags );
+		if( !( inm ? v.etag_matches( inm ) : v.unmodified_since( ims ) ) ) return HANDLER_GO_ON;
+
+		server* s = const_cast< server* >( &srv );
+		if( v.etag_len ) response_header_overwrite( s, &con, CONST_STR_LEN( "ETag" ), v.etag, v.etag_len );
+		response_header_overwrite( s, &con, CONST_STR_LEN( "Last-Modified" ), v.last_modified, v.last_modified_len );
+
+		++not_modified;
+		con.http_status = 304;
+		return HANDLER_FINISHED;
+	}
+
+	handler_t handle_trigger( )
+	{
+		status_counter_set( CONST_STR_LEN( "revalidate.not-modified" ), static_cast< int >( not_modified ) );
+		status_counter_set( CONST_STR_LEN( "revalidate.cache-hits" ), static_cast< int >( cache.hits ) );
+		status_counter_set( CONST_STR_LEN( "revalidate.cache-misses" ), static_cast< int >( cache.misses ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< bool >						enable;
+	config_option< std::vector< std::string > >	exclude_extensions;
+	config_option< int >						cache_entries;
+
+	validator_cache cache;
+	uint64_t not_modified;
+};
+
+#endif // _MOD_REVALIDATE_HPP_
@@ -0,0 +1,7 @@
+/**
+ * Shared memory response cache, see mod_shm_cache.hpp.
+ */
+
+#include "mod_shm_cache.hpp"
+
+MAKE_PLUGIN( mod_shm_cache, "shm_cache", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,1107 @@
+/**
+ * Caches whole backend responses (status, headers and body) in one
+ * shared memory arena mapped before lighttpd forks its workers, so every
+ * worker hits on what any of them stored and memory doesn't grow with
+ * server.max-worker.
+ *
+ * The arena is split into an index and a ring of equal segments.  Entries
+ * are appended to the current segment; when it fills up the next one in
+ * the ring is wiped and becomes current, dropping everything in it.  An
+ * entry hit while in the older half of the ring is appended again, so
+ * what is still being asked for moves forward and what isn't ages out a
+ * segment at a time: an LRU with segment granularity and no list to keep.
+ *
+ * The index is an open addressing table of 64 bit words (a hash tag and
+ * where the entry is), looked up and replaced with plain atomic loads and
+ * CAS, eight to a cache line.  Each segment has an epoch that is bumped
+ * when it is wiped, and each entry a stamp of its segment's epoch written
+ * after the rest of it.  A reader checks the stamp, copies the entry out
+ * and checks the epoch again, like a seqlock, so an index word left over
+ * from a wiped segment or an entry being overwritten under it is a miss,
+ * never a torn read.  Only moving on to the next segment takes a lock,
+ * and it waits for anyone still writing to the segment it wipes.
+ *
+ * Entries are keyed on method, scheme, host, the port the request came in
+ * on, URI and the config contexts the request matched, and on the
+ * request's values of whatever the response listed in Vary: a primary
+ * entry then just holds the header names, and the response itself is
+ * under the longer key.  Lookups are from handle_physical, so mod_access,
+ * mod_auth and the like have had their say first.
+ * Freshness comes from Cache-Control s-maxage or max-age, and
+ * stale-while-revalidate (or shm-cache.stale-while-revalidate) says how
+ * long after that an entry may still be served.  The first request to find
+ * an entry stale claims it, in a small shared table of claims, and goes on
+ * to the backend, whose response replaces the entry; every other request,
+ * in any worker, gets the stale copy until then or until the claim times
+ * out.
+ *
+ * Only GET responses without Set-Cookie, private or no-store are stored,
+ * and HEAD is answered from them.  Requests with an Authorization header
+ * are left alone.  Load this after mod_stream_compress, so its filter has
+ * run by the time the body is copied.
+ *
+ * Config:
+ *  shm-cache.enable = "enable"                   # per context
+ *  shm-cache.default-ttl = 0                     # per context, seconds for
+ *                                                # responses without max-age
+ *  shm-cache.stale-while-revalidate = 0          # per context, seconds
+ *  shm-cache.size = 67108864                     # global, bytes, fixed at
+ *                                                # startup
+ *  shm-cache.max-object-size = 1048576           # global, bytes
+ */
+
+#ifndef _MOD_SHM_CACHE_HPP_
+#define _MOD_SHM_CACHE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/response_builder.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// What is kept of a response.
+struct cache_object
+{
+	cache_object( ) : status( 0 ), stored( 0 ), expires( 0 ), stale_until( 0 ), vary( false ) {}
+
+	int status;
+	std::string headers;    // "Name: value\r\n" each, or Vary names for a
+	std::string body;       // primary entry
+	time_t stored;
+	time_t expires;
+	time_t stale_until;
+	bool vary;
+};
+
+// What Cache-Control says about storing a response.
+struct cache_policy
+{
+	cache_policy( ) : storable( true ), max_age( -1 ), stale( -1 ) {}
+
+	static cache_policy parse( const char* p, std::size_t len )
+	{
+		cache_policy c;
+		int max_age = -1, s_maxage = -1;
+
+		for( std::size_t i = 0; i < len; )
+		{
+			while( i < len && ( p[i] == ' ' || p[i] == '\t' || p[i] == ',' ) ) ++i;
+			std::size_t start = i;
+			while( i < len && p[i] != ',' ) ++i;
+
+			std::size_t end = i;
+			while( end > start && ( p[end - 1] == ' ' || p[end - 1] == '\t' ) ) --end;
+			const char* d = p + start;
+			std::size_t n = end - start;
+
+			if( token( d, n, "no-store" ) || token( d, n, "private" ) || token( d, n, "no-cache" ) )
+				c.storable = false;
+			else
+			{
+				value( d, n, "max-age=", max_age );
+				value( d, n, "s-maxage=", s_maxage );
+				value( d, n, "stale-while-revalidate=", c.stale );
+			}
+		}
+
+		// A shared cache goes by s-maxage first.
+		c.max_age = s_maxage >= 0 ? s_maxage : max_age;
+		return c;
+	}
+
+	bool storable;
+	int max_age;    // -1 if not given
+	int stale;      // stale-while-revalidate, -1 if not given
+
+private:
+	static bool token( const char* d, std::size_t n, const char* name )
+	{
+		return n == std::strlen( name ) && 0 == strncasecmp( d, name, n );
+	}
+
+	static void value( const char* d, std::size_t n, const char* name, int& out )
+	{
+		std::size_t l = std::strlen( name );
+		if( n <= l || 0 != strncasecmp( d, name, l ) ) return;
+
+		int v = 0;
+		for( std::size_t i = l; i < n; ++i )
+		{
+			if( d[i] == '"' ) continue;
+			if( d[i] < '0' || d[i] > '9' ) return;
+			if( v < 100000000 ) v = v * 10 + ( d[i] - '0' );
+		}
+		out = v;
+	}
+};
+
+/**
+ * The shared arena.  Create it before forking; everything after that is
+ * safe from any number of processes at once.
+ */
+class shm_cache : boost::noncopyable
+{
+public:
+	enum result
+	{
+		MISS,
+		FRESH,
+		STALE,          // being revalidated by someone else, serve it
+		REVALIDATE      // stale and ours to revalidate, go to the backend
+	};
+
+	// Index words per cache line, which is as far as a key is probed.
+	static const std::size_t probe = 8;
+	static const std::size_t claims = 1024;
+
+	// How long a claim to revalidate keeps others off.
+	static const time_t claim_timeout = 10;
+
+	shm_cache( ) : arena( 0 ), arena_size( 0 ), hdr( 0 ) {}
+
+	~shm_cache( )
+	{
+		if( arena ) munmap( arena, arena_size );
+	}
+
+	// Map bytes of shared memory, split about 1/64 into segments.
+	bool create( std::size_t bytes )
+	{
+		if( arena ) return true;
+
+		std::size_t segment_bytes = std::max< std::size_t >( bytes / 64, 64 * 1024 );
+		if( segment_bytes > max_segment ) segment_bytes = max_segment;
+		segment_bytes &= ~static_cast< std::size_t >( 63 );
+
+		std::size_t nslots = probe;
+		while( nslots * 512 < bytes ) nslots <<= 1;
+
+		std::size_t meta = round_up( sizeof( header ) ) + round_up( nslots * sizeof( word ) )
+			+ round_up( claims * sizeof( word ) );
+		if( bytes < meta + 64 ) return false;
+
+		// Less a line for rounding up the segment table.
+		std::size_t nsegments = ( bytes - meta - 64 ) / ( segment_bytes + sizeof( segment ) );
+		if( nsegments < 4 || nsegments > 65535 ) return false;
+		meta += round_up( nsegments * sizeof( segment ) );
+
+		void* p = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+		if( p == MAP_FAILED ) return false;
+
+		arena = reinterpret_cast< char* >( p );
+		arena_size = bytes;
+
+		char* next = arena;
+		hdr = new( next ) header;
+		next += round_up( sizeof( header ) );
+		slots = reinterpret_cast< word* >( next );
+		next += round_up( nslots * sizeof( word ) );
+		locks = reinterpret_cast< word* >( next );
+		next += round_up( claims * sizeof( word ) );
+		segments = reinterpret_cast< segment* >( next );
+		data = arena + meta;
+
+		for( std::size_t i = 0; i < nslots; ++i ) new( &slots[i] ) word( 0 );
+		for( std::size_t i = 0; i < claims; ++i ) new( &locks[i] ) word( 0 );
+		for( std::size_t i = 0; i < nsegments; ++i ) new( &segments[i] ) segment;
+
+		hdr->nslots = nslots;
+		hdr->nsegments = nsegments;
+		hdr->segment_bytes = segment_bytes;
+
+		if( !slots[0].is_lock_free( ) )
+		{
+			munmap( arena, arena_size );
+			arena = 0;
+			hdr = 0;
+			return false;
+		}
+		return true;
+	}
+
+	bool valid( ) const { return hdr != 0; }
+
+	// The biggest key plus object that fits.
+	std::size_t max_entry( ) const { return hdr ? hdr->segment_bytes / 2 : 0; }
+
+	static uint64_t hash( const std::string& key )
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for( std::size_t i = 0; i < key.size( ); ++i )
+			h = ( h ^ static_cast< unsigned char >( key[i] ) ) * 1099511628211ULL;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	result find( const std::string& key, time_t now, cache_object& out )
+	{
+		if( !hdr ) return MISS;
+
+		uint64_t h = hash( key );
+		word* w = window( h );
+
+		for( std::size_t j = 0; j < probe; ++j )
+		{
+			uint64_t v = w[j].load( boost::memory_order_acquire );
+			if( !v || tag_of( v ) != tag( h ) || !read( v, h, key, out ) ) continue;
+
+			if( now < out.expires )
+			{
+				// Near the end of the ring, move it to the front.
+				if( age( segment_of( v ) ) >= hdr->nsegments / 2 ) store( key, out );
+				return FRESH;
+			}
+			if( now >= out.stale_until ) return MISS;
+			return claim( h, now ) ? REVALIDATE : STALE;
+		}
+		return MISS;
+	}
+
+	bool store( const std::string& key, const cache_object& obj )
+	{
+		if( !hdr ) return false;
+
+		std::size_t total = round_up( sizeof( record ) + key.size( ) + obj.headers.size( ) + obj.body.size( ), 8 );
+		if( total > max_entry( ) ) return false;
+
+		uint32_t seg, off, epoch;
+		reserve( total, seg, off, epoch );
+
+		uint64_t h = hash( key );
+		record* r = at( seg, off );
+		r->stamp.store( 0, boost::memory_order_relaxed );
+		r->hash = h;
+		r->stored = obj.stored;
+		r->expires = obj.expires;
+		r->stale_until = obj.stale_until;
+		r->key_len = key.size( );
+		r->head_len = obj.headers.size( );
+		r->body_len = obj.body.size( );
+		r->status = obj.status;
+		r->flags = obj.vary ? VARY : 0;
+
+		char* p = reinterpret_cast< char* >( r + 1 );
+		std::memcpy( p, key.data( ), key.size( ) );
+		std::memcpy( p + key.size( ), obj.headers.data( ), obj.headers.size( ) );
+		std::memcpy( p + key.size( ) + obj.headers.size( ), obj.body.data( ), obj.body.size( ) );
+
+		// Last, everything above is in place for whoever sees this.
+		r->stamp.store( stamp( epoch, h ), boost::memory_order_release );
+		done( seg );
+
+		publish( h, make_word( h, seg, off ) );
+		unclaim( h );
+		++hdr->stores;
+		return true;
+	}
+
+	// Count a lookup's outcome in the shared counters.
+	void account( result r )
+	{
+		if( !hdr ) return;
+		if( r == FRESH ) ++hdr->hits;
+		else if( r == STALE ) ++hdr->stale;
+		else ++hdr->misses;
+	}
+
+	uint64_t hits( ) const { return hdr ? hdr->hits.load( ) : 0; }
+	uint64_t stale( ) const { return hdr ? hdr->stale.load( ) : 0; }
+	uint64_t misses( ) const { return hdr ? hdr->misses.load( ) : 0; }
+	uint64_t stores( ) const { return hdr ? hdr->stores.load( ) : 0; }
+	uint64_t evictions( ) const { return hdr ? hdr->evictions.load( ) : 0; }
+
+	std::size_t segment_count( ) const { return hdr ? hdr->nsegments : 0; }
+	std::size_t segment_size( ) const { return hdr ? hdr->segment_bytes : 0; }
+
+private:
+	typedef boost::atomic< uint64_t > word;
+
+	// Offsets are kept in 8 byte units in 24 bits of an index word.
+	static const std::size_t max_segment = std::size_t( 1 ) << 27;
+
+	// Far past the end of any segment, with room to spare for the
+	// fetch_adds of writers that find it so.
+	static const uint32_t closed = 0x80000000u;
+
+	enum { VARY = 1 };
+
+	struct header
+	{
+		header( ) : nslots( 0 ), nsegments( 0 ), segment_bytes( 0 ), head( 0 ), rollover( 0 ),
+			hits( 0 ), stale( 0 ), misses( 0 ), stores( 0 ), evictions( 0 ) {}
+
+		std::size_t nslots;
+		std::size_t nsegments;
+		std::size_t segment_bytes;
+
+		boost::atomic< uint32_t > head;         // the segment being filled
+		boost::atomic< uint32_t > rollover;     // held while moving on from it
+
+		boost::atomic< uint64_t > hits;
+		boost::atomic< uint64_t > stale;
+		boost::atomic< uint64_t > misses;
+		boost::atomic< uint64_t > stores;
+		boost::atomic< uint64_t > evictions;
+	};
+
+	struct segment
+	{
+		segment( ) : epoch( 1 ), fill( 0 ), writers( 0 ) {}
+
+		boost::atomic< uint32_t > epoch;        // bumped when it is wiped
+		boost::atomic< uint32_t > fill;         // closed while being wiped
+		boost::atomic< int32_t > writers;
+	};
+
+	// Followed by the key, the headers and the body.
+	struct record
+	{
+		word stamp;                 // segment epoch and hash, 0 while written
+		uint64_t hash;
+		int64_t stored;
+		int64_t expires;
+		int64_t stale_until;
+		uint32_t key_len;
+		uint32_t head_len;
+		uint32_t body_len;
+		uint16_t status;
+		uint16_t flags;
+	};
+
+	static std::size_t round_up( std::size_t n, std::size_t to = 64 )
+	{
+		return ( n + to - 1 ) & ~( to - 1 );
+	}
+
+	// Index words: a 24 bit tag with its top bit set, so never 0, then the
+	// segment and the offset in 8 byte units.
+	static uint64_t tag( uint64_t h ) { return ( h >> 40 ) | 0x800000; }
+	static uint64_t tag_of( uint64_t v ) { return v >> 40; }
+	static uint32_t segment_of( uint64_t v ) { return static_cast< uint32_t >( v >> 24 ) & 0xffff; }
+	static uint32_t offset_of( uint64_t v ) { return static_cast< uint32_t >( v & 0xffffff ) * 8; }
+
+	static uint64_t make_word( uint64_t h, uint32_t seg, uint32_t off )
+	{
+		return ( tag( h ) << 40 ) | ( uint64_t( seg ) << 24 ) | ( off / 8 );
+	}
+
+	static uint64_t stamp( uint32_t epoch, uint64_t h )
+	{
+		return ( uint64_t( epoch ) << 32 ) | ( h & 0xffffffff );
+	}
+
+	word* window( uint64_t h ) const
+	{
+		return slots + ( h & ( hdr->nslots - 1 ) & ~( probe - 1 ) );
+	}
+
+	record* at( uint32_t seg, uint32_t off ) const
+	{
+		return reinterpret_cast< record* >( data + std::size_t( seg ) * hdr->segment_bytes + off );
+	}
+
+	// How many segments ago seg was current.
+	std::size_t age( uint32_t seg ) const
+	{
+		return ( hdr->head.load( boost::memory_order_relaxed ) + hdr->nsegments - seg ) % hdr->nsegments;
+	}
+
+	// Copy out the entry v points at if it is still key's, 0 if it was
+	// wiped before or while we looked.
+	bool read( uint64_t v, uint64_t h, const std::string& key, cache_object& out ) const
+	{
+		uint32_t seg = segment_of( v ), off = offset_of( v );
+		if( seg >= hdr->nsegments || off + sizeof( record ) > hdr->segment_bytes ) return false;
+
+		const segment& s = segments[ seg ];
+		uint32_t epoch = s.epoch.load( boost::memory_order_acquire );
+
+		const record* r = at( seg, off );
+		if( r->stamp.load( boost::memory_order_acquire ) != stamp( epoch, h ) ) return false;
+
+		std::size_t key_len = r->key_len, head_len = r->head_len, body_len = r->body_len;
+		if( r->hash != h || key_len != key.size( )
+			|| off + sizeof( record ) + key_len + head_len + body_len > hdr->segment_bytes ) return false;
+
+		const char* p = reinterpret_cast< const char* >( r + 1 );
+		if( 0 != std::memcmp( p, key.data( ), key_len ) ) return false;
+
+		out.status = r->status;
+		out.stored = r->stored;
+		out.expires = r->expires;
+		out.stale_until = r->stale_until;
+		out.vary = r->flags & VARY;
+		out.headers.assign( p + key_len, head_len );
+		out.body.assign( p + key_len + head_len, body_len );
+
+		boost::atomic_thread_fence( boost::memory_order_acquire );
+		return s.epoch.load( boost::memory_order_relaxed ) == epoch;
+	}
+
+	// Is the entry v points at gone with its segment?
+	bool dead( uint64_t v ) const
+	{
+		uint32_t seg = segment_of( v ), off = offset_of( v );
+		if( seg >= hdr->nsegments || off + sizeof( record ) > hdr->segment_bytes ) return true;
+		return ( at( seg, off )->stamp.load( boost::memory_order_acquire ) >> 32 ) != segments[ seg ].epoch.load( );
+	}
+
+	// Room for n bytes in the current segment, moving on if it is full.
+	// The segment can't be wiped until the caller calls done( seg ).
+	void reserve( std::size_t n, uint32_t& seg, uint32_t& off, uint32_t& epoch )
+	{
+		for( ;; )
+		{
+			seg = hdr->head.load( boost::memory_order_acquire );
+			segment& s = segments[ seg ];
+			epoch = s.epoch.load( );
+			off = closed;
+
+			++s.writers;
+			if( s.epoch.load( ) == epoch )
+			{
+				off = s.fill.fetch_add( n );
+				if( off + n <= hdr->segment_bytes ) return;
+			}
+			--s.writers;
+
+			// Full, rather than being wiped under us.
+			if( off < closed && s.epoch.load( ) == epoch )
+				next_segment( seg );
+			else
+				sched_yield( );
+		}
+	}
+
+	void done( uint32_t seg )
+	{
+		--segments[ seg ].writers;
+	}
+
+	// Wipe the segment after full and make it current, unless someone
+	// already has.  Anyone still writing to it from its last time round
+	// the ring (a worker descheduled mid-store) is waited for, up to a
+	// couple of seconds in case they died.
+	void next_segment( uint32_t full )
+	{
+		while( hdr->rollover.exchange( 1, boost::memory_order_acquire ) ) sched_yield( );
+
+		if( hdr->head.load( boost::memory_order_relaxed ) == full )
+		{
+			uint32_t n = ( full + 1 ) % hdr->nsegments;
+			segment& s = segments[n];
+
+			if( s.fill.exchange( closed ) ) ++hdr->evictions;
+			s.epoch.fetch_add( 1 );
+
+			time_t start = time( 0 );
+			while( s.writers.load( ) > 0 && time( 0 ) < start + 2 ) sched_yield( );
+
+			// Still some after the wait, they died mid-store.  Left alone
+			// otherwise, a plain store of 0 could undo the count of one
+			// that has just come in and take it below zero when it leaves.
+			int32_t w = s.writers.load( );
+			while( w > 0 && !s.writers.compare_exchange_weak( w, 0 ) ) {}
+
+			s.fill.store( 0 );
+			hdr->head.store( n, boost::memory_order_release );
+		}
+
+		hdr->rollover.store( 0, boost::memory_order_release );
+	}
+
+	// Point the index at a new entry: over the key's old one, else an
+	// empty or dead word, else whatever is oldest in the window.
+	void publish( uint64_t h, uint64_t v )
+	{
+		word* w = window( h );
+
+		for( int attempt = 0; attempt < 4; ++attempt )
+		{
+			std::size_t pick = probe, oldest = probe, oldest_age = 0;
+			uint64_t expected = 0;
+
+			for( std::size_t j = 0; j < probe; ++j )
+			{
+				uint64_t o = w[j].load( boost::memory_order_acquire );
+				if( o && tag_of( o ) == tag( h ) && !dead( o ) && at( segment_of( o ), offset_of( o ) )->hash == h )
+				{
+					pick = j;
+					expected = o;
+					break;
+				}
+				if( pick == probe && ( !o || dead( o ) ) )
+				{
+					pick = j;
+					expected = o;
+				}
+				if( o && age( segment_of( o ) ) >= oldest_age )
+				{
+					oldest = j;
+					oldest_age = age( segment_of( o ) );
+				}
+			}
+
+			if( pick == probe )
+			{
+				pick = oldest;
+				expected = w[ pick ].load( );
+			}
+
+			if( w[ pick ].compare_exchange_strong( expected, v, boost::memory_order_release ) )
+			{
+				forget_others( w, pick, h );
+				return;
+			}
+		}
+	}
+
+	// Two stores of one key racing can each take a word, keep the last.
+	void forget_others( word* w, std::size_t keep, uint64_t h )
+	{
+		for( std::size_t j = 0; j < probe; ++j )
+		{
+			uint64_t o = w[j].load( boost::memory_order_acquire );
+			if( j == keep || !o || tag_of( o ) != tag( h ) || dead( o ) ) continue;
+			if( at( segment_of( o ), offset_of( o ) )->hash == h ) w[j].compare_exchange_strong( o, 0 );
+		}
+	}
+
+	// Claims are ( hash, until ), one per slot, the newest winning on a
+	// collision.
+	bool claim( uint64_t h, time_t now )
+	{
+		word& l = locks[ h % claims ];
+		uint64_t o = l.load( );
+		uint32_t mine = static_cast< uint32_t >( h >> 32 );
+
+		if( o && static_cast< uint32_t >( o >> 32 ) == mine && static_cast< uint32_t >( o ) > static_cast< uint32_t >( now ) )
+			return false;
+
+		uint64_t v = ( uint64_t( mine ) << 32 ) | static_cast< uint32_t >( now + claim_timeout );
+		return l.compare_exchange_strong( o, v );
+	}
+
+	void unclaim( uint64_t h )
+	{
+		word& l = locks[ h % claims ];
+		uint64_t o = l.load( );
+		if( o && static_cast< uint32_t >( o >> 32 ) == static_cast< uint32_t >( h >> 32 ) )
+			l.compare_exchange_strong( o, 0 );
+	}
+
+	char* arena;
+	std::size_t arena_size;
+
+	header* hdr;
+	word* slots;
+	word* locks;
+	segment* segments;
+	char* data;
+};
+
+class mod_shm_cache : public Plugin< mod_shm_cache >
+{
+public:
+	mod_shm_cache( server& srv )
+	 :	Plugin< mod_shm_cache >( srv ),
+		enable					( "shm-cache.enable" ),
+		default_ttl				( "shm-cache.default-ttl" ),
+		stale_while_revalidate	( "shm-cache.stale-while-revalidate" ),
+		size					( "shm-cache.size" ),
+		max_object_size			( "shm-cache.max-object-size" ),
+		max_object				( 1 << 20 )
+	{}
+
+	virtual ~mod_shm_cache( ){ }
+
+	typedef boost::mpl::list< 	UriCleanHandler,
+								PhysicalHandler,
+								ResponseHeaderHandler,
+								FilterResponseContentHandler,
+								ConnectionResetHandler,
+								TriggerHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_shm_cache >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		configure( );
+		return HANDLER_GO_ON;
+	}
+
+	// set_defaults runs before the workers are forked, so they all share
+	// the one mapping.  Its size can't change after that.
+	void configure( )
+	{
+		if( !cache.valid( ) )
+		{
+			int s = *size.defaults( ).front( );
+			cache.create( s > 0 ? s : 64 << 20 );
+		}
+
+		int m = *max_object_size.defaults( ).front( );
+		max_object = m > 0 ? m : 1 << 20;
+	}
+
+	// A new request, nothing of the last one's carries over.
+	handler_t handle_uri_clean( connection& con )
+	{
+		free_state( con );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_physical( connection& con )
+	{
+		free_state( con );
+
+		if( !enable[ con ] || !cache.valid( ) ) return HANDLER_GO_ON;
+		if( con.request.http_method != HTTP_METHOD_GET && con.request.http_method != HTTP_METHOD_HEAD ) return HANDLER_GO_ON;
+		if( array_get_element( con.request.headers, CONST_STR_LEN( "Authorization" ) ) ) return HANDLER_GO_ON;
+
+		state* s = new state;
+		con.plugin_ctx[ id( ) ] = s;
+		s->key = primary_key( con );
+
+		cache_object obj;
+		shm_cache::result r = cache.find( s->key, srv.cur_ts, obj );
+		if( r != shm_cache::MISS && obj.vary )
+		{
+			obj.vary = false;
+			r = cache.find( variant_key( con, s->key, obj.headers ), srv.cur_ts, obj );
+		}
+		cache.account( r );
+
+		if( r == shm_cache::MISS || r == shm_cache::REVALIDATE ) return HANDLER_GO_ON;
+
+		s->served = true;
+		serve( con, obj, r == shm_cache::FRESH ? "HIT" : "STALE" );
+		return HANDLER_FINISHED;
+	}
+
+	handler_t handle_response_header( connection& con )
+	{
+		state* s = reinterpret_cast< state* >( con.plugin_ctx[ id( ) ] );
+		if( !s || s->served || con.request.http_method != HTTP_METHOD_GET ) return HANDLER_GO_ON;
+		if( !storable_status( con.http_status ) ) return HANDLER_GO_ON;
+		if( response_header( con, "Set-Cookie" ) ) return HANDLER_GO_ON;
+
+		cache_policy policy;
+		if( const data_string* cc = response_header( con, "Cache-Control" ) )
+			policy = cache_policy::parse( CONST_BUF_LEN( cc->value ) );
+		if( !policy.storable ) return HANDLER_GO_ON;
+
+		int ttl = policy.max_age >= 0 ? policy.max_age : default_ttl[ con ];
+		int stale = policy.stale >= 0 ? policy.stale : stale_while_revalidate[ con ];
+		if( ttl <= 0 ) return HANDLER_GO_ON;
+
+		s->vary.clear( );
+		if( const data_string* vary = response_header( con, "Vary" ) )
+		{
+			if( !vary_names( vary->value, s->vary ) ) return HANDLER_GO_ON;
+		}
+
+		s->obj.status = con.http_status;
+		s->obj.stored = srv.cur_ts;
+		s->obj.expires = srv.cur_ts + ttl;
+		s->obj.stale_until = s->obj.expires + std::max( stale, 0 );
+		s->capturing = true;
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_filter_response_content( connection& con )
+	{
+		state* s = reinterpret_cast< state* >( con.plugin_ctx[ id( ) ] );
+		if( !s || !s->capturing ) return HANDLER_GO_ON;
+
+		for( chunk* c = first_new( con, *s ); c && s->capturing; c = c->next )
+		{
+			if( !copy_chunk( *c, *s ) || s->obj.body.size( ) > max_object ) stop_capturing( *s );
+		}
+
+		if( s->capturing && con.file_finished )
+		{
+			store( con, *s );
+			stop_capturing( *s );
+		}
+		return HANDLER_GO_ON;
+	}
+
+	handler_t connection_reset( connection& con )
+	{
+		free_state( con );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_trigger( )
+	{
+		status_counter_set( CONST_STR_LEN( "shm-cache.hits" ), static_cast< int >( cache.hits( ) ) );
+		status_counter_set( CONST_STR_LEN( "shm-cache.stale" ), static_cast< int >( cache.stale( ) ) );
+		status_counter_set( CONST_STR_LEN( "shm-cache.misses" ), static_cast< int >( cache.misses( ) ) );
+		status_counter_set( CONST_STR_LEN( "shm-cache.stores" ), static_cast< int >( cache.stores( ) ) );
+		status_counter_set( CONST_STR_LEN( "shm-cache.evictions" ), static_cast< int >( cache.evictions( ) ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< bool >	enable;
+	config_option< int >	default_ttl;
+	config_option< int >	stale_while_revalidate;
+	config_option< int >	size;
+	config_option< int >	max_object_size;
+
+	std::size_t max_object;
+	shm_cache cache;
+
+private:
+	/**
+	 * Per-connection state.  The chunks already copied are remembered
+	 * in order, as in mod_stream_compress, to tell what the backend added
+	 * since the last pass from what was there before.  By what costs the
+	 * same however big a chunk is: its buffer, length and the bytes at
+	 * either end, or for a file its start and length.  One that was
+	 * already written out when we saw it only has to still be.
+	 */
+	struct state : boost::noncopyable
+	{
+		struct seen
+		{
+			chunk* c;
+			bool done;				// nothing left in it to copy
+			off_t used;				// else its length
+			const char* ptr;		// where it is
+			uint32_t fingerprint;	// and its ends
+		};
+
+		state( ) : served( false ), capturing( false ) {}
+
+		enum { fingerprint_ends = 16 };
+
+		static uint32_t fingerprint( const chunk& c )
+		{
+			uint32_t h = 2166136261u;
+			if( c.type != chunk::MEM_CHUNK ) return h ^ static_cast< uint32_t >( c.file.start );
+
+			const buffer* b = c.mem;
+			std::size_t head = std::min( b->used, std::size_t( fingerprint_ends ) );
+			std::size_t tail = std::max( head, b->used > fingerprint_ends ? b->used - fingerprint_ends : 0 );
+			for( std::size_t i = 0; i < head; ++i )
+			{
+				h ^= static_cast< unsigned char >( b->ptr[i] );
+				h *= 16777619u;
+			}
+			for( std::size_t i = tail; i < b->used; ++i )
+			{
+				h ^= static_cast< unsigned char >( b->ptr[i] );
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		static const char* where( const chunk& c )
+		{
+			if( c.type == chunk::MEM_CHUNK ) return c.mem->ptr;
+			if( c.type == chunk::FILE_CHUNK ) return c.file.name->ptr;
+			return 0;
+		}
+
+		void remember( chunk& c )
+		{
+			if( is_done( c ) )
+			{
+				seen e = { &c, true, 0, 0, 0 };
+				history.push_back( e );
+				return;
+			}
+
+			seen e = { &c, false, length( c ), where( c ), fingerprint( c ) };
+			history.push_back( e );
+		}
+
+		bool matches( const seen& s, chunk* c ) const
+		{
+			if( s.c != c ) return false;
+			if( s.done ) return is_done( *c );
+			return length( *c ) == s.used && where( *c ) == s.ptr && fingerprint( *c ) == s.fingerprint;
+		}
+
+		std::string key;
+		std::vector< std::string > vary;
+		cache_object obj;
+		std::deque< seen > history;
+		bool served;
+		bool capturing;
+	};
+
+	static bool storable_status( int status )
+	{
+		return status == 200 || status == 203 || status == 204 || status == 300
+			|| status == 301 || status == 404 || status == 410;
+	}
+
+	const data_string* response_header( connection& con, const char* name ) const
+	{
+		return reinterpret_cast< const data_string* >(
+			array_get_element( con.response.headers, name, std::strlen( name ) ) );
+	}
+
+	// "GET https://host :443 /uri 1,4", the last being the config contexts
+	// the request matched, as they may send it to different backends.
+	std::string primary_key( connection& con ) const
+	{
+		std::string key( "GET " );
+		if( !buffer_is_empty( con.uri.scheme ) ) key.append( CONST_BUF_LEN( con.uri.scheme ) );
+		key.append( "://" );
+		if( !buffer_is_empty( con.request.http_host ) ) key.append( CONST_BUF_LEN( con.request.http_host ) );
+
+		char port[ 16 ];
+		snprintf( port, sizeof( port ), " :%u ", local_port( con ) );
+		key.append( port );
+		if( !buffer_is_empty( con.request.uri ) ) key.append( CONST_BUF_LEN( con.request.uri ) );
+
+		key.append( 1, ' ' );
+		server* sp = const_cast< server* >( &srv );
+		for( std::size_t i = 1; sp->config_context && i < sp->config_context->used; ++i )
+		{
+			if( !config_check_cond( sp, &con, reinterpret_cast< data_config* >( sp->config_context->data[i] ) ) )
+				continue;
+
+			snprintf( port, sizeof( port ), "%lu,", static_cast< unsigned long >( i ) );
+			key.append( port );
+		}
+		return key;
+	}
+
+	// The port of the socket the request came in on, 0 if unknown.
+	static unsigned local_port( const connection& con )
+	{
+		sock_addr addr;
+		socklen_t len = sizeof( addr );
+		if( 0 != getsockname( con.fd, &addr.plain, &len ) ) return 0;
+
+		if( addr.plain.sa_family == AF_INET ) return ntohs( addr.ipv4.sin_port );
+		if( addr.plain.sa_family == AF_INET6 ) return ntohs( addr.ipv6.sin6_port );
+		return 0;
+	}
+
+	// The primary key and the request's value of each name, one a line.
+	static std::string variant_key( connection& con, const std::string& primary, const std::string& names )
+	{
+		std::string key = primary;
+		for( std::size_t i = 0; i < names.size( ); )
+		{
+			std::size_t nl = names.find( '\n', i );
+			if( nl == std::string::npos ) nl = names.size( );
+
+			key.append( 1, '\n' ).append( names, i, nl - i ).append( 1, ':' );
+			const data_string* ds = reinterpret_cast< const data_string* >(
+				array_get_element( con.request.headers, names.data( ) + i, nl - i ) );
+			if( ds && !buffer_is_empty( ds->value ) ) key.append( CONST_BUF_LEN( ds->value ) );
+
+			i = nl + 1;
+		}
+		return key;
+	}
+
+	// Lower cased names of a Vary header, false for "*".
+	static bool vary_names( const buffer* value, std::vector< std::string >& names )
+	{
+		std::string name;
+		for( std::size_t i = 0; i + 1 <= value->used; ++i )
+		{
+			char c = i + 1 < value->used ? value->ptr[i] : ',';
+			if( c == ',' )
+			{
+				if( name == "*" ) return false;
+				if( !name.empty( ) ) names.push_back( name );
+				name.clear( );
+			}
+			else if( c != ' ' && c != '\t' )
+			{
+				name.append( 1, static_cast< char >( c >= 'A' && c <= 'Z' ? c + 32 : c ) );
+			}
+		}
+
+		std::sort( names.begin( ), names.end( ) );
+		names.erase( std::unique( names.begin( ), names.end( ) ), names.end( ) );
+		return true;
+	}
+
+	// Headers that are the connection's, not the response's.
+	static bool hop_by_hop( const buffer* name )
+	{
+		static const char* skip[] = { "Connection", "Keep-Alive", "Transfer-Encoding", "Content-Length",
+			"Date", "Server", "Age", "X-Cache" };
+
+		for( std::size_t i = 0; i < sizeof( skip ) / sizeof( skip[0] ); ++i )
+		{
+			if( 0 == strcasecmp( name->ptr, skip[i] ) ) return true;
+		}
+		return false;
+	}
+
+	void store( connection& con, state& s )
+	{
+		const array* h = con.response.headers;
+		for( std::size_t i = 0; h && i < h->used; ++i )
+		{
+			const data_string* ds = reinterpret_cast< const data_string* >( h->data[i] );
+			if( buffer_is_empty( ds->key ) || hop_by_hop( ds->key ) ) continue;
+
+			s.obj.headers.append( CONST_BUF_LEN( ds->key ) ).append( ": " );
+			if( !buffer_is_empty( ds->value ) ) s.obj.headers.append( CONST_BUF_LEN( ds->value ) );
+			s.obj.headers.append( "\r\n" );
+		}
+
+		if( s.vary.empty( ) )
+		{
+			cache.store( s.key, s.obj );
+			return;
+		}
+
+		// The names under the primary key for as long as the variant may
+		// be served, the response under its own.
+		cache_object names;
+		names.vary = true;
+		names.stored = s.obj.stored;
+		names.expires = names.stale_until = s.obj.stale_until;
+		for( std::vector< std::string >::const_iterator i = s.vary.begin( ); i != s.vary.end( ); ++i )
+		{
+			if( i != s.vary.begin( ) ) names.headers.append( 1, '\n' );
+			names.headers.append( *i );
+		}
+
+		if( cache.store( variant_key( con, s.key, names.headers ), s.obj ) )
+			cache.store( s.key, names );
+	}
+
+	void serve( connection& con, const cache_object& obj, const char* how )
+	{
+		server* sp = const_cast< server* >( &srv );
+
+		for( std::size_t i = 0; i < obj.headers.size( ); )
+		{
+			std::size_t end = obj.headers.find( "\r\n", i );
+			if( end == std::string::npos ) break;
+
+			std::size_t colon = obj.headers.find( ':', i );
+			if( colon < end )
+			{
+				std::size_t value = std::min( colon + 2, end );
+				response_header_insert( sp, &con, obj.headers.data( ) + i, colon - i,
+					obj.headers.data( ) + value, end - value );
+			}
+			i = end + 2;
+		}
+
+		char age[ 24 ];
+		int n = snprintf( age, sizeof( age ), "%ld", static_cast< long >( std::max< time_t >( srv.cur_ts - obj.stored, 0 ) ) );
+		response_header_overwrite( sp, &con, CONST_STR_LEN( "Age" ), age, n );
+		response_header_overwrite( sp, &con, CONST_STR_LEN( "X-Cache" ), how, std::strlen( how ) );
+
+		response_builder out( con.write_queue );
+		out.append( obj.body.data( ), obj.body.size( ) );
+
+		con.http_status = obj.status;
+		con.file_finished = 1;
+	}
+
+	static off_t length( const chunk& c )
+	{
+		if( c.type == chunk::MEM_CHUNK ) return c.mem->used ? c.mem->used - 1 : 0;
+		if( c.type == chunk::FILE_CHUNK ) return c.file.length;
+		return 0;
+	}
+
+	static bool is_done( const chunk& c )
+	{
+		return c.offset >= length( c );
+	}
+
+	// The first chunk we haven't copied, our copied ones being a run at
+	// the head of the queue minus what has been written out since.
+	chunk* first_new( connection& con, state& s )
+	{
+		chunk* c = con.write_queue->first;
+
+		std::size_t i = 0;
+		while( i < s.history.size( ) && !s.matches( s.history[i], c ) ) ++i;
+
+		if( i == s.history.size( ) )
+		{
+			s.history.clear( );
+			return c;
+		}
+
+		s.history.erase( s.history.begin( ), s.history.begin( ) + i );
+		for( std::size_t j = 0; j < s.history.size( ) && c && s.matches( s.history[j], c ); ++j )
+			c = c->next;
+
+		return c;
+	}
+
+	// Append what is left of c to the body, from where any filter before
+	// us left it.
+	bool copy_chunk( chunk& c, state& s )
+	{
+		off_t len = length( c );
+
+		if( c.type == chunk::MEM_CHUNK && len > c.offset )
+		{
+			s.obj.body.append( c.mem->ptr + c.offset, len - c.offset );
+		}
+		else if( c.type == chunk::FILE_CHUNK && len > c.offset )
+		{
+			if( len - c.offset > static_cast< off_t >( max_object ) ) return false;
+
+			int fd = open( c.file.name->ptr, O_RDONLY | O_CLOEXEC );
+			if( fd == -1 ) return false;
+
+			std::size_t at = s.obj.body.size( );
+			s.obj.body.resize( at + ( len - c.offset ) );
+			ssize_t r = pread( fd, &s.obj.body[ at ], len - c.offset, c.file.start + c.offset );
+			close( fd );
+			if( r != len - c.offset ) return false;
+		}
+
+		s.remember( c );
+		return true;
+	}
+
+	static void stop_capturing( state& s )
+	{
+		s.capturing = false;
+		std::string( ).swap( s.obj.body );
+		s.history.clear( );
+	}
+
+	void free_state( connection& con )
+	{
+		delete reinterpret_cast< state* >( con.plugin_ctx[ id( ) ] );
+		con.plugin_ctx[ id( ) ] = 0;
+	}
+};
+
+#endif // _MOD_SHM_CACHE_HPP_
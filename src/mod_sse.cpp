@@ -0,0 +1,8 @@
+/**
+ * Server-sent events published once and sent to every subscriber from
+ * one shared copy, see mod_sse.hpp.
+ */
+
+#include "mod_sse.hpp"
+
+MAKE_PLUGIN( mod_sse, "sse", LIGHTTPD_VERSION_ID );
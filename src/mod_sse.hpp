@@ -0,0 +1,843 @@
+/**
+ * Server-sent events: publish to a topic once, and every subscriber to
+ * it is sent the event.
+ *
+ * Subscribers GET sse.subscribe-prefix followed by the topic and are
+ * kept as a text/event-stream response.  Events are POSTed to
+ * sse.publish-prefix followed by the topic, the body as the data and
+ * ?event=name for the event's name, published once all of the body is
+ * in; or published from another plugin through the hub.  Topics are
+ * found through an index by name.
+ *
+ * An event is encoded once, into the topic's spool: a file in
+ * sse.tempdir (shared memory by default), appended to until full and
+ * then another started.  Subscribers' write queues get file chunks for
+ * ranges of the spool, so the event goes out to each with sendfile()
+ * from the one copy in the page cache rather than being copied into
+ * every connection's queue.  Events published back to back are one
+ * range, one chunk.  Ranges under sse.copy-below bytes are copied
+ * instead, as another sendfile() costs more than copying so little.
+ * The chunks name the spool rather than holding an fd of it, the core
+ * opens it as it comes to send each, so an event queued to thousands
+ * of subscribers isn't thousands of descriptors.  Each connection keeps
+ * the spools its queue names until it is done with them, and a spool
+ * goes away once no connection does.
+ *
+ * Each topic keeps its last sse.backlog events, for subscribers that
+ * are behind and for ones coming back with a Last-Event-ID.  While more
+ * than sse.max-pending bytes are waiting to go to a subscriber it is
+ * sent nothing more, and sse.slow-policy says what happens to the
+ * events it misses meanwhile:
+ *  wait        it is sent them once it catches up; it is dropped should
+ *              the backlog move on without it
+ *  skip        they are skipped, and it carries on from the latest
+ *  disconnect  its stream is ended, for it to reconnect with its
+ *              Last-Event-ID and be sent what is still in the backlog
+ * Idle streams get a comment every sse.keepalive seconds, so proxies
+ * don't close them.
+ *
+ * Config:
+ *  sse.subscribe-prefix = "/events/"   # per context, unset declines
+ *  sse.publish-prefix = "/publish/"    # per context, unset declines;
+ *                                      # keep it to trusted clients
+ *  sse.max-pending = 262144            # per context, bytes
+ *  sse.slow-policy = "skip"            # per context, wait, skip or disconnect
+ *  sse.keepalive = 15                  # per context, seconds
+ *  sse.backlog = 256                   # global, events kept per topic
+ *  sse.spool-size = 4194304            # global, bytes in a spool file
+ *  sse.copy-below = 1024               # global, bytes, -1 copies nothing
+ *  sse.tempdir = "/dev/shm"            # global
+ */
+
+#ifndef _MOD_SSE_HPP_
+#define _MOD_SSE_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/async_handler.hpp>
+#include <lighttpd-cpp/response_builder.hpp>
+#include <lighttpd-cpp/pooled_buffer.hpp>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * One event as sent, the lines of data each a "data:" line:
+ *
+ *  id: 42
+ *  event: price
+ *  data: first line
+ *  data: second line
+ *
+ * Line breaks in the event name are left out.
+ */
+inline void sse_encode( uint64_t id, const std::string& event, const std::string& data, std::string& out )
+{
+	char head[ 32 ];
+	out.append( head, std::snprintf( head, sizeof( head ), "id: %llu\n", static_cast< unsigned long long >( id ) ) );
+
+	if( !event.empty( ) )
+	{
+		out += "event: ";
+		for( std::string::const_iterator c = event.begin( ); c != event.end( ); ++c )
+		{
+			if( *c != '\r' && *c != '\n' ) out += *c;
+		}
+		out += '\n';
+	}
+
+	// \r\n, \r and \n all end a line.
+	std::size_t start = 0;
+	while( true )
+	{
+		std::size_t end = data.find_first_of( "\r\n", start );
+		out += "data: ";
+		out.append( data, start, end == std::string::npos ? std::string::npos : end - start );
+		out += '\n';
+		if( end == std::string::npos ) break;
+
+		start = end + ( data[ end ] == '\r' && end + 1 < data.size( ) && data[ end + 1 ] == '\n' ? 2 : 1 );
+		if( start == data.size( ) ) break;
+	}
+	out += '\n';
+}
+
+/**
+ * Where a topic's events are encoded, one after another.  A file in
+ * tempdir, mapped to copy small ranges from, or memory when there's no
+ * tempdir or the file can't be made.  Written with pwrite(), so a full
+ * tmpfs is a failed append( ) rather than a SIGBUS.
+ */
+class sse_spool : boost::noncopyable
+{
+public:
+	sse_spool( std::size_t capacity, const std::string& tempdir )
+	 : base( 0 ), fd( -1 ), capacity( std::max( capacity, std::size_t( 1 ) ) ), used( 0 )
+	{
+		if( !tempdir.empty( ) ) make_file( tempdir );
+		if( fd == -1 )
+		{
+			memory.resize( this->capacity );
+			base = &memory[0];
+		}
+	}
+
+	~sse_spool( )
+	{
+		if( fd == -1 ) return;
+		munmap( base, capacity );
+		close( fd );
+		unlink( path.c_str( ) );
+	}
+
+	// Where it went, -1 when there isn't room.
+	off_t append( const char* p, std::size_t len )
+	{
+		if( len > capacity - used ) return -1;
+
+		if( fd == -1 )
+		{
+			std::memcpy( base + used, p, len );
+		}
+		else
+		{
+			for( std::size_t done = 0; done < len; )
+			{
+				ssize_t n = pwrite( fd, p + done, len - done, used + done );
+				if( n < 0 && errno == EINTR ) continue;
+				if( n <= 0 )
+				{
+					// Whatever made it in is never pointed at, start another.
+					used = capacity;
+					return -1;
+				}
+				done += n;
+			}
+		}
+
+		off_t at = used;
+		used += len;
+		return at;
+	}
+
+	const char* data( ) const { return base; }
+	std::size_t size( ) const { return used; }
+
+	// -1 when in memory.
+	int file( ) const { return fd; }
+	const std::string& file_name( ) const { return path; }
+
+private:
+	// Under its name while we live, as shared_fragment's, for network
+	// backends that open file chunks by name.
+	void make_file( const std::string& tempdir )
+	{
+		std::string name = tempdir + "/lighttpd-sse-XXXXXX";
+		std::vector< char > templ( name.begin( ), name.end( ) );
+		templ.push_back( '\0' );
+
+		int f = mkstemp( &templ[0] );
+		if( f == -1 ) return;
+
+		void* p = mmap( NULL, capacity, PROT_READ, MAP_SHARED, f, 0 );
+		if( p == MAP_FAILED )
+		{
+			close( f );
+			unlink( &templ[0] );
+			return;
+		}
+
+		fcntl( f, F_SETFD, FD_CLOEXEC );
+		base = static_cast< char* >( p );
+		fd = f;
+		path = &templ[0];
+	}
+
+	char* base;
+	int fd;
+	std::string path;
+	std::vector< char > memory;
+	const std::size_t capacity;
+	std::size_t used;
+};
+
+typedef boost::shared_ptr< sse_spool > sse_spool_ptr;
+
+struct sse_message
+{
+	sse_message( uint64_t id, const sse_spool_ptr& spool, off_t offset, std::size_t length )
+	 : id( id ), spool( spool ), offset( offset ), length( length )
+	{}
+
+	uint64_t id;
+	sse_spool_ptr spool;
+	off_t offset;
+	std::size_t length;
+};
+
+/**
+ * A topic: its backlog of encoded events and the subscribers waiting
+ * for the next.  Ids count up from 1; a subscriber's cursor is the id
+ * of the next event it is to be sent.
+ */
+class sse_topic : boost::noncopyable
+{
+public:
+	sse_topic( std::size_t backlog_max, std::size_t spool_size, const std::string& tempdir )
+	 :	subscribers( 0 ), last_publish( 0 ), copied( 0 ), referenced( 0 ),
+		backlog_max( std::max( backlog_max, std::size_t( 1 ) ) ), spool_size( spool_size ), tempdir( tempdir ), next( 1 )
+	{}
+
+	uint64_t publish( const std::string& event, const std::string& data, time_t now = 0 )
+	{
+		uint64_t id = next;
+		scratch.clear( );
+		sse_encode( id, event, data, scratch );
+
+		off_t at = spool ? spool->append( scratch.data( ), scratch.size( ) ) : -1;
+		if( at < 0 )
+		{
+			spool.reset( new sse_spool( std::max( spool_size, scratch.size( ) ), tempdir ) );
+			at = spool->append( scratch.data( ), scratch.size( ) );
+		}
+		if( at < 0 )
+		{
+			spool.reset( new sse_spool( std::max( spool_size, scratch.size( ) ), "" ) );
+			at = spool->append( scratch.data( ), scratch.size( ) );
+		}
+
+		backlog.push_back( sse_message( id, spool, at, scratch.size( ) ) );
+		if( backlog.size( ) > backlog_max ) backlog.pop_front( );
+
+		++next;
+		last_publish = now;
+		arrived.signal( );
+		return id;
+	}
+
+	// The oldest event still kept, next_id( ) when there are none.
+	uint64_t first_id( ) const { return backlog.empty( ) ? next : backlog.front( ).id; }
+	uint64_t next_id( ) const { return next; }
+
+	/**
+	 * Appends the events from cursor on, a chunk for each run of them
+	 * that is one range of a spool, until max_bytes or more are appended
+	 * (always at least one event).  With chunked, each chunk is framed
+	 * for Transfer-Encoding: chunked.  Moves cursor past what was
+	 * appended and returns how many bytes of events that was.  cursor
+	 * mustn't be before first_id( ).  The spools chunks were appended by
+	 * name from are added to held, to be kept until they are sent.
+	 */
+	std::size_t deliver( uint64_t& cursor, response_builder& out, bool chunked, std::size_t max_bytes, std::size_t copy_below,
+		std::vector< sse_spool_ptr >& held )
+	{
+		std::size_t done = 0;
+		while( cursor < next && done < max_bytes )
+		{
+			uint64_t first = first_id( );
+			const sse_message& m = backlog[ cursor - first ];
+
+			std::size_t len = m.length;
+			uint64_t end = cursor + 1;
+			for( ; end < next && done + len < max_bytes; ++end )
+			{
+				const sse_message& n = backlog[ end - first ];
+				if( n.spool != m.spool || n.offset != m.offset + off_t( len ) ) break;
+				len += n.length;
+			}
+
+			if( send( *m.spool, m.offset, len, out, chunked, copy_below )
+				&& std::find( held.begin( ), held.end( ), m.spool ) == held.end( ) )
+			{
+				held.push_back( m.spool );
+			}
+			cursor = end;
+			done += len;
+		}
+		return done;
+	}
+
+	// Signalled for each event.
+	async_event arrived;
+
+	std::size_t subscribers;
+	time_t last_publish;
+
+	// Bytes of events appended by copying and by reference.
+	uint64_t copied;
+	uint64_t referenced;
+
+private:
+	// true when it went by name.
+	bool send( const sse_spool& s, off_t offset, std::size_t len, response_builder& out, bool chunked, std::size_t copy_below )
+	{
+		bool by_name = false;
+		if( chunked )
+		{
+			char size[ 24 ];
+			out.append( size, std::snprintf( size, sizeof( size ), "%lx\r\n", static_cast< unsigned long >( len ) ) );
+		}
+
+		if( s.file( ) == -1 || len < copy_below )
+		{
+			out.append( s.data( ) + offset, len );
+			copied += len;
+		}
+		else
+		{
+			pooled_buffer name;
+			buffer_copy_string_len( name.get( ), s.file_name( ).data( ), s.file_name( ).size( ) );
+			out.file_by_name( name.get( ), offset, len );
+			referenced += len;
+			by_name = true;
+		}
+
+		if( chunked ) out.append( "\r\n", 2 );
+		return by_name;
+	}
+
+	const std::size_t backlog_max;
+	const std::size_t spool_size;
+	const std::string tempdir;
+
+	uint64_t next;
+	std::deque< sse_message > backlog;
+	sse_spool_ptr spool;
+	std::string scratch;
+};
+
+typedef boost::shared_ptr< sse_topic > sse_topic_ptr;
+
+/**
+ * The topic index.  Topics are made as they are first subscribed or
+ * published to, and forgotten once nobody is subscribed and nothing has
+ * been published for a while.
+ */
+class sse_hub : boost::noncopyable
+{
+public:
+	sse_hub( )
+	 : backlog( 256 ), spool_size( 4 * 1024 * 1024 ), tempdir( "/dev/shm" ), published( 0 )
+	{}
+
+	// Null when there's no such topic.
+	sse_topic_ptr find( const std::string& name ) const
+	{
+		topic_map::const_iterator i = topics.find( name );
+		return i == topics.end( ) ? sse_topic_ptr( ) : i->second;
+	}
+
+	sse_topic_ptr get( const std::string& name, time_t now = 0 )
+	{
+		sse_topic_ptr& t = topics[ name ];
+		if( !t )
+		{
+			t.reset( new sse_topic( backlog, spool_size, tempdir ) );
+			t->last_publish = now;
+		}
+		return t;
+	}
+
+	uint64_t publish( const std::string& name, const std::string& event, const std::string& data, time_t now = 0 )
+	{
+		++published;
+		return get( name, now )->publish( event, data, now );
+	}
+
+	void expire( time_t now, time_t idle )
+	{
+		for( topic_map::iterator i = topics.begin( ); i != topics.end( ); )
+		{
+			if( !i->second->subscribers && i->second->last_publish + idle <= now ) topics.erase( i++ );
+			else ++i;
+		}
+	}
+
+	std::size_t size( ) const { return topics.size( ); }
+
+	std::size_t subscribers( ) const
+	{
+		std::size_t n = 0;
+		for( topic_map::const_iterator i = topics.begin( ); i != topics.end( ); ++i ) n += i->second->subscribers;
+		return n;
+	}
+
+	// For topics made from now on.
+	std::size_t backlog;
+	std::size_t spool_size;
+	std::string tempdir;
+
+	uint64_t published;
+
+private:
+	typedef std::map< std::string, sse_topic_ptr > topic_map;
+	topic_map topics;
+};
+
+enum sse_slow_policy { SSE_WAIT, SSE_SKIP, SSE_DISCONNECT };
+
+class mod_sse;
+
+struct sse_task : async_task
+{
+	inline sse_task( mod_sse& p, connection& con );
+
+	~sse_task( )
+	{
+		if( topic ) --topic->subscribers;
+	}
+
+	inline handler_t operator()( async_context& ctx );
+
+	// Answers a publish request, HANDLER_GO_ON when it isn't one.
+	inline handler_t publish( );
+
+	// Starts the stream, false when it isn't a subscribe request.
+	inline bool subscribe( );
+
+	/**
+	 * Sends what the subscriber is behind by, as much as max_pending
+	 * allows, applying the slow policy to the rest.  false when the
+	 * subscriber is to be dropped.
+	 */
+	inline bool catch_up( );
+
+	// Drops the spools nothing in the write queue names any more.
+	void let_go( std::vector< sse_spool_ptr >& held ) const
+	{
+		for( std::size_t i = 0; i < held.size( ); )
+		{
+			if( named( *held[i] ) ) ++i;
+			else held.erase( held.begin( ) + i );
+		}
+	}
+
+	bool named( const sse_spool& s ) const
+	{
+		for( const chunk* c = con.write_queue->first; c; c = c->next )
+		{
+			if( c->type == chunk::FILE_CHUNK && !buffer_is_empty( c->file.name ) && c->file.name->used - 1 == s.file_name( ).size( )
+				&& 0 == std::memcmp( c->file.name->ptr, s.file_name( ).data( ), s.file_name( ).size( ) ) )
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	off_t pending( ) const
+	{
+		return chunkqueue_length( con.write_queue ) - chunkqueue_written( con.write_queue );
+	}
+
+	// The topic after prefix, empty when the path isn't under it.
+	std::string topic_name( const std::string& prefix ) const
+	{
+		if( prefix.empty( ) || buffer_is_empty( con.uri.path ) ) return std::string( );
+		if( con.uri.path->used - 1 <= prefix.size( ) || 0 != std::strncmp( con.uri.path->ptr, prefix.data( ), prefix.size( ) ) )
+			return std::string( );
+		return std::string( con.uri.path->ptr + prefix.size( ), con.uri.path->used - 1 - prefix.size( ) );
+	}
+
+	// Whether the core has read all of the request body, or all there is
+	// going to be.
+	bool body_read( ) const
+	{
+		const chunkqueue* cq = con.request_content_queue;
+		return !cq || cq->is_closed || cq->bytes_in >= static_cast< off_t >( con.request.content_length );
+	}
+
+	// The request body, false if it couldn't be read or is over max.
+	bool read_body( std::string& out, std::size_t max ) const
+	{
+		if( con.request.content_length > max ) return false;
+
+		for( chunk* c = con.request_content_queue ? con.request_content_queue->first : 0; c; c = c->next )
+		{
+			if( c->type == chunk::MEM_CHUNK )
+			{
+				if( c->mem->used > 1 + std::size_t( c->offset ) )
+					out.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+			}
+			else if( c->type == chunk::FILE_CHUNK )
+			{
+				// The chunkqueue closes it with the rest.
+				if( c->file.fd == -1 && -1 == ( c->file.fd = open( c->file.name->ptr, O_RDONLY | O_CLOEXEC ) ) ) return false;
+
+				off_t len = c->file.length - c->offset;
+				std::size_t at = out.size( );
+				out.resize( at + len );
+				for( off_t done = 0; done < len; )
+				{
+					ssize_t n = pread( c->file.fd, &out[ at + done ], len - done, c->file.start + c->offset + done );
+					if( n < 0 && errno == EINTR ) continue;
+					if( n <= 0 ) return false;
+					done += n;
+				}
+			}
+			if( out.size( ) > max ) return false;
+		}
+		return true;
+	}
+
+	// The value of name in the query string.
+	std::string query_value( const char* name ) const
+	{
+		if( buffer_is_empty( con.uri.query ) ) return std::string( );
+
+		std::string q( con.uri.query->ptr, con.uri.query->used - 1 );
+		std::string key = std::string( name ) + "=";
+		for( std::size_t at = 0; at < q.size( ); )
+		{
+			std::size_t end = q.find( '&', at );
+			if( end == std::string::npos ) end = q.size( );
+			if( 0 == q.compare( at, key.size( ), key ) ) return q.substr( at + key.size( ), end - at - key.size( ) );
+			at = end + 1;
+		}
+		return std::string( );
+	}
+
+	mod_sse& p;
+	connection& con;
+	std::string subscribe_prefix;
+	std::string publish_prefix;
+	off_t max_pending;
+	sse_slow_policy policy;
+	time_t keepalive;
+
+	sse_topic_ptr topic;
+	uint64_t cursor;
+	bool chunked;
+	bool draining;
+};
+
+class mod_sse
+ : 	public Plugin< mod_sse >,
+	public async_backend< mod_sse, sse_task >
+{
+public:
+	mod_sse( server& srv )
+	 :	Plugin< mod_sse >( srv ),
+		async_backend< mod_sse, sse_task >( srv ),
+		subscribe_prefix	( "sse.subscribe-prefix" ),
+		publish_prefix		( "sse.publish-prefix" ),
+		max_pending			( "sse.max-pending" ),
+		slow_policy			( "sse.slow-policy" ),
+		keepalive			( "sse.keepalive" ),
+		backlog				( "sse.backlog" ),
+		spool_size			( "sse.spool-size" ),
+		copy_below			( "sse.copy-below" ),
+		tempdir				( "sse.tempdir" ),
+		copy_threshold( 1024 ),
+		skipped( 0 ),
+		dropped( 0 ),
+		delivered( 0 )
+	{}
+
+	virtual ~mod_sse( ){ }
+
+	typedef async_backend< mod_sse, sse_task >::handlers handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_sse >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		configure( );
+		return HANDLER_GO_ON;
+	}
+
+	void configure( )
+	{
+		int n = *backlog.defaults( ).front( );
+		hub.backlog = n > 0 ? n : 256;
+		n = *spool_size.defaults( ).front( );
+		hub.spool_size = n > 0 ? n : 4 * 1024 * 1024;
+		hub.tempdir = *tempdir.defaults( ).front( );
+		if( hub.tempdir.empty( ) ) hub.tempdir = "/dev/shm";
+
+		n = *copy_below.defaults( ).front( );
+		copy_threshold = n > 0 ? n : ( n < 0 ? 0 : 1024 );
+	}
+
+	// The response is done with, and with it the spools it named.
+	handler_t connection_reset( connection& con )
+	{
+		if( static_cast< std::size_t >( con.ndx ) < holding.size( ) ) holding[ con.ndx ].clear( );
+		return async_backend< mod_sse, sse_task >::connection_reset( con );
+	}
+
+	handler_t handle_connection_close( connection& con )
+	{
+		return connection_reset( con );
+	}
+
+	// The spools con's write queue has chunks of by name.  Here rather
+	// than in the task, which is gone before the last of them is sent.
+	std::vector< sse_spool_ptr >& held( const connection& con )
+	{
+		std::size_t ndx = static_cast< std::size_t >( con.ndx );
+		if( ndx >= holding.size( ) ) holding.resize( ndx + 1 );
+		return holding[ ndx ];
+	}
+
+	handler_t handle_trigger( )
+	{
+		async_backend< mod_sse, sse_task >::handle_trigger( );
+		hub.expire( srv.cur_ts, 60 );
+
+		status_counter_set( CONST_STR_LEN( "sse.topics" ), static_cast< int >( hub.size( ) ) );
+		status_counter_set( CONST_STR_LEN( "sse.subscribers" ), static_cast< int >( hub.subscribers( ) ) );
+		status_counter_set( CONST_STR_LEN( "sse.published" ), static_cast< int >( hub.published ) );
+		status_counter_set( CONST_STR_LEN( "sse.delivered-kbytes" ), static_cast< int >( delivered / 1024 ) );
+		status_counter_set( CONST_STR_LEN( "sse.skipped" ), static_cast< int >( skipped ) );
+		status_counter_set( CONST_STR_LEN( "sse.dropped" ), static_cast< int >( dropped ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< std::string >	subscribe_prefix;
+	config_option< std::string >	publish_prefix;
+	config_option< int >			max_pending;
+	config_option< std::string >	slow_policy;
+	config_option< int >			keepalive;
+	config_option< int >			backlog;
+	config_option< int >			spool_size;
+	config_option< int >			copy_below;
+	config_option< std::string >	tempdir;
+
+	sse_hub hub;
+	std::size_t copy_threshold;
+
+	// Events skipped by slow subscribers, subscribers dropped for being
+	// slow, and bytes of events sent.
+	uint64_t skipped;
+	uint64_t dropped;
+	uint64_t delivered;
+
+private:
+	friend struct sse_task;
+
+	std::vector< std::vector< sse_spool_ptr > > holding;
+};
+
+inline sse_task::sse_task( mod_sse& p, connection& con )
+ :	p( p ), con( con ), subscribe_prefix( p.subscribe_prefix[ con ] ), publish_prefix( p.publish_prefix[ con ] ),
+	max_pending( p.max_pending[ con ] ), policy( SSE_SKIP ), keepalive( p.keepalive[ con ] ),
+	cursor( 0 ), chunked( false ), draining( false )
+{
+	if( max_pending <= 0 ) max_pending = 256 * 1024;
+	if( keepalive <= 0 ) keepalive = 15;
+
+	const std::string& s = p.slow_policy[ con ];
+	if( s == "wait" ) policy = SSE_WAIT;
+	else if( s == "disconnect" ) policy = SSE_DISCONNECT;
+}
+
+inline handler_t sse_task::operator()( async_context& ctx )
+{
+	BOOST_ASIO_CORO_REENTER( this )
+	{
+		if( con.request.http_method == HTTP_METHOD_POST )
+		{
+			if( topic_name( publish_prefix ).empty( ) ) return HANDLER_GO_ON;
+
+			// The event is all of the body, which may still be arriving.
+			// One over the limit is refused without waiting for it.
+			while( con.request.content_length <= p.hub.spool_size && !body_read( ) )
+			{
+				BOOST_ASIO_CORO_YIELD return ctx.request_body( );
+			}
+			return publish( );
+		}
+
+		if( !subscribe( ) ) return HANDLER_GO_ON;
+
+		while( catch_up( ) )
+		{
+			// Until the client has taken half of what is queued.
+			if( draining )
+			{
+				BOOST_ASIO_CORO_YIELD return ctx.drained( max_pending / 2, keepalive );
+				continue;
+			}
+
+			BOOST_ASIO_CORO_YIELD return ctx.wait( topic->arrived, keepalive );
+
+			// Nothing for a while, say so to whatever is in between.
+			if( ctx.timed_out( ) && !pending( ) )
+			{
+				response_builder out( con.write_queue );
+				out.append( chunked ? "3\r\n:\n\n\r\n" : ":\n\n", chunked ? 10 : 3 );
+			}
+		}
+
+		++p.dropped;
+		if( chunked )
+		{
+			response_builder out( con.write_queue );
+			out.append( "0\r\n\r\n", 5 );
+		}
+		con.file_finished = 1;
+	}
+
+	return HANDLER_FINISHED;
+}
+
+inline handler_t sse_task::publish( )
+{
+	std::string name = topic_name( publish_prefix );
+	if( name.empty( ) ) return HANDLER_GO_ON;
+
+	std::string data;
+	if( !read_body( data, p.hub.spool_size ) )
+	{
+		con.http_status = 413;
+		con.file_finished = 1;
+		return HANDLER_FINISHED;
+	}
+
+	// Closed on us part way through the body.
+	if( data.size( ) < con.request.content_length ) return HANDLER_ERROR;
+
+	uint64_t id = p.hub.publish( name, query_value( "event" ), data, p.srv.cur_ts );
+
+	char value[ 24 ];
+	response_header_overwrite( const_cast< server* >( &p.srv ), &con, CONST_STR_LEN( "X-Event-Id" ),
+		value, std::snprintf( value, sizeof( value ), "%llu", static_cast< unsigned long long >( id ) ) );
+	con.http_status = 204;
+	con.file_finished = 1;
+	return HANDLER_FINISHED;
+}
+
+inline bool sse_task::subscribe( )
+{
+	if( con.request.http_method != HTTP_METHOD_GET ) return false;
+
+	std::string name = topic_name( subscribe_prefix );
+	if( name.empty( ) ) return false;
+
+	topic = p.hub.get( name, p.srv.cur_ts );
+	++topic->subscribers;
+
+	// Coming back: whatever it missed that is still kept.
+	cursor = topic->next_id( );
+	data_string* last = reinterpret_cast< data_string* >(
+		array_get_element( con.request.headers, CONST_STR_LEN( "Last-Event-ID" ) ) );
+	if( last && !buffer_is_empty( last->value ) )
+	{
+		char* end;
+		unsigned long long id = std::strtoull( last->value->ptr, &end, 10 );
+		if( !*end && id < cursor ) cursor = std::max( topic->first_id( ), uint64_t( id + 1 ) );
+	}
+
+	server* s = const_cast< server* >( &p.srv );
+	response_header_overwrite( s, &con, CONST_STR_LEN( "Content-Type" ), CONST_STR_LEN( "text/event-stream" ) );
+	response_header_overwrite( s, &con, CONST_STR_LEN( "Cache-Control" ), CONST_STR_LEN( "no-cache" ) );
+	con.http_status = 200;
+	con.file_started = 1;
+	chunked = con.response.transfer_encoding == response_t::HTTP_TRANSFER_ENCODING_CHUNKED;
+
+	// A comment, so the client has the headers now rather than with the
+	// first event.
+	response_builder out( con.write_queue );
+	out.append( chunked ? "3\r\n:\n\n\r\n" : ":\n\n", chunked ? 10 : 3 );
+	return true;
+}
+
+inline bool sse_task::catch_up( )
+{
+	draining = false;
+
+	// The backlog moved on without it.
+	if( cursor < topic->first_id( ) )
+	{
+		if( policy != SSE_SKIP ) return false;
+		p.skipped += topic->first_id( ) - cursor;
+		cursor = topic->first_id( );
+	}
+	if( cursor == topic->next_id( ) ) return true;
+
+	off_t queued = pending( );
+	if( queued >= max_pending )
+	{
+		switch( policy )
+		{
+		case SSE_DISCONNECT:
+			return false;
+		case SSE_SKIP:
+			p.skipped += topic->next_id( ) - cursor;
+			cursor = topic->next_id( );
+			return true;
+		case SSE_WAIT:
+			draining = true;
+			return true;
+		}
+	}
+
+	std::vector< sse_spool_ptr >& held = p.held( con );
+	let_go( held );
+
+	response_builder out( con.write_queue );
+	p.delivered += topic->deliver( cursor, out, chunked, max_pending - queued, p.copy_threshold, held );
+	if( out.failed( ) ) return false;
+
+	// More than would fit, the rest once this has gone.
+	draining = cursor < topic->next_id( );
+	return true;
+}
+
+#endif // _MOD_SSE_HPP_
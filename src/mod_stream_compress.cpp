@@ -0,0 +1,7 @@
+/**
+ * Streaming gzip/deflate of responses, see mod_stream_compress.hpp.
+ */
+
+#include "mod_stream_compress.hpp"
+
+MAKE_PLUGIN( mod_stream_compress, "stream_compress", LIGHTTPD_VERSION_ID );
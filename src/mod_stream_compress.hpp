@@ -0,0 +1,750 @@
+/**
+ * Compresses responses with gzip or deflate as they stream through
+ * con.write_queue.
+ *
+ * handle_response_header decides whether a response gets compressed
+ * (a 200, an encoding the client accepts, a content type on the
+ * allowlist, not already encoded) and sets the headers, giving the body
+ * an ETag of its own.  From then on handle_filter_response_content
+ * compresses whatever the backend has appended since the last pass and
+ * puts the result back on the queue in chunk_size pieces.  The raw
+ * chunks are left where they are but marked as written, so they fall out
+ * of the queue with the rest.  File chunks are read through mmap windows
+ * rather than copied in.
+ *
+ * deflate states are big (window plus hash tables) and slow to set up,
+ * so finished ones are reset and handed to the next response instead of
+ * being freed.  Filters only run on the event loop thread, so one pool
+ * per plugin serves as the per-thread pool.
+ *
+ * The compressed output of static files (anything with a physical path
+ * and an ETag) is also kept in a bounded LRU keyed by format, path and
+ * ETag, so repeat requests for hot files skip compression entirely.
+ *
+ * Config:
+ *  stream-compress.enable = "enable"                     # per context
+ *  stream-compress.mimetypes = ( "text/", "application/javascript" )
+ *                                                        # prefixes, default "text/"
+ *  stream-compress.level = 6                             # global
+ *  stream-compress.cache-size = 16777216                 # global, bytes, 0 disables
+ */
+
+#ifndef _MOD_STREAM_COMPRESS_HPP_
+#define _MOD_STREAM_COMPRESS_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+
+#include <boost/mpl/list.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+#include <stdint.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef HTTP_ACCEPT_ENCODING_GZIP
+# define HTTP_ACCEPT_ENCODING_GZIP    BV(1)
+# define HTTP_ACCEPT_ENCODING_DEFLATE BV(2)
+#endif
+
+enum compress_format { COMPRESS_GZIP, COMPRESS_DEFLATE, COMPRESS_FORMATS };
+
+/**
+ * Free lists of deflate states, one per format as the format is fixed
+ * when a state is created.
+ */
+class deflate_pool : boost::noncopyable
+{
+public:
+	// Keep at most this many idle states per format.
+	static const std::size_t max_idle = 64;
+
+	deflate_pool( int level = Z_DEFAULT_COMPRESSION ) : level( level ), created( 0 ) {}
+
+	~deflate_pool( )
+	{
+		for( int f = 0; f < COMPRESS_FORMATS; ++f )
+		{
+			for( std::vector< z_stream* >::iterator i = idle[f].begin( ); i != idle[f].end( ); ++i )
+				destroy( *i );
+		}
+	}
+
+	// A fresh stream, 0 if zlib couldn't make one.
+	z_stream* acquire( compress_format f )
+	{
+		if( !idle[f].empty( ) )
+		{
+			z_stream* z = idle[f].back( );
+			idle[f].pop_back( );
+			deflateReset( z );
+			return z;
+		}
+
+		z_stream* z = new z_stream;
+		std::memset( z, 0, sizeof( *z ) );
+
+		// 16 more window bits asks zlib for a gzip wrapper.
+		if( Z_OK != deflateInit2( z, level, Z_DEFLATED, f == COMPRESS_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY ) )
+		{
+			delete z;
+			return 0;
+		}
+
+		++created;
+		return z;
+	}
+
+	void release( compress_format f, z_stream* z )
+	{
+		if( !z ) return;
+		if( idle[f].size( ) >= max_idle )
+			destroy( z );
+		else
+			idle[f].push_back( z );
+	}
+
+	std::size_t idle_count( compress_format f ) const { return idle[f].size( ); }
+
+	// Idle states were set up at the old level, so go when it changes.
+	void set_level( int l )
+	{
+		if( l == level ) return;
+		level = l;
+
+		for( int f = 0; f < COMPRESS_FORMATS; ++f )
+		{
+			for( std::vector< z_stream* >::iterator i = idle[f].begin( ); i != idle[f].end( ); ++i )
+				destroy( *i );
+			idle[f].clear( );
+		}
+	}
+
+	int level;
+
+	// How many states have ever been set up, for reporting.
+	std::size_t created;
+
+private:
+	static void destroy( z_stream* z )
+	{
+		deflateEnd( z );
+		delete z;
+	}
+
+	std::vector< z_stream* > idle[ COMPRESS_FORMATS ];
+};
+
+/**
+ * One response's worth of compression.  Output is staged until there is
+ * a whole chunk_size of it (or the stream ends) and then handed to the
+ * sink, a functor taking ( const char*, std::size_t ).  Up to
+ * cache_limit bytes of output are also kept for the cache.
+ */
+class stream_compressor : boost::noncopyable
+{
+public:
+	static const std::size_t chunk_size = 16384;
+
+	stream_compressor( deflate_pool& pool, compress_format format, std::size_t cache_limit = 0 )
+	 :	pool( pool ), format( format ), bytes_in( 0 ), bytes_out( 0 ),
+		z( pool.acquire( format ) ), staging( chunk_size ), staged( 0 ),
+		cache_limit( cache_limit ), cacheable( cache_limit > 0 ), finished( false )
+	{}
+
+	~stream_compressor( )
+	{
+		pool.release( format, z );
+	}
+
+	bool ok( ) const { return z != 0; }
+
+	template < typename Sink >
+	bool write( const char* p, std::size_t len, Sink& sink )
+	{
+		if( !z || finished ) return false;
+
+		z->next_in = reinterpret_cast< Bytef* >( const_cast< char* >( p ) );
+		z->avail_in = static_cast< uInt >( len );
+		bytes_in += len;
+		return run( Z_NO_FLUSH, sink );
+	}
+
+	// Flush everything out and give the state back to the pool.
+	template < typename Sink >
+	bool finish( Sink& sink )
+	{
+		if( !z || finished ) return false;
+
+		z->next_in = 0;
+		z->avail_in = 0;
+		bool r = run( Z_FINISH, sink );
+
+		finished = true;
+		pool.release( format, z );
+		z = 0;
+		return r;
+	}
+
+	// The whole output, if it fit in cache_limit.
+	const std::string* cached( ) const
+	{
+		return finished && cacheable ? &cache_fill : 0;
+	}
+
+	bool is_finished( ) const { return finished; }
+
+	deflate_pool& pool;
+	compress_format format;
+
+	std::size_t bytes_in;
+	std::size_t bytes_out;
+
+private:
+	template < typename Sink >
+	bool run( int flush, Sink& sink )
+	{
+		for( ;; )
+		{
+			z->next_out = reinterpret_cast< Bytef* >( &staging[ staged ] );
+			z->avail_out = static_cast< uInt >( chunk_size - staged );
+
+			int r = deflate( z, flush );
+			if( r == Z_STREAM_ERROR ) return false;
+
+			staged = chunk_size - z->avail_out;
+			if( staged == chunk_size ) emit( sink );
+
+			if( flush == Z_FINISH )
+			{
+				if( r != Z_STREAM_END ) continue;
+				emit( sink );
+				return true;
+			}
+
+			// All input taken and deflate stopped short of our buffer.
+			if( z->avail_in == 0 && ( z->avail_out != 0 || r == Z_BUF_ERROR ) ) return true;
+		}
+	}
+
+	template < typename Sink >
+	void emit( Sink& sink )
+	{
+		if( !staged ) return;
+
+		sink( &staging[0], staged );
+		bytes_out += staged;
+
+		if( cacheable )
+		{
+			if( cache_fill.size( ) + staged > cache_limit )
+			{
+				cacheable = false;
+				std::string( ).swap( cache_fill );
+			}
+			else
+			{
+				cache_fill.append( &staging[0], staged );
+			}
+		}
+
+		staged = 0;
+	}
+
+	z_stream* z;
+
+	std::vector< char > staging;
+	std::size_t staged;
+
+	std::size_t cache_limit;
+	bool cacheable;
+	std::string cache_fill;
+	bool finished;
+};
+
+/**
+ * Compressed bodies of static files, least recently used out first once
+ * over capacity bytes.
+ */
+class compressed_cache : boost::noncopyable
+{
+public:
+	compressed_cache( std::size_t capacity = 0 ) : capacity( capacity ), used( 0 ), hits( 0 ), misses( 0 ) {}
+
+	static std::string make_key( compress_format f, const buffer* path, const buffer* etag )
+	{
+		std::string key( 1, static_cast< char >( '0' + f ) );
+		key.append( CONST_BUF_LEN( path ) );
+		key.append( 1, '\0' );
+		key.append( CONST_BUF_LEN( etag ) );
+		return key;
+	}
+
+	const std::string* find( const std::string& key )
+	{
+		entry_map::iterator i = entries.find( key );
+		if( i == entries.end( ) )
+		{
+			++misses;
+			return 0;
+		}
+
+		// Most recent to the front.
+		lru.splice( lru.begin( ), lru, i->second.position );
+		++hits;
+		return &i->second.body;
+	}
+
+	void insert( const std::string& key, const std::string& body )
+	{
+		if( body.size( ) > capacity / 8 ) return;
+
+		entry_map::iterator i = entries.find( key );
+		if( i != entries.end( ) ) erase( i );
+
+		evict( capacity - body.size( ) );
+
+		lru.push_front( key );
+		entry& e = entries[ key ];
+		e.body = body;
+		e.position = lru.begin( );
+		used += body.size( );
+	}
+
+	void resize( std::size_t c )
+	{
+		capacity = c;
+		evict( capacity );
+	}
+
+	std::size_t size( ) const { return entries.size( ); }
+	std::size_t bytes( ) const { return used; }
+
+	std::size_t capacity;
+	std::size_t used;
+	std::size_t hits;
+	std::size_t misses;
+
+private:
+	typedef std::list< std::string > lru_list;
+
+	struct entry
+	{
+		std::string body;
+		lru_list::iterator position;
+	};
+
+	typedef std::map< std::string, entry > entry_map;
+
+	void erase( entry_map::iterator i )
+	{
+		used -= i->second.body.size( );
+		lru.erase( i->second.position );
+		entries.erase( i );
+	}
+
+	// Oldest out until at most limit bytes are used.
+	void evict( std::size_t limit )
+	{
+		while( used > limit && !lru.empty( ) )
+			erase( entries.find( lru.back( ) ) );
+	}
+
+	entry_map entries;
+	lru_list lru;
+};
+
+// Appends to a chunkqueue, one chunk per call.
+struct chunkqueue_sink
+{
+	chunkqueue_sink( chunkqueue* cq ) : cq( cq ), appended( 0 ) {}
+
+	void operator()( const char* p, std::size_t len )
+	{
+		buffer* b = chunkqueue_get_append_buffer( cq );
+		buffer_copy_string_len( b, p, len );
+		appended.push_back( cq->last );
+	}
+
+	chunkqueue* cq;
+	std::vector< chunk* > appended;
+};
+
+class mod_stream_compress : public Plugin< mod_stream_compress >
+{
+public:
+	// Size of the mmap windows file chunks are read through.
+	static const off_t mmap_window = 512 * 1024;
+
+	mod_stream_compress( server& srv )
+	 :	Plugin< mod_stream_compress >( srv ),
+		enable		( "stream-compress.enable" ),
+		mimetypes	( "stream-compress.mimetypes" ),
+		level		( "stream-compress.level" ),
+		cache_size	( "stream-compress.cache-size" )
+	{}
+
+	virtual ~mod_stream_compress( ){ }
+
+	typedef boost::mpl::list< 	ResponseHeaderHandler,
+								FilterResponseContentHandler,
+								ConnectionResetHandler,
+								TriggerHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_stream_compress >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		configure( );
+		return HANDLER_GO_ON;
+	}
+
+	void configure( )
+	{
+		int l = *level.defaults( ).front( );
+		pool.set_level( ( l >= 1 && l <= 9 ) ? l : Z_DEFAULT_COMPRESSION );
+
+		int c = *cache_size.defaults( ).front( );
+		cache.resize( c > 0 ? c : 0 );
+	}
+
+	handler_t handle_response_header( connection& con )
+	{
+		if( !enable[ con ] || con.http_status != 200 ) return HANDLER_GO_ON;
+		if( con.request.http_method == HTTP_METHOD_HEAD ) return HANDLER_GO_ON;
+
+		compress_format format;
+		if( con.request.accept_encoding & HTTP_ACCEPT_ENCODING_GZIP )
+			format = COMPRESS_GZIP;
+		else if( con.request.accept_encoding & HTTP_ACCEPT_ENCODING_DEFLATE )
+			format = COMPRESS_DEFLATE;
+		else
+			return HANDLER_GO_ON;
+
+		if( array_get_element( con.response.headers, CONST_STR_LEN( "Content-Encoding" ) ) )
+			return HANDLER_GO_ON;
+		if( !compressible( con ) ) return HANDLER_GO_ON;
+
+		response_header_overwrite( const_cast< server* >( &srv ), &con, CONST_STR_LEN( "Content-Encoding" ),
+			format == COMPRESS_GZIP ? "gzip" : "deflate", format == COMPRESS_GZIP ? 4 : 7 );
+		response_header_insert( const_cast< server* >( &srv ), &con, CONST_STR_LEN( "Vary" ), CONST_STR_LEN( "Accept-Encoding" ) );
+		mutate_etag( con, format );
+		con.response.content_length = -1;
+
+		state* s = new state;
+		con.plugin_ctx[ id( ) ] = s;
+
+		// Static files can come out of, or go in to, the cache.
+		if( cache.capacity && !buffer_is_empty( con.physical.path ) && !buffer_is_empty( con.physical.etag ) )
+		{
+			s->cache_key = compressed_cache::make_key( format, con.physical.path, con.physical.etag );
+			if( const std::string* body = cache.find( s->cache_key ) )
+			{
+				s->from_cache = true;
+				consume( con, *s );
+				chunkqueue_sink sink( con.write_queue );
+				const std::size_t step = stream_compressor::chunk_size;
+				for( std::size_t off = 0; off < body->size( ); off += step )
+					sink( body->data( ) + off, std::min( step, body->size( ) - off ) );
+				s->remember( sink.appended );
+				return HANDLER_GO_ON;
+			}
+
+			s->compressor.reset( new stream_compressor( pool, format, cache.capacity / 8 ) );
+		}
+		else
+		{
+			s->compressor.reset( new stream_compressor( pool, format ) );
+		}
+
+		if( !s->compressor->ok( ) )
+		{
+			free_state( con );
+			return HANDLER_ERROR;
+		}
+
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_filter_response_content( connection& con )
+	{
+		state* s = reinterpret_cast< state* >( con.plugin_ctx[ id( ) ] );
+		if( !s ) return HANDLER_GO_ON;
+
+		if( s->from_cache )
+		{
+			// Anything more from the backend is already in what we sent.
+			consume( con, *s );
+			return HANDLER_GO_ON;
+		}
+
+		chunkqueue_sink sink( con.write_queue );
+		chunk* last_raw = con.write_queue->last;
+
+		for( chunk* c = first_raw( con, *s ); c; c = c->next )
+		{
+			if( !compress_chunk( *c, *s->compressor, sink ) ) return HANDLER_ERROR;
+			mark_done( *c );
+			s->remember_done( c );
+			if( c == last_raw ) break;
+		}
+
+		if( con.file_finished && !s->compressor->is_finished( ) )
+		{
+			if( !s->compressor->finish( sink ) ) return HANDLER_ERROR;
+			if( const std::string* body = s->compressor->cached( ) )
+			{
+				if( !s->cache_key.empty( ) ) cache.insert( s->cache_key, *body );
+			}
+		}
+
+		s->remember( sink.appended );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t connection_reset( connection& con )
+	{
+		free_state( con );
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_trigger( )
+	{
+		status_counter_set( CONST_STR_LEN( "stream-compress.contexts" ), static_cast< int >( pool.created ) );
+		status_counter_set( CONST_STR_LEN( "stream-compress.cache-bytes" ), static_cast< int >( cache.bytes( ) ) );
+		status_counter_set( CONST_STR_LEN( "stream-compress.cache-hits" ), static_cast< int >( cache.hits ) );
+		status_counter_set( CONST_STR_LEN( "stream-compress.cache-misses" ), static_cast< int >( cache.misses ) );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< bool > 						enable;
+	config_option< std::vector< std::string > > mimetypes;
+	config_option< int >						level;
+	config_option< int >						cache_size;
+
+	deflate_pool pool;
+	compressed_cache cache;
+
+private:
+	/**
+	 * Per-connection state.  Chunks we have put in the queue, or consumed
+	 * from it, are remembered in order so we can tell the backend's new
+	 * chunks from ours on the next pass.  lighttpd recycles chunk structs,
+	 * so a pointer alone isn't enough to know a chunk is still ours.  A
+	 * slow client leaves many of ours queued for many passes, so they are
+	 * told apart by what costs the same however big they are: the buffer,
+	 * its length and the bytes at either end.
+	 */
+	struct state : boost::noncopyable
+	{
+		struct seen
+		{
+			chunk* c;
+			bool done;				// a raw chunk we consumed
+			std::size_t used;		// else our output, its length
+			const char* ptr;		// where it is
+			uint32_t fingerprint;	// and its ends
+		};
+
+		state( ) : from_cache( false ) {}
+
+		// Deflate output, so the ends are as good as random.
+		enum { fingerprint_ends = 16 };
+
+		static uint32_t fingerprint( const buffer* b )
+		{
+			uint32_t h = 2166136261u;
+			std::size_t head = std::min( b->used, std::size_t( fingerprint_ends ) );
+			std::size_t tail = std::max( head, b->used > fingerprint_ends ? b->used - fingerprint_ends : 0 );
+			for( std::size_t i = 0; i < head; ++i )
+			{
+				h ^= static_cast< unsigned char >( b->ptr[i] );
+				h *= 16777619u;
+			}
+			for( std::size_t i = tail; i < b->used; ++i )
+			{
+				h ^= static_cast< unsigned char >( b->ptr[i] );
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		void remember( const std::vector< chunk* >& appended )
+		{
+			for( std::vector< chunk* >::const_iterator i = appended.begin( ); i != appended.end( ); ++i )
+			{
+				seen s = { *i, false, (*i)->mem->used, (*i)->mem->ptr, fingerprint( (*i)->mem ) };
+				history.push_back( s );
+			}
+		}
+
+		void remember_done( chunk* c )
+		{
+			seen s = { c, true, 0, 0, 0 };
+			history.push_back( s );
+		}
+
+		bool matches( const seen& s, chunk* c ) const
+		{
+			if( s.c != c ) return false;
+			if( s.done ) return is_done( *c );
+			return c->type == chunk::MEM_CHUNK && c->mem->used == s.used && c->mem->ptr == s.ptr &&
+				fingerprint( c->mem ) == s.fingerprint;
+		}
+
+		std::deque< seen > history;
+		boost::scoped_ptr< stream_compressor > compressor;
+		std::string cache_key;
+		bool from_cache;
+	};
+
+	// Does the response's Content-Type start with an allowed prefix?
+	bool compressible( connection& con )
+	{
+		data_string* ct = reinterpret_cast< data_string* >(
+			array_get_element( con.response.headers, CONST_STR_LEN( "Content-Type" ) ) );
+		if( !ct || buffer_is_empty( ct->value ) ) return false;
+
+		const std::vector< std::string >& allowed = mimetypes[ con ];
+		if( allowed.empty( ) ) return 0 == strncmp( ct->value->ptr, "text/", 5 );
+
+		for( std::vector< std::string >::const_iterator i = allowed.begin( ); i != allowed.end( ); ++i )
+		{
+			if( 0 == strncmp( ct->value->ptr, i->c_str( ), i->size( ) ) ) return true;
+		}
+		return false;
+	}
+
+	// The compressed body is another representation, so it needs its own
+	// ETag or caches would hand it to clients that asked for identity.
+	// "abc" becomes "abc-gzip", a weak one stays weak.
+	static void mutate_etag( connection& con, compress_format format )
+	{
+		data_string* etag = reinterpret_cast< data_string* >(
+			array_get_element( con.response.headers, CONST_STR_LEN( "ETag" ) ) );
+		if( !etag || buffer_is_empty( etag->value ) ) return;
+
+		std::string v( etag->value->ptr, etag->value->used - 1 );
+		const char* suffix = format == COMPRESS_GZIP ? "-gzip" : "-deflate";
+		if( v.size( ) >= 2 && v[ v.size( ) - 1 ] == '"' )
+			v.insert( v.size( ) - 1, suffix );
+		else
+			v.append( suffix );
+
+		buffer_copy_string_len( etag->value, v.data( ), v.size( ) );
+	}
+
+	static bool is_done( const chunk& c )
+	{
+		if( c.type == chunk::MEM_CHUNK ) return c.offset >= static_cast< off_t >( c.mem->used ? c.mem->used - 1 : 0 );
+		if( c.type == chunk::FILE_CHUNK ) return c.offset >= c.file.length;
+		return true;
+	}
+
+	// Leave the chunk in place but with nothing left to write.
+	static void mark_done( chunk& c )
+	{
+		if( c.type == chunk::MEM_CHUNK )
+			c.offset = c.mem->used ? c.mem->used - 1 : 0;
+		else if( c.type == chunk::FILE_CHUNK )
+			c.offset = c.file.length;
+	}
+
+	// The first chunk the backend added since our last pass.  What we left
+	// behind is a run at the head of the queue, minus whatever has been
+	// written out since.
+	chunk* first_raw( connection& con, state& s )
+	{
+		chunk* c = con.write_queue->first;
+
+		std::size_t i = 0;
+		while( i < s.history.size( ) && !s.matches( s.history[i], c ) ) ++i;
+
+		// None of ours left, it is all new.
+		if( i == s.history.size( ) )
+		{
+			s.history.clear( );
+			return c;
+		}
+
+		s.history.erase( s.history.begin( ), s.history.begin( ) + i );
+		for( std::size_t j = 0; j < s.history.size( ) && c && s.matches( s.history[j], c ); ++j )
+			c = c->next;
+
+		return c;
+	}
+
+	template < typename Sink >
+	bool compress_chunk( chunk& c, stream_compressor& comp, Sink& sink )
+	{
+		if( c.type == chunk::MEM_CHUNK )
+		{
+			if( c.mem->used <= 1 ) return true;
+			return comp.write( c.mem->ptr + c.offset, c.mem->used - 1 - c.offset, sink );
+		}
+
+		if( c.type != chunk::FILE_CHUNK ) return true;
+
+		int fd = open( c.file.name->ptr, O_RDONLY );
+		if( fd == -1 ) return false;
+
+		bool ok = true;
+		const off_t page = sysconf( _SC_PAGESIZE );
+		const off_t window = mmap_window;
+		off_t pos = c.file.start + c.offset;
+		off_t end = c.file.start + c.file.length;
+
+		while( ok && pos < end )
+		{
+			// Windows start on a page boundary.
+			off_t base = pos - pos % page;
+			std::size_t len = static_cast< std::size_t >( std::min( end - base, window ) );
+
+			void* map = mmap( 0, len, PROT_READ, MAP_SHARED, fd, base );
+			if( map == MAP_FAILED )
+			{
+				ok = false;
+				break;
+			}
+			madvise( map, len, MADV_SEQUENTIAL );
+
+			ok = comp.write( reinterpret_cast< char* >( map ) + ( pos - base ), len - ( pos - base ), sink );
+			munmap( map, len );
+			pos = base + len;
+		}
+
+		close( fd );
+		return ok;
+	}
+
+	// Take everything the backend has queued out of play.
+	void consume( connection& con, state& s )
+	{
+		chunk* last_raw = con.write_queue->last;
+		for( chunk* c = first_raw( con, s ); c; c = c->next )
+		{
+			mark_done( *c );
+			s.remember_done( c );
+			if( c == last_raw ) break;
+		}
+	}
+
+	void free_state( connection& con )
+	{
+		delete reinterpret_cast< state* >( con.plugin_ctx[ id( ) ] );
+		con.plugin_ctx[ id( ) ] = 0;
+	}
+};
+
+#endif // _MOD_STREAM_COMPRESS_HPP_
@@ -0,0 +1,8 @@
+/**
+ * Document roots and settings for many hosts from one mapped table, see
+ * mod_vhostmap.hpp.
+ */
+
+#include "mod_vhostmap.hpp"
+
+MAKE_PLUGIN( mod_vhostmap, "vhostmap", LIGHTTPD_VERSION_ID );
@@ -0,0 +1,158 @@
+/**
+ * Mass virtual hosting from one table of hosts, each with its document
+ * root and settings, for as many hosts as there are, without a
+ * conditional or a directory lookup per host.
+ *
+ * The table is built from a text map by vhostmap_compile (see
+ * vhost_table.hpp for the map) and mapped, not read: looking a host up
+ * costs a hash probe, and one more for each label when it takes a
+ * wildcard, however many hosts the table has.  Workers share the mapped
+ * pages.
+ *
+ * vhostmap_compile writes a new table beside the old and renames it
+ * over.  Once a second, and on SIGHUP, the file is stat()ed and, when it
+ * is another file, the new table mapped and swapped in for the next
+ * request; a table that won't open is counted and the old one kept.
+ *
+ * Hosts not in the table keep the configured document root.  Hosts in
+ * it get their document root, server name (the Host when the map gives
+ * none) and, when the map says, server.follow-symlink.
+ *
+ * Config:
+ *  vhostmap.file = "/etc/lighttpd/hosts.vhostmap"   # global
+ *  vhostmap.enable = "enable"                       # per context
+ */
+
+#ifndef _MOD_VHOSTMAP_HPP_
+#define _MOD_VHOSTMAP_HPP_
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/vhost_table.hpp>
+
+#include <boost/mpl/list.hpp>
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+class mod_vhostmap : public Plugin< mod_vhostmap >
+{
+public:
+	mod_vhostmap( server& srv )
+	 :	Plugin< mod_vhostmap >( srv ),
+		file	( "vhostmap.file" ),
+		enable	( "vhostmap.enable" ),
+		hits( 0 ),
+		wildcard_hits( 0 ),
+		misses( 0 ),
+		loads( 0 ),
+		load_errors( 0 )
+	{}
+
+	virtual ~mod_vhostmap( ){ }
+
+	typedef boost::mpl::list< 	DocRootHandler,
+								TriggerHandler,
+								SighupHandler > handlers;
+
+	virtual handler_t set_defaults( )
+	{
+		if( Plugin< mod_vhostmap >::set_defaults( ) != HANDLER_GO_ON )
+			return HANDLER_ERROR;
+
+		return configure( ) ? HANDLER_GO_ON : HANDLER_ERROR;
+	}
+
+	// Without a table to start with there's nothing to serve the hosts
+	// with; a later bad one only keeps the table there is.
+	bool configure( )
+	{
+		path = *file.defaults( ).front( );
+		if( path.empty( ) ) return true;
+		return check( );
+	}
+
+	// Maps the file again when it isn't the one mapped.
+	bool check( )
+	{
+		struct stat st;
+		if( 0 != stat( path.c_str( ), &st ) )
+		{
+			++load_errors;
+			return false;
+		}
+		if( table && table->same_file( st ) ) return true;
+
+		std::string error;
+		vhost_table_ptr next = vhost_table::open( path, error );
+		if( !next )
+		{
+			++load_errors;
+			return false;
+		}
+
+		// Requests being handled copied what they needed already.
+		table = next;
+		++loads;
+		return true;
+	}
+
+	handler_t handle_docroot( connection& con )
+	{
+		if( !table || !enable[ con ] ) return HANDLER_GO_ON;
+
+		vhost_match m;
+		if( buffer_is_empty( con.request.http_host ) || !table->find( CONST_BUF_LEN( con.request.http_host ), m ) )
+		{
+			++misses;
+			return HANDLER_GO_ON;
+		}
+
+		buffer_copy_string_len( con.physical.doc_root, m.docroot, m.docroot_len );
+		if( m.server_name_len )
+			buffer_copy_string_len( con.server_name, m.server_name, m.server_name_len );
+		else
+			buffer_copy_string_buffer( con.server_name, con.request.http_host );
+		if( m.follow_symlink >= 0 ) con.conf.follow_symlink = m.follow_symlink;
+
+		++hits;
+		if( m.wildcard ) ++wildcard_hits;
+		return HANDLER_GO_ON;
+	}
+
+	handler_t handle_trigger( )
+	{
+		if( !path.empty( ) ) check( );
+
+		status_counter_set( CONST_STR_LEN( "vhostmap.hosts" ), table ? static_cast< int >( table->hosts( ) ) : 0 );
+		status_counter_set( CONST_STR_LEN( "vhostmap.wildcards" ), table ? static_cast< int >( table->wildcards( ) ) : 0 );
+		status_counter_set( CONST_STR_LEN( "vhostmap.hits" ), static_cast< int >( hits ) );
+		status_counter_set( CONST_STR_LEN( "vhostmap.wildcard-hits" ), static_cast< int >( wildcard_hits ) );
+		status_counter_set( CONST_STR_LEN( "vhostmap.misses" ), static_cast< int >( misses ) );
+		status_counter_set( CONST_STR_LEN( "vhostmap.loads" ), static_cast< int >( loads ) );
+		status_counter_set( CONST_STR_LEN( "vhostmap.load-errors" ), static_cast< int >( load_errors ) );
+		return HANDLER_GO_ON;
+	}
+
+	// Don't wait for the trigger to pick up a new table.
+	handler_t handle_sighup( )
+	{
+		if( !path.empty( ) ) check( );
+		return HANDLER_GO_ON;
+	}
+
+	config_option< std::string >	file;
+	config_option< bool >			enable;
+
+	std::string path;
+	vhost_table_ptr table;
+
+	uint64_t hits;
+	uint64_t wildcard_hits;
+	uint64_t misses;
+	uint64_t loads;
+	uint64_t load_errors;
+};
+
+#endif // _MOD_VHOSTMAP_HPP_
@@ -0,0 +1,402 @@
+/**
+ * Test routing and responses of app_handler and that handlers wait for
+ * the whole request body, and compare answering a small request in
+ * process with a round trip to a FastCGI stand-in on a local Unix socket,
+ * as mod_fastcgi would make over a kept-alive connection.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include <lighttpd-cpp/plugin.hpp>
+#include <lighttpd-cpp/app_handler.hpp>
+
+class mod_app_test
+ : 	public Plugin< mod_app_test >,
+	public app_handler< mod_app_test >
+{
+public:
+	mod_app_test( server& srv )
+	 :	Plugin< mod_app_test >( srv ),
+		app_handler< mod_app_test >( srv )
+	{
+		route( HTTP_METHOD_GET, "/health", &mod_app_test::health );
+		route( HTTP_METHOD_POST, "/echo", &mod_app_test::echo );
+		route( HTTP_METHOD_GET, "/users/", &mod_app_test::user, PREFIX );
+		route( HTTP_METHOD_GET, "/users/admin/", &mod_app_test::admin, PREFIX );
+		route( HTTP_METHOD_UNSET, "/throws", &mod_app_test::throws );
+	}
+
+	typedef app_handler< mod_app_test >::handlers handlers;
+
+	void health( app_request& req, app_response& res )
+	{
+		res.header( "Content-Type", "text/plain" );
+		res << "ok\n";
+	}
+
+	void echo( app_request& req, app_response& res )
+	{
+		res << req.body( );
+	}
+
+	void user( app_request& req, app_response& res )
+	{
+		res << "user " << req.path( ).str( ).substr( 7 );
+	}
+
+	void admin( app_request& req, app_response& res )
+	{
+		res.status( 403 ) << "admin " << req.path( ).str( ).substr( 13 );
+	}
+
+	void throws( app_request& req, app_response& res )
+	{
+		res << "half a body";
+		throw std::runtime_error( "oops" );
+	}
+};
+
+MAKE_PLUGIN( mod_app_test, "app_test", LIGHTTPD_VERSION_ID );
+
+static const char* fcgi_path = "/tmp/lighttpd-cpp-fcgi.sock";
+
+// Just enough FastCGI for one responder over a kept-alive connection.
+enum { FCGI_BEGIN_REQUEST = 1, FCGI_END_REQUEST = 3, FCGI_PARAMS = 4, FCGI_STDIN = 5, FCGI_STDOUT = 6 };
+
+static void fcgi_record( std::string& out, int type, const std::string& content )
+{
+	const unsigned char h[8] = { 1, static_cast< unsigned char >( type ), 0, 1,
+		static_cast< unsigned char >( content.size( ) >> 8 ), static_cast< unsigned char >( content.size( ) ), 0, 0 };
+	out.append( reinterpret_cast< const char* >( h ), 8 );
+	out += content;
+}
+
+static void fcgi_param( std::string& out, const std::string& name, const std::string& value )
+{
+	out += static_cast< char >( name.size( ) );
+	out += static_cast< char >( value.size( ) );
+	out += name;
+	out += value;
+}
+
+static bool read_all( int fd, char* p, std::size_t n )
+{
+	while( n )
+	{
+		ssize_t r = read( fd, p, n );
+		if( r <= 0 ) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+static bool write_all( int fd, const std::string& s )
+{
+	return write( fd, s.data( ), s.size( ) ) == static_cast< ssize_t >( s.size( ) );
+}
+
+static bool read_record( int fd, int& type, std::string& content )
+{
+	unsigned char h[8];
+	if( !read_all( fd, reinterpret_cast< char* >( h ), 8 ) ) return false;
+
+	type = h[1];
+	content.resize( ( h[4] << 8 ) + h[5] + h[6] );
+	if( !content.empty( ) && !read_all( fd, &content[0], content.size( ) ) ) return false;
+	content.resize( ( h[4] << 8 ) + h[5] );
+	return true;
+}
+
+// The application: answers every request with "ok" once its stdin ends.
+static void fcgi_app( int listener )
+{
+	int fd = accept( listener, NULL, NULL );
+	if( fd == -1 ) return;
+
+	int type;
+	std::string content;
+	while( read_record( fd, type, content ) )
+	{
+		if( type != FCGI_STDIN || !content.empty( ) ) continue;
+
+		std::string out;
+		fcgi_record( out, FCGI_STDOUT, "Status: 200\r\nContent-Type: text/plain\r\n\r\nok\n" );
+		fcgi_record( out, FCGI_STDOUT, "" );
+		fcgi_record( out, FCGI_END_REQUEST, std::string( 8, '\0' ) );
+		if( !write_all( fd, out ) ) break;
+	}
+	close( fd );
+}
+
+class app_handler_tests : public testing::Test
+{
+	public:
+		// Zeroed before p is made from srv.
+		app_handler_tests( ) : srv( ), con( ), p( srv ) { }
+
+		void SetUp( )
+		{
+			con.mode = DIRECT;
+			con.write_queue = chunkqueue_init( );
+			con.request_content_queue = chunkqueue_init( );
+			con.request.headers = array_init( );
+			con.response.headers = array_init( );
+			con.uri.path = buffer_init( );
+		}
+
+		void TearDown( )
+		{
+			chunkqueue_free( con.write_queue );
+			chunkqueue_free( con.request_content_queue );
+			array_free( con.request.headers );
+			array_free( con.response.headers );
+			buffer_free( con.uri.path );
+		}
+
+		handler_t request( http_method_t method, const char* path )
+		{
+			chunkqueue_reset( con.write_queue );
+			array_reset( con.response.headers );
+			con.http_status = 0;
+			con.file_finished = 0;
+			con.request.http_method = method;
+			buffer_copy_string_len( con.uri.path, path, std::strlen( path ) );
+			return p.handle_start_backend( con );
+		}
+
+		// As the core reads it off the network.
+		void queue_body( const std::string& part )
+		{
+			buffer_copy_string_len( chunkqueue_get_append_buffer( con.request_content_queue ), part.data( ), part.size( ) );
+			con.request_content_queue->bytes_in += part.size( );
+		}
+
+		std::string written( )
+		{
+			std::string s;
+			for( chunk* c = con.write_queue->first; c; c = c->next )
+			{
+				if( c->type == chunk::MEM_CHUNK && c->mem->used ) s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+			}
+			return s;
+		}
+
+		std::string response_header( const char* name )
+		{
+			data_string* ds = reinterpret_cast< data_string* >(
+				array_get_element( con.response.headers, name, std::strlen( name ) ) );
+			return ds ? std::string( ds->value->ptr, ds->value->used - 1 ) : std::string( );
+		}
+
+		server srv;
+		connection con;
+		mod_app_test p;
+};
+
+TEST_F( app_handler_tests, Routes )
+{
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/health" ) );
+	EXPECT_EQ( 200, con.http_status );
+	EXPECT_EQ( 1, con.file_finished );
+	EXPECT_EQ( "ok\n", written( ) );
+	EXPECT_EQ( "text/plain", response_header( "Content-Type" ) );
+
+	// GET routes answer HEAD too.
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_HEAD, "/health" ) );
+	EXPECT_EQ( 200, con.http_status );
+
+	// Exact means exact.
+	EXPECT_EQ( HANDLER_GO_ON, request( HTTP_METHOD_GET, "/healthz" ) );
+	EXPECT_EQ( HANDLER_GO_ON, request( HTTP_METHOD_GET, "/" ) );
+	EXPECT_EQ( "", written( ) );
+}
+
+TEST_F( app_handler_tests, LongestPrefix )
+{
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/users/alice" ) );
+	EXPECT_EQ( "user alice", written( ) );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/users/admin/bob" ) );
+	EXPECT_EQ( 403, con.http_status );
+	EXPECT_EQ( "admin bob", written( ) );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( HTTP_METHOD_GET, "/users" ) );
+}
+
+TEST_F( app_handler_tests, MethodNotAllowed )
+{
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_POST, "/health" ) );
+	EXPECT_EQ( 405, con.http_status );
+	EXPECT_EQ( "GET", response_header( "Allow" ) );
+	EXPECT_EQ( "", written( ) );
+
+	// Any method will do for this one.
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_POST, "/throws" ) );
+	EXPECT_NE( 405, con.http_status );
+}
+
+TEST_F( app_handler_tests, DeclinesOthersRequests )
+{
+	con.mode = EXTERNAL;
+	EXPECT_EQ( HANDLER_GO_ON, request( HTTP_METHOD_GET, "/health" ) );
+	EXPECT_EQ( 0, con.http_status );
+}
+
+TEST_F( app_handler_tests, ReadsBody )
+{
+	// Spread over a few chunks, as it is read off the network.
+	std::string body;
+	for( int i = 0; i < 3; ++i )
+	{
+		std::string part( 3000, static_cast< char >( 'a' + i ) );
+		queue_body( part );
+		body += part;
+	}
+	con.request.content_length = body.size( );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_POST, "/echo" ) );
+	EXPECT_EQ( 200, con.http_status );
+	EXPECT_EQ( body, written( ) );
+}
+
+TEST_F( app_handler_tests, WaitsForBody )
+{
+	con.request.content_length = 10;
+	queue_body( "hello" );
+
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, request( HTTP_METHOD_POST, "/echo" ) );
+	EXPECT_EQ( "", written( ) );
+
+	// Not all of it yet.
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( con ) );
+
+	queue_body( "world" );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_start_backend( con ) );
+	EXPECT_EQ( 200, con.http_status );
+	EXPECT_EQ( "helloworld", written( ) );
+}
+
+TEST_F( app_handler_tests, ClosedPartWay )
+{
+	con.request.content_length = 10;
+	queue_body( "hello" );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, request( HTTP_METHOD_POST, "/echo" ) );
+
+	con.request_content_queue->is_closed = 1;
+	EXPECT_EQ( HANDLER_ERROR, p.handle_start_backend( con ) );
+	EXPECT_EQ( "", written( ) );
+
+	// Nothing left waiting for the next request.
+	con.request_content_queue->is_closed = 0;
+	con.request.content_length = 0;
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/health" ) );
+	EXPECT_EQ( "ok\n", written( ) );
+}
+
+TEST_F( app_handler_tests, ThrowIsServerError )
+{
+	EXPECT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/throws" ) );
+	EXPECT_EQ( 500, con.http_status );
+	EXPECT_EQ( "", written( ) );
+}
+
+// One request to the FastCGI stand-in, its stdout's body into write_queue.
+static bool fcgi_request( int fd, connection& con )
+{
+	std::string params, out;
+	fcgi_param( params, "REQUEST_METHOD", "GET" );
+	fcgi_param( params, "SCRIPT_NAME", std::string( con.uri.path->ptr, con.uri.path->used - 1 ) );
+	fcgi_param( params, "QUERY_STRING", "" );
+	fcgi_param( params, "CONTENT_LENGTH", "0" );
+
+	fcgi_record( out, FCGI_BEGIN_REQUEST, std::string( "\0\1\0\0\0\0\0\0", 8 ) );
+	fcgi_record( out, FCGI_PARAMS, params );
+	fcgi_record( out, FCGI_PARAMS, "" );
+	fcgi_record( out, FCGI_STDIN, "" );
+	if( !write_all( fd, out ) ) return false;
+
+	int type;
+	std::string content, stdout_data;
+	while( read_record( fd, type, content ) && type != FCGI_END_REQUEST )
+	{
+		if( type == FCGI_STDOUT ) stdout_data += content;
+	}
+
+	std::size_t head = stdout_data.find( "\r\n\r\n" );
+	if( head == std::string::npos ) return false;
+
+	response_builder res( con.write_queue );
+	res.append( stdout_data.data( ) + head + 4, stdout_data.size( ) - head - 4 );
+	con.http_status = 200;
+	return true;
+}
+
+static double elapsed_us( const struct timeval& a, const struct timeval& b )
+{
+	return ( b.tv_sec - a.tv_sec ) * 1e6 + ( b.tv_usec - a.tv_usec );
+}
+
+TEST_F( app_handler_tests, AgainstFastCGI )
+{
+	const int requests = 20000;
+
+	struct sockaddr_un addr;
+	std::memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, fcgi_path );
+	unlink( fcgi_path );
+
+	int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	ASSERT_EQ( 0, bind( listener, reinterpret_cast< struct sockaddr* >( &addr ), sizeof( addr ) ) );
+	ASSERT_EQ( 0, listen( listener, 1 ) );
+	boost::thread app( fcgi_app, listener );
+
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	ASSERT_EQ( 0, connect( fd, reinterpret_cast< struct sockaddr* >( &addr ), sizeof( addr ) ) );
+
+	buffer_copy_string_len( con.uri.path, CONST_STR_LEN( "/health" ) );
+
+	struct timeval a, b;
+	gettimeofday( &a, 0 );
+	for( int i = 0; i < requests; ++i )
+	{
+		chunkqueue_reset( con.write_queue );
+		ASSERT_TRUE( fcgi_request( fd, con ) );
+	}
+	gettimeofday( &b, 0 );
+	double fcgi = elapsed_us( a, b ) / requests;
+	EXPECT_EQ( "ok\n", written( ) );
+
+	close( fd );
+	app.join( );
+	close( listener );
+	unlink( fcgi_path );
+
+	gettimeofday( &a, 0 );
+	for( int i = 0; i < requests; ++i )
+	{
+		ASSERT_EQ( HANDLER_FINISHED, request( HTTP_METHOD_GET, "/health" ) );
+	}
+	gettimeofday( &b, 0 );
+	double in_process = elapsed_us( a, b ) / requests;
+	EXPECT_EQ( "ok\n", written( ) );
+
+	std::printf( "GET /health: %.2f us/request to a FastCGI stand-in, %.2f us/request in process\n", fcgi, in_process );
+	EXPECT_LT( in_process, fcgi );
+}
@@ -0,0 +1,87 @@
+/**
+ * Test the blocked bloom filter never gives false negatives and stays
+ * close to its configured false positive rate.
+ */
+
+#include <string>
+#include <sstream>
+#include <gtest/gtest.h>
+
+#include <lighttpd-cpp/blocked_bloom_filter.hpp>
+
+static std::string key( std::size_t i, const char* prefix = "/srv/www/file-" )
+{
+	std::ostringstream s;
+	s << prefix << i;
+	return s.str( );
+}
+
+TEST( blocked_bloom_filter_tests, NoFalseNegatives )
+{
+	blocked_bloom_filter f( 10000, 10 );
+
+	for( std::size_t i = 0; i < 10000; ++i )
+	{
+		std::string k = key( i );
+		f.insert( path_hash( k.data( ), k.size( ) ) );
+	}
+
+	EXPECT_EQ( 10000u, f.size( ) );
+
+	for( std::size_t i = 0; i < 10000; ++i )
+	{
+		std::string k = key( i );
+		EXPECT_TRUE( f.may_contain( path_hash( k.data( ), k.size( ) ) ) );
+	}
+}
+
+TEST( blocked_bloom_filter_tests, FalsePositiveRate )
+{
+	blocked_bloom_filter f( 10000, 10 );
+
+	for( std::size_t i = 0; i < 10000; ++i )
+	{
+		std::string k = key( i );
+		f.insert( path_hash( k.data( ), k.size( ) ) );
+	}
+
+	std::size_t positives = 0;
+	for( std::size_t i = 0; i < 100000; ++i )
+	{
+		std::string k = key( i, "/srv/www/missing-" );
+		if( f.may_contain( path_hash( k.data( ), k.size( ) ) ) ) ++positives;
+	}
+
+	// ~1% estimated, allow for the blocking and some noise.
+	EXPECT_LT( f.false_positive_rate( ), 0.015 );
+	EXPECT_LT( positives, 3000u );
+}
+
+TEST( blocked_bloom_filter_tests, SeedsAreIndependent )
+{
+	blocked_bloom_filter f( 1000, 10 );
+	f.insert( path_hash( "/a/b", 4, 0 ) );
+
+	EXPECT_TRUE( f.may_contain( path_hash( "/a/b", 4, 0 ) ) );
+	EXPECT_FALSE( f.may_contain( path_hash( "/a/b", 4, 1 ) ) );
+}
+
+TEST( blocked_bloom_filter_tests, ResetAndSwap )
+{
+	blocked_bloom_filter a( 100, 10 ), b( 100000, 16 );
+	uint64_t h = path_hash( "x", 1 );
+
+	a.insert( h );
+	EXPECT_TRUE( a.may_contain( h ) );
+
+	std::size_t a_mem = a.memory_usage( ), b_mem = b.memory_usage( );
+	a.swap( b );
+	EXPECT_EQ( b_mem, a.memory_usage( ) );
+	EXPECT_EQ( a_mem, b.memory_usage( ) );
+	EXPECT_TRUE( b.may_contain( h ) );
+	EXPECT_FALSE( a.may_contain( h ) );
+
+	b.reset( 100, 10 );
+	EXPECT_EQ( 0u, b.size( ) );
+	EXPECT_FALSE( b.may_contain( h ) );
+}
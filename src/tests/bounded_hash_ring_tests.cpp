@@ -0,0 +1,247 @@
+/**
+ * Test consistent hashing with bounded loads: keys stay put as upstreams
+ * come and go, and nobody carries more than its bound.
+ *
+ * The simulation runs a zipf distributed key stream with a fixed number of
+ * requests in flight, against the plain ring and the bounded one, and
+ * prints how far the busiest upstream got above the average.
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <sstream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+
+#include <lighttpd-cpp/bounded_hash_ring.hpp>
+
+static std::vector< std::string > upstreams( std::size_t n )
+{
+	std::vector< std::string > names;
+	for( std::size_t i = 0; i < n; ++i )
+	{
+		std::ostringstream s;
+		s << "10.0.0." << i + 1 << ":8080";
+		names.push_back( s.str( ) );
+	}
+	return names;
+}
+
+static uint64_t key( std::size_t i )
+{
+	std::ostringstream s;
+	s << "/objects/" << i;
+	std::string k = s.str( );
+	return bounded_hash_ring::hash( k.data( ), k.size( ) );
+}
+
+TEST( bounded_hash_ring_tests, Empty )
+{
+	bounded_hash_ring ring;
+	std::size_t npos = bounded_hash_ring::npos;
+	EXPECT_EQ( npos, ring.pick( 42 ) );
+
+	ring.assign( upstreams( 1 ) );
+	EXPECT_EQ( 0u, ring.pick( 42 ) );
+}
+
+TEST( bounded_hash_ring_tests, KeysStayPut )
+{
+	bounded_hash_ring ring( 0 );
+	ring.assign( upstreams( 10 ) );
+
+	std::vector< std::string > before;
+	for( std::size_t i = 0; i < 10000; ++i )
+		before.push_back( ring.name( ring.pick( key( i ) ) ) );
+
+	// One more, only keys moving to it move.
+	ring.assign( upstreams( 11 ) );
+	std::size_t moved = 0;
+	for( std::size_t i = 0; i < 10000; ++i )
+	{
+		const std::string& now = ring.name( ring.pick( key( i ) ) );
+		if( now == before[i] ) continue;
+		EXPECT_EQ( "10.0.0.11:8080", now );
+		++moved;
+	}
+	EXPECT_GT( moved, 10000u / 11 / 2 );
+	EXPECT_LT( moved, 10000u / 11 * 2 );
+
+	// And back again.
+	ring.assign( upstreams( 10 ) );
+	for( std::size_t i = 0; i < 10000; ++i )
+		EXPECT_EQ( before[i], ring.name( ring.pick( key( i ) ) ) );
+}
+
+TEST( bounded_hash_ring_tests, Bounded )
+{
+	bounded_hash_ring ring( 1.25 );
+	ring.assign( upstreams( 4 ) );
+
+	// One very hot key.
+	std::vector< std::size_t > held;
+	for( int i = 0; i < 100; ++i )
+	{
+		std::size_t s = ring.pick( key( 7 ) );
+		ring.acquire( s );
+		held.push_back( s );
+
+		for( std::size_t u = 0; u < ring.size( ); ++u )
+			EXPECT_LE( ring.load( u ), static_cast< std::size_t >( std::ceil( 1.25 * ring.in_flight( ) / 4 ) ) );
+	}
+
+	// Its home upstream is full, it is back there once that drains.
+	std::size_t home = held[0];
+	for( std::vector< std::size_t >::iterator i = held.begin( ); i != held.end( ); ++i )
+		ring.release( *i );
+	EXPECT_EQ( 0u, ring.in_flight( ) );
+	EXPECT_EQ( home, ring.pick( key( 7 ) ) );
+}
+
+struct not_slot
+{
+	not_slot( std::size_t s ) : s( s ) {}
+	bool operator()( std::size_t t ) const { return t != s; }
+	std::size_t s;
+};
+
+TEST( bounded_hash_ring_tests, SkipsUnusable )
+{
+	bounded_hash_ring ring;
+	ring.assign( upstreams( 3 ) );
+
+	for( std::size_t i = 0; i < 1000; ++i )
+	{
+		std::size_t home = ring.pick( key( i ) );
+		std::size_t other = ring.pick( key( i ), not_slot( home ) );
+		EXPECT_NE( home, other );
+		EXPECT_LT( other, 3u );
+	}
+}
+
+TEST( bounded_hash_ring_tests, RemovedWhileInFlight )
+{
+	bounded_hash_ring ring;
+	ring.assign( upstreams( 3 ) );
+
+	std::size_t s = ring.find( "10.0.0.2:8080" );
+	ring.acquire( s );
+	ring.acquire( ring.find( "10.0.0.1:8080" ) );
+
+	ring.assign( upstreams( 1 ) );
+	EXPECT_EQ( 1u, ring.size( ) );
+	EXPECT_EQ( 1u, ring.in_flight( ) );
+
+	// Its slot isn't reused until it is released.
+	ring.assign( upstreams( 3 ) );
+	EXPECT_NE( s, ring.find( "10.0.0.2:8080" ) );
+	ring.release( s );
+	EXPECT_EQ( 1u, ring.in_flight( ) );
+}
+
+// Zipf over n keys with exponent 1.
+class zipf
+{
+public:
+	zipf( std::size_t n ) : cdf( n )
+	{
+		double sum = 0;
+		for( std::size_t i = 0; i < n; ++i )
+			cdf[i] = sum += 1.0 / ( i + 1 );
+		for( std::size_t i = 0; i < n; ++i )
+			cdf[i] /= sum;
+	}
+
+	std::size_t operator()( )
+	{
+		double r = std::rand( ) / ( RAND_MAX + 1.0 );
+		return std::lower_bound( cdf.begin( ), cdf.end( ), r ) - cdf.begin( );
+	}
+
+private:
+	std::vector< double > cdf;
+};
+
+struct simulation
+{
+	simulation( ) : peak_skew( 0 ), home( 0 ), ns_per_pick( 0 ) {}
+
+	double peak_skew;
+	double home;
+	double ns_per_pick;
+};
+
+static simulation simulate( double balance, std::size_t nodes, std::size_t in_flight, std::size_t requests )
+{
+	bounded_hash_ring ring( balance ), plain( 0 );
+	ring.assign( upstreams( nodes ) );
+	plain.assign( upstreams( nodes ) );
+
+	std::vector< uint64_t > keys;
+	for( std::size_t i = 0; i < 100000; ++i )
+		keys.push_back( key( i ) );
+
+	std::srand( 1 );
+	zipf z( keys.size( ) );
+	std::deque< std::size_t > running;
+	simulation r;
+	std::size_t at_home = 0;
+	double picking = 0;
+
+	for( std::size_t i = 0; i < requests; ++i )
+	{
+		// The oldest request finishes as each new one comes in.
+		if( running.size( ) == in_flight )
+		{
+			ring.release( running.front( ) );
+			running.pop_front( );
+		}
+
+		uint64_t k = keys[ z( ) ];
+
+		struct timeval a, b;
+		gettimeofday( &a, 0 );
+		std::size_t s = ring.pick( k );
+		gettimeofday( &b, 0 );
+		picking += ( b.tv_sec - a.tv_sec ) * 1e9 + ( b.tv_usec - a.tv_usec ) * 1e3;
+
+		ring.acquire( s );
+		running.push_back( s );
+		if( s == plain.pick( k ) ) ++at_home;
+
+		if( running.size( ) == in_flight )
+		{
+			std::size_t busiest = 0;
+			for( std::size_t u = 0; u < nodes; ++u )
+				busiest = std::max( busiest, ring.load( u ) );
+			r.peak_skew = std::max( r.peak_skew, double( busiest ) * nodes / in_flight );
+		}
+	}
+
+	r.home = double( at_home ) / requests;
+	r.ns_per_pick = picking / requests;
+	return r;
+}
+
+TEST( bounded_hash_ring_tests, Simulation )
+{
+	const std::size_t nodes = 10, in_flight = 200, requests = 1000000;
+
+	simulation plain = simulate( 0, nodes, in_flight, requests );
+	simulation bounded = simulate( 1.25, nodes, in_flight, requests );
+
+	std::printf( "zipf keys, %lu upstreams, %lu in flight: busiest at %.2fx average unbounded, "
+		"%.2fx bounded with %.1f%% of requests on their home upstream, %.0f ns/pick\n",
+		static_cast< unsigned long >( nodes ), static_cast< unsigned long >( in_flight ),
+		plain.peak_skew, bounded.peak_skew, bounded.home * 100, bounded.ns_per_pick );
+
+	EXPECT_LE( bounded.peak_skew, 1.25 + double( nodes ) / in_flight );
+	EXPECT_GT( plain.peak_skew, bounded.peak_skew );
+	EXPECT_GT( bounded.home, 0.5 );
+}
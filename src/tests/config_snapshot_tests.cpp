@@ -0,0 +1,293 @@
+/**
+ * Test writing config snapshots and starting from them, that a changed
+ * config file or anything off about a snapshot means the config is parsed
+ * instead, and what a snapshot saves on a config with many contexts.
+ */
+
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_blank.hpp"
+
+static const char* main_conf = "/tmp/blank-snapshot.conf";
+static const char* values_conf = "/tmp/blank-snapshot-values.conf";
+
+// Written an hour ago, a config that has settled.
+static void write_conf( const char* name, const std::string& text, int age = 3600 )
+{
+	std::ofstream( name ) << text;
+
+	struct timeval times[2];
+	gettimeofday( &times[0], NULL );
+	times[0].tv_sec -= age;
+	times[1] = times[0];
+	utimes( name, times );
+}
+
+// The stub config, its values in a file of their own.
+static std::string make_conf( )
+{
+	std::ifstream in( "src/tests/config_snapshot_stub.conf" );
+	std::ostringstream main, values;
+	std::string line;
+	while( std::getline( in, line ) )
+		( line.compare( 0, 5, "some_" ) ? main : values ) << line << "\n";
+
+	main << "include \"blank-snapshot-values.conf\"\n";
+	write_conf( values_conf, values.str( ) );
+	write_conf( main_conf, main.str( ) );
+	return main_conf;
+}
+
+class config_snapshot_tests : public plugin_tests< mod_blank >
+{
+	public:
+		config_snapshot_tests( )
+		 : plugin_tests< mod_blank >( make_conf( ) ), path( "/tmp/blank.snapshot" )
+		{
+			std::remove( path.c_str( ) );
+			config_snapshot::config_file = main_conf;
+		}
+
+		virtual ~config_snapshot_tests( )
+		{
+			std::remove( path.c_str( ) );
+			std::remove( main_conf );
+			std::remove( values_conf );
+			config_snapshot::config_file.clear( );
+		}
+
+		static void expect_values( const mod_blank& mb )
+		{
+			EXPECT_EQ( 5, *mb.some_int.defaults( ).front( ) );
+			EXPECT_EQ( std::string( "five" ), *mb.some_string.defaults( ).front( ) );
+			EXPECT_TRUE( *mb.some_bool.defaults( ).front( ) );
+			EXPECT_EQ( 55, *mb.some_short.defaults( ).front( ) );
+		}
+
+		const std::string path;
+};
+
+TEST_F( config_snapshot_tests, WrittenThenLoaded )
+{
+	uint64_t parse_us, snapshot_us;
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+		EXPECT_FALSE( config_snapshot::last_from_snapshot );
+		expect_values( mb );
+		parse_us = config_snapshot::last_load_us;
+	}
+
+	FILE* f = std::fopen( path.c_str( ), "r" );
+	ASSERT_TRUE( f );
+	std::fclose( f );
+
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+		EXPECT_TRUE( config_snapshot::last_from_snapshot );
+		expect_values( mb );
+		snapshot_us = config_snapshot::last_load_us;
+	}
+
+	std::printf( "config load: parsed %lluus, from snapshot %lluus\n",
+		static_cast< unsigned long long >( parse_us ), static_cast< unsigned long long >( snapshot_us ) );
+}
+
+TEST_F( config_snapshot_tests, EditedIncludeIsParsed )
+{
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	}
+
+	// As if lighttpd had read the edited file.
+	write_conf( values_conf, "some_int = 6\nsome_string = \"five\"\nsome_bool = \"enable\"\nsome_short = 55\n", 1800 );
+	data_config* global = reinterpret_cast< data_config* >( srv->config_context->data[0] );
+	data_integer* di = reinterpret_cast< data_integer* >( array_get_element( global->value, CONST_STR_LEN( "some_int" ) ) );
+	ASSERT_TRUE( di );
+	di->value = 6;
+
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+		EXPECT_FALSE( config_snapshot::last_from_snapshot );
+		EXPECT_EQ( 6, *mb.some_int.defaults( ).front( ) );
+	}
+
+	mod_blank mb( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	EXPECT_TRUE( config_snapshot::last_from_snapshot );
+	EXPECT_EQ( 6, *mb.some_int.defaults( ).front( ) );
+}
+
+// Without a config file to go by, keyed on the parsed config.
+TEST_F( config_snapshot_tests, ChangedConfigIsParsed )
+{
+	config_snapshot::config_file = "/nonexistent/lighttpd.conf";
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	}
+
+	data_config* global = reinterpret_cast< data_config* >( srv->config_context->data[0] );
+	data_integer* di = reinterpret_cast< data_integer* >( array_get_element( global->value, CONST_STR_LEN( "some_int" ) ) );
+	ASSERT_TRUE( di );
+	di->value = 6;
+
+	mod_blank mb( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	EXPECT_FALSE( config_snapshot::last_from_snapshot );
+	EXPECT_EQ( 6, *mb.some_int.defaults( ).front( ) );
+}
+
+TEST_F( config_snapshot_tests, CorruptSnapshotIsParsed )
+{
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	}
+
+	// Flip a byte of the payload.
+	FILE* f = std::fopen( path.c_str( ), "r+" );
+	ASSERT_TRUE( f );
+	std::fseek( f, -1, SEEK_END );
+	int c = std::fgetc( f );
+	std::fseek( f, -1, SEEK_END );
+	std::fputc( c ^ 0xff, f );
+	std::fclose( f );
+
+	mod_blank mb( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+	EXPECT_FALSE( config_snapshot::last_from_snapshot );
+	expect_values( mb );
+}
+
+TEST( config_sources_tests, OnlyPlainConfigs )
+{
+	const char* plain[] =
+	{
+		"server.port = 80  # include \"commented.conf\"\n",
+		"var.word = \"include\"\nsetenv.add-environment = ( \"A\" => \"b\" )\n",
+	};
+	const char* not_plain[] =
+	{
+		"include_shell \"cat /etc/lighttpd/*.conf\"\n",
+		"server.document-root = env.DOCROOT\n",
+		"server.document-root = var.CWD + \"/htdocs\"\n",
+		"include \"conf.d/*.conf\"\n",
+		"include var.confdir + \"/vhosts.conf\"\n",
+		"include \"vhosts-\" + var.site + \".conf\"\n",
+		"include \"/nonexistent/lighttpd.conf\"\n"
+	};
+
+	config_sources::list_type sources;
+	for( std::size_t i = 0; i < sizeof( plain ) / sizeof( plain[0] ); ++i )
+	{
+		write_conf( main_conf, plain[i] );
+		EXPECT_TRUE( config_sources::scan( main_conf, sources ) ) << plain[i];
+		EXPECT_EQ( 1u, sources.size( ) );
+	}
+	for( std::size_t i = 0; i < sizeof( not_plain ) / sizeof( not_plain[0] ); ++i )
+	{
+		write_conf( main_conf, not_plain[i] );
+		EXPECT_FALSE( config_sources::scan( main_conf, sources ) ) << not_plain[i];
+	}
+
+	// Nested, relative to the main file.
+	write_conf( main_conf, "$HTTP[\"host\"] == \"a\" {\n  include \"blank-snapshot-values.conf\"\n}\n" );
+	write_conf( values_conf, "some_int = 1\n" );
+	ASSERT_TRUE( config_sources::scan( main_conf, sources ) );
+	ASSERT_EQ( 2u, sources.size( ) );
+	EXPECT_EQ( values_conf, sources[1].path );
+	EXPECT_TRUE( config_sources::unchanged( sources, main_conf ) );
+	EXPECT_TRUE( config_sources::settled( sources, time( 0 ) ) );
+
+	write_conf( values_conf, "some_int = 2\n", 1800 );
+	EXPECT_FALSE( config_sources::unchanged( sources, main_conf ) );
+
+	// Just written, lighttpd may have read it half way.
+	write_conf( values_conf, "some_int = 2\n", 0 );
+	ASSERT_TRUE( config_sources::scan( main_conf, sources ) );
+	EXPECT_FALSE( config_sources::settled( sources, time( 0 ) ) );
+
+	std::remove( main_conf );
+	std::remove( values_conf );
+}
+
+// The stub config with contexts hosts conditionals, each setting the
+// options again.
+static std::string make_large_conf( int contexts )
+{
+	std::ifstream in( "src/tests/config_snapshot_stub.conf" );
+	std::ostringstream out;
+	out << in.rdbuf( );
+	for( int i = 0; i < contexts; ++i )
+	{
+		out << "$HTTP[\"host\"] == \"host" << i << ".example\" {\n"
+			<< "  some_int = " << i << "\n  some_string = \"host" << i << "\"\n"
+			<< "  some_bool = \"disable\"\n  some_short = " << i % 100 << "\n}\n";
+	}
+	write_conf( main_conf, out.str( ) );
+	return main_conf;
+}
+
+class config_snapshot_large_tests : public plugin_tests< mod_blank >
+{
+	public:
+		config_snapshot_large_tests( )
+		 : plugin_tests< mod_blank >( make_large_conf( 2000 ) ), path( "/tmp/blank.snapshot" )
+		{
+			std::remove( path.c_str( ) );
+			config_snapshot::config_file = main_conf;
+		}
+
+		virtual ~config_snapshot_large_tests( )
+		{
+			std::remove( path.c_str( ) );
+			std::remove( main_conf );
+			config_snapshot::config_file.clear( );
+		}
+
+		const std::string path;
+};
+
+TEST_F( config_snapshot_large_tests, ManyContexts )
+{
+	uint64_t parse_us, snapshot_us, hashed_us;
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+		EXPECT_FALSE( config_snapshot::last_from_snapshot );
+		parse_us = config_snapshot::last_load_us;
+	}
+	{
+		mod_blank mb( *srv );
+		ASSERT_EQ( HANDLER_GO_ON, mb.set_defaults( ) );
+		EXPECT_TRUE( config_snapshot::last_from_snapshot );
+		snapshot_us = config_snapshot::last_load_us;
+	}
+
+	// What the key alone costs when it is a walk of the parsed config.
+	uint64_t start = 0;
+	{
+		struct timeval tv;
+		gettimeofday( &tv, NULL );
+		start = uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+		config_snapshot::hash_config( *srv, "salt" );
+		gettimeofday( &tv, NULL );
+		hashed_us = uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec - start;
+	}
+
+	std::printf( "2000 contexts: parsed %lluus, from snapshot %lluus, hashing the config tree %lluus\n",
+		static_cast< unsigned long long >( parse_us ), static_cast< unsigned long long >( snapshot_us ),
+		static_cast< unsigned long long >( hashed_us ) );
+	EXPECT_LT( snapshot_us, parse_us );
+}
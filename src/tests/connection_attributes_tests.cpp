@@ -0,0 +1,97 @@
+/**
+ * Test that connection attributes are shared by name, checked by type, and
+ * cleared when a connection starts its next request.
+ */
+
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <lighttpd-cpp/connection_attributes.hpp>
+
+struct tenant
+{
+	int id;
+};
+
+class connection_attributes_tests : public testing::Test
+{
+	public:
+		connection_attributes_tests( )
+		{
+			std::memset( &con, 0, sizeof( con ) );
+			con.ndx = 0;
+			con.request_count = 1;
+
+			std::memset( &other, 0, sizeof( other ) );
+			other.ndx = 3;
+			other.request_count = 1;
+		}
+
+		// Slots point at connections, ours are about to go.
+		virtual ~connection_attributes_tests( )
+		{
+			connection_attribute< tenant >::reset( con );
+			connection_attribute< tenant >::reset( other );
+		}
+
+		connection con, other;
+};
+
+TEST_F( connection_attributes_tests, SharedByName )
+{
+	// As declared by two plugins.
+	connection_attribute< tenant > published( "test.tenant" );
+	connection_attribute< tenant > read( "test.tenant" );
+	connection_attribute< tenant > unrelated( "test.tenant2" );
+
+	EXPECT_EQ( published.slot, read.slot );
+	EXPECT_NE( published.slot, unrelated.slot );
+
+	tenant t = { 42 };
+	EXPECT_EQ( 0, read[ con ] );
+	published.set( con, &t );
+	EXPECT_EQ( &t, read[ con ] );
+	EXPECT_EQ( 0, unrelated[ con ] );
+	EXPECT_EQ( 0, read[ other ] );
+
+	read.clear( con );
+	EXPECT_EQ( 0, published[ con ] );
+}
+
+TEST_F( connection_attributes_tests, TypeMismatch )
+{
+	connection_attribute< tenant > t( "test.typed" );
+	EXPECT_THROW( connection_attribute< int > i( "test.typed" ), std::logic_error );
+	EXPECT_NO_THROW( connection_attribute< tenant > again( "test.typed" ) );
+}
+
+TEST_F( connection_attributes_tests, ClearedOnNextRequest )
+{
+	connection_attribute< tenant > a( "test.request" );
+	tenant t = { 1 };
+
+	a.set( con, &t );
+	a.set( other, &t );
+	EXPECT_EQ( &t, a[ con ] );
+
+	++con.request_count;
+	EXPECT_EQ( 0, a[ con ] );
+	EXPECT_EQ( &t, a[ other ] );
+
+	connection_attribute< tenant >::reset( other );
+	EXPECT_EQ( 0, a[ other ] );
+}
+
+TEST_F( connection_attributes_tests, DeclaredLater )
+{
+	connection_attribute< tenant > first( "test.first" );
+	tenant t = { 1 }, u = { 2 };
+	first.set( con, &t );
+
+	// A plugin loaded after the request started.
+	connection_attribute< tenant > later( "test.later" );
+	EXPECT_EQ( 0, later[ con ] );
+	later.set( con, &u );
+	EXPECT_EQ( &t, first[ con ] );
+	EXPECT_EQ( &u, later[ con ] );
+}
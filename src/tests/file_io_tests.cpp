@@ -0,0 +1,239 @@
+/**
+ * Test reads and stats come back the same through io_uring and through
+ * the work_pool, go in batches, and wake whoever is waiting.
+ */
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <lighttpd-cpp/file_io.hpp>
+
+static const char* file_path = "/tmp/lighttpd-cpp-file-io-test";
+
+static void snooze( int ms )
+{
+	boost::this_thread::sleep( boost::posix_time::milliseconds( ms ) );
+}
+
+// Run each test with the ring, where there is one, and without.
+class file_io_tests : public testing::TestWithParam< bool >
+{
+	public:
+		void SetUp( )
+		{
+			// Nothing is registered without srv.ev, so a blank server will do.
+			std::memset( &srv, 0, sizeof( srv ) );
+			std::memset( &con, 0, sizeof( con ) );
+
+			content.resize( 256 * 1024 );
+			for( std::size_t i = 0; i < content.size( ); ++i )
+				content[i] = static_cast< char >( 'a' + i % 26 );
+
+			std::FILE* f = std::fopen( file_path, "wb" );
+			std::fwrite( content.data( ), content.size( ), 1, f );
+			std::fclose( f );
+
+			fd = open( file_path, O_RDONLY );
+		}
+
+		void TearDown( )
+		{
+			close( fd );
+			unlink( file_path );
+		}
+
+		// Hand completions back as the eventfd handler would.
+		void wait_all( file_io& io, const std::vector< file_request_ptr >& requests )
+		{
+			for( int tries = 0; tries < 5000 && io.in_flight( ); ++tries )
+			{
+				io.complete( );
+				if( io.in_flight( ) ) snooze( 1 );
+			}
+
+			for( std::vector< file_request_ptr >::const_iterator i = requests.begin( ); i != requests.end( ); ++i )
+				ASSERT_TRUE( (*i)->done( ) );
+		}
+
+		server srv;
+		connection con;
+		std::string content;
+		int fd;
+};
+
+TEST_P( file_io_tests, Reads )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+	std::vector< file_request_ptr > r;
+
+	r.push_back( io.read( con, fd, 0, 100 ) );
+	r.push_back( io.read( con, fd, 5000, 4096 ) );
+	r.push_back( io.read( con, fd, content.size( ) - 10, 4096 ) );
+	EXPECT_FALSE( r[0]->done( ) );
+
+	io.submit( );
+	wait_all( io, r );
+
+	EXPECT_EQ( 100, r[0]->result );
+	EXPECT_EQ( content.substr( 0, 100 ), std::string( r[0]->data( ), r[0]->result ) );
+	EXPECT_EQ( 4096, r[1]->result );
+	EXPECT_EQ( content.substr( 5000, 4096 ), std::string( r[1]->data( ), r[1]->result ) );
+
+	// Short at the end of the file.
+	EXPECT_EQ( 10, r[2]->result );
+	EXPECT_EQ( content.substr( content.size( ) - 10 ), std::string( r[2]->data( ), r[2]->result ) );
+	EXPECT_EQ( 3u, io.completed( ) );
+}
+
+TEST_P( file_io_tests, Stats )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+	std::vector< file_request_ptr > r;
+
+	r.push_back( io.stat( con, file_path ) );
+	r.push_back( io.stat( con, "/tmp/lighttpd-cpp-file-io-test-missing" ) );
+	io.submit( );
+	wait_all( io, r );
+
+	struct stat st;
+	ASSERT_EQ( 0, ::stat( file_path, &st ) );
+
+	EXPECT_EQ( 0, r[0]->result );
+	EXPECT_EQ( st.st_size, r[0]->st.st_size );
+	EXPECT_EQ( st.st_ino, r[0]->st.st_ino );
+	EXPECT_EQ( st.st_dev, r[0]->st.st_dev );
+	EXPECT_EQ( st.st_mtime, r[0]->st.st_mtime );
+	EXPECT_TRUE( S_ISREG( r[0]->st.st_mode ) );
+
+	EXPECT_EQ( -ENOENT, r[1]->result );
+}
+
+TEST_P( file_io_tests, Errors )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+	std::vector< file_request_ptr > r;
+
+	r.push_back( io.read( con, -1, 0, 100 ) );
+	io.submit( );
+	wait_all( io, r );
+
+	EXPECT_EQ( -EBADF, r[0]->result );
+}
+
+TEST_P( file_io_tests, OneBatchPerSubmit )
+{
+	file_io io( srv, 64, 4096, 4, GetParam( ) );
+	std::vector< file_request_ptr > r;
+
+	for( int i = 0; i < 40; ++i )
+		r.push_back( io.read( con, fd, i * 4096, 4096 ) );
+	io.submit( );
+	EXPECT_EQ( 1u, io.batches( ) );
+
+	wait_all( io, r );
+	for( int i = 0; i < 40; ++i )
+	{
+		ASSERT_EQ( 4096, r[i]->result );
+		ASSERT_EQ( 0, std::memcmp( content.data( ) + i * 4096, r[i]->data( ), 4096 ) );
+	}
+}
+
+TEST_P( file_io_tests, BuffersAreReused )
+{
+	file_io io( srv, 2, 4096, 2, GetParam( ) );
+	std::vector< file_request_ptr > r;
+
+	// Two from the pool, and the third, like anything over buffer_size,
+	// gets one of its own.
+	r.push_back( io.read( con, fd, 0, 4096 ) );
+	r.push_back( io.read( con, fd, 4096, 4096 ) );
+	r.push_back( io.read( con, fd, 8192, 4096 ) );
+	r.push_back( io.read( con, fd, 0, 100000 ) );
+	io.submit( );
+	wait_all( io, r );
+
+	EXPECT_EQ( content.substr( 8192, 4096 ), std::string( r[2]->data( ), r[2]->result ) );
+	EXPECT_EQ( content.substr( 0, 100000 ), std::string( r[3]->data( ), r[3]->result ) );
+
+	// Let go of one and its buffer goes to the next read.
+	const char* buffer = r[0]->data( );
+	r[0].reset( );
+	file_request_ptr next = io.read( con, fd, 0, 10 );
+	EXPECT_EQ( buffer, next->data( ) );
+}
+
+TEST_P( file_io_tests, WakesWaitingTasks )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+	async_slot slot( srv, 1 );
+	slot.con = &con;
+
+	file_request_ptr r = io.read( con, fd, 0, 100 );
+	io.submit( );
+
+	async_context ctx( slot );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, r->wait( ctx, 10 ) );
+	EXPECT_EQ( async_slot::WAIT_EVENT, slot.wait );
+
+	wait_all( io, std::vector< file_request_ptr >( 1, r ) );
+	EXPECT_TRUE( slot.ready );
+	EXPECT_EQ( 100, r->result );
+
+	// Done already, so just a yield, which the backend comes straight
+	// back from.
+	async_context again( slot );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, r->wait( again ) );
+	EXPECT_EQ( async_slot::WAIT_NONE, slot.wait );
+	slot.unwatch( );
+}
+
+TEST_P( file_io_tests, CancelledStillFinish )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+	async_slot slot( srv, 1 );
+	slot.con = &con;
+
+	file_request_ptr r = io.read( con, fd, 0, 100 );
+	file_request_ptr dropped = io.read( con, fd, 0, 100 );
+	io.submit( );
+
+	async_context ctx( slot );
+	r->wait( ctx );
+	io.cancel( r );
+
+	// Let go of, as a closed connection would: kept until done, the
+	// kernel or a thread may still be writing to its buffer.
+	io.cancel( dropped );
+	dropped.reset( );
+	EXPECT_EQ( 2u, io.in_flight( ) );
+
+	wait_all( io, std::vector< file_request_ptr >( 1, r ) );
+	EXPECT_EQ( 0u, io.in_flight( ) );
+	EXPECT_EQ( 100, r->result );
+	EXPECT_FALSE( slot.ready );
+	slot.unwatch( );
+}
+
+TEST_P( file_io_tests, RingWhenAsked )
+{
+	file_io io( srv, 8, 4096, 2, GetParam( ) );
+
+	// Asked for, old kernels and seccomp filters may still refuse a ring.
+#ifndef HAVE_IO_URING
+	EXPECT_FALSE( io.uring( ) );
+#endif
+	if( !GetParam( ) )
+	{
+		EXPECT_FALSE( io.uring( ) );
+		EXPECT_FALSE( io.fixed_buffers( ) );
+	}
+}
+
+INSTANTIATE_TEST_CASE_P( RingAndPool, file_io_tests, testing::Bool( ) );
@@ -0,0 +1,332 @@
+/**
+ * Test the SIMD request scanner, on its own and against the lemon parser
+ * it stands in for.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+
+#include <lighttpd-cpp/http_scanner.hpp>
+
+// A read_queue holding s, cut into chunks at each of cuts.
+static chunkqueue* make_queue( const std::string& s, const std::vector< std::size_t >& cuts = std::vector< std::size_t >( ) )
+{
+	chunkqueue* cq = chunkqueue_init( );
+
+	std::size_t from = 0;
+	for( std::size_t i = 0; i <= cuts.size( ); ++i )
+	{
+		std::size_t to = i < cuts.size( ) ? cuts[i] : s.size( );
+		if( to <= from ) continue;
+
+		buffer* b = chunkqueue_get_append_buffer( cq );
+		buffer_copy_string_len( b, s.data( ) + from, to - from );
+		from = to;
+	}
+	return cq;
+}
+
+// Whatever is left unread in cq.
+static std::string unread( chunkqueue* cq )
+{
+	std::string s;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->mem->used > static_cast< std::size_t >( c->offset ) + 1 )
+			s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+	}
+	return s;
+}
+
+static std::string headers_of( const http_req_t* req )
+{
+	std::string s;
+	for( std::size_t i = 0; i < req->headers->used; ++i )
+	{
+		const data_string* ds = reinterpret_cast< const data_string* >( req->headers->data[i] );
+		s.append( ds->key->ptr, ds->key->used - 1 ).append( "|" );
+		s.append( ds->value->ptr, ds->value->used ? ds->value->used - 1 : 0 ).append( "\n" );
+	}
+	return s;
+}
+
+static const std::string simple =
+	"GET /index.html?a=b HTTP/1.1\r\n"
+	"Host: example.org\r\n"
+	"Accept:  */*  \r\n"
+	"X-Empty:\r\n"
+	"\r\n"
+	"BODY";
+
+TEST( http_scanner_tests, Spans )
+{
+	chunkqueue* cq = make_queue( simple );
+	http_scanner scanner;
+
+	ASSERT_EQ( PARSE_SUCCESS, scanner.scan( *cq ) );
+	EXPECT_EQ( "GET", scanner.method.str( ) );
+	EXPECT_EQ( "/index.html?a=b", scanner.uri.str( ) );
+	EXPECT_EQ( "HTTP/1.1", scanner.protocol.str( ) );
+	EXPECT_EQ( HTTP_METHOD_GET, scanner.method_key );
+	EXPECT_EQ( HTTP_VERSION_1_1, scanner.protocol_key );
+
+	ASSERT_EQ( 3u, scanner.headers.size( ) );
+	EXPECT_EQ( "Host", scanner.headers[0].key.str( ) );
+	EXPECT_EQ( "example.org", scanner.headers[0].value.str( ) );
+	EXPECT_EQ( "*/*", scanner.headers[1].value.str( ) );
+	EXPECT_EQ( "", scanner.headers[2].value.str( ) );
+
+	// Straight out of the chunk.
+	const char* mem = cq->first->mem->ptr;
+	EXPECT_TRUE( scanner.uri.ptr > mem && scanner.uri.ptr < mem + simple.size( ) );
+
+	// Scanning leaves the queue alone.
+	EXPECT_EQ( simple, unread( cq ) );
+	chunkqueue_free( cq );
+}
+
+TEST( http_scanner_tests, ParseLeavesBody )
+{
+	chunkqueue* cq = make_queue( simple );
+	http_req_t* req = http_request_init( );
+	http_scanner scanner;
+
+	ASSERT_EQ( PARSE_SUCCESS, scanner.parse( *cq, *req ) );
+	EXPECT_EQ( HTTP_METHOD_GET, req->method );
+	EXPECT_EQ( std::string( "/index.html?a=b" ), std::string( req->uri_raw->ptr, req->uri_raw->used - 1 ) );
+	EXPECT_EQ( "Host|example.org\nAccept|*/*\nX-Empty|\n", headers_of( req ) );
+	EXPECT_EQ( "BODY", unread( cq ) );
+
+	http_request_free( req );
+	chunkqueue_free( cq );
+}
+
+TEST( http_scanner_tests, NeedMore )
+{
+	http_scanner scanner;
+	std::size_t header_len = simple.size( ) - 4;
+
+	for( std::size_t i = 0; i < header_len; ++i )
+	{
+		chunkqueue* cq = make_queue( simple.substr( 0, i ) );
+		EXPECT_EQ( PARSE_NEED_MORE, scanner.scan( *cq ) ) << i;
+		chunkqueue_free( cq );
+	}
+}
+
+TEST( http_scanner_tests, SplitAnywhere )
+{
+	http_scanner scanner;
+
+	for( std::size_t i = 1; i < simple.size( ); ++i )
+	{
+		for( std::size_t j = i; j < simple.size( ); ++j )
+		{
+			std::vector< std::size_t > cuts;
+			cuts.push_back( i );
+			cuts.push_back( j );
+			chunkqueue* cq = make_queue( simple, cuts );
+			http_req_t* req = http_request_init( );
+
+			ASSERT_EQ( PARSE_SUCCESS, scanner.parse( *cq, *req ) ) << i << " " << j;
+			EXPECT_EQ( "Host|example.org\nAccept|*/*\nX-Empty|\n", headers_of( req ) ) << i << " " << j;
+			EXPECT_EQ( "BODY", unread( cq ) ) << i << " " << j;
+
+			http_request_free( req );
+			chunkqueue_free( cq );
+		}
+	}
+}
+
+TEST( http_scanner_tests, FoldedAndRepeated )
+{
+	chunkqueue* cq = make_queue(
+		"\r\nPOST  /  HTTP/1.0\n"
+		"Accept: a\n"
+		"X-Folded: one\r\n"
+		" \t two \r\n"
+		"accept: b\r\n"
+		"\r\n" );
+	http_req_t* req = http_request_init( );
+	http_scanner scanner;
+
+	ASSERT_EQ( PARSE_SUCCESS, scanner.parse( *cq, *req ) );
+	EXPECT_EQ( HTTP_METHOD_POST, req->method );
+	EXPECT_EQ( HTTP_VERSION_1_0, req->protocol );
+	EXPECT_EQ( "Accept|a, b\nX-Folded|one two\n", headers_of( req ) );
+
+	http_request_free( req );
+	chunkqueue_free( cq );
+}
+
+TEST( http_scanner_tests, Errors )
+{
+	const char* bad[] =
+	{
+		"GET / HTTP/1.1\rHost: x\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost x\r\n\r\n",
+		"GET / HTTP/1.1\r\nHo st: x\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost : x\r\n\r\n",
+		"GET / HTTP/1.1\r\n: x\r\n\r\n",
+		"GET / HTTP/1.1\r\n folded: first\r\n\r\n",
+		"GET /\r\n\r\n",
+		"GET / HTTP/1.1 extra\r\n\r\n",
+		"FETCH / HTTP/1.1\r\n\r\n",
+		"GET / HTTP/9.9\r\n\r\n",
+	};
+
+	http_scanner scanner;
+	for( std::size_t i = 0; i < sizeof( bad ) / sizeof( bad[0] ); ++i )
+	{
+		chunkqueue* cq = make_queue( bad[i] );
+		EXPECT_EQ( PARSE_ERROR, scanner.scan( *cq ) ) << bad[i];
+		chunkqueue_free( cq );
+	}
+}
+
+// Requests put together from likely and unlikely pieces, then mutated.
+static std::string random_request( )
+{
+	static const char* methods[] = { "GET", "POST", "HEAD", "get", "FETCH", "" };
+	static const char* uris[] = { "/", "/a/b/../c?d=e&f", "*", "http://h/p", "/%2e%2E/x", "" };
+	static const char* protocols[] = { "HTTP/1.1", "HTTP/1.0", "HTTP/2.0", "http/1.1", "" };
+	static const char* names[] = { "Host", "Accept", "Cookie", "X-A", "host", "Bad Name", "" };
+	static const char* values[] = { "example.org", "", "  spaced  ", "a:b:c", "\t", "x, y" };
+	static const char* ends[] = { "\r\n", "\r\n", "\r\n", "\n", "\r" };
+	static const char mutations[] = " :\r\n\tA";
+
+#	define PICK( a ) a[ std::rand( ) % ( sizeof( a ) / sizeof( a[0] ) ) ]
+
+	std::string s;
+	if( std::rand( ) % 8 == 0 ) s += PICK( ends );
+
+	s += PICK( methods );
+	s += std::string( 1 + std::rand( ) % 2, ' ' );
+	s += PICK( uris );
+	s += ' ';
+	s += PICK( protocols );
+	s += PICK( ends );
+
+	for( int n = std::rand( ) % 6; n; --n )
+	{
+		if( std::rand( ) % 10 == 0 )
+			s += " folded";
+		else
+			s.append( PICK( names ) ).append( ":" ).append( PICK( values ) );
+		if( std::rand( ) % 10 == 0 ) s += std::string( 100 + std::rand( ) % 100, 'v' );
+		s += PICK( ends );
+	}
+	s += PICK( ends );
+	s += "body";
+
+	for( int n = std::rand( ) % 3; n; --n )
+		s[ std::rand( ) % s.size( ) ] = PICK( mutations );
+
+#	undef PICK
+
+	return s;
+}
+
+TEST( http_scanner_tests, DifferentialFuzz )
+{
+	std::srand( 1 );
+	http_scanner scanner;
+
+	for( int round = 0; round < 100000; ++round )
+	{
+		std::string s = random_request( );
+
+		std::vector< std::size_t > cuts;
+		for( int n = std::rand( ) % 4; n; --n ) cuts.push_back( std::rand( ) % s.size( ) );
+		std::sort( cuts.begin( ), cuts.end( ) );
+
+		chunkqueue* theirs = make_queue( s, cuts );
+		chunkqueue* ours = make_queue( s, cuts );
+		http_req_t* expected = http_request_init( );
+		http_req_t* actual = http_request_init( );
+
+		parse_status_t status = http_request_parse_cq( theirs, expected );
+		ASSERT_EQ( status, scanner.parse( *ours, *actual ) ) << s;
+
+		if( status == PARSE_SUCCESS )
+		{
+			EXPECT_EQ( expected->method, actual->method ) << s;
+			EXPECT_EQ( expected->protocol, actual->protocol ) << s;
+			EXPECT_TRUE( buffer_is_equal( expected->uri_raw, actual->uri_raw ) ) << s;
+			EXPECT_EQ( headers_of( expected ), headers_of( actual ) ) << s;
+			EXPECT_EQ( unread( theirs ), unread( ours ) ) << s;
+		}
+
+		http_request_free( expected );
+		http_request_free( actual );
+		chunkqueue_free( theirs );
+		chunkqueue_free( ours );
+	}
+}
+
+static double seconds( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+TEST( http_scanner_tests, Throughput )
+{
+	const std::string request =
+		"GET /images/2019/03/some-rather-long-article-slug/hero.jpg?w=1200&h=630&fit=crop HTTP/1.1\r\n"
+		"Host: www.example.org\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/72.0.3626.121 Safari/537.36\r\n"
+		"Accept: image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+		"Referer: https://www.example.org/2019/03/some-rather-long-article-slug/\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; _ga=GA1.2.1234567890.1234567890\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n"
+		"x";
+	const int rounds = 200000;
+
+	chunkqueue* cq = make_queue( request );
+	http_req_t* req = http_request_init( );
+	http_scanner scanner;
+
+	double start = seconds( );
+	for( int i = 0; i < rounds; ++i )
+	{
+		cq->first->offset = 0;
+		http_request_reset( req );
+		ASSERT_EQ( PARSE_SUCCESS, scanner.parse( *cq, *req ) );
+	}
+	double ours = seconds( ) - start;
+
+	start = seconds( );
+	for( int i = 0; i < rounds; ++i )
+	{
+		cq->first->offset = 0;
+		http_request_reset( req );
+		ASSERT_EQ( PARSE_SUCCESS, http_request_parse_cq( cq, req ) );
+	}
+	double theirs = seconds( ) - start;
+
+	cq->first->offset = 0;
+	start = seconds( );
+	for( int i = 0; i < rounds; ++i )
+	{
+		ASSERT_EQ( PARSE_SUCCESS, scanner.scan( *cq ) );
+	}
+	double scan_only = seconds( ) - start;
+
+	double bytes = double( request.size( ) - 1 ) * rounds;
+	std::printf( "request parsing: scanner %.2f GB/s (scan alone %.2f GB/s), lemon %.2f GB/s\n",
+		bytes / ours / 1e9, bytes / scan_only / 1e9, bytes / theirs / 1e9 );
+
+	http_request_free( req );
+	chunkqueue_free( cq );
+}
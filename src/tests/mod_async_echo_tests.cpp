@@ -0,0 +1,187 @@
+/**
+ * Test the resumable backend handlers by running mod_async_echo against
+ * an echo server on a local Unix socket, standing in for the event loop.
+ */
+
+#include <string>
+#include <cstdlib>
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_async_echo.hpp"
+
+MAKE_PLUGIN( mod_async_echo, "async_echo", LIGHTTPD_VERSION_ID );
+
+static const char* echo_path = "/tmp/lighttpd-cpp-echo.sock";
+
+// Echo everything back to one client, then close.
+static void echo_once( int listener )
+{
+	int fd = accept( listener, NULL, NULL );
+	if( fd == -1 ) return;
+
+	char buf[ 256 ];
+	ssize_t n;
+	while( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 )
+	{
+		if( write( fd, buf, n ) != n ) break;
+	}
+	close( fd );
+}
+
+class mod_async_echo_tests : public plugin_tests< mod_async_echo >
+{
+	public:
+		mod_async_echo_tests( ) : plugin_tests< mod_async_echo >( "src/tests/mod_async_echo_stub.conf" ), listener( -1 ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_async_echo >::SetUp( );
+			srv->ev = fdevent_init( srv->max_fds + 1, FDEVENT_HANDLER_POLL );
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->write_queue = chunkqueue_init( );
+			con->uri.path = buffer_init_string( "/hello/world" );
+
+			struct sockaddr_un addr;
+			std::memset( &addr, 0, sizeof( addr ) );
+			addr.sun_family = AF_UNIX;
+			strcpy( addr.sun_path, echo_path );
+			unlink( echo_path );
+
+			listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+			ASSERT_EQ( 0, bind( listener, reinterpret_cast< struct sockaddr* >( &addr ), sizeof( addr ) ) );
+			ASSERT_EQ( 0, listen( listener, 1 ) );
+		}
+
+		void TearDown( )
+		{
+			close( listener );
+			unlink( echo_path );
+
+			chunkqueue_free( con->write_queue );
+			buffer_free( con->uri.path );
+			free( con );
+
+			plugin_tests< mod_async_echo >::TearDown( );
+		}
+
+		// Be the event loop: wait for what the task waits on, fire the
+		// fdevent handler and resume as lighttpd would from the joblist.
+		handler_t pump( mod_async_echo& p )
+		{
+			handler_t r = p.handle_start_backend( *con );
+			while( r == HANDLER_WAIT_FOR_EVENT )
+			{
+				async_slot* slot = p.slot( *con );
+				if( !slot || slot->wait != async_slot::WAIT_FD ) return HANDLER_ERROR;
+
+				struct pollfd pfd;
+				pfd.fd = slot->sock->fd;
+				pfd.events = ( slot->events & FDEVENT_IN ) ? POLLIN : POLLOUT;
+				if( 1 != poll( &pfd, 1, 5000 ) ) return HANDLER_ERROR;
+
+				int revents = 0;
+				if( pfd.revents & POLLIN ) revents |= FDEVENT_IN;
+				if( pfd.revents & POLLOUT ) revents |= FDEVENT_OUT;
+				if( pfd.revents & POLLHUP ) revents |= FDEVENT_HUP;
+				async_slot::on_fdevent( srv, slot, revents );
+
+				r = p.handle_start_backend( *con );
+			}
+			return r;
+		}
+
+		std::string written( )
+		{
+			std::string s;
+			for( chunk* c = con->write_queue->first; c; c = c->next )
+			{
+				if( c->type == chunk::MEM_CHUNK && c->mem->used ) s.append( c->mem->ptr, c->mem->used - 1 );
+			}
+			return s;
+		}
+
+		int listener;
+		connection* con;
+};
+
+TEST_F( mod_async_echo_tests, EchoesPath )
+{
+	mod_async_echo p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	boost::thread echo( &echo_once, listener );
+
+	EXPECT_EQ( HANDLER_FINISHED, pump( p ) );
+	echo.join( );
+
+	EXPECT_EQ( 200, con->http_status );
+	EXPECT_EQ( std::string( "/hello/world\n" ), written( ) );
+	EXPECT_FALSE( p.slot( *con )->live );
+}
+
+TEST_F( mod_async_echo_tests, FramesReused )
+{
+	mod_async_echo p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	boost::thread first( &echo_once, listener );
+	EXPECT_EQ( HANDLER_FINISHED, pump( p ) );
+	first.join( );
+
+	void* frame = p.slot( *con )->frame;
+
+	boost::thread second( &echo_once, listener );
+	EXPECT_EQ( HANDLER_FINISHED, pump( p ) );
+	second.join( );
+
+	EXPECT_EQ( frame, p.slot( *con )->frame );
+}
+
+TEST_F( mod_async_echo_tests, ResetCancels )
+{
+	mod_async_echo p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	// Nobody accepts, so the task stays suspended.
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( *con ) );
+	ASSERT_TRUE( p.slot( *con )->live );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.connection_reset( *con ) );
+	EXPECT_FALSE( p.slot( *con )->live );
+	EXPECT_EQ( async_slot::WAIT_NONE, p.slot( *con )->wait );
+}
+
+TEST_F( mod_async_echo_tests, DrainWakes )
+{
+	mod_async_echo p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( *con ) );
+	async_slot* slot = p.slot( *con );
+	ASSERT_TRUE( slot && slot->live );
+
+	// As a task waiting for the client to take all but 4 of 10 bytes.
+	slot->unwatch( );
+	buffer_copy_string_len( chunkqueue_get_append_buffer( con->write_queue ), CONST_STR_LEN( "0123456789" ) );
+	async_context ctx( *slot );
+	ctx.drained( 4 );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_joblist( *con ) );
+	EXPECT_FALSE( slot->ready );
+
+	con->write_queue->first->offset = 6;
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_joblist( *con ) );
+	EXPECT_TRUE( slot->ready );
+	EXPECT_EQ( async_slot::WAIT_NONE, slot->wait );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.connection_reset( *con ) );
+}
@@ -0,0 +1,279 @@
+/**
+ * Test the ring and writer behind mod_binlog, reading the log back as
+ * binlog2text does (headers from several workers and all), and compare
+ * the event loop's cost per request with writing a text line per request.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../mod_binlog.hpp"
+
+static const char* log_path = "/tmp/lighttpd-cpp-binlog-test.binlog";
+static const char* rotated_path = "/tmp/lighttpd-cpp-binlog-test.binlog.1";
+
+static uint64_t now_us( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
+
+// A record for request i.
+static std::size_t make_record( char* buf, std::size_t len, int i )
+{
+	binlog_encoder out( buf, len );
+	out.head.status = 200;
+	out.head.start_us = uint64_t( 1300000000 ) * 1000000 + i;
+	out.head.duration_us = 1500;
+	out.head.bytes_in = 120;
+	out.head.bytes_out = 4096 + i;
+	out.head.http_minor = 1;
+
+	char uri[ 32 ];
+	out.field( BINLOG_METHOD, "GET", 3 );
+	out.field( BINLOG_REMOTE_ADDR, "10.0.0.1", 8 );
+	out.field( BINLOG_URI, uri, snprintf( uri, sizeof( uri ), "/item/%d", i ) );
+	out.field( BINLOG_USER_AGENT, "curl/7.21", 9 );
+	return out.finish( );
+}
+
+static std::vector< binlog_record > read_log( const char* path, binlog_reader::result& result )
+{
+	std::vector< binlog_record > records;
+	std::FILE* in = std::fopen( path, "rb" );
+	if( !in )
+	{
+		result = binlog_reader::BAD;
+		return records;
+	}
+
+	binlog_reader reader( in );
+	binlog_record r;
+	while( binlog_reader::RECORD == ( result = reader.next( r ) ) )
+		records.push_back( r );
+
+	std::fclose( in );
+	return records;
+}
+
+class mod_binlog_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			unlink( log_path );
+			unlink( rotated_path );
+		}
+
+		void TearDown( )
+		{
+			unlink( log_path );
+			unlink( rotated_path );
+		}
+};
+
+TEST( binlog_format_tests, Text )
+{
+	char buf[ 1024 ];
+	std::size_t n = make_record( buf, sizeof( buf ), 7 );
+
+	std::FILE* f = std::tmpfile( );
+	binlog_file_header h = binlog_file_header::make( );
+	std::fwrite( &h, sizeof( h ), 1, f );
+	std::fwrite( buf, n, 1, f );
+	std::rewind( f );
+
+	binlog_reader reader( f );
+	binlog_record r;
+	ASSERT_EQ( binlog_reader::RECORD, reader.next( r ) );
+	EXPECT_EQ( "10.0.0.1 - - [13/Mar/2011:07:06:40 +0000] \"GET /item/7 HTTP/1.1\" 200 4103 \"-\" \"curl/7.21\" - 1500 120", binlog_text( r ) );
+	EXPECT_EQ( binlog_reader::END, reader.next( r ) );
+	std::fclose( f );
+}
+
+TEST( binlog_format_tests, FieldsCutShort )
+{
+	char buf[ 64 ];
+	std::string big( 1000, 'x' );
+	binlog_encoder out( buf, sizeof( buf ) );
+	out.field( BINLOG_URI, big.data( ), big.size( ) );
+	out.field( BINLOG_HOST, "example.com", 11 );
+
+	// Never past the end, and still readable.
+	EXPECT_EQ( sizeof( buf ), out.finish( ) );
+	EXPECT_EQ( 1, out.head.fields );
+}
+
+TEST( log_ring_tests, Wraps )
+{
+	log_ring ring( 4096 );
+	std::vector< char > block( 1000, 'a' );
+	struct iovec iov[2];
+	int count;
+
+	// Three in and out moves the ring on to 3000.
+	for( int i = 0; i < 3; ++i )
+	{
+		ASSERT_TRUE( ring.push( &block[0], block.size( ) ) );
+		ring.consume( ring.peek( iov, count ) );
+	}
+
+	// Past the end, so in two pieces.
+	std::string in( 2000, 'b' );
+	in[0] = 'c';
+	in[1999] = 'd';
+	ASSERT_TRUE( ring.push( in.data( ), in.size( ) ) );
+
+	EXPECT_EQ( 2000u, ring.peek( iov, count ) );
+	ASSERT_EQ( 2, count );
+	EXPECT_EQ( 1096u, iov[0].iov_len );
+	EXPECT_EQ( 904u, iov[1].iov_len );
+
+	std::string out( static_cast< char* >( iov[0].iov_base ), iov[0].iov_len );
+	out.append( static_cast< char* >( iov[1].iov_base ), iov[1].iov_len );
+	EXPECT_EQ( in, out );
+}
+
+TEST( log_ring_tests, DropsWhenFull )
+{
+	log_ring ring( 4096 );
+	std::vector< char > block( 1000, 'a' );
+
+	for( int i = 0; i < 4; ++i )
+		EXPECT_TRUE( ring.push( &block[0], block.size( ) ) );
+
+	// Full, the record is dropped rather than waited for.
+	EXPECT_FALSE( ring.push( &block[0], block.size( ) ) );
+	EXPECT_EQ( 1ul, ring.dropped( ) );
+	EXPECT_TRUE( ring.push( &block[0], 96 ) );
+	EXPECT_EQ( 4096u, ring.used( ) );
+}
+
+TEST_F( mod_binlog_tests, WritesInBatches )
+{
+	log_ring ring( 1 << 20 );
+	const int requests = 20000;
+
+	{
+		log_writer writer( ring, log_path, log_writer::open_log( log_path ), 20 );
+
+		char buf[ 1024 ];
+		for( int i = 0; i < requests; ++i )
+		{
+			std::size_t n = make_record( buf, sizeof( buf ), i );
+			while( !ring.push( buf, n ) ) writer.nudge( );
+		}
+
+		// Closing writes out what is left.
+	}
+
+	binlog_reader::result result;
+	std::vector< binlog_record > records = read_log( log_path, result );
+	EXPECT_EQ( binlog_reader::END, result );
+	ASSERT_EQ( static_cast< std::size_t >( requests ), records.size( ) );
+
+	for( int i = 0; i < requests; ++i )
+	{
+		char uri[ 32 ];
+		snprintf( uri, sizeof( uri ), "/item/%d", i );
+		ASSERT_EQ( uri, records[i].fields[ BINLOG_URI ] );
+		ASSERT_EQ( 4096 + i, records[i].head.bytes_out );
+	}
+}
+
+TEST_F( mod_binlog_tests, ReopensForRotation )
+{
+	log_ring ring( 1 << 16 );
+	char buf[ 1024 ];
+
+	{
+		log_writer writer( ring, log_path, log_writer::open_log( log_path ), 10 );
+
+		ring.push( buf, make_record( buf, sizeof( buf ), 1 ) );
+		while( ring.used( ) ) usleep( 1000 );
+
+		// As logrotate would, then SIGHUP.
+		ASSERT_EQ( 0, rename( log_path, rotated_path ) );
+		writer.reopen( );
+		usleep( 50 * 1000 );
+
+		ring.push( buf, make_record( buf, sizeof( buf ), 2 ) );
+	}
+
+	binlog_reader::result result;
+	std::vector< binlog_record > old_records = read_log( rotated_path, result );
+	std::vector< binlog_record > new_records = read_log( log_path, result );
+
+	ASSERT_EQ( 1u, old_records.size( ) );
+	ASSERT_EQ( 1u, new_records.size( ) );
+	EXPECT_EQ( "/item/1", old_records[0].fields[ BINLOG_URI ] );
+	EXPECT_EQ( "/item/2", new_records[0].fields[ BINLOG_URI ] );
+}
+
+TEST_F( mod_binlog_tests, HeadersBetweenRecords )
+{
+	// Two workers both found the file empty.
+	int first = log_writer::open_log( log_path );
+	int second = log_writer::open_log( log_path );
+	ASSERT_NE( -1, first );
+	ASSERT_NE( -1, second );
+
+	binlog_file_header h = binlog_file_header::make( );
+	char buf[ 1024 ];
+	std::size_t n = make_record( buf, sizeof( buf ), 1 );
+	ASSERT_EQ( static_cast< ssize_t >( n ), write( first, buf, n ) );
+	ASSERT_EQ( static_cast< ssize_t >( sizeof( h ) ), write( second, &h, sizeof( h ) ) );
+	n = make_record( buf, sizeof( buf ), 2 );
+	ASSERT_EQ( static_cast< ssize_t >( n ), write( second, buf, n ) );
+	close( first );
+	close( second );
+
+	binlog_reader::result result;
+	std::vector< binlog_record > records = read_log( log_path, result );
+	EXPECT_EQ( binlog_reader::END, result );
+	ASSERT_EQ( 2u, records.size( ) );
+	EXPECT_EQ( "/item/1", records[0].fields[ BINLOG_URI ] );
+	EXPECT_EQ( "/item/2", records[1].fields[ BINLOG_URI ] );
+}
+
+TEST_F( mod_binlog_tests, AgainstLinePerRequest )
+{
+	const int requests = 200000;
+	char buf[ 1024 ];
+
+	// Encode and push on this thread, the writer doing the rest, and
+	// timed until all of it is written.
+	log_ring ring( 16 << 20 );
+	uint64_t start = now_us( );
+	{
+		log_writer writer( ring, log_path, log_writer::open_log( log_path ), 100 );
+		for( int i = 0; i < requests; ++i )
+			ring.push( buf, make_record( buf, sizeof( buf ), i ) );
+	}
+	uint64_t binary_us = now_us( ) - start;
+
+	// A text line and a write() per request, as mod_accesslog unbuffered.
+	int fd = open( rotated_path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+	ASSERT_NE( -1, fd );
+	start = now_us( );
+	for( int i = 0; i < requests; ++i )
+	{
+		int n = snprintf( buf, sizeof( buf ), "10.0.0.1 - - [13/Mar/2011:07:06:40 +0000] \"GET /item/%d HTTP/1.1\" 200 %d \"-\" \"curl/7.21\"\n", i, 4096 + i );
+		if( write( fd, buf, n ) != n ) break;
+	}
+	uint64_t text_us = now_us( ) - start;
+	close( fd );
+
+	EXPECT_EQ( 0ul, ring.dropped( ) );
+	std::printf( "binary, batched: %.3f us per request\n", double( binary_us ) / requests );
+	std::printf( "text, write per request: %.3f us per request\n", double( text_us ) / requests );
+
+	EXPECT_LT( binary_us, text_us );
+}
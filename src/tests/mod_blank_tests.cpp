@@ -82,13 +82,22 @@ TEST_F( mod_blank_tests, PluginInitCleanup )
 	EXPECT_FALSE( p.handle_connection_close );
 	EXPECT_FALSE( p.handle_joblist );
 
-	mod_blank* mb = reinterpret_cast< mod_blank* >( p.init( srv ) );
+	void* data = p.init( srv );
+	ASSERT_TRUE( data );
+
+	// lighttpd writes the plugin id over the start of plugin.data,
+	// make sure that doesn't hurt us.
+	reinterpret_cast< plugin_handle* >( data )->id = 3;
+
+	mod_blank* mb = plugin_handle::get< mod_blank >( data );
 
 	EXPECT_EQ( std::string( "blank" ), mb->name );
 	EXPECT_EQ( LIGHTTPD_VERSION_ID, mb->version );
+	EXPECT_EQ( 3u, mb->id( ) );
+	EXPECT_EQ( HANDLER_GO_ON, p.set_defaults( srv, data ) );
 
 	// Cleanup
-	EXPECT_EQ( p.cleanup( srv, mb ), HANDLER_GO_ON );
+	EXPECT_EQ( p.cleanup( srv, data ), HANDLER_GO_ON );
 }
 
 TEST_F( mod_blank_tests, SetDefaults )
@@ -0,0 +1,404 @@
+/**
+ * Test listings are rendered once, kept current by inotify one entry at a
+ * time, that directories mod_indexfile answers for are left to it, and
+ * compare a cached listing with reading a big directory afresh.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+#include <utime.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_dircache.hpp"
+
+static uint64_t now_us( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
+
+class mod_dircache_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			char templ[] = "/tmp/lighttpd-cpp-dircache-XXXXXX";
+			ASSERT_TRUE( mkdtemp( templ ) );
+			dir = templ;
+		}
+
+		void TearDown( )
+		{
+			std::string cmd = "rm -rf " + dir;
+			if( system( cmd.c_str( ) ) ) {}
+		}
+
+		void write_file( const std::string& name, std::size_t size, time_t mtime = 1000000000 )
+		{
+			std::string path = dir + "/" + name;
+			std::FILE* f = std::fopen( path.c_str( ), "wb" );
+			std::string content( size, 'x' );
+			if( size ) std::fwrite( content.data( ), size, 1, f );
+			std::fclose( f );
+
+			struct utimbuf t = { mtime, mtime };
+			utime( path.c_str( ), &t );
+		}
+
+		void make_dir( const std::string& name )
+		{
+			std::string path = dir + "/" + name;
+			mkdir( path.c_str( ), 0755 );
+			struct utimbuf t = { 1000000000, 1000000000 };
+			utime( path.c_str( ), &t );
+		}
+
+		std::vector< std::string > names( const dir_listing& l )
+		{
+			std::vector< std::string > out;
+			for( std::vector< dir_entry >::const_iterator i = l.list( ).begin( ); i != l.list( ).end( ); ++i )
+				out.push_back( i->name );
+			return out;
+		}
+
+		std::string dir;
+};
+
+TEST( dirlist_render_tests, Rows )
+{
+	dir_entry file( "a <b>&c.txt" );
+	file.size = 1536;
+	file.mtime = 784111777;
+
+	std::string html;
+	dirlist_render::row( DIRLIST_HTML, file, 0, html );
+	EXPECT_EQ( "<tr><td><a href=\"a%20%3Cb%3E%26c.txt\">a &lt;b&gt;&amp;c.txt</a></td>"
+		"<td>1994-Nov-06 08:49:37</td><td>1.5K</td><td>application/octet-stream</td></tr>\n", html );
+
+	dir_entry sub( "sub", true );
+	sub.mtime = 784111777;
+	std::string json;
+	dirlist_render::row( DIRLIST_JSON, sub, 0, json );
+	EXPECT_EQ( "{\"name\":\"sub\",\"type\":\"directory\",\"size\":0,\"mtime\":784111777}", json );
+
+	std::string quoted;
+	dirlist_render::escape_json( "a\"b\\c\n", quoted );
+	EXPECT_EQ( "a\\\"b\\\\c\\u000a", quoted );
+
+	std::string sizes;
+	dirlist_render::human_size( 1000, sizes );
+	sizes += ' ';
+	dirlist_render::human_size( 5 * 1024 * 1024 + 512 * 1024, sizes );
+	EXPECT_EQ( "1000 5.5M", sizes );
+}
+
+TEST_F( mod_dircache_tests, Listing )
+{
+	write_file( "b.txt", 10 );
+	write_file( "a.txt", 2000 );
+	write_file( ".hidden", 1 );
+	make_dir( "zdir" );
+
+	dir_listing l( dir );
+	ASSERT_TRUE( l.refresh( ) );
+
+	// Directories first, dotfiles hidden.
+	std::vector< std::string > expected;
+	expected.push_back( "zdir" );
+	expected.push_back( "a.txt" );
+	expected.push_back( "b.txt" );
+	EXPECT_EQ( expected, names( l ) );
+	EXPECT_TRUE( l.contains( "a.txt" ) );
+	EXPECT_TRUE( l.contains( "zdir" ) );
+	EXPECT_FALSE( l.contains( ".hidden" ) );
+
+	shared_fragment_ptr json = l.body( DIRLIST_JSON, 0, "/tmp" );
+	EXPECT_EQ(
+		"{\"name\":\"zdir\",\"type\":\"directory\",\"size\":0,\"mtime\":1000000000},\n"
+		"{\"name\":\"a.txt\",\"type\":\"file\",\"size\":2000,\"mtime\":1000000000},\n"
+		"{\"name\":\"b.txt\",\"type\":\"file\",\"size\":10,\"mtime\":1000000000}", json->data( ) );
+
+	// Rendered once, the same body until something changes.
+	EXPECT_EQ( json, l.body( DIRLIST_JSON, 0, "/tmp" ) );
+	EXPECT_EQ( 3u, l.rows_rendered );
+	l.body( DIRLIST_HTML, 0, "/tmp" );
+	EXPECT_EQ( 6u, l.rows_rendered );
+
+	dir_listing dotted( dir, true );
+	ASSERT_TRUE( dotted.refresh( ) );
+	EXPECT_TRUE( dotted.contains( ".hidden" ) );
+}
+
+TEST_F( mod_dircache_tests, OneEntryAtATime )
+{
+	for( int i = 0; i < 100; ++i )
+	{
+		char name[ 32 ];
+		snprintf( name, sizeof( name ), "file%03d", i );
+		write_file( name, i );
+	}
+
+	dir_cache cache;
+	dir_listing* l = cache.get( dir, false );
+	ASSERT_TRUE( l );
+	l->body( DIRLIST_HTML, 0, "/tmp" );
+	EXPECT_EQ( 100u, l->rows_rendered );
+	EXPECT_EQ( 1u, cache.misses );
+
+	// One new, one gone, one changed.
+	write_file( "file050b", 5 );
+	unlink( ( dir + "/file010" ).c_str( ) );
+	write_file( "file020", 12345, 1200000000 );
+
+	ASSERT_EQ( l, cache.get( dir, false ) );
+	EXPECT_EQ( 1u, cache.hits );
+	EXPECT_EQ( 1u, l->full_loads );
+	EXPECT_EQ( 1u, l->updates );
+
+	std::string body = l->body( DIRLIST_HTML, 0, "/tmp" )->data( );
+
+	// Only the two new rows were rendered, not the directory again.
+	EXPECT_EQ( 102u, l->rows_rendered );
+	EXPECT_EQ( 100u, l->size( ) );
+	EXPECT_EQ( std::string::npos, body.find( "\"file010\"" ) );
+	EXPECT_NE( std::string::npos, body.find( "\"file020\">file020</a></td><td>2008-Jan-10 21:20:00</td><td>12.1K" ) );
+	EXPECT_LT( body.find( "\"file050\"" ), body.find( "\"file050b\"" ) );
+	EXPECT_LT( body.find( "\"file050b\"" ), body.find( "\"file051\"" ) );
+
+	// Nothing happened, nothing to do.
+	cache.get( dir, false );
+	EXPECT_EQ( 1u, l->updates );
+}
+
+TEST_F( mod_dircache_tests, WithAndWithoutDotfiles )
+{
+	write_file( "a.txt", 1 );
+	write_file( ".hidden", 1 );
+
+	dir_cache cache;
+	dir_listing* plain = cache.get( dir, false );
+	dir_listing* dotted = cache.get( dir, true );
+	ASSERT_TRUE( plain );
+	ASSERT_TRUE( dotted );
+	EXPECT_NE( plain, dotted );
+	EXPECT_FALSE( plain->contains( ".hidden" ) );
+	EXPECT_TRUE( dotted->contains( ".hidden" ) );
+
+	// Asking one way then the other reads nothing again.
+	for( int i = 0; i < 4; ++i )
+	{
+		EXPECT_EQ( plain, cache.get( dir, false ) );
+		EXPECT_EQ( dotted, cache.get( dir, true ) );
+	}
+	EXPECT_EQ( 2u, cache.full_loads( ) );
+	EXPECT_EQ( 8u, cache.hits );
+
+	// The one watch keeps both current.
+	write_file( ".new", 1 );
+	write_file( "b.txt", 1 );
+	ASSERT_EQ( plain, cache.get( dir, false ) );
+	ASSERT_EQ( dotted, cache.get( dir, true ) );
+	EXPECT_FALSE( plain->contains( ".new" ) );
+	EXPECT_TRUE( plain->contains( "b.txt" ) );
+	EXPECT_TRUE( dotted->contains( ".new" ) );
+	EXPECT_TRUE( dotted->contains( "b.txt" ) );
+	EXPECT_EQ( 2u, cache.full_loads( ) );
+}
+
+TEST_F( mod_dircache_tests, WatchOutlivesOneListing )
+{
+	make_dir( "a" );
+	make_dir( "b" );
+
+	// The dotfile listing of a goes, the plain one keeps the watch.
+	dir_cache cache( 2 );
+	ASSERT_TRUE( cache.get( dir + "/a", true ) );
+	dir_listing* a = cache.get( dir + "/a", false );
+	ASSERT_TRUE( a );
+	cache.get( dir + "/b", false );
+	EXPECT_EQ( 2u, cache.size( ) );
+
+	write_file( "a/x", 1 );
+	ASSERT_EQ( a, cache.get( dir + "/a", false ) );
+	EXPECT_TRUE( a->contains( "x" ) );
+	EXPECT_EQ( 1u, a->updates );
+}
+
+TEST_F( mod_dircache_tests, DirectoryGoingAwayIsDropped )
+{
+	make_dir( "sub" );
+	write_file( "sub/x", 1 );
+
+	dir_cache cache;
+	ASSERT_TRUE( cache.get( dir + "/sub", false ) );
+	EXPECT_EQ( 1u, cache.size( ) );
+
+	unlink( ( dir + "/sub/x" ).c_str( ) );
+	rmdir( ( dir + "/sub" ).c_str( ) );
+
+	EXPECT_FALSE( cache.get( dir + "/sub", false ) );
+	EXPECT_EQ( 0u, cache.size( ) );
+}
+
+TEST_F( mod_dircache_tests, LeastRecentlyUsedGoes )
+{
+	make_dir( "a" );
+	make_dir( "b" );
+	make_dir( "c" );
+
+	dir_cache cache( 2 );
+	cache.get( dir + "/a", false );
+	cache.get( dir + "/b", false );
+	cache.get( dir + "/a", false );
+	cache.get( dir + "/c", false );
+
+	EXPECT_EQ( 2u, cache.size( ) );
+	EXPECT_EQ( 1u, cache.hits );
+
+	// a was used since b, so b went.
+	cache.get( dir + "/a", false );
+	EXPECT_EQ( 2u, cache.hits );
+	cache.get( dir + "/b", false );
+	EXPECT_EQ( 4u, cache.misses );
+}
+
+TEST_F( mod_dircache_tests, BigBodiesGoByFile )
+{
+	for( int i = 0; i < 300; ++i )
+	{
+		char name[ 32 ];
+		snprintf( name, sizeof( name ), "artifact-%04d.tar.gz", i );
+		write_file( name, 0 );
+	}
+
+	dir_listing l( dir );
+	ASSERT_TRUE( l.refresh( ) );
+	shared_fragment_ptr body = l.body( DIRLIST_HTML, 0, "/tmp" );
+	EXPECT_GT( body->size( ), std::size_t( shared_fragment::sendfile_threshold ) );
+	EXPECT_NE( -1, body->file( ) );
+}
+
+class mod_dircache_handler_tests : public plugin_tests< mod_dircache >
+{
+	public:
+		mod_dircache_handler_tests( ) : plugin_tests< mod_dircache >( "src/tests/mod_dircache_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_dircache >::SetUp( );
+
+			char templ[] = "/tmp/lighttpd-cpp-dircache-XXXXXX";
+			ASSERT_TRUE( mkdtemp( templ ) );
+			root = templ;
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->write_queue = chunkqueue_init( );
+			con->response.headers = array_init( );
+			con->physical.path = buffer_init( );
+			con->physical.doc_root = buffer_init_string( root.c_str( ) );
+			con->uri.path = buffer_init_string( "/sub/" );
+			con->request.http_method = HTTP_METHOD_GET;
+		}
+
+		void TearDown( )
+		{
+			chunkqueue_reset( con->write_queue );
+			chunkqueue_free( con->write_queue );
+			array_free( con->response.headers );
+			buffer_free( con->physical.path );
+			buffer_free( con->physical.doc_root );
+			buffer_free( con->uri.path );
+			free( con );
+
+			std::string cmd = "rm -rf " + root;
+			if( system( cmd.c_str( ) ) ) {}
+
+			plugin_tests< mod_dircache >::TearDown( );
+		}
+
+		// A GET for the directory root/name/.
+		handler_t request( mod_dircache& p, const std::string& name )
+		{
+			chunkqueue_reset( con->write_queue );
+			con->http_status = 0;
+			buffer_copy_string( con->physical.path, ( root + "/" + name + "/" ).c_str( ) );
+			return p.handle_physical( *con );
+		}
+
+		void touch( const std::string& name )
+		{
+			std::FILE* f = std::fopen( ( root + "/" + name ).c_str( ), "wb" );
+			std::fclose( f );
+		}
+
+		std::string root;
+		connection* con;
+};
+
+TEST_F( mod_dircache_handler_tests, LeavesIndexFileNames )
+{
+	mod_dircache p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	mkdir( ( root + "/plain" ).c_str( ), 0755 );
+	mkdir( ( root + "/home" ).c_str( ), 0755 );
+	touch( "plain/index.html" );
+	touch( "home/home.html" );
+
+	// index.html isn't one of the server's, so listed.
+	EXPECT_EQ( HANDLER_FINISHED, request( p, "plain" ) );
+	EXPECT_EQ( 200, con->http_status );
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "home" ) );
+
+	// Under the document root, for every directory.
+	touch( "shared-index.html" );
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "plain" ) );
+}
+
+TEST_F( mod_dircache_tests, AgainstReadingAfresh )
+{
+	const int files = 20000;
+	for( int i = 0; i < files; ++i )
+	{
+		char name[ 32 ];
+		snprintf( name, sizeof( name ), "build-%05d.zip", i );
+		write_file( name, i );
+	}
+
+	dir_cache cache;
+	ASSERT_TRUE( cache.get( dir, false ) );
+	cache.get( dir, false )->body( DIRLIST_HTML, 0, "/tmp" );
+
+	const int requests = 200;
+
+	// A cached listing with one entry changing between requests.
+	uint64_t start = now_us( );
+	for( int i = 0; i < requests; ++i )
+	{
+		if( i % 10 == 0 ) write_file( "build-00000.zip", i );
+		cache.get( dir, false )->body( DIRLIST_HTML, 0, "/tmp" );
+	}
+	uint64_t cached_us = now_us( ) - start;
+
+	// What mod_dirlisting does: read, stat and render it all each time.
+	start = now_us( );
+	for( int i = 0; i < requests / 10; ++i )
+	{
+		dir_listing fresh( dir );
+		fresh.refresh( );
+		fresh.body( DIRLIST_HTML, 0, "/tmp" );
+	}
+	uint64_t fresh_us = ( now_us( ) - start ) * 10;
+
+	std::printf( "%d entries, cached: %.1f us per request, read afresh: %.1f us per request\n",
+		files, double( cached_us ) / requests, double( fresh_us ) / requests );
+
+	EXPECT_LT( cached_us, fresh_us );
+}
@@ -0,0 +1,164 @@
+/**
+ * Test the path indexes behind mod_pathfilter against a scratch
+ * directory tree, including keeping up with inotify and with roots that
+ * are replaced or are symlinks swapped to another tree.
+ */
+
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <gtest/gtest.h>
+
+#include "../mod_pathfilter.hpp"
+
+class mod_pathfilter_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			char tmpl[] = "/tmp/pathfilter-XXXXXX";
+			ASSERT_TRUE( mkdtemp( tmpl ) );
+			root = tmpl;
+
+			mkdir( ( root + "/dir" ).c_str( ), 0755 );
+			touch( "/index.html" );
+			touch( "/dir/page.html" );
+			touch( "/app.php" );
+
+			indexes.add_root( root + "/", 10 );
+		}
+
+		void TearDown( )
+		{
+			std::system( ( "rm -rf '" + root + "'" ).c_str( ) );
+		}
+
+		void touch( const std::string& rel )
+		{
+			FILE* f = fopen( ( root + rel ).c_str( ), "w" );
+			if( f ) fclose( f );
+		}
+
+		bool absent( const std::string& rel )
+		{
+			const path_index* index = indexes.find( root.data( ), root.size( ) );
+			std::string path = root + rel;
+			return index && index->definitely_absent( path.data( ), path.size( ) );
+		}
+
+		std::string root;
+		path_index_set indexes;
+};
+
+TEST_F( mod_pathfilter_tests, ExistingPathsPass )
+{
+	ASSERT_EQ( 1u, indexes.indexes.size( ) );
+
+	EXPECT_FALSE( absent( "/index.html" ) );
+	EXPECT_FALSE( absent( "/dir" ) );
+	EXPECT_FALSE( absent( "/dir/" ) );
+	EXPECT_FALSE( absent( "/dir/page.html" ) );
+	EXPECT_FALSE( absent( "/" ) );
+}
+
+TEST_F( mod_pathfilter_tests, MissingPathsRejected )
+{
+	EXPECT_TRUE( absent( "/wp-login.php" ) );
+	EXPECT_TRUE( absent( "/dir/missing.html" ) );
+	EXPECT_TRUE( absent( "/missing/dir/" ) );
+}
+
+TEST_F( mod_pathfilter_tests, PathInfoPasses )
+{
+	EXPECT_FALSE( absent( "/app.php/some/path/info" ) );
+}
+
+TEST_F( mod_pathfilter_tests, OutsideRootPasses )
+{
+	const path_index* index = indexes.find( root.data( ), root.size( ) );
+	ASSERT_TRUE( index );
+	EXPECT_FALSE( index->definitely_absent( CONST_STR_LEN( "/etc/passwd" ) ) );
+}
+
+TEST_F( mod_pathfilter_tests, CreationsFollowed )
+{
+	EXPECT_TRUE( absent( "/new.html" ) );
+	EXPECT_TRUE( absent( "/newdir/inner.html" ) );
+
+	touch( "/new.html" );
+	mkdir( ( root + "/newdir" ).c_str( ), 0755 );
+	indexes.drain( );
+	touch( "/newdir/inner.html" );
+	indexes.drain( );
+
+	EXPECT_FALSE( absent( "/new.html" ) );
+	EXPECT_FALSE( absent( "/newdir/inner.html" ) );
+}
+
+TEST_F( mod_pathfilter_tests, RemovalsRebuild )
+{
+	path_index* index = indexes.find( root.data( ), root.size( ) );
+	ASSERT_TRUE( index );
+	EXPECT_FALSE( index->needs_rebuild( ) );
+
+	unlink( ( root + "/index.html" ).c_str( ) );
+	unlink( ( root + "/dir/page.html" ).c_str( ) );
+	unlink( ( root + "/app.php" ).c_str( ) );
+	indexes.drain( );
+
+	// Still maybe present until the rebuild.
+	EXPECT_FALSE( absent( "/index.html" ) );
+	EXPECT_TRUE( index->needs_rebuild( ) );
+
+	EXPECT_TRUE( indexes.rebuild_one( ) );
+	EXPECT_TRUE( absent( "/index.html" ) );
+	EXPECT_FALSE( indexes.rebuild_one( ) );
+}
+
+TEST_F( mod_pathfilter_tests, RootReplaced )
+{
+	std::string old = root + ".old";
+	ASSERT_EQ( 0, rename( root.c_str( ), old.c_str( ) ) );
+	indexes.drain( );
+
+	// Nothing is known while it isn't there.
+	EXPECT_FALSE( absent( "/wp-login.php" ) );
+	EXPECT_TRUE( indexes.rebuild_one( ) );
+	EXPECT_FALSE( absent( "/wp-login.php" ) );
+
+	mkdir( root.c_str( ), 0755 );
+	touch( "/fresh.html" );
+	EXPECT_TRUE( indexes.rebuild_one( ) );
+	EXPECT_FALSE( absent( "/fresh.html" ) );
+	EXPECT_TRUE( absent( "/index.html" ) );
+
+	std::system( ( "rm -rf '" + old + "'" ).c_str( ) );
+}
+
+TEST_F( mod_pathfilter_tests, SymlinkSwapped )
+{
+	mkdir( ( root + "/v1" ).c_str( ), 0755 );
+	mkdir( ( root + "/v2" ).c_str( ), 0755 );
+	touch( "/v1/old.html" );
+	touch( "/v2/new.html" );
+	ASSERT_EQ( 0, symlink( "v1", ( root + "/current" ).c_str( ) ) );
+
+	path_index_set set;
+	std::string current = root + "/current";
+	set.add_root( current, 10 );
+	const path_index* index = set.find( current.data( ), current.size( ) );
+	ASSERT_TRUE( index );
+
+	std::string old_page = current + "/old.html", new_page = current + "/new.html";
+	EXPECT_FALSE( index->definitely_absent( old_page.data( ), old_page.size( ) ) );
+	EXPECT_TRUE( index->definitely_absent( new_page.data( ), new_page.size( ) ) );
+
+	// As deploys do it, a new link renamed over the old one.
+	ASSERT_EQ( 0, symlink( "v2", ( root + "/current.new" ).c_str( ) ) );
+	ASSERT_EQ( 0, rename( ( root + "/current.new" ).c_str( ), current.c_str( ) ) );
+	set.drain( );
+
+	EXPECT_TRUE( set.rebuild_one( ) );
+	EXPECT_FALSE( index->definitely_absent( new_page.data( ), new_page.size( ) ) );
+	EXPECT_TRUE( index->definitely_absent( old_page.data( ), old_page.size( ) ) );
+}
@@ -0,0 +1,196 @@
+/**
+ * Test the upstream connection pool and the chunked decoding behind
+ * mod_proxy_pool.
+ */
+
+#include <string>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../mod_proxy_pool.hpp"
+
+static const char* upstream_path = "/tmp/lighttpd-cpp-upstream.sock";
+
+struct string_sink
+{
+	void operator()( const char* p, std::size_t n ) { s.append( p, n ); }
+	std::string s;
+};
+
+TEST( mod_proxy_pool_tests, Dechunks )
+{
+	const std::string body = "4\r\nWiki\r\n5;ext=1\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\n\r\n";
+	const std::string after = "HTTP/1.1 200 OK";
+	const std::string input = body + after;
+
+	// Split in two at every offset.
+	for( std::size_t split = 0; split <= input.size( ); ++split )
+	{
+		chunked_decoder d;
+		string_sink out;
+		std::size_t used = 0, total = 0;
+
+		chunked_decoder::result r = d.feed( input.data( ), split, out, used );
+		total += used;
+		if( r == chunked_decoder::MORE )
+		{
+			r = d.feed( input.data( ) + split, input.size( ) - split, out, used );
+			total += used;
+		}
+
+		ASSERT_EQ( chunked_decoder::DONE, r ) << split;
+		EXPECT_EQ( "Wikipedia in\r\n\r\nchunks.", out.s ) << split;
+		EXPECT_EQ( body.size( ), total ) << split;
+	}
+}
+
+TEST( mod_proxy_pool_tests, BadChunks )
+{
+	const char* bad[] = { "x\r\n", "\r\n", "4\r\nWikiX", "12345678123456781\r\n", "0\r\n\rX" };
+
+	for( std::size_t i = 0; i < sizeof( bad ) / sizeof( bad[0] ); ++i )
+	{
+		chunked_decoder d;
+		string_sink out;
+		std::size_t used;
+		EXPECT_EQ( chunked_decoder::BAD, d.feed( bad[i], std::strlen( bad[i] ), out, used ) ) << bad[i];
+	}
+}
+
+class upstream_pool_tests : public testing::Test
+{
+	public:
+		upstream_pool_tests( ) : listener( -1 ) {}
+
+		void SetUp( )
+		{
+			struct sockaddr_un addr;
+			std::memset( &addr, 0, sizeof( addr ) );
+			addr.sun_family = AF_UNIX;
+			strcpy( addr.sun_path, upstream_path );
+			unlink( upstream_path );
+
+			listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+			ASSERT_EQ( 0, bind( listener, reinterpret_cast< struct sockaddr* >( &addr ), sizeof( addr ) ) );
+			ASSERT_EQ( 0, listen( listener, 8 ) );
+		}
+
+		void TearDown( )
+		{
+			close( listener );
+			unlink( upstream_path );
+		}
+
+		int listener;
+		upstream_pool pool;
+};
+
+TEST_F( upstream_pool_tests, Addresses )
+{
+	EXPECT_TRUE( pool.get( std::string( "unix:" ) + upstream_path ).valid( ) );
+	EXPECT_TRUE( pool.get( "127.0.0.1:8080" ).valid( ) );
+	EXPECT_TRUE( pool.get( "[::1]:8080" ).valid( ) );
+	EXPECT_FALSE( pool.get( "unix:" ).valid( ) );
+	EXPECT_FALSE( pool.get( "no-port" ).valid( ) );
+
+	// One per address.
+	EXPECT_EQ( &pool.get( "127.0.0.1:8080" ), &pool.get( "127.0.0.1:8080" ) );
+}
+
+TEST_F( upstream_pool_tests, Lookups )
+{
+	// Not from a request, only once configure asks.
+	upstream& u = pool.get( "localhost:8080" );
+	EXPECT_FALSE( u.valid( ) );
+	EXPECT_TRUE( u.resolve( ) );
+	EXPECT_TRUE( u.valid( ) );
+
+	EXPECT_FALSE( pool.get( "no-port" ).resolve( ) );
+}
+
+TEST_F( upstream_pool_tests, Reused )
+{
+	upstream& u = pool.get( std::string( "unix:" ) + upstream_path );
+
+	EXPECT_EQ( -1, u.take_idle( ) );
+	int fd = u.connect_new( );
+	ASSERT_NE( -1, fd );
+	int peer = accept( listener, NULL, NULL );
+	ASSERT_NE( -1, peer );
+
+	pool.release( u, fd, 100 );
+	EXPECT_EQ( 1u, pool.idle_count( ) );
+	EXPECT_EQ( fd, u.take_idle( ) );
+	EXPECT_EQ( 1u, u.connects );
+	EXPECT_EQ( 1u, u.reuses );
+
+	// Closed by the upstream while idle.
+	pool.release( u, fd, 100 );
+	close( peer );
+	EXPECT_EQ( -1, u.take_idle( ) );
+	EXPECT_EQ( 0u, pool.idle_count( ) );
+}
+
+TEST_F( upstream_pool_tests, IdleLimits )
+{
+	upstream& u = pool.get( std::string( "unix:" ) + upstream_path );
+	pool.max_idle = 2;
+	pool.idle_timeout = 60;
+
+	int peers[3];
+	for( int i = 0; i < 3; ++i )
+	{
+		int fd = u.connect_new( );
+		ASSERT_NE( -1, fd );
+		peers[i] = accept( listener, NULL, NULL );
+		pool.release( u, fd, 100 + i );
+	}
+	EXPECT_EQ( 2u, pool.idle_count( ) );
+
+	// The older one goes first.
+	pool.reap( 160 );
+	EXPECT_EQ( 1u, pool.idle_count( ) );
+	pool.reap( 161 );
+	EXPECT_EQ( 0u, pool.idle_count( ) );
+
+	for( int i = 0; i < 3; ++i ) close( peers[i] );
+}
+
+TEST_F( upstream_pool_tests, Health )
+{
+	std::vector< std::string > names;
+	names.push_back( "127.0.0.1:1" );
+	names.push_back( "127.0.0.1:2" );
+	names.push_back( "not an address" );
+
+	upstream& a = pool.get( names[0] );
+	upstream& b = pool.get( names[1] );
+	pool.max_fails = 2;
+	pool.fail_timeout = 10;
+
+	// Round robin over the valid ones.
+	EXPECT_EQ( &a, pool.choose( names, 0 ) );
+	EXPECT_EQ( &b, pool.choose( names, 0 ) );
+	EXPECT_EQ( &a, pool.choose( names, 0 ) );
+
+	pool.failed( a, 0 );
+	EXPECT_TRUE( a.healthy( 0 ) );
+	pool.failed( a, 0 );
+	EXPECT_FALSE( a.healthy( 0 ) );
+
+	for( int i = 0; i < 4; ++i )
+		EXPECT_EQ( &b, pool.choose( names, 5 ) );
+
+	// Both down, a is back first.
+	pool.failed( b, 5 );
+	pool.failed( b, 5 );
+	EXPECT_EQ( &a, pool.choose( names, 5 ) );
+
+	EXPECT_TRUE( a.healthy( 10 ) );
+	pool.succeeded( b );
+	EXPECT_TRUE( b.healthy( 5 ) );
+}
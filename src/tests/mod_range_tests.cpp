@@ -0,0 +1,409 @@
+/**
+ * Test Range parsing, the 206 bodies built from it, which requests are
+ * left to mod_staticfile and spotting sequential readers, and compare building multi-range responses from
+ * file chunks with reading the ranges into memory.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_range.hpp"
+
+static const char* file_path = "/tmp/lighttpd-cpp-range-test";
+
+static uint64_t now_us( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
+
+// The body as queued, file chunks read back.
+static std::string written( chunkqueue* cq )
+{
+	std::string s;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::MEM_CHUNK && c->mem->used )
+			s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+
+		if( c->type == chunk::FILE_CHUNK )
+		{
+			std::vector< char > buf( c->file.length );
+			if( pread( c->file.fd, &buf[0], buf.size( ), c->file.start ) == static_cast< ssize_t >( buf.size( ) ) )
+				s.append( &buf[0], buf.size( ) );
+		}
+	}
+	return s;
+}
+
+static std::size_t count( chunkqueue* cq, int type )
+{
+	std::size_t n = 0;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == type ) ++n;
+	}
+	return n;
+}
+
+// Close what the chunks dup()ed, as the core does once they are sent.
+static void clear( chunkqueue* cq )
+{
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::FILE_CHUNK && c->file.fd != -1 ) close( c->file.fd );
+	}
+	chunkqueue_reset( cq );
+}
+
+class mod_range_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			content.resize( 10000 );
+			for( std::size_t i = 0; i < content.size( ); ++i )
+				content[i] = static_cast< char >( 'a' + i % 26 );
+
+			std::FILE* f = std::fopen( file_path, "wb" );
+			std::fwrite( content.data( ), content.size( ), 1, f );
+			std::fclose( f );
+
+			fd = open( file_path, O_RDONLY );
+			name = buffer_init( );
+			buffer_copy_string( name, file_path );
+			cq = chunkqueue_init( );
+		}
+
+		void TearDown( )
+		{
+			clear( cq );
+			chunkqueue_free( cq );
+			buffer_free( name );
+			close( fd );
+			unlink( file_path );
+		}
+
+		std::string content;
+		int fd;
+		buffer* name;
+		chunkqueue* cq;
+};
+
+TEST( range_set_tests, Forms )
+{
+	range_set set;
+
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=0-499", 10000 ) );
+	ASSERT_EQ( 1u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 0, 499 ), set.ranges[0] );
+
+	// Open ended, and past the end, stop at the end.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=9500-", 10000 ) );
+	EXPECT_EQ( byte_range( 9500, 9999 ), set.ranges[0] );
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=9500-20000", 10000 ) );
+	EXPECT_EQ( byte_range( 9500, 9999 ), set.ranges[0] );
+
+	// Suffixes, longer than the file is all of it.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=-500", 10000 ) );
+	EXPECT_EQ( byte_range( 9500, 9999 ), set.ranges[0] );
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=-20000", 10000 ) );
+	EXPECT_EQ( byte_range( 0, 9999 ), set.ranges[0] );
+
+	// Whitespace, case and empty list elements.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( " Bytes = 0-9 , ,20-29 ", 10000 ) );
+	ASSERT_EQ( 2u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 20, 29 ), set.ranges[1] );
+	EXPECT_EQ( 20, set.total( ) );
+}
+
+TEST( range_set_tests, Overlapping )
+{
+	range_set set;
+
+	// Overlapping and touching merge, out of order ones are sorted.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=500-600,0-99,100-199,550-700,-100", 10000 ) );
+	EXPECT_EQ( 5u, set.requested );
+	ASSERT_EQ( 3u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 0, 199 ), set.ranges[0] );
+	EXPECT_EQ( byte_range( 500, 700 ), set.ranges[1] );
+	EXPECT_EQ( byte_range( 9900, 9999 ), set.ranges[2] );
+
+	// The same range over and over is just the one.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=0-0,0-0,0-0", 10000 ) );
+	ASSERT_EQ( 1u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 0, 0 ), set.ranges[0] );
+
+	// One inside another.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=0-1000,10-20", 10000 ) );
+	ASSERT_EQ( 1u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 0, 1000 ), set.ranges[0] );
+}
+
+TEST( range_set_tests, Unsatisfiable )
+{
+	range_set set;
+
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=10000-", 10000 ) );
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=20000-30000,10000-10001", 10000 ) );
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=-0", 10000 ) );
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=0-10", 0 ) );
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=-10", 0 ) );
+	EXPECT_EQ( range_set::UNSATISFIABLE, set.parse( "bytes=99999999999999999999999-", 10000 ) );
+
+	// Any range inside the file is enough, the rest are dropped.
+	ASSERT_EQ( range_set::SATISFIABLE, set.parse( "bytes=20000-,5-9", 10000 ) );
+	ASSERT_EQ( 1u, set.ranges.size( ) );
+	EXPECT_EQ( byte_range( 5, 9 ), set.ranges[0] );
+}
+
+TEST( range_set_tests, Ignored )
+{
+	range_set set;
+
+	EXPECT_EQ( range_set::IGNORE, set.parse( "", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "items=0-5", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes 0-5", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=5-0", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=-", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=0-5x", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=0-5,abc", 10000 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=--5", 10000 ) );
+
+	// Too many ranges, the whole file rather than a pile of parts.
+	EXPECT_EQ( range_set::SATISFIABLE, set.parse( "bytes=0-0,2-2,4-4", 10000, 3 ) );
+	EXPECT_EQ( range_set::IGNORE, set.parse( "bytes=0-0,2-2,4-4,6-6", 10000, 3 ) );
+}
+
+TEST_F( mod_range_tests, SingleRange )
+{
+	range_set set;
+	set.parse( "bytes=100-199", content.size( ) );
+
+	response_builder out( cq );
+	range_body::write( out, fd, name, set, content.size( ), CONST_STR_LEN( "text/plain" ), "B" );
+
+	EXPECT_EQ( content.substr( 100, 100 ), written( cq ) );
+	EXPECT_EQ( 1u, count( cq, chunk::FILE_CHUNK ) );
+	EXPECT_EQ( 0u, count( cq, chunk::MEM_CHUNK ) );
+	EXPECT_EQ( 100, out.length( ) );
+
+	char line[ 64 ];
+	std::size_t n = range_body::content_range( line, sizeof( line ), set.ranges[0], content.size( ) );
+	EXPECT_EQ( "bytes 100-199/10000", std::string( line, n ) );
+}
+
+TEST_F( mod_range_tests, MultiRange )
+{
+	range_set set;
+	set.parse( "bytes=0-4,-3,10-14", content.size( ) );
+
+	response_builder out( cq );
+	range_body::write( out, fd, name, set, content.size( ), CONST_STR_LEN( "text/plain" ), "THIS_STRING_SEPARATES" );
+
+	EXPECT_EQ(
+		"\r\n--THIS_STRING_SEPARATES\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-4/10000\r\n\r\n"
+		"abcde"
+		"\r\n--THIS_STRING_SEPARATES\r\nContent-Type: text/plain\r\nContent-Range: bytes 10-14/10000\r\n\r\n"
+		"klmno"
+		"\r\n--THIS_STRING_SEPARATES\r\nContent-Type: text/plain\r\nContent-Range: bytes 9997-9999/10000\r\n\r\n"
+		+ content.substr( 9997 ) +
+		"\r\n--THIS_STRING_SEPARATES--\r\n", written( cq ) );
+
+	// Nothing of the file was copied.
+	EXPECT_EQ( 3u, count( cq, chunk::FILE_CHUNK ) );
+	EXPECT_EQ( static_cast< off_t >( written( cq ).size( ) ), out.length( ) );
+
+	EXPECT_EQ( "multipart/byteranges; boundary=THIS_STRING_SEPARATES", range_body::multipart_type( "THIS_STRING_SEPARATES" ) );
+}
+
+class mod_range_handler_tests : public plugin_tests< mod_range >
+{
+	public:
+		mod_range_handler_tests( ) : plugin_tests< mod_range >( "src/tests/mod_range_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_range >::SetUp( );
+
+			std::FILE* f = std::fopen( file_path, "wb" );
+			std::fputs( "abcdefghijklmnopqrstuvwxyz", f );
+			std::fclose( f );
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->mode = DIRECT;
+			con->conf.follow_symlink = 1;
+			con->etag_flags = static_cast< etag_flags_t >( ETAG_USE_MTIME | ETAG_USE_SIZE );
+			con->write_queue = chunkqueue_init( );
+			con->request.headers = array_init( );
+			con->response.headers = array_init( );
+			con->physical.path = buffer_init_string( file_path );
+			con->request.http_method = HTTP_METHOD_GET;
+			con->request.http_range = "bytes=0-4";
+		}
+
+		void TearDown( )
+		{
+			clear( con->write_queue );
+			chunkqueue_free( con->write_queue );
+			array_free( con->request.headers );
+			array_free( con->response.headers );
+			buffer_free( con->physical.path );
+			free( con );
+			unlink( file_path );
+
+			plugin_tests< mod_range >::TearDown( );
+		}
+
+		void request_header( const char* key, const char* value )
+		{
+			data_string* ds = data_string_init( );
+			buffer_copy_string( ds->key, key );
+			buffer_copy_string( ds->value, value );
+			array_insert_unique( con->request.headers, reinterpret_cast< data_unset* >( ds ) );
+		}
+
+		const char* response_header( const char* key )
+		{
+			data_string* ds = reinterpret_cast< data_string* >( array_get_element( con->response.headers, key, std::strlen( key ) ) );
+			return ds ? ds->value->ptr : NULL;
+		}
+
+		connection* con;
+};
+
+TEST_F( mod_range_handler_tests, SendsValidators )
+{
+	mod_range p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	ASSERT_EQ( HANDLER_FINISHED, p.handle_physical( *con ) );
+	EXPECT_EQ( 206, con->http_status );
+	EXPECT_EQ( "abcde", written( con->write_queue ) );
+	EXPECT_TRUE( response_header( "Last-Modified" ) != NULL );
+	ASSERT_TRUE( response_header( "ETag" ) != NULL );
+	EXPECT_NE( '\0', response_header( "ETag" )[0] );
+
+	// No ETag when the server is configured not to send them.
+	clear( con->write_queue );
+	array_reset( con->response.headers );
+	con->etag_flags = static_cast< etag_flags_t >( 0 );
+	ASSERT_EQ( HANDLER_FINISHED, p.handle_physical( *con ) );
+	EXPECT_TRUE( response_header( "ETag" ) == NULL );
+}
+
+TEST_F( mod_range_handler_tests, LeavesConditionalsToStaticfile )
+{
+	mod_range p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	// Parsed by the core into the request.
+	con->request.http_if_none_match = "\"x\"";
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_physical( *con ) );
+	con->request.http_if_none_match = NULL;
+
+	con->request.http_if_modified_since = "Thu, 01 Jan 1970 00:00:00 GMT";
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_physical( *con ) );
+	con->request.http_if_modified_since = NULL;
+
+	// Only in the headers.
+	const char* names[] = { "If-Range", "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since" };
+	for( std::size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i )
+	{
+		array_reset( con->request.headers );
+		request_header( names[i], "\"x\"" );
+		EXPECT_EQ( HANDLER_GO_ON, p.handle_physical( *con ) ) << names[i];
+	}
+	EXPECT_EQ( 0, con->http_status );
+	EXPECT_EQ( "", written( con->write_queue ) );
+
+	array_reset( con->request.headers );
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_physical( *con ) );
+}
+
+TEST( readahead_tracker_tests, SpotsSequentialReaders )
+{
+	readahead_tracker readers( 64 );
+	struct stat st;
+	std::memset( &st, 0, sizeof( st ) );
+	st.st_ino = 42;
+
+	EXPECT_FALSE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 0, 999 ) ) );
+	EXPECT_TRUE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 1000, 1999 ) ) );
+	EXPECT_TRUE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 2000, 2999 ) ) );
+
+	// A seek, then carrying on from there.
+	EXPECT_FALSE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 50000, 50999 ) ) );
+	EXPECT_TRUE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 51000, 51999 ) ) );
+
+	// Someone else, or another file, isn't carrying on from anything.
+	EXPECT_FALSE( readers.advance( CONST_STR_LEN( "10.0.0.2" ), st, byte_range( 52000, 52999 ) ) );
+	st.st_ino = 43;
+	EXPECT_FALSE( readers.advance( CONST_STR_LEN( "10.0.0.1" ), st, byte_range( 52000, 52999 ) ) );
+
+	EXPECT_EQ( 3u, readers.sequential );
+	EXPECT_EQ( 4u, readers.random );
+}
+
+TEST_F( mod_range_tests, AgainstCopyingRanges )
+{
+	// A 16MB file, as a video would be, and requests for eight 64KB ranges.
+	std::string big( 16 << 20, 'v' );
+	std::FILE* f = std::fopen( file_path, "wb" );
+	std::fwrite( big.data( ), big.size( ), 1, f );
+	std::fclose( f );
+	int big_fd = open( file_path, O_RDONLY );
+	ASSERT_NE( -1, big_fd );
+
+	const char* header = "bytes=0-65535,2000000-2065535,4000000-4065535,6000000-6065535,"
+		"8000000-8065535,10000000-10065535,12000000-12065535,14000000-14065535";
+	const int responses = 2000;
+	off_t bytes = 0;
+
+	uint64_t start = now_us( );
+	for( int i = 0; i < responses; ++i )
+	{
+		range_set set;
+		set.parse( header, big.size( ) );
+		response_builder out( cq );
+		range_body::write( out, big_fd, name, set, big.size( ), CONST_STR_LEN( "video/mp4" ), "0123456789abcdef" );
+		bytes += out.length( );
+		clear( cq );
+	}
+	uint64_t chunks_us = now_us( ) - start;
+
+	// The slow path: each range read into memory and queued as text.
+	start = now_us( );
+	for( int i = 0; i < responses; ++i )
+	{
+		range_set set;
+		set.parse( header, big.size( ) );
+		response_builder out( cq );
+		for( std::vector< byte_range >::const_iterator r = set.ranges.begin( ); r != set.ranges.end( ); ++r )
+		{
+			out << "\r\n--0123456789abcdef\r\nContent-Type: video/mp4\r\nContent-Range: bytes 0-0/0\r\n\r\n";
+			char* p = out.reserve( r->length( ) );
+			ssize_t n = pread( big_fd, p, r->length( ), r->first );
+			out.commit( n > 0 ? n : 0 );
+		}
+		clear( cq );
+	}
+	uint64_t copying_us = now_us( ) - start;
+	close( big_fd );
+
+	std::printf( "file chunks: %.2f us per response, %.0f MB/s assembled\n", double( chunks_us ) / responses,
+		double( bytes ) / ( chunks_us ? chunks_us : 1 ) );
+	std::printf( "copied: %.2f us per response\n", double( copying_us ) / responses );
+
+	EXPECT_LT( chunks_us, copying_us );
+}
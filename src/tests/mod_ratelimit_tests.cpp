@@ -0,0 +1,224 @@
+/**
+ * Test the token buckets and the fixed size table behind mod_ratelimit,
+ * then the handlers that admit requests and charge their bytes.
+ */
+
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_ratelimit.hpp"
+
+MAKE_PLUGIN( mod_ratelimit, "ratelimit", LIGHTTPD_VERSION_ID );
+
+TEST( mod_ratelimit_tests, BurstThenRefill )
+{
+	rate_table table( 1024 );
+	rate_limits limits( 10, 5, 0 );
+
+	for( int i = 0; i < 5; ++i )
+		EXPECT_TRUE( rate_table::admit( table.find( 100, 1000, limits ), limits ) );
+	EXPECT_FALSE( rate_table::admit( table.find( 100, 1000, limits ), limits ) );
+	EXPECT_EQ( 1, rate_table::retry_after( table.find( 100, 1000, limits ), limits ) );
+
+	// 10 a second is one every 100ms.
+	EXPECT_FALSE( rate_table::admit( table.find( 100, 1099, limits ), limits ) );
+	EXPECT_TRUE( rate_table::admit( table.find( 100, 1100, limits ), limits ) );
+
+	// Never more than the burst saved up.
+	int admitted = 0;
+	while( rate_table::admit( table.find( 100, 100000, limits ), limits ) ) ++admitted;
+	EXPECT_EQ( 5, admitted );
+
+	// Somebody else is unaffected.
+	EXPECT_TRUE( rate_table::admit( table.find( 200, 100000, limits ), limits ) );
+}
+
+TEST( mod_ratelimit_tests, ByteDebt )
+{
+	rate_table table( 1024 );
+	rate_limits limits( 0, 0, 1000 );
+
+	rate_bucket& b = table.find( 7, 0, limits );
+	EXPECT_TRUE( rate_table::admit( b, limits ) );
+
+	// Three seconds worth written in one.
+	rate_table::charge( b, 3000 );
+	EXPECT_FALSE( rate_table::admit( table.find( 7, 0, limits ), limits ) );
+	EXPECT_EQ( 3, rate_table::retry_after( table.find( 7, 0, limits ), limits ) );
+
+	EXPECT_FALSE( rate_table::admit( table.find( 7, 1999, limits ), limits ) );
+	EXPECT_TRUE( rate_table::admit( table.find( 7, 2000, limits ), limits ) );
+}
+
+TEST( mod_ratelimit_tests, ClockWrap )
+{
+	rate_table table( 1024 );
+	rate_limits limits( 1, 1, 0 );
+
+	EXPECT_TRUE( rate_table::admit( table.find( 9, 0xfffffc00u, limits ), limits ) );
+	EXPECT_FALSE( rate_table::admit( table.find( 9, 0xfffffc00u, limits ), limits ) );
+	EXPECT_TRUE( rate_table::admit( table.find( 9, 0x00000010u, limits ), limits ) );
+}
+
+TEST( mod_ratelimit_tests, ConstantMemory )
+{
+	rate_table table( 1 << 16 );
+	rate_limits limits( 1, 100, 0 );
+	std::size_t memory = table.memory_usage( );
+
+	// Drain most of a hot client's bucket.
+	for( int i = 0; i < 90; ++i ) rate_table::admit( table.find( 1, 0, limits ), limits );
+
+	// A few million one-off clients, the hot one coming back in between.
+	for( uint64_t k = 2; k < 3000000; ++k )
+	{
+		table.find( mod_ratelimit::hash( &k, sizeof( k ), 0 ), 0, limits );
+		if( k % 4 == 0 ) table.find( 1, 0, limits );
+	}
+
+	EXPECT_EQ( memory, table.memory_usage( ) );
+	EXPECT_LE( table.size( ), table.capacity( ) );
+	EXPECT_GT( table.evictions, 0u );
+
+	// CLOCK kept it, so it still has only its ten requests left.
+	int admitted = 0;
+	while( rate_table::admit( table.find( 1, 0, limits ), limits ) ) ++admitted;
+	EXPECT_EQ( 10, admitted );
+}
+
+TEST( mod_ratelimit_tests, BucketsShareCacheLines )
+{
+	EXPECT_EQ( 32u, sizeof( rate_bucket ) );
+}
+
+TEST( mod_ratelimit_tests, EveryHomeSlotUsed )
+{
+	rate_table table( 1024 );
+	rate_limits limits( 1, 1, 0 );
+
+	// Eight keys homed at slot 0, and a ninth homed at slot 1: as long as
+	// the even homes are used, it still finds room within the probe.
+	for( uint64_t k = 1; k <= 8; ++k )
+		table.find( k * 1024, 0, limits );
+	table.find( 9 * 1024 + 1, 0, limits );
+	EXPECT_EQ( 0u, table.evictions );
+	EXPECT_EQ( 9u, table.size( ) );
+}
+
+class mod_ratelimit_handler_tests : public plugin_tests< mod_ratelimit >
+{
+	public:
+		mod_ratelimit_handler_tests( ) : plugin_tests< mod_ratelimit >( "src/tests/mod_ratelimit_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_ratelimit >::SetUp( );
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->request.headers = array_init( );
+			con->response.headers = array_init( );
+			con->dst_addr.ipv4.sin_family = AF_INET;
+			inet_pton( AF_INET, "192.0.2.1", &con->dst_addr.ipv4.sin_addr );
+
+			// The connection is the server's only one.
+			srv->conns->ptr = &con;
+			srv->conns->used = 1;
+		}
+
+		void TearDown( )
+		{
+			srv->conns->ptr = 0;
+			srv->conns->used = 0;
+
+			array_free( con->request.headers );
+			array_free( con->response.headers );
+			free( con );
+
+			plugin_tests< mod_ratelimit >::TearDown( );
+		}
+
+		// One request on the connection, writing bytes before it ends.
+		handler_t request( mod_ratelimit& p, off_t bytes = 0 )
+		{
+			array_reset( con->response.headers );
+			con->http_status = 0;
+			++con->request_count;
+
+			handler_t r = p.handle_uri_raw( *con );
+			if( r == HANDLER_GO_ON ) con->bytes_written_cur_second += bytes;
+			p.connection_reset( *con );
+			return r;
+		}
+
+		// The second ticks over: triggers, then lighttpd zeroes the count.
+		void tick( mod_ratelimit& p )
+		{
+			p.handle_trigger( );
+			con->bytes_written_cur_second = 0;
+		}
+
+		connection* con;
+};
+
+TEST_F( mod_ratelimit_handler_tests, UriRawRejects )
+{
+	mod_ratelimit p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	for( int i = 0; i < 3; ++i )
+		EXPECT_EQ( HANDLER_GO_ON, request( p ) );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p ) );
+	EXPECT_EQ( 429, con->http_status );
+	EXPECT_TRUE( array_get_element( con->response.headers, CONST_STR_LEN( "Retry-After" ) ) );
+	EXPECT_EQ( 1u, p.rejected );
+
+	// Somebody else is unaffected.
+	inet_pton( AF_INET, "192.0.2.2", &con->dst_addr.ipv4.sin_addr );
+	EXPECT_EQ( HANDLER_GO_ON, request( p ) );
+}
+
+TEST_F( mod_ratelimit_handler_tests, TriggerCharges )
+{
+	mod_ratelimit p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	// Still writing when the second ticks over.
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_uri_raw( *con ) );
+	con->bytes_written_cur_second = 3000;
+	tick( p );
+	p.connection_reset( *con );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p ) );
+}
+
+TEST_F( mod_ratelimit_handler_tests, ResetCharges )
+{
+	mod_ratelimit p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	// Done within the second, before any trigger could see it.
+	EXPECT_EQ( HANDLER_GO_ON, request( p, 3000 ) );
+	tick( p );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p ) );
+}
+
+TEST_F( mod_ratelimit_handler_tests, ChargedOnce )
+{
+	mod_ratelimit p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	// Most of a second's worth, charged at the reset.  The next request
+	// in the same second writes nothing, so the trigger has nothing more
+	// to charge for the connection.
+	EXPECT_EQ( HANDLER_GO_ON, request( p, 900 ) );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_uri_raw( *con ) );
+	tick( p );
+	p.connection_reset( *con );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( p ) );
+}
@@ -0,0 +1,140 @@
+/**
+ * Test the validator formatting, matching and caching of mod_revalidate,
+ * and that it only answers for static files.
+ */
+
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include "../mod_revalidate.hpp"
+
+static struct stat make_stat( ino_t ino, off_t size, time_t mtime )
+{
+	struct stat st;
+	std::memset( &st, 0, sizeof( st ) );
+	st.st_ino = ino;
+	st.st_size = size;
+	st.st_mtime = mtime;
+	st.st_mode = S_IFREG | 0644;
+	return st;
+}
+
+// What mod_staticfile would send, worked by hand from etag.c.
+static std::string reference_etag( const char* raw )
+{
+	uint32_t h = 0;
+	for( const char* p = raw; *p; ++p ) h = ( h << 5 ) ^ ( h >> 27 ) ^ *p;
+
+	char out[ 32 ];
+	snprintf( out, sizeof( out ), "\"%u\"", h );
+	return out;
+}
+
+TEST( mod_revalidate_tests, EtagFormat )
+{
+	struct stat st = make_stat( 1234, 5678, 1000000000 );
+	char out[ file_validators::etag_max ];
+
+	std::size_t n = file_validators::format_etag( st, ETAG_USE_INODE | ETAG_USE_SIZE | ETAG_USE_MTIME, out );
+	EXPECT_EQ( reference_etag( "1234-5678-1000000000" ), std::string( out, n ) );
+
+	n = file_validators::format_etag( st, ETAG_USE_MTIME, out );
+	EXPECT_EQ( reference_etag( "1000000000" ), std::string( out, n ) );
+
+	n = file_validators::format_etag( st, ETAG_USE_SIZE | ETAG_USE_MTIME, out );
+	EXPECT_EQ( reference_etag( "5678-1000000000" ), std::string( out, n ) );
+
+	EXPECT_EQ( 0u, file_validators::format_etag( st, 0, out ) );
+}
+
+TEST( mod_revalidate_tests, HttpDate )
+{
+	char out[ file_validators::last_modified_max ];
+	std::size_t n = file_validators::format_http_date( 784111777, out );
+	EXPECT_EQ( "Sun, 06 Nov 1994 08:49:37 GMT", std::string( out, n ) );
+}
+
+TEST( mod_revalidate_tests, IfNoneMatch )
+{
+	file_validators v;
+	v.assign( make_stat( 1, 2, 3 ), ETAG_USE_MTIME );
+	std::string etag( v.etag, v.etag_len );
+
+	EXPECT_TRUE( v.etag_matches( etag.c_str( ) ) );
+	EXPECT_TRUE( v.etag_matches( "*" ) );
+	EXPECT_TRUE( v.etag_matches( ( "\"abc\", " + etag ).c_str( ) ) );
+	EXPECT_TRUE( v.etag_matches( ( "\"abc\",W/" + etag + " , \"def\"" ).c_str( ) ) );
+
+	EXPECT_FALSE( v.etag_matches( "\"abc\"" ) );
+	EXPECT_FALSE( v.etag_matches( "" ) );
+	EXPECT_FALSE( v.etag_matches( etag.substr( 1 ).c_str( ) ) );
+
+	// No ETags configured, nothing matches.
+	file_validators none;
+	none.assign( make_stat( 1, 2, 3 ), 0 );
+	EXPECT_FALSE( none.etag_matches( "*" ) );
+}
+
+TEST( mod_revalidate_tests, IfModifiedSince )
+{
+	file_validators v;
+	v.assign( make_stat( 1, 2, 784111777 ), ETAG_USE_MTIME );
+
+	EXPECT_TRUE( v.unmodified_since( "Sun, 06 Nov 1994 08:49:37 GMT" ) );
+	EXPECT_TRUE( v.unmodified_since( "Sun, 06 Nov 1994 08:49:37 GMT; length=2" ) );
+	EXPECT_TRUE( v.unmodified_since( "Mon, 07 Nov 1994 08:49:37 GMT" ) );
+
+	EXPECT_FALSE( v.unmodified_since( "Sun, 06 Nov 1994 08:49:36 GMT" ) );
+	EXPECT_FALSE( v.unmodified_since( "yesterday" ) );
+}
+
+TEST( mod_revalidate_tests, CacheVersions )
+{
+	validator_cache cache( 100 );
+	EXPECT_EQ( 128u, cache.size( ) );
+
+	struct stat a = make_stat( 42, 10, 1000 );
+	const file_validators& first = cache.lookup( a, ETAG_USE_MTIME );
+	std::string etag( first.etag, first.etag_len );
+	EXPECT_EQ( 0u, cache.hits );
+	EXPECT_EQ( 1u, cache.misses );
+
+	cache.lookup( a, ETAG_USE_MTIME );
+	EXPECT_EQ( 1u, cache.hits );
+
+	// A new version of the same file replaces the old.
+	struct stat b = make_stat( 42, 10, 1001 );
+	const file_validators& second = cache.lookup( b, ETAG_USE_MTIME );
+	EXPECT_NE( etag, std::string( second.etag, second.etag_len ) );
+	EXPECT_EQ( 2u, cache.misses );
+
+	// So do different ETag settings.
+	cache.lookup( b, ETAG_USE_MTIME | ETAG_USE_SIZE );
+	EXPECT_EQ( 3u, cache.misses );
+}
+
+TEST( mod_revalidate_tests, OnlyStaticFiles )
+{
+	connection con;
+	std::memset( &con, 0, sizeof( con ) );
+	con.physical.path = buffer_init( );
+	std::vector< std::string > none, own( 1, ".tmpl" );
+
+	buffer_copy_string( con.physical.path, "/srv/www/index.html" );
+	EXPECT_TRUE( static_file_request( con, none ) );
+	EXPECT_TRUE( static_file_request( con, own ) );
+
+	// Scripts by default, only those listed once there is a list.
+	buffer_copy_string( con.physical.path, "/srv/www/index.php" );
+	EXPECT_FALSE( static_file_request( con, none ) );
+	EXPECT_TRUE( static_file_request( con, own ) );
+	buffer_copy_string( con.physical.path, "/srv/www/page.tmpl" );
+	EXPECT_FALSE( static_file_request( con, own ) );
+
+	// Taken by a backend, whatever it is called.
+	buffer_copy_string( con.physical.path, "/srv/www/index.html" );
+	con.mode = static_cast< connection_type >( DIRECT + 1 );
+	EXPECT_FALSE( static_file_request( con, none ) );
+
+	buffer_free( con.physical.path );
+}
@@ -0,0 +1,467 @@
+/**
+ * Test the shared memory cache behind mod_shm_cache: freshness and
+ * revalidation claims, segment eviction, and readers and writers in
+ * forked processes never seeing a torn entry.
+ *
+ * HitRatio plays a zipf request stream round robin over a number of
+ * workers, against one shared arena and against per-worker caches of the
+ * same total size, and prints both hit ratios.
+ */
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_shm_cache.hpp"
+
+static cache_object object( const std::string& body, time_t now, int ttl, int stale = 0 )
+{
+	cache_object o;
+	o.status = 200;
+	o.headers = "Content-Type: text/plain\r\n";
+	o.body = body;
+	o.stored = now;
+	o.expires = now + ttl;
+	o.stale_until = now + ttl + stale;
+	return o;
+}
+
+static std::string key( std::size_t i )
+{
+	std::ostringstream s;
+	s << "GET example.com /objects/" << i;
+	return s.str( );
+}
+
+// Run f( n ) in n forked children, returning their exit codes.
+template < typename F >
+static std::vector< int > in_children( int n, F f )
+{
+	std::vector< pid_t > pids;
+	for( int i = 0; i < n; ++i )
+	{
+		pid_t pid = fork( );
+		if( pid == 0 ) _exit( f( i ) );
+		pids.push_back( pid );
+	}
+
+	std::vector< int > codes;
+	for( std::vector< pid_t >::iterator i = pids.begin( ); i != pids.end( ); ++i )
+	{
+		int status = 0;
+		waitpid( *i, &status, 0 );
+		codes.push_back( WIFEXITED( status ) ? WEXITSTATUS( status ) : -1 );
+	}
+	return codes;
+}
+
+TEST( cache_policy_tests, Parses )
+{
+	cache_policy c = cache_policy::parse( CONST_STR_LEN( "public, max-age=60, stale-while-revalidate=30" ) );
+	EXPECT_TRUE( c.storable );
+	EXPECT_EQ( 60, c.max_age );
+	EXPECT_EQ( 30, c.stale );
+
+	c = cache_policy::parse( CONST_STR_LEN( "max-age=60,s-maxage=\"600\"" ) );
+	EXPECT_EQ( 600, c.max_age );
+
+	EXPECT_FALSE( cache_policy::parse( CONST_STR_LEN( "private, max-age=60" ) ).storable );
+	EXPECT_FALSE( cache_policy::parse( CONST_STR_LEN( "No-Store" ) ).storable );
+	EXPECT_EQ( -1, cache_policy::parse( CONST_STR_LEN( "max-age=soon" ) ).max_age );
+}
+
+TEST( shm_cache_tests, Freshness )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+
+	cache_object out;
+	EXPECT_EQ( shm_cache::MISS, cache.find( key( 1 ), 100, out ) );
+
+	ASSERT_TRUE( cache.store( key( 1 ), object( "hello", 100, 10, 5 ) ) );
+	EXPECT_EQ( shm_cache::FRESH, cache.find( key( 1 ), 109, out ) );
+	EXPECT_EQ( "hello", out.body );
+	EXPECT_EQ( "Content-Type: text/plain\r\n", out.headers );
+	EXPECT_EQ( 200, out.status );
+	EXPECT_EQ( 100, out.stored );
+
+	// Stale: the first one revalidates, the rest are served it.
+	EXPECT_EQ( shm_cache::REVALIDATE, cache.find( key( 1 ), 110, out ) );
+	EXPECT_EQ( shm_cache::STALE, cache.find( key( 1 ), 111, out ) );
+	EXPECT_EQ( "hello", out.body );
+	EXPECT_EQ( shm_cache::MISS, cache.find( key( 1 ), 115, out ) );
+
+	// Its fresh response replaces it.
+	ASSERT_TRUE( cache.store( key( 1 ), object( "again", 112, 10, 5 ) ) );
+	EXPECT_EQ( shm_cache::FRESH, cache.find( key( 1 ), 112, out ) );
+	EXPECT_EQ( "again", out.body );
+	EXPECT_EQ( shm_cache::MISS, cache.find( key( 2 ), 112, out ) );
+}
+
+TEST( shm_cache_tests, ClaimTimesOut )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+	ASSERT_TRUE( cache.store( key( 1 ), object( "hello", 0, 10, 1000 ) ) );
+
+	cache_object out;
+	time_t timeout = shm_cache::claim_timeout;
+	EXPECT_EQ( shm_cache::REVALIDATE, cache.find( key( 1 ), 10, out ) );
+	EXPECT_EQ( shm_cache::STALE, cache.find( key( 1 ), 10 + timeout - 1, out ) );
+
+	// Whoever claimed it never came back.
+	EXPECT_EQ( shm_cache::REVALIDATE, cache.find( key( 1 ), 10 + timeout, out ) );
+}
+
+TEST( shm_cache_tests, EvictsOldestSegments )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+	const std::string body( 3000, 'x' );
+	const std::size_t n = 2000;
+
+	// One key asked for all along, the rest once each.
+	ASSERT_TRUE( cache.store( "hot", object( body, 0, 100 ) ) );
+	cache_object out;
+	for( std::size_t i = 0; i < n; ++i )
+	{
+		ASSERT_TRUE( cache.store( key( i ), object( body, 0, 100 ) ) );
+		ASSERT_EQ( shm_cache::FRESH, cache.find( "hot", 1, out ) ) << i;
+	}
+
+	EXPECT_GT( cache.evictions( ), 0u );
+	EXPECT_EQ( shm_cache::MISS, cache.find( key( 0 ), 1, out ) );
+	EXPECT_EQ( shm_cache::FRESH, cache.find( key( n - 1 ), 1, out ) );
+
+	// Everything in the newest half of the ring is still there.
+	std::size_t per_segment = cache.segment_size( ) / ( body.size( ) + 128 );
+	for( std::size_t i = n - per_segment * cache.segment_count( ) / 2; i < n; ++i )
+		EXPECT_EQ( shm_cache::FRESH, cache.find( key( i ), 1, out ) ) << i;
+}
+
+TEST( shm_cache_tests, TooBig )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+	EXPECT_FALSE( cache.store( key( 1 ), object( std::string( cache.max_entry( ), 'x' ), 0, 10 ) ) );
+}
+
+struct store_one
+{
+	store_one( shm_cache& cache ) : cache( cache ) {}
+	int operator()( int i ) { return cache.store( key( 7 ), object( "from a child", 0, 10 ) ) ? 0 : 1; }
+	shm_cache& cache;
+};
+
+TEST( shm_cache_tests, SharedAcrossWorkers )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+
+	EXPECT_EQ( std::vector< int >( 1, 0 ), in_children( 1, store_one( cache ) ) );
+
+	cache_object out;
+	EXPECT_EQ( shm_cache::FRESH, cache.find( key( 7 ), 5, out ) );
+	EXPECT_EQ( "from a child", out.body );
+	EXPECT_EQ( 1u, cache.stores( ) );
+}
+
+struct find_stale
+{
+	find_stale( shm_cache& cache ) : cache( cache ) {}
+	int operator()( int i )
+	{
+		cache_object out;
+		return cache.find( key( 1 ), 15, out );
+	}
+	shm_cache& cache;
+};
+
+TEST( shm_cache_tests, OneWorkerRevalidates )
+{
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+	ASSERT_TRUE( cache.store( key( 1 ), object( "hello", 0, 10, 60 ) ) );
+
+	std::vector< int > r = in_children( 16, find_stale( cache ) );
+	int revalidate = shm_cache::REVALIDATE, stale = shm_cache::STALE;
+	EXPECT_EQ( 1, std::count( r.begin( ), r.end( ), revalidate ) );
+	EXPECT_EQ( 15, std::count( r.begin( ), r.end( ), stale ) );
+}
+
+// Bodies that say which key and version they are all the way through,
+// so a torn one shows.
+static cache_object versioned( std::size_t k, unsigned v )
+{
+	std::ostringstream s;
+	s << k << '.' << v << ';';
+	std::string unit = s.str( ), body;
+	std::size_t copies = 50 + ( k * 7 + v ) % 400;
+	for( std::size_t i = 0; i < copies; ++i ) body += unit;
+
+	cache_object o = object( body, 0, 1000 );
+	o.headers = unit;
+	return o;
+}
+
+static bool intact( std::size_t k, const cache_object& o )
+{
+	const std::string& unit = o.headers;
+	std::ostringstream s;
+	s << k << '.';
+	if( unit.compare( 0, s.str( ).size( ), s.str( ) ) != 0 || o.body.size( ) % unit.size( ) ) return false;
+
+	for( std::size_t i = 0; i < o.body.size( ); i += unit.size( ) )
+	{
+		if( o.body.compare( i, unit.size( ), unit ) != 0 ) return false;
+	}
+	return o.body.size( ) / unit.size( ) == versioned( k, atoi( unit.c_str( ) + s.str( ).size( ) ) ).body.size( ) / unit.size( );
+}
+
+struct hammer
+{
+	hammer( shm_cache& cache ) : cache( cache ) {}
+	int operator()( int worker )
+	{
+		srand( worker + 1 );
+		cache_object out;
+		for( unsigned i = 0; i < 50000; ++i )
+		{
+			std::size_t k = rand( ) % 500;
+			if( rand( ) % 4 == 0 )
+			{
+				cache.store( key( k ), versioned( k, i ) );
+			}
+			else if( cache.find( key( k ), 1, out ) != shm_cache::MISS && !intact( k, out ) )
+			{
+				return 1;
+			}
+		}
+		return 0;
+	}
+	shm_cache& cache;
+};
+
+TEST( shm_cache_tests, ConcurrentWorkersNeverTear )
+{
+	// Small enough to wrap the ring many times over.
+	shm_cache cache;
+	ASSERT_TRUE( cache.create( 1 << 20 ) );
+
+	std::vector< int > r = in_children( 4, hammer( cache ) );
+	EXPECT_EQ( std::vector< int >( 4, 0 ), r );
+	EXPECT_GT( cache.evictions( ), cache.segment_count( ) );
+}
+
+// Zipf over n keys with exponent 1.
+class zipf
+{
+public:
+	zipf( std::size_t n ) : cdf( n )
+	{
+		double sum = 0;
+		for( std::size_t i = 0; i < n; ++i )
+			cdf[i] = sum += 1.0 / ( i + 1 );
+		for( std::size_t i = 0; i < n; ++i )
+			cdf[i] /= sum;
+	}
+
+	std::size_t operator()( )
+	{
+		double r = std::rand( ) / ( RAND_MAX + 1.0 );
+		return std::lower_bound( cdf.begin( ), cdf.end( ), r ) - cdf.begin( );
+	}
+
+private:
+	std::vector< double > cdf;
+};
+
+static double hit_ratio( std::vector< shm_cache* >& caches, std::size_t requests )
+{
+	std::srand( 1 );
+	zipf z( 50000 );
+	const std::string body( 2000, 'x' );
+	std::size_t hits = 0;
+
+	for( std::size_t i = 0; i < requests; ++i )
+	{
+		shm_cache& c = *caches[ i % caches.size( ) ];
+		std::string k = key( z( ) );
+
+		cache_object out;
+		if( c.find( k, 1, out ) == shm_cache::FRESH )
+			++hits;
+		else
+			c.store( k, object( body, 0, 1000 ) );
+	}
+	return double( hits ) / requests;
+}
+
+TEST( shm_cache_tests, HitRatio )
+{
+	const std::size_t workers = 8, total = 32 << 20, requests = 1000000;
+
+	std::vector< shm_cache* > shared( 1, new shm_cache ), own;
+	ASSERT_TRUE( shared[0]->create( total ) );
+	for( std::size_t i = 0; i < workers; ++i )
+	{
+		own.push_back( new shm_cache );
+		ASSERT_TRUE( own.back( )->create( total / workers ) );
+	}
+
+	double one = hit_ratio( shared, requests );
+	double each = hit_ratio( own, requests );
+
+	std::printf( "zipf over 50000 objects, %lu workers, %lu MB: %.1f%% hits shared, %.1f%% with a cache each\n",
+		static_cast< unsigned long >( workers ), static_cast< unsigned long >( total >> 20 ), one * 100, each * 100 );
+	EXPECT_GT( one, each );
+
+	delete shared[0];
+	for( std::size_t i = 0; i < workers; ++i ) delete own[i];
+}
+
+class mod_shm_cache_handler_tests : public plugin_tests< mod_shm_cache >
+{
+	public:
+		mod_shm_cache_handler_tests( ) : plugin_tests< mod_shm_cache >( "src/tests/mod_shm_cache_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_shm_cache >::SetUp( );
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->fd = -1;
+			con->plugin_ctx = reinterpret_cast< void** >( calloc( 1, sizeof( void* ) ) );
+			con->write_queue = chunkqueue_init( );
+			con->request.headers = array_init( );
+			con->response.headers = array_init( );
+			con->request.uri = buffer_init_string( "/page" );
+			con->request.http_host = buffer_init_string( "example.com" );
+			con->uri.scheme = buffer_init_string( "http" );
+		}
+
+		void TearDown( )
+		{
+			chunkqueue_free( con->write_queue );
+			array_free( con->request.headers );
+			array_free( con->response.headers );
+			buffer_free( con->request.uri );
+			buffer_free( con->request.http_host );
+			buffer_free( con->uri.scheme );
+			free( con->plugin_ctx );
+			free( con );
+
+			plugin_tests< mod_shm_cache >::TearDown( );
+		}
+
+		// A GET for the page, up to where the cache answers it or not.
+		handler_t request( mod_shm_cache& p, const char* scheme )
+		{
+			p.connection_reset( *con );
+			chunkqueue_reset( con->write_queue );
+			array_reset( con->response.headers );
+			con->http_status = 0;
+			con->file_finished = 0;
+			con->request.http_method = HTTP_METHOD_GET;
+			buffer_copy_string( con->uri.scheme, scheme );
+
+			EXPECT_EQ( HANDLER_GO_ON, p.handle_uri_clean( *con ) );
+			return p.handle_physical( *con );
+		}
+
+		// The backend's answer to a request the cache didn't.
+		void respond( mod_shm_cache& p, const std::string& body )
+		{
+			con->http_status = 200;
+			response_header_insert( srv, con, CONST_STR_LEN( "Cache-Control" ), CONST_STR_LEN( "max-age=60" ) );
+			p.handle_response_header( *con );
+
+			buffer_copy_string_len( chunkqueue_get_append_buffer( con->write_queue ), body.data( ), body.size( ) );
+			con->file_finished = 1;
+			p.handle_filter_response_content( *con );
+		}
+
+		std::string written( )
+		{
+			std::string s;
+			for( chunk* c = con->write_queue->first; c; c = c->next )
+			{
+				if( c->type == chunk::MEM_CHUNK && c->mem->used ) s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+			}
+			return s;
+		}
+
+		connection* con;
+};
+
+TEST_F( mod_shm_cache_handler_tests, AnswersAtPhysical )
+{
+	mod_shm_cache p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "http" ) );
+	respond( p, "hello" );
+	EXPECT_EQ( 1u, p.cache.stores( ) );
+
+	// Not at uri_clean, the access checks come first.
+	p.connection_reset( *con );
+	chunkqueue_reset( con->write_queue );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_uri_clean( *con ) );
+	EXPECT_EQ( "", written( ) );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p, "http" ) );
+	EXPECT_EQ( 200, con->http_status );
+	EXPECT_EQ( "hello", written( ) );
+}
+
+TEST_F( mod_shm_cache_handler_tests, KeyedByScheme )
+{
+	mod_shm_cache p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "https" ) );
+	respond( p, "secure" );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "http" ) );
+	respond( p, "plain" );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p, "https" ) );
+	EXPECT_EQ( "secure", written( ) );
+	EXPECT_EQ( HANDLER_FINISHED, request( p, "http" ) );
+	EXPECT_EQ( "plain", written( ) );
+}
+
+TEST_F( mod_shm_cache_handler_tests, CapturesAcrossPasses )
+{
+	mod_shm_cache p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	EXPECT_EQ( HANDLER_GO_ON, request( p, "http" ) );
+	con->http_status = 200;
+	response_header_insert( srv, con, CONST_STR_LEN( "Cache-Control" ), CONST_STR_LEN( "max-age=60" ) );
+	p.handle_response_header( *con );
+
+	buffer_copy_string_len( chunkqueue_get_append_buffer( con->write_queue ), CONST_STR_LEN( "first " ) );
+	p.handle_filter_response_content( *con );
+
+	// Some of it written out between passes, and an empty one behind it.
+	con->write_queue->first->offset = 3;
+	chunkqueue_get_append_buffer( con->write_queue );
+	p.handle_filter_response_content( *con );
+
+	buffer_copy_string_len( chunkqueue_get_append_buffer( con->write_queue ), CONST_STR_LEN( "second" ) );
+	con->file_finished = 1;
+	p.handle_filter_response_content( *con );
+
+	EXPECT_EQ( HANDLER_FINISHED, request( p, "http" ) );
+	EXPECT_EQ( "first second", written( ) );
+}
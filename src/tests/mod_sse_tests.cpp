@@ -0,0 +1,468 @@
+/**
+ * Test events are encoded once and queued to subscribers by reference,
+ * back to back ones as one chunk, backlogs and spools are let go of, a
+ * subscriber with too much queued waits for it to drain, and compare fanning an event out by reference with copying it to each.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_sse.hpp"
+
+static uint64_t now_us( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
+
+// The body as queued, file chunks read back by name as the core would.
+static std::string written( chunkqueue* cq )
+{
+	std::string s;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::MEM_CHUNK && c->mem->used )
+			s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+
+		if( c->type == chunk::FILE_CHUNK )
+		{
+			int fd = c->file.fd != -1 ? c->file.fd : open( c->file.name->ptr, O_RDONLY );
+			std::vector< char > buf( c->file.length );
+			if( pread( fd, &buf[0], buf.size( ), c->file.start ) == static_cast< ssize_t >( buf.size( ) ) )
+				s.append( &buf[0], buf.size( ) );
+			if( fd != c->file.fd && fd != -1 ) close( fd );
+		}
+	}
+	return s;
+}
+
+// File chunks holding an fd.
+static std::size_t open_files( chunkqueue* cq )
+{
+	std::size_t n = 0;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::FILE_CHUNK && c->file.fd != -1 ) ++n;
+	}
+	return n;
+}
+
+static std::size_t count( chunkqueue* cq, int type )
+{
+	std::size_t n = 0;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == type ) ++n;
+	}
+	return n;
+}
+
+// Close what the chunks hold, as the core does once they are sent.
+static void clear( chunkqueue* cq )
+{
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::FILE_CHUNK && c->file.fd != -1 ) close( c->file.fd );
+	}
+	chunkqueue_reset( cq );
+}
+
+static std::string encoded( uint64_t id, const std::string& event, const std::string& data )
+{
+	std::string s;
+	sse_encode( id, event, data, s );
+	return s;
+}
+
+class mod_sse_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			char templ[] = "/tmp/lighttpd-cpp-sse-XXXXXX";
+			ASSERT_TRUE( mkdtemp( templ ) );
+			dir = templ;
+			cq = chunkqueue_init( );
+		}
+
+		void TearDown( )
+		{
+			clear( cq );
+			chunkqueue_free( cq );
+			std::string cmd = "rm -rf " + dir;
+			if( system( cmd.c_str( ) ) ) {}
+		}
+
+		// Spool files there are.
+		std::size_t spools( )
+		{
+			std::size_t n = 0;
+			DIR* d = opendir( dir.c_str( ) );
+			while( struct dirent* e = readdir( d ) )
+			{
+				if( e->d_name[0] != '.' ) ++n;
+			}
+			closedir( d );
+			return n;
+		}
+
+		std::string dir;
+		chunkqueue* cq;
+		std::vector< sse_spool_ptr > held;
+};
+
+TEST( sse_encode_tests, Encoding )
+{
+	EXPECT_EQ( "id: 1\ndata: hello\n\n", encoded( 1, "", "hello" ) );
+	EXPECT_EQ( "id: 2\nevent: price\ndata: a\ndata: b\ndata: \ndata: c\n\n", encoded( 2, "price", "a\r\nb\n\rc" ) );
+	EXPECT_EQ( "id: 3\nevent: xy\ndata: \n\n", encoded( 3, "x\r\ny", "" ) );
+
+	// A trailing line break doesn't make another data line.
+	EXPECT_EQ( "id: 4\ndata: a\n\n", encoded( 4, "", "a\n" ) );
+}
+
+TEST_F( mod_sse_tests, Spool )
+{
+	sse_spool file( 64, dir );
+	ASSERT_NE( -1, file.file( ) );
+	EXPECT_EQ( 1u, spools( ) );
+
+	EXPECT_EQ( 0, file.append( "hello ", 6 ) );
+	EXPECT_EQ( 6, file.append( "world", 5 ) );
+	EXPECT_EQ( "hello world", std::string( file.data( ), file.size( ) ) );
+	EXPECT_EQ( -1, file.append( std::string( 60, 'x' ).data( ), 60 ) );
+
+	// Without a tempdir it stays in memory.
+	sse_spool memory( 64, dir + "/missing" );
+	EXPECT_EQ( -1, memory.file( ) );
+	EXPECT_EQ( 0, memory.append( "abc", 3 ) );
+	EXPECT_EQ( "abc", std::string( memory.data( ), memory.size( ) ) );
+}
+
+TEST_F( mod_sse_tests, BackToBackIsOneChunk )
+{
+	sse_topic topic( 16, 4096, dir );
+	topic.publish( "", "one" );
+	topic.publish( "tick", "two" );
+	topic.publish( "", "three" );
+	EXPECT_EQ( 1u, topic.first_id( ) );
+	EXPECT_EQ( 4u, topic.next_id( ) );
+
+	uint64_t cursor = 1;
+	response_builder out( cq );
+	std::size_t n = topic.deliver( cursor, out, false, 65536, 0, held );
+
+	std::string expected = encoded( 1, "", "one" ) + encoded( 2, "tick", "two" ) + encoded( 3, "", "three" );
+	EXPECT_EQ( expected.size( ), n );
+	EXPECT_EQ( 4u, cursor );
+	EXPECT_EQ( 1u, count( cq, chunk::FILE_CHUNK ) );
+	EXPECT_EQ( 0u, count( cq, chunk::MEM_CHUNK ) );
+	EXPECT_EQ( expected, written( cq ) );
+	EXPECT_EQ( n, topic.referenced );
+
+	// By name, no descriptor until the core comes to send it, and the
+	// spool is held for it meanwhile.
+	EXPECT_EQ( 0u, open_files( cq ) );
+	EXPECT_EQ( 1u, held.size( ) );
+
+	// Caught up, nothing more.
+	EXPECT_EQ( 0u, topic.deliver( cursor, out, false, 65536, 0, held ) );
+}
+
+TEST_F( mod_sse_tests, ChunkedAndCopied )
+{
+	sse_topic topic( 16, 4096, dir );
+	topic.publish( "", "small" );
+
+	uint64_t cursor = 1;
+	response_builder out( cq );
+	std::size_t n = topic.deliver( cursor, out, true, 65536, 1024, held );
+
+	std::string e = encoded( 1, "", "small" );
+	char size[ 16 ];
+	std::snprintf( size, sizeof( size ), "%lx\r\n", static_cast< unsigned long >( e.size( ) ) );
+
+	EXPECT_EQ( e.size( ), n );
+	EXPECT_EQ( 0u, count( cq, chunk::FILE_CHUNK ) );
+	EXPECT_EQ( size + e + "\r\n", written( cq ) );
+	EXPECT_EQ( n, topic.copied );
+}
+
+TEST_F( mod_sse_tests, AsMuchAsAllowed )
+{
+	sse_topic topic( 16, 4096, dir );
+	std::string data( 100, 'x' );
+	for( int i = 0; i < 5; ++i ) topic.publish( "", data );
+	std::size_t each = encoded( 1, "", data ).size( );
+
+	// Enough for two and a bit is three, and the rest later.
+	uint64_t cursor = 1;
+	response_builder out( cq );
+	EXPECT_EQ( 3 * each, topic.deliver( cursor, out, false, 2 * each + 1, 0, held ) );
+	EXPECT_EQ( 4u, cursor );
+	EXPECT_EQ( 2 * each, topic.deliver( cursor, out, false, 2 * each + 1, 0, held ) );
+	EXPECT_EQ( 6u, cursor );
+
+	// However little is allowed, one goes.
+	cursor = 1;
+	clear( cq );
+	EXPECT_EQ( each, topic.deliver( cursor, out, false, 1, 0, held ) );
+}
+
+TEST_F( mod_sse_tests, SpoolsComeAndGo )
+{
+	std::string data( 300, 'x' );
+	std::size_t each = encoded( 1, "", data ).size( );
+
+	sse_topic topic( 4, 3 * each, dir );
+	for( int i = 0; i < 5; ++i ) topic.publish( "", data );
+	EXPECT_EQ( 2u, spools( ) );
+	EXPECT_EQ( 2u, topic.first_id( ) );
+
+	// A chunk for each spool the events are in.
+	uint64_t cursor = topic.first_id( );
+	response_builder out( cq );
+	topic.deliver( cursor, out, false, 65536, 0, held );
+	EXPECT_EQ( 2u, count( cq, chunk::FILE_CHUNK ) );
+	EXPECT_EQ( encoded( 2, "", data ) + encoded( 3, "", data ) + encoded( 4, "", data ) + encoded( 5, "", data ), written( cq ) );
+
+	// Once the backlog is past the first and its chunk is sent, it goes,
+	// and an event bigger than a spool gets one of its own.
+	clear( cq );
+	held.clear( );
+	topic.publish( "", data );
+	topic.publish( "", std::string( 5 * each, 'y' ) );
+	EXPECT_EQ( 2u, spools( ) );
+
+	// The big one's is full, so another.
+	topic.publish( "", data );
+	EXPECT_EQ( 3u, spools( ) );
+
+	// What holds the spools of queued chunks keeps them, and their names.
+	cursor = topic.first_id( );
+	topic.deliver( cursor, out, false, 65536, 0, held );
+	EXPECT_EQ( 3u, held.size( ) );
+	std::string before = written( cq );
+	for( int i = 0; i < 8; ++i ) topic.publish( "", data );
+	EXPECT_EQ( before, written( cq ) );
+
+	// And once let go of, they go.
+	std::size_t kept = spools( );
+	held.clear( );
+	EXPECT_EQ( kept - 3, spools( ) );
+}
+
+TEST_F( mod_sse_tests, Hub )
+{
+	sse_hub hub;
+	hub.tempdir = dir;
+
+	EXPECT_FALSE( hub.find( "news" ) );
+	EXPECT_EQ( 1u, hub.publish( "news", "", "a", 100 ) );
+	EXPECT_EQ( 2u, hub.publish( "news", "", "b", 100 ) );
+	EXPECT_EQ( 1u, hub.publish( "sport", "", "c", 100 ) );
+	EXPECT_EQ( 2u, hub.size( ) );
+
+	sse_topic_ptr news = hub.find( "news" );
+	ASSERT_TRUE( news );
+	EXPECT_EQ( 3u, news->next_id( ) );
+	++news->subscribers;
+	EXPECT_EQ( 1u, hub.subscribers( ) );
+
+	// Only topics nobody is subscribed to, and after idle seconds.
+	hub.expire( 150, 60 );
+	EXPECT_EQ( 2u, hub.size( ) );
+	hub.expire( 160, 60 );
+	EXPECT_EQ( 1u, hub.size( ) );
+	EXPECT_FALSE( hub.find( "sport" ) );
+
+	--news->subscribers;
+	hub.expire( 160, 60 );
+	EXPECT_EQ( 0u, hub.size( ) );
+}
+
+TEST_F( mod_sse_tests, SubscribersWoken )
+{
+	server srv;
+	std::memset( &srv, 0, sizeof( srv ) );
+	std::vector< connection > cons( 3 );
+	std::vector< async_slot* > slots;
+
+	sse_topic topic( 16, 4096, dir );
+	for( std::size_t i = 0; i < cons.size( ); ++i )
+	{
+		std::memset( &cons[i], 0, sizeof( connection ) );
+		slots.push_back( new async_slot( srv, 1 ) );
+		slots[i]->con = &cons[i];
+		async_context ctx( *slots[i] );
+		EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, ctx.wait( topic.arrived, 15 ) );
+	}
+	EXPECT_EQ( 3u, topic.arrived.waiting( ) );
+
+	// One gone before the event.
+	slots[1]->unwatch( );
+
+	topic.publish( "", "x" );
+	EXPECT_TRUE( slots[0]->ready );
+	EXPECT_FALSE( slots[1]->ready );
+	EXPECT_TRUE( slots[2]->ready );
+	EXPECT_EQ( 0u, topic.arrived.waiting( ) );
+
+	for( std::size_t i = 0; i < slots.size( ); ++i ) delete slots[i];
+}
+
+class mod_sse_handler_tests : public plugin_tests< mod_sse >
+{
+	public:
+		mod_sse_handler_tests( ) : plugin_tests< mod_sse >( "src/tests/mod_sse_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_sse >::SetUp( );
+
+			char templ[] = "/tmp/lighttpd-cpp-sse-XXXXXX";
+			ASSERT_TRUE( mkdtemp( templ ) );
+			dir = templ;
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->write_queue = chunkqueue_init( );
+			con->request.headers = array_init( );
+			con->response.headers = array_init( );
+			con->uri.path = buffer_init_string( "/events/news" );
+			con->request.http_method = HTTP_METHOD_GET;
+		}
+
+		void TearDown( )
+		{
+			clear( con->write_queue );
+			chunkqueue_free( con->write_queue );
+			array_free( con->request.headers );
+			array_free( con->response.headers );
+			buffer_free( con->uri.path );
+			free( con );
+
+			std::string cmd = "rm -rf " + dir;
+			if( system( cmd.c_str( ) ) ) {}
+
+			plugin_tests< mod_sse >::TearDown( );
+		}
+
+		// As the core does once it has sent all but left of the queue.
+		void send_all_but( off_t left )
+		{
+			off_t pending = chunkqueue_length( con->write_queue ) - chunkqueue_written( con->write_queue );
+			for( chunk* c = con->write_queue->first; c && pending > left; c = c->next )
+			{
+				off_t len = c->type == chunk::MEM_CHUNK ? off_t( c->mem->used - 1 ) : c->file.length;
+				off_t take = std::min( len - c->offset, pending - left );
+				c->offset += take;
+				pending -= take;
+			}
+		}
+
+		std::string dir;
+		connection* con;
+};
+
+TEST_F( mod_sse_handler_tests, WaitsForTheQueueToDrain )
+{
+	mod_sse p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+	p.hub.tempdir = dir;
+
+	ASSERT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( *con ) );
+	async_slot* slot = p.slot( *con );
+	ASSERT_TRUE( slot && slot->live );
+	EXPECT_EQ( async_slot::WAIT_EVENT, slot->wait );
+
+	// Twice what may be pending, the first half goes and then it waits
+	// on the client rather than the clock.
+	std::string data( 1000, 'x' );
+	for( int i = 0; i < 8; ++i ) p.hub.publish( "news", "", data );
+	ASSERT_TRUE( slot->ready );
+	ASSERT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( *con ) );
+	EXPECT_EQ( async_slot::WAIT_DRAIN, slot->wait );
+	EXPECT_FALSE( slot->ready );
+	EXPECT_EQ( 0u, open_files( con->write_queue ) );
+	EXPECT_EQ( 1u, p.held( *con ).size( ) );
+
+	off_t first = chunkqueue_length( con->write_queue );
+	EXPECT_GE( first, 4096 );
+
+	send_all_but( 3000 );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_joblist( *con ) );
+	EXPECT_FALSE( slot->ready );
+
+	send_all_but( 2048 );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_joblist( *con ) );
+	ASSERT_TRUE( slot->ready );
+
+	// The rest, and caught up it waits for the next event.
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_start_backend( *con ) );
+	EXPECT_EQ( async_slot::WAIT_EVENT, slot->wait );
+	EXPECT_EQ( off_t( 3 + 8 * encoded( 1, "", data ).size( ) ), chunkqueue_length( con->write_queue ) );
+
+	// The spools go with the response, not the task.
+	EXPECT_EQ( HANDLER_GO_ON, p.connection_reset( *con ) );
+	EXPECT_EQ( 0u, p.held( *con ).size( ) );
+}
+
+TEST_F( mod_sse_tests, AgainstCopyingToEach )
+{
+	const int subscribers = 2000;
+	const std::string data( 32 * 1024, 'd' );
+
+	sse_topic topic( 16, 4 * 1024 * 1024, dir );
+	std::vector< chunkqueue* > queues;
+	for( int i = 0; i < subscribers; ++i ) queues.push_back( chunkqueue_init( ) );
+
+	// Encoded once, queued to each by reference.
+	uint64_t start = now_us( );
+	topic.publish( "", data );
+	for( int i = 0; i < subscribers; ++i )
+	{
+		uint64_t cursor = 1;
+		response_builder out( queues[i] );
+		topic.deliver( cursor, out, true, 256 * 1024, 1024, held );
+	}
+	uint64_t shared_us = now_us( ) - start;
+	EXPECT_EQ( 0u, topic.copied );
+
+	for( int i = 0; i < subscribers; ++i ) clear( queues[i] );
+
+	// What writing the event into every queue would do.
+	start = now_us( );
+	std::string e = encoded( 1, "", data );
+	for( int i = 0; i < subscribers; ++i )
+	{
+		response_builder out( queues[i] );
+		char size[ 24 ];
+		out.append( size, std::snprintf( size, sizeof( size ), "%lx\r\n", static_cast< unsigned long >( e.size( ) ) ) );
+		out << e;
+		out.append( "\r\n", 2 );
+	}
+	uint64_t copy_us = now_us( ) - start;
+
+	std::printf( "%d subscribers, %lu byte event: by reference %lu us, copied to each %lu us (%lu MB copied)\n",
+		subscribers, static_cast< unsigned long >( e.size( ) ), static_cast< unsigned long >( shared_us ),
+		static_cast< unsigned long >( copy_us ), static_cast< unsigned long >( e.size( ) * subscribers / ( 1024 * 1024 ) ) );
+
+	for( int i = 0; i < subscribers; ++i )
+	{
+		clear( queues[i] );
+		chunkqueue_free( queues[i] );
+	}
+
+	EXPECT_LT( shared_us, copy_us );
+}
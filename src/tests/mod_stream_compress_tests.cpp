@@ -0,0 +1,352 @@
+/**
+ * Test the pieces behind mod_stream_compress: pooled deflate states,
+ * chunked streaming output and the compressed file cache, then the
+ * handlers over a real chunkqueue.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <gtest/gtest.h>
+
+#include <lighttpd-cpp/tests/plugin_tests.hpp>
+#include "../mod_stream_compress.hpp"
+
+MAKE_PLUGIN( mod_stream_compress, "stream_compress", LIGHTTPD_VERSION_ID );
+
+// Collects output, remembering how it was chunked.
+struct string_sink
+{
+	void operator()( const char* p, std::size_t len )
+	{
+		out.append( p, len );
+		sizes.push_back( len );
+	}
+
+	std::string out;
+	std::vector< std::size_t > sizes;
+};
+
+static std::string inflate_all( const std::string& in, compress_format f )
+{
+	z_stream z;
+	std::memset( &z, 0, sizeof( z ) );
+	inflateInit2( &z, f == COMPRESS_GZIP ? 15 + 16 : 15 );
+
+	std::string out;
+	char buf[ 4096 ];
+	z.next_in = reinterpret_cast< Bytef* >( const_cast< char* >( in.data( ) ) );
+	z.avail_in = in.size( );
+
+	int r;
+	do
+	{
+		z.next_out = reinterpret_cast< Bytef* >( buf );
+		z.avail_out = sizeof( buf );
+		r = inflate( &z, Z_NO_FLUSH );
+		out.append( buf, sizeof( buf ) - z.avail_out );
+	} while( r == Z_OK );
+
+	inflateEnd( &z );
+	return r == Z_STREAM_END ? out : std::string( "<corrupt>" );
+}
+
+// Something big enough for several output chunks, not too compressible.
+static std::string body( std::size_t len )
+{
+	std::string s;
+	s.reserve( len );
+	srand( 42 );
+	while( s.size( ) < len ) s.append( 1, static_cast< char >( 'a' + rand( ) % 26 ) );
+	return s;
+}
+
+TEST( mod_stream_compress_tests, RoundTrip )
+{
+	deflate_pool pool;
+	std::string in = body( 200000 );
+
+	for( int f = 0; f < COMPRESS_FORMATS; ++f )
+	{
+		string_sink sink;
+		stream_compressor c( pool, static_cast< compress_format >( f ) );
+		ASSERT_TRUE( c.ok( ) );
+
+		// Fed in uneven pieces, as a backend would.
+		for( std::size_t off = 0; off < in.size( ); off += 7777 )
+			ASSERT_TRUE( c.write( in.data( ) + off, std::min< std::size_t >( 7777, in.size( ) - off ), sink ) );
+		ASSERT_TRUE( c.finish( sink ) );
+
+		EXPECT_EQ( in, inflate_all( sink.out, static_cast< compress_format >( f ) ) );
+		EXPECT_EQ( in.size( ), c.bytes_in );
+		EXPECT_EQ( sink.out.size( ), c.bytes_out );
+	}
+}
+
+TEST( mod_stream_compress_tests, WholeChunks )
+{
+	deflate_pool pool;
+	std::string in = body( 500000 );
+
+	string_sink sink;
+	stream_compressor c( pool, COMPRESS_GZIP );
+	ASSERT_TRUE( c.write( in.data( ), in.size( ), sink ) );
+	ASSERT_TRUE( c.finish( sink ) );
+
+	// Every chunk but the last is full sized.
+	std::size_t full = stream_compressor::chunk_size;
+	ASSERT_GT( sink.sizes.size( ), 2u );
+	for( std::size_t i = 0; i + 1 < sink.sizes.size( ); ++i )
+		EXPECT_EQ( full, sink.sizes[i] );
+}
+
+TEST( mod_stream_compress_tests, StatesReused )
+{
+	deflate_pool pool;
+	std::string in = body( 1000 );
+
+	for( int i = 0; i < 10; ++i )
+	{
+		string_sink sink;
+		stream_compressor c( pool, COMPRESS_GZIP );
+		c.write( in.data( ), in.size( ), sink );
+		c.finish( sink );
+		EXPECT_EQ( in, inflate_all( sink.out, COMPRESS_GZIP ) );
+	}
+
+	EXPECT_EQ( 1u, pool.created );
+	EXPECT_EQ( 1u, pool.idle_count( COMPRESS_GZIP ) );
+
+	// Abandoned half way, the state still goes back.
+	{
+		string_sink sink;
+		stream_compressor c( pool, COMPRESS_DEFLATE );
+		c.write( in.data( ), in.size( ), sink );
+	}
+	EXPECT_EQ( 2u, pool.created );
+	EXPECT_EQ( 1u, pool.idle_count( COMPRESS_DEFLATE ) );
+}
+
+TEST( mod_stream_compress_tests, CacheFill )
+{
+	deflate_pool pool;
+	std::string in = body( 100000 );
+
+	string_sink small_sink, big_sink;
+	stream_compressor fits( pool, COMPRESS_GZIP, 1 << 20 ), too_big( pool, COMPRESS_GZIP, 100 );
+
+	fits.write( in.data( ), in.size( ), small_sink );
+	too_big.write( in.data( ), in.size( ), big_sink );
+	EXPECT_FALSE( fits.cached( ) );
+
+	fits.finish( small_sink );
+	too_big.finish( big_sink );
+
+	ASSERT_TRUE( fits.cached( ) );
+	EXPECT_EQ( small_sink.out, *fits.cached( ) );
+	EXPECT_FALSE( too_big.cached( ) );
+}
+
+TEST( mod_stream_compress_tests, CacheEvictsLeastRecent )
+{
+	compressed_cache cache( 8000 );
+
+	cache.insert( "a", std::string( 1000, 'a' ) );
+	cache.insert( "b", std::string( 1000, 'b' ) );
+	EXPECT_EQ( 2000u, cache.bytes( ) );
+
+	// Too big for an eighth of the cache.
+	cache.insert( "huge", std::string( 1001, 'h' ) );
+	EXPECT_FALSE( cache.find( "huge" ) );
+
+	// Touch a, so b is the oldest.
+	ASSERT_TRUE( cache.find( "a" ) );
+	for( char k = 'c'; k <= 'h'; ++k )
+		cache.insert( std::string( 1, k ), std::string( 1000, k ) );
+	cache.insert( "i", std::string( 1000, 'i' ) );
+
+	EXPECT_LE( cache.bytes( ), 8000u );
+	EXPECT_TRUE( cache.find( "a" ) );
+	EXPECT_FALSE( cache.find( "b" ) );
+	EXPECT_TRUE( cache.find( "i" ) );
+	EXPECT_EQ( 3u, cache.hits );
+}
+
+class mod_stream_compress_handler_tests : public plugin_tests< mod_stream_compress >
+{
+	public:
+		mod_stream_compress_handler_tests( ) : plugin_tests< mod_stream_compress >( "src/tests/mod_stream_compress_stub.conf" ) { }
+
+		void SetUp( )
+		{
+			plugin_tests< mod_stream_compress >::SetUp( );
+
+			con = reinterpret_cast< connection* >( calloc( 1, sizeof( connection ) ) );
+			con->plugin_ctx = reinterpret_cast< void** >( calloc( 1, sizeof( void* ) ) );
+			con->write_queue = chunkqueue_init( );
+			con->response.headers = array_init( );
+			con->physical.path = buffer_init( );
+			con->physical.etag = buffer_init( );
+
+			std::strcpy( file_name, "/tmp/lighttpd-cpp-compress-XXXXXX" );
+			int fd = mkstemp( file_name );
+			ASSERT_NE( -1, fd );
+			file_body = body( 300000 );
+			ASSERT_EQ( static_cast< ssize_t >( file_body.size( ) ), write( fd, file_body.data( ), file_body.size( ) ) );
+			close( fd );
+		}
+
+		void TearDown( )
+		{
+			unlink( file_name );
+
+			chunkqueue_free( con->write_queue );
+			array_free( con->response.headers );
+			buffer_free( con->physical.path );
+			buffer_free( con->physical.etag );
+			free( con->plugin_ctx );
+			free( con );
+
+			plugin_tests< mod_stream_compress >::TearDown( );
+		}
+
+		// A fresh 200 for a client that takes the given encoding.
+		void respond( int accept, const char* etag )
+		{
+			chunkqueue_reset( con->write_queue );
+			array_reset( con->response.headers );
+			con->http_status = 200;
+			con->file_finished = 0;
+			con->request.http_method = HTTP_METHOD_GET;
+			con->request.accept_encoding = accept;
+			response_header_insert( srv, con, CONST_STR_LEN( "Content-Type" ), CONST_STR_LEN( "text/plain" ) );
+			if( etag ) response_header_insert( srv, con, CONST_STR_LEN( "ETag" ), etag, std::strlen( etag ) );
+		}
+
+		void append( const std::string& s )
+		{
+			buffer_copy_string_len( chunkqueue_get_append_buffer( con->write_queue ), s.data( ), s.size( ) );
+		}
+
+		void append_file( off_t start, off_t len )
+		{
+			buffer* name = buffer_init_string( file_name );
+			chunkqueue_append_file( con->write_queue, name, start, len );
+			buffer_free( name );
+		}
+
+		// Be the network: write out up to n chunks, as lighttpd would
+		// between filter passes, and drop what is finished.
+		void drain( std::size_t n = static_cast< std::size_t >( -1 ) )
+		{
+			for( chunk* c = con->write_queue->first; c && n; c = c->next, --n )
+			{
+				if( c->type == chunk::MEM_CHUNK && c->mem->used > 1 )
+				{
+					sent.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+					c->offset = c->mem->used - 1;
+				}
+				else if( c->type == chunk::FILE_CHUNK && c->offset < c->file.length )
+				{
+					// Raw file chunks must all have been consumed.
+					ADD_FAILURE( ) << "raw file chunk left to write";
+					c->offset = c->file.length;
+				}
+			}
+			chunkqueue_remove_finished_chunks( con->write_queue );
+		}
+
+		std::string response_header( const char* name )
+		{
+			data_string* ds = reinterpret_cast< data_string* >( array_get_element( con->response.headers, name, std::strlen( name ) ) );
+			return ds ? std::string( ds->value->ptr, ds->value->used - 1 ) : std::string( );
+		}
+
+		connection* con;
+		char file_name[ 64 ];
+		std::string file_body;
+		std::string sent;
+};
+
+TEST_F( mod_stream_compress_handler_tests, EtagPerEncoding )
+{
+	mod_stream_compress p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	respond( HTTP_ACCEPT_ENCODING_GZIP, "\"abc\"" );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_response_header( *con ) );
+	EXPECT_EQ( std::string( "gzip" ), response_header( "Content-Encoding" ) );
+	EXPECT_EQ( std::string( "\"abc-gzip\"" ), response_header( "ETag" ) );
+	p.connection_reset( *con );
+
+	respond( HTTP_ACCEPT_ENCODING_DEFLATE, "W/\"abc\"" );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_response_header( *con ) );
+	EXPECT_EQ( std::string( "W/\"abc-deflate\"" ), response_header( "ETag" ) );
+	p.connection_reset( *con );
+
+	// Left alone when not compressing.
+	respond( 0, "\"abc\"" );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_response_header( *con ) );
+	EXPECT_EQ( std::string( "\"abc\"" ), response_header( "ETag" ) );
+}
+
+TEST_F( mod_stream_compress_handler_tests, StreamsMemAndFileChunks )
+{
+	mod_stream_compress p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	respond( HTTP_ACCEPT_ENCODING_GZIP, 0 );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_response_header( *con ) );
+
+	std::string head = body( 50000 ), tail( 20000, 'z' );
+
+	append( head );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_filter_response_content( *con ) );
+
+	// Only part of our output goes out, the rest stays queued ahead of
+	// what the backend adds next.
+	drain( 1 );
+	append_file( 1000, 200000 );
+	append( tail );
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_filter_response_content( *con ) );
+
+	// A pass with nothing new must not compress anything twice.
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_filter_response_content( *con ) );
+
+	drain( 2 );
+	append_file( 250000, 50000 );
+	con->file_finished = 1;
+	ASSERT_EQ( HANDLER_GO_ON, p.handle_filter_response_content( *con ) );
+	drain( );
+
+	EXPECT_EQ( head + file_body.substr( 1000, 200000 ) + tail + file_body.substr( 250000 ),
+		inflate_all( sent, COMPRESS_GZIP ) );
+	EXPECT_TRUE( con->write_queue->first == 0 );
+}
+
+TEST_F( mod_stream_compress_handler_tests, StaticFilesFromCache )
+{
+	mod_stream_compress p( *srv );
+	ASSERT_EQ( HANDLER_GO_ON, p.set_defaults( ) );
+
+	for( int i = 0; i < 2; ++i )
+	{
+		respond( HTTP_ACCEPT_ENCODING_GZIP, "\"v1\"" );
+		buffer_copy_string( con->physical.path, file_name );
+		buffer_copy_string( con->physical.etag, "\"v1\"" );
+		ASSERT_EQ( HANDLER_GO_ON, p.handle_response_header( *con ) );
+
+		append_file( 0, file_body.size( ) );
+		con->file_finished = 1;
+		ASSERT_EQ( HANDLER_GO_ON, p.handle_filter_response_content( *con ) );
+
+		sent.clear( );
+		drain( );
+		EXPECT_EQ( file_body, inflate_all( sent, COMPRESS_GZIP ) );
+		p.connection_reset( *con );
+	}
+
+	EXPECT_EQ( 1u, p.cache.misses );
+	EXPECT_EQ( 1u, p.cache.hits );
+}
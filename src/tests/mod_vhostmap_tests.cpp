@@ -0,0 +1,290 @@
+/**
+ * Test hosts and wildcards map to their settings, damaged tables are
+ * refused, a table written over is picked up, and a lookup costs the
+ * same for a few hosts and for many.
+ */
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+
+#include "../mod_vhostmap.hpp"
+
+static const char* table_path = "/tmp/lighttpd-cpp-vhostmap-test";
+
+static uint64_t now_us( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
+
+class mod_vhostmap_tests : public testing::Test
+{
+	public:
+		void TearDown( )
+		{
+			unlink( table_path );
+		}
+
+		vhost_table_ptr build( const std::string& map )
+		{
+			vhost_table_builder builder;
+			std::istringstream in( map );
+			std::string error;
+			EXPECT_TRUE( builder.parse( in, error ) ) << error;
+			EXPECT_TRUE( builder.write( table_path, error ) ) << error;
+
+			vhost_table_ptr t = vhost_table::open( table_path, error );
+			EXPECT_TRUE( t ) << error;
+			return t;
+		}
+
+		// The docroot, or "-" for none.
+		std::string docroot( const vhost_table_ptr& t, const std::string& host )
+		{
+			vhost_match m;
+			if( !t->find( host.data( ), host.size( ), m ) ) return "-";
+			return std::string( m.docroot, m.docroot_len );
+		}
+};
+
+TEST_F( mod_vhostmap_tests, Hosts )
+{
+	vhost_table_ptr t = build(
+		"# hosts\n"
+		"example.com      /srv/example   server-name=www.example.com\n"
+		"www.example.com  /srv/example\n"
+		"\n"
+		"static.example   /srv/static    follow-symlink=disable   # no links\n"
+		"10.0.0.1         /srv/by-address\n"
+		"[::1]            /srv/local\n" );
+	ASSERT_TRUE( t );
+	EXPECT_EQ( 5u, t->hosts( ) );
+	EXPECT_EQ( 0u, t->wildcards( ) );
+
+	vhost_match m;
+	ASSERT_TRUE( t->find( CONST_STR_LEN( "example.com" ), m ) );
+	EXPECT_EQ( "/srv/example", std::string( m.docroot, m.docroot_len ) );
+	EXPECT_EQ( "www.example.com", std::string( m.server_name, m.server_name_len ) );
+	EXPECT_EQ( -1, m.follow_symlink );
+	EXPECT_FALSE( m.wildcard );
+
+	ASSERT_TRUE( t->find( CONST_STR_LEN( "static.example" ), m ) );
+	EXPECT_EQ( 0u, m.server_name_len );
+	EXPECT_EQ( 0, m.follow_symlink );
+
+	// Without case, port or trailing dot.
+	EXPECT_EQ( "/srv/example", docroot( t, "WWW.Example.COM:8080" ) );
+	EXPECT_EQ( "/srv/example", docroot( t, "example.com." ) );
+	EXPECT_EQ( "/srv/by-address", docroot( t, "10.0.0.1:80" ) );
+	EXPECT_EQ( "/srv/local", docroot( t, "[::1]:8080" ) );
+
+	EXPECT_EQ( "-", docroot( t, "example.org" ) );
+	EXPECT_EQ( "-", docroot( t, "a.example.com" ) );
+	EXPECT_EQ( "-", docroot( t, "" ) );
+	EXPECT_EQ( "-", docroot( t, "*.example.com" ) );
+}
+
+TEST_F( mod_vhostmap_tests, Wildcards )
+{
+	vhost_table_ptr t = build(
+		"*.example.com         /srv/any\n"
+		"*.users.example.com   /srv/users  server-name=users.example.com\n"
+		"www.example.com       /srv/www\n"
+		"*.com                 /srv/com\n" );
+	ASSERT_TRUE( t );
+	EXPECT_EQ( 1u, t->hosts( ) );
+	EXPECT_EQ( 3u, t->wildcards( ) );
+
+	vhost_match m;
+	ASSERT_TRUE( t->find( CONST_STR_LEN( "shop.example.com" ), m ) );
+	EXPECT_EQ( "/srv/any", std::string( m.docroot, m.docroot_len ) );
+	EXPECT_TRUE( m.wildcard );
+
+	// However deep, the longest wildcard, and an exact host first.
+	EXPECT_EQ( "/srv/any", docroot( t, "a.b.c.example.com" ) );
+	EXPECT_EQ( "/srv/users", docroot( t, "alice.users.example.com" ) );
+	EXPECT_EQ( "/srv/any", docroot( t, "users.example.com" ) );
+	EXPECT_EQ( "/srv/www", docroot( t, "www.example.com" ) );
+
+	// Not the name itself, and labels whole.
+	EXPECT_EQ( "/srv/com", docroot( t, "example.com" ) );
+	EXPECT_EQ( "-", docroot( t, "com" ) );
+	EXPECT_EQ( "/srv/com", docroot( t, "notexample.com" ) );
+	EXPECT_EQ( "-", docroot( t, "example.com.org" ) );
+}
+
+TEST_F( mod_vhostmap_tests, BadMaps )
+{
+	const char* maps[] =
+	{
+		"example.com\n",
+		"example.com /a\nEXAMPLE.com /b\n",
+		"example.com /a color=blue\n",
+		"a..b /a\n",
+		"*.*.example.com /a\n",
+		"www.*.com /a\n",
+		"example.com:80 /a\n",
+		".example.com /a\n"
+	};
+
+	for( std::size_t i = 0; i < sizeof( maps ) / sizeof( maps[0] ); ++i )
+	{
+		vhost_table_builder builder;
+		std::istringstream in( maps[i] );
+		std::string error;
+		EXPECT_FALSE( builder.parse( in, error ) ) << maps[i];
+		EXPECT_EQ( 0u, error.find( "line " ) ) << maps[i];
+	}
+
+	vhost_table_builder builder;
+	std::istringstream in( "a.example /a\n\n# fine so far\nb.example\n" );
+	std::string error;
+	EXPECT_FALSE( builder.parse( in, error ) );
+	EXPECT_EQ( "line 4: no document root for b.example", error );
+}
+
+TEST_F( mod_vhostmap_tests, DamagedTablesRefused )
+{
+	vhost_table_builder builder;
+	for( int i = 0; i < 100; ++i )
+	{
+		vhost_entry e;
+		char host[ 32 ];
+		snprintf( host, sizeof( host ), "%shost%d.example", i % 10 ? "" : "*.", i );
+		e.host = host;
+		e.docroot = "/srv/x";
+		std::string error;
+		ASSERT_TRUE( builder.add( e, error ) ) << error;
+	}
+	std::string image = builder.image( );
+
+	std::string error;
+	EXPECT_FALSE( vhost_table::open( "/tmp/lighttpd-cpp-vhostmap-missing", error ) );
+	EXPECT_NE( std::string::npos, error.find( "No such file" ) );
+
+	// Cut short, each area pointing past the end, and a record's lengths.
+	std::vector< std::string > damaged;
+	damaged.push_back( image.substr( 0, image.size( ) - 1 ) );
+	damaged.push_back( image.substr( 0, 20 ) );
+	for( std::size_t field = offsetof( vhost_table_header, host_slots_at ); field < sizeof( vhost_table_header ); field += 8 )
+	{
+		std::string d = image;
+		uint64_t far = 1ULL << 40;
+		std::memcpy( &d[ field ], &far, 8 );
+		damaged.push_back( d );
+	}
+	{
+		vhost_table_header h;
+		std::memcpy( &h, image.data( ), sizeof( h ) );
+		std::string d = image;
+		uint16_t long_host = 0xffff;
+		std::memcpy( &d[ h.records_at ], &long_host, 2 );
+		damaged.push_back( d );
+	}
+
+	for( std::size_t i = 0; i < damaged.size( ); ++i )
+	{
+		std::FILE* f = std::fopen( table_path, "wb" );
+		std::fwrite( damaged[i].data( ), damaged[i].size( ), 1, f );
+		std::fclose( f );
+		EXPECT_FALSE( vhost_table::open( table_path, error ) ) << i;
+	}
+
+	std::FILE* f = std::fopen( table_path, "wb" );
+	std::fwrite( image.data( ), image.size( ), 1, f );
+	std::fclose( f );
+	vhost_table_ptr t = vhost_table::open( table_path, error );
+	ASSERT_TRUE( t );
+	EXPECT_EQ( "/srv/x", docroot( t, "host5.example" ) );
+	EXPECT_EQ( "/srv/x", docroot( t, "www.host50.example" ) );
+}
+
+TEST_F( mod_vhostmap_tests, WrittenOverIsSeen )
+{
+	vhost_table_ptr old = build( "example.com /srv/old\n" );
+	ASSERT_TRUE( old );
+
+	struct stat st;
+	ASSERT_EQ( 0, stat( table_path, &st ) );
+	EXPECT_TRUE( old->same_file( st ) );
+
+	vhost_table_ptr next = build( "example.com /srv/new\n" );
+	ASSERT_TRUE( next );
+	ASSERT_EQ( 0, stat( table_path, &st ) );
+	EXPECT_FALSE( old->same_file( st ) );
+	EXPECT_TRUE( next->same_file( st ) );
+
+	// The old mapping is whole until let go of.
+	EXPECT_EQ( "/srv/old", docroot( old, "example.com" ) );
+	EXPECT_EQ( "/srv/new", docroot( next, "example.com" ) );
+}
+
+// Looks up hosts in a table of size hosts, returning ns a lookup.
+static double lookup_ns( int size )
+{
+	vhost_table_builder builder;
+	for( int i = 0; i < size; ++i )
+	{
+		vhost_entry e;
+		char host[ 64 ];
+		snprintf( host, sizeof( host ), "customer-%d.example.net", i );
+		e.host = host;
+		e.docroot = std::string( "/srv/customers/" ) + host;
+		std::string error;
+		builder.add( e, error );
+
+		snprintf( host, sizeof( host ), "*.customer-%d.example.org", i );
+		e.host = host;
+		builder.add( e, error );
+	}
+
+	std::string error;
+	builder.write( table_path, error );
+	vhost_table_ptr t = vhost_table::open( table_path, error );
+	if( !t ) return 0;
+
+	std::vector< std::string > hosts;
+	for( int i = 0; i < 1000; ++i )
+	{
+		char host[ 64 ];
+		int n = static_cast< int >( ( i * 7919u ) % size );
+		snprintf( host, sizeof( host ), i % 2 ? "Customer-%d.example.net" : "www.customer-%d.example.org", n );
+		hosts.push_back( host );
+	}
+
+	const int rounds = 200;
+	int found = 0;
+	uint64_t start = now_us( );
+	for( int r = 0; r < rounds; ++r )
+	{
+		for( std::size_t i = 0; i < hosts.size( ); ++i )
+		{
+			vhost_match m;
+			found += t->find( hosts[i].data( ), hosts[i].size( ), m );
+		}
+	}
+	uint64_t took = now_us( ) - start;
+
+	EXPECT_EQ( rounds * 1000, found );
+	return double( took ) * 1000 / ( rounds * hosts.size( ) );
+}
+
+TEST_F( mod_vhostmap_tests, SameCostForManyHosts )
+{
+	double few = lookup_ns( 100 );
+	double many = lookup_ns( 200000 );
+
+	std::printf( "100 hosts: %.0f ns a lookup, 200000 hosts: %.0f ns a lookup\n", few, many );
+
+	// Cache misses on a bigger table, but nothing like the 2000 times the
+	// hosts.
+	EXPECT_LT( many, few * 10 );
+}
@@ -0,0 +1,111 @@
+/**
+ * Test borrowing and returning buffers through pooled_buffer.
+ */
+
+#include <gtest/gtest.h>
+
+#include <boost/move/utility.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <lighttpd-cpp/pooled_buffer.hpp>
+
+class pooled_buffer_tests : public testing::Test
+{
+	public:
+		pooled_buffer_tests( )
+		 : max_buffers( buffer_cache::max_buffers ), max_capacity( buffer_cache::max_capacity )
+		{}
+
+		virtual ~pooled_buffer_tests( )
+		{
+			buffer_cache::max_buffers = max_buffers;
+			buffer_cache::max_capacity = max_capacity;
+		}
+
+		std::size_t max_buffers;
+		std::size_t max_capacity;
+};
+
+TEST_F( pooled_buffer_tests, ReusedWithCapacity )
+{
+	buffer* first;
+	std::size_t size;
+	{
+		pooled_buffer b;
+		buffer_copy_string_len( b.get( ), CONST_STR_LEN( "some scratch space" ) );
+		first = b.get( );
+		size = b->size;
+	}
+
+	uint64_t hits = buffer_cache::local( ).stats( ).hits;
+	{
+		pooled_buffer b;
+		EXPECT_EQ( first, b.get( ) );
+		EXPECT_EQ( size, b->size );
+		EXPECT_EQ( 0u, b->used );
+	}
+	EXPECT_EQ( hits + 1, buffer_cache::local( ).stats( ).hits );
+}
+
+TEST_F( pooled_buffer_tests, Moved )
+{
+	pooled_buffer a;
+	buffer* p = a.get( );
+
+	pooled_buffer b( boost::move( a ) );
+	EXPECT_EQ( 0, a.get( ) );
+	EXPECT_EQ( p, b.get( ) );
+
+	pooled_buffer c;
+	c = boost::move( b );
+	EXPECT_EQ( 0, b.get( ) );
+	EXPECT_EQ( p, c.get( ) );
+}
+
+TEST_F( pooled_buffer_tests, Limits )
+{
+	buffer_cache::max_buffers = 2;
+	buffer_cache::max_capacity = 1024;
+	buffer_cache& cache = buffer_cache::local( );
+
+	uint64_t discarded = cache.stats( ).discarded;
+	{
+		pooled_buffer a, b, c;
+	}
+	EXPECT_LE( cache.stats( ).pooled, 2u );
+	EXPECT_LE( discarded + 1, cache.stats( ).discarded );
+
+	discarded = cache.stats( ).discarded;
+	std::size_t pooled = cache.stats( ).pooled;
+	{
+		pooled_buffer big;
+		buffer_prepare_copy( big.get( ), 4096 );
+	}
+	// It came from the pool but doesn't go back.
+	EXPECT_EQ( discarded + 1, cache.stats( ).discarded );
+	EXPECT_EQ( pooled - 1, cache.stats( ).pooled );
+}
+
+static void borrow( buffer** out )
+{
+	pooled_buffer b;
+	*out = b.get( );
+}
+
+TEST_F( pooled_buffer_tests, PerThread )
+{
+	buffer* ours;
+	{
+		pooled_buffer b;
+		ours = b.get( );
+	}
+
+	buffer* theirs = 0;
+	boost::thread t( borrow, &theirs );
+	t.join( );
+
+	EXPECT_NE( ours, theirs );
+
+	pooled_buffer b;
+	EXPECT_EQ( ours, b.get( ) );
+}
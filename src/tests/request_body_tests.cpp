@@ -0,0 +1,359 @@
+/**
+ * Test request bodies are taken from memory and file chunks alike, are
+ * held back when a plugin takes less, end once per request however they
+ * end, stay in memory under the threshold, and spill past it to
+ * preallocated files taken round the upload dirs.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lighttpd-cpp/request_body.hpp>
+
+static const char* chunk_path = "/tmp/lighttpd-cpp-request-body-chunk";
+
+// Whether files in dir can be preallocated at all.
+static bool can_fallocate( const std::string& dir )
+{
+	std::string name = dir + "/lighttpd-cpp-fallocate-XXXXXX";
+	int fd = mkstemp( &name[0] );
+	if( fd == -1 ) return false;
+
+	bool ok = 0 == fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, 4096 );
+	close( fd );
+	unlink( name.c_str( ) );
+	return ok;
+}
+
+// Takes up to room bytes.
+struct limited_sink
+{
+	limited_sink( std::size_t room )
+	 : room( room )
+	{}
+
+	std::size_t operator()( const char* p, std::size_t len )
+	{
+		std::size_t n = std::min( len, room );
+		got.append( p, n );
+		room -= n;
+		return n;
+	}
+
+	std::size_t room;
+	std::string got;
+};
+
+// A backend plugin taking bodies into a request_body.
+struct body_plugin : request_body_reader< body_plugin >
+{
+	body_plugin( )
+	 : room( std::size_t( -1 ) ), ended( 0 )
+	{}
+
+	std::size_t id( ) const { return 7; }
+
+	std::size_t request_body_data( connection&, const char* p, std::size_t len )
+	{
+		std::size_t n = std::min( len, room );
+		got.append( p, n );
+		room -= n;
+		return n;
+	}
+
+	handler_t request_body_end( connection& )
+	{
+		++ended;
+		return HANDLER_FINISHED;
+	}
+
+	std::size_t room;
+	std::string got;
+	int ended;
+};
+
+class request_body_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			std::memset( &con, 0, sizeof( con ) );
+			con.request_content_queue = chunkqueue_init( );
+			con.mode = static_cast< connection_type >( 7 );
+
+			dirs.clear( );
+			for( int i = 0; i < 3; ++i )
+			{
+				char name[ 64 ];
+				std::snprintf( name, sizeof( name ), "/tmp/lighttpd-cpp-request-body-%d", i );
+				mkdir( name, 0700 );
+				dirs.push_back( name );
+			}
+		}
+
+		void TearDown( )
+		{
+			chunkqueue_free( con.request_content_queue );
+			unlink( chunk_path );
+			for( std::size_t i = 0; i < dirs.size( ); ++i ) rmdir( dirs[i].c_str( ) );
+		}
+
+		void queue_mem( const std::string& s )
+		{
+			buffer* b = chunkqueue_get_append_buffer( con.request_content_queue );
+			buffer_copy_string_len( b, s.data( ), s.size( ) );
+			con.request_content_queue->bytes_in += s.size( );
+		}
+
+		// As the core spools a big body.
+		void queue_file( const std::string& s )
+		{
+			std::FILE* f = std::fopen( chunk_path, "wb" );
+			std::fputs( "skipped", f );
+			std::fwrite( s.data( ), s.size( ), 1, f );
+			std::fclose( f );
+
+			buffer* name = buffer_init( );
+			buffer_copy_string( name, chunk_path );
+			chunkqueue_append_file( con.request_content_queue, name, 7, s.size( ) );
+			buffer_free( name );
+			con.request_content_queue->bytes_in += s.size( );
+		}
+
+		// Files in dir.
+		int files_in( const std::string& dir )
+		{
+			DIR* d = opendir( dir.c_str( ) );
+			if( !d ) return -1;
+
+			int n = 0;
+			while( struct dirent* e = readdir( d ) )
+				if( e->d_name[0] != '.' ) ++n;
+			closedir( d );
+			return n;
+		}
+
+		connection con;
+		std::vector< std::string > dirs;
+};
+
+TEST_F( request_body_tests, FedFromMemoryAndFiles )
+{
+	queue_mem( "hello " );
+	queue_file( std::string( 40000, 'x' ) );
+	queue_mem( "world" );
+
+	limited_sink sink( std::size_t( -1 ) );
+	off_t taken = 0;
+	EXPECT_EQ( BODY_FED, request_body_feed( con.request_content_queue, sink, taken ) );
+	EXPECT_EQ( 40011, taken );
+	EXPECT_EQ( "hello " + std::string( 40000, 'x' ) + "world", sink.got );
+
+	EXPECT_EQ( 40011, con.request_content_queue->bytes_out );
+	EXPECT_TRUE( con.request_content_queue->first == NULL );
+}
+
+TEST_F( request_body_tests, HeldBackUntilTaken )
+{
+	queue_mem( "0123456789" );
+	queue_file( "abcdefghij" );
+
+	limited_sink sink( 4 );
+	off_t taken = 0;
+	EXPECT_EQ( BODY_STALLED, request_body_feed( con.request_content_queue, sink, taken ) );
+	EXPECT_EQ( 4, taken );
+	EXPECT_EQ( 4, con.request_content_queue->bytes_out );
+
+	// What wasn't taken is offered again.
+	sink.room = 8;
+	EXPECT_EQ( BODY_STALLED, request_body_feed( con.request_content_queue, sink, taken ) );
+	EXPECT_EQ( "0123456789ab", sink.got );
+
+	sink.room = 100;
+	EXPECT_EQ( BODY_FED, request_body_feed( con.request_content_queue, sink, taken ) );
+	EXPECT_EQ( "0123456789abcdefghij", sink.got );
+	EXPECT_EQ( 20, taken );
+	EXPECT_TRUE( con.request_content_queue->first == NULL );
+}
+
+TEST_F( request_body_tests, ReaderWaitsAndEndsOnce )
+{
+	body_plugin p;
+	con.request.content_length = 15;
+
+	// Not ours.
+	con.mode = DIRECT;
+	queue_mem( "first" );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "", p.got );
+	con.mode = static_cast< connection_type >( 7 );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "first", p.got );
+
+	p.room = 3;
+	queue_mem( "second" );
+	queue_file( "last" );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "firstsec", p.got );
+	EXPECT_EQ( 0, p.ended );
+
+	p.room = 100;
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "firstsecondlast", p.got );
+	EXPECT_EQ( 1, p.ended );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( 1, p.ended );
+}
+
+TEST_F( request_body_tests, ChunkedEndsWhenClosed )
+{
+	body_plugin p;
+
+	queue_mem( "some" );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	queue_mem( "more" );
+	con.request_content_queue->is_closed = 1;
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "somemore", p.got );
+	EXPECT_EQ( 1, p.ended );
+}
+
+TEST_F( request_body_tests, EndsWhenClosedAfterTaken )
+{
+	body_plugin p;
+
+	// All of it taken before the queue says that was all.
+	queue_mem( "all" );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( 0, p.ended );
+
+	con.request_content_queue->is_closed = 1;
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_send_request_content( con ) );
+	EXPECT_EQ( "all", p.got );
+	EXPECT_EQ( 1, p.ended );
+
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( 1, p.ended );
+}
+
+TEST_F( request_body_tests, EmptyBodiesEndOnce )
+{
+	body_plugin p;
+	con.request_content_queue->is_closed = 1;
+
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_send_request_content( con ) );
+	EXPECT_EQ( HANDLER_GO_ON, p.handle_send_request_content( con ) );
+	EXPECT_EQ( 1, p.ended );
+
+	// The next request on the connection has its own.
+	++con.request_count;
+	EXPECT_EQ( HANDLER_FINISHED, p.handle_send_request_content( con ) );
+	EXPECT_EQ( 2, p.ended );
+}
+
+TEST_F( request_body_tests, SmallBodiesStayInMemory )
+{
+	tempdir_rotation rotation;
+	rotation.assign( dirs );
+
+	request_body body( 1024, rotation, 1000 );
+	for( int i = 0; i < 10; ++i ) EXPECT_TRUE( body.append( std::string( 100, 'a' + i ).data( ), 100 ) );
+
+	EXPECT_FALSE( body.spilled( ) );
+	EXPECT_EQ( -1, body.file( ) );
+	EXPECT_EQ( 1000, body.size( ) );
+	EXPECT_EQ( std::string( 100, 'a' ), std::string( body.data( ), 100 ) );
+	for( std::size_t i = 0; i < dirs.size( ); ++i ) EXPECT_EQ( 0, files_in( dirs[i] ) );
+
+	std::string all;
+	EXPECT_TRUE( body.read( all ) );
+	EXPECT_EQ( 1000u, all.size( ) );
+	EXPECT_EQ( std::string( 100, 'j' ), all.substr( 900 ) );
+}
+
+TEST_F( request_body_tests, BigBodiesSpillPreallocated )
+{
+	tempdir_rotation rotation;
+	rotation.assign( dirs );
+
+	const off_t length = 4 * 1024 * 1024;
+	std::string name;
+	{
+		request_body body( 64 * 1024, rotation, length );
+		std::string piece( 16 * 1024, 'z' );
+		for( int i = 0; i < 4; ++i ) EXPECT_TRUE( body.append( piece.data( ), piece.size( ) ) );
+		EXPECT_FALSE( body.spilled( ) );
+
+		// Past the threshold: what was in memory goes first.
+		piece[0] = 'q';
+		EXPECT_TRUE( body.append( piece.data( ), piece.size( ) ) );
+		ASSERT_TRUE( body.spilled( ) );
+		name = body.file_name( );
+		EXPECT_EQ( 0u, name.find( dirs[0] + "/lighttpd-upload-" ) );
+
+		struct stat st;
+		ASSERT_EQ( 0, fstat( body.file( ), &st ) );
+		EXPECT_EQ( 80 * 1024, st.st_size );
+
+		// The Content-Length is there already, where the filesystem can.
+		if( can_fallocate( dirs[0] ) ) EXPECT_GE( st.st_blocks * 512, length );
+
+		std::string all;
+		EXPECT_TRUE( body.read( all ) );
+		EXPECT_EQ( std::size_t( 80 * 1024 ), all.size( ) );
+		EXPECT_EQ( 'z', all[ 0 ] );
+		EXPECT_EQ( 'q', all[ 64 * 1024 ] );
+
+		chunkqueue* cq = chunkqueue_init( );
+		response_builder out( cq );
+		body.queue( out );
+		ASSERT_TRUE( cq->first != NULL );
+		EXPECT_EQ( chunk::FILE_CHUNK, cq->first->type );
+		EXPECT_EQ( 80 * 1024, cq->first->file.length );
+		chunkqueue_free( cq );
+	}
+
+	// Gone with the body.
+	EXPECT_NE( 0, access( name.c_str( ), F_OK ) );
+}
+
+TEST_F( request_body_tests, SpillsGoRoundTheDirs )
+{
+	tempdir_rotation rotation;
+	rotation.assign( dirs );
+
+	std::vector< request_body* > bodies;
+	for( int i = 0; i < 6; ++i )
+	{
+		// Length not known: preallocated a step at a time.
+		request_body* body = new request_body( 10, rotation );
+		EXPECT_TRUE( body->append( "more than ten bytes", 19 ) );
+		bodies.push_back( body );
+	}
+
+	for( int i = 0; i < 6; ++i )
+		EXPECT_EQ( 0u, bodies[i]->file_name( ).find( dirs[ i % 3 ] + "/" ) ) << bodies[i]->file_name( );
+	for( std::size_t i = 0; i < dirs.size( ); ++i ) EXPECT_EQ( 2, files_in( dirs[i] ) );
+
+	for( int i = 0; i < 6; ++i ) delete bodies[i];
+	for( std::size_t i = 0; i < dirs.size( ); ++i ) EXPECT_EQ( 0, files_in( dirs[i] ) );
+
+	// A directory that won't do is passed over.
+	std::vector< std::string > some;
+	some.push_back( "/nonexistent/lighttpd-cpp" );
+	some.push_back( dirs[1] );
+	rotation.assign( some );
+	request_body body( 0, rotation );
+	EXPECT_TRUE( body.append( "x", 1 ) );
+	EXPECT_EQ( 0u, body.file_name( ).find( dirs[1] ) );
+}
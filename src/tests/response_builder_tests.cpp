@@ -0,0 +1,173 @@
+/**
+ * Test building responses in a chunkqueue with response_builder.
+ */
+
+#include <cstdio>
+#include <string>
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <lighttpd-cpp/response_builder.hpp>
+
+// What the network backend would send from cq.
+static std::string sent( chunkqueue* cq )
+{
+	std::string s;
+	for( chunk* c = cq->first; c; c = c->next )
+	{
+		if( c->type == chunk::MEM_CHUNK )
+		{
+			s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+		}
+		else
+		{
+			// Opened by name when it holds no fd.
+			int fd = c->file.fd != -1 ? c->file.fd : open( c->file.name->ptr, O_RDONLY );
+			std::string part( c->file.length, '\0' );
+			EXPECT_EQ( c->file.length, pread( fd, &part[0], part.size( ), c->file.start ) );
+			if( fd != c->file.fd ) close( fd );
+			s += part;
+		}
+	}
+	return s;
+}
+
+static std::size_t chunks( chunkqueue* cq )
+{
+	std::size_t n = 0;
+	for( chunk* c = cq->first; c; c = c->next ) ++n;
+	return n;
+}
+
+TEST( response_builder_tests, SmallPiecesShareAChunk )
+{
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		response_builder out( cq );
+		buffer* b = buffer_init_string( "buffer" );
+		out << "<p>" << std::string( "string" ) << b << "</p>";
+		buffer_free( b );
+
+		EXPECT_EQ( 1u, chunks( cq ) );
+		EXPECT_EQ( "<p>stringbuffer</p>", sent( cq ) );
+		EXPECT_EQ( 19, out.length( ) );
+	}
+	chunkqueue_free( cq );
+}
+
+TEST( response_builder_tests, FullChunksAreNotGrown )
+{
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		const std::size_t block = response_builder::block_size;
+		std::string big( block + 10, 'x' );
+
+		response_builder out( cq );
+		out << "a" << big << "b";
+
+		EXPECT_EQ( "a" + big + "b", sent( cq ) );
+		EXPECT_LE( chunks( cq ), 3u );
+	}
+	chunkqueue_free( cq );
+}
+
+TEST( response_builder_tests, RenderInPlace )
+{
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		response_builder out( cq );
+		out << "n=";
+		char* p = out.reserve( 32 );
+		out.commit( snprintf( p, 32, "%d", 12345 ) );
+		out << ";";
+
+		EXPECT_EQ( 1u, chunks( cq ) );
+		EXPECT_EQ( "n=12345;", sent( cq ) );
+	}
+	chunkqueue_free( cq );
+}
+
+TEST( response_builder_tests, FileRanges )
+{
+	char name[] = "/tmp/response_builder_testXXXXXX";
+	int fd = mkstemp( name );
+	ASSERT_NE( -1, fd );
+	ASSERT_EQ( 10, write( fd, "0123456789", 10 ) );
+
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		buffer* b = buffer_init_string( name );
+		response_builder out( cq );
+		out << "[";
+		out.file( fd, 2, 5, b );
+		out << "]";
+		buffer_free( b );
+
+		EXPECT_EQ( 3u, chunks( cq ) );
+		EXPECT_NE( fd, cq->first->next->file.fd );
+		EXPECT_EQ( "[23456]", sent( cq ) );
+		EXPECT_EQ( 7, out.length( ) );
+		EXPECT_FALSE( out.failed( ) );
+	}
+	chunkqueue_free( cq );
+
+	// Still ours.
+	EXPECT_EQ( 0, close( fd ) );
+	unlink( name );
+}
+
+TEST( response_builder_tests, FilesByName )
+{
+	char name[] = "/tmp/response_builder_testXXXXXX";
+	int fd = mkstemp( name );
+	ASSERT_NE( -1, fd );
+	ASSERT_EQ( 10, write( fd, "0123456789", 10 ) );
+	close( fd );
+
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		buffer* b = buffer_init_string( name );
+		response_builder out( cq );
+		out.file_by_name( b, 4, 3 );
+		out.file_by_name( b, 0, 0 );
+		buffer_free( b );
+
+		EXPECT_EQ( 1u, chunks( cq ) );
+		EXPECT_EQ( -1, cq->first->file.fd );
+		EXPECT_EQ( "456", sent( cq ) );
+		EXPECT_EQ( 3, out.length( ) );
+	}
+	chunkqueue_free( cq );
+	unlink( name );
+}
+
+TEST( response_builder_tests, Fragments )
+{
+	const std::size_t threshold = shared_fragment::sendfile_threshold;
+	shared_fragment_ptr small( new shared_fragment( "<footer/>" ) );
+	shared_fragment_ptr big( new shared_fragment( std::string( threshold, 'f' ) ) );
+
+	EXPECT_EQ( -1, small->file( ) );
+	ASSERT_NE( -1, big->file( ) );
+	std::string big_name = big->file_name( );
+
+	chunkqueue* cq = chunkqueue_init( );
+	{
+		response_builder out( cq );
+		out << "body";
+		out.fragment( *small );
+		out.fragment( *big );
+
+		EXPECT_EQ( 2u, chunks( cq ) );
+		EXPECT_EQ( chunk::FILE_CHUNK, cq->last->type );
+	}
+
+	// The queued response outlives the fragment.
+	big.reset( );
+	EXPECT_NE( 0, access( big_name.c_str( ), F_OK ) );
+	EXPECT_EQ( "body<footer/>" + std::string( threshold, 'f' ), sent( cq ) );
+
+	chunkqueue_free( cq );
+}
@@ -0,0 +1,379 @@
+/**
+ * Test that identical requests share one leader's response, waiters are
+ * woken as it arrives, and a leader giving up hands the flight on.
+ */
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <lighttpd-cpp/single_flight.hpp>
+
+// A connection with a task slot to wait in.
+struct waiter
+{
+	waiter( server& srv ) : slot( srv, 1 )
+	{
+		std::memset( &con, 0, sizeof( con ) );
+		con.write_queue = chunkqueue_init( );
+		con.response.headers = array_init( );
+		slot.con = &con;
+	}
+
+	~waiter( )
+	{
+		slot.unwatch( );
+		chunkqueue_free( con.write_queue );
+		array_free( con.response.headers );
+	}
+
+	handler_t wait( )
+	{
+		slot.ready = false;
+		async_context ctx( slot );
+		return ticket.wait( ctx, 10 );
+	}
+
+	flight_ticket::replay_result replay( server& srv )
+	{
+		return ticket.replay( srv, con );
+	}
+
+	// The body as queued, file chunks read back.
+	std::string written( )
+	{
+		std::string s;
+		for( chunk* c = con.write_queue->first; c; c = c->next )
+		{
+			if( c->type == chunk::MEM_CHUNK && c->mem->used )
+				s.append( c->mem->ptr + c->offset, c->mem->used - 1 - c->offset );
+
+			if( c->type == chunk::FILE_CHUNK )
+			{
+				std::vector< char > buf( c->file.length );
+				if( pread( c->file.fd, &buf[0], buf.size( ), c->file.start ) == static_cast< ssize_t >( buf.size( ) ) )
+					s.append( &buf[0], buf.size( ) );
+			}
+		}
+		return s;
+	}
+
+	bool has_file_chunk( )
+	{
+		for( chunk* c = con.write_queue->first; c; c = c->next )
+		{
+			if( c->type == chunk::FILE_CHUNK ) return true;
+		}
+		return false;
+	}
+
+	std::string response_header( const char* name )
+	{
+		data_string* ds = reinterpret_cast< data_string* >(
+			array_get_element( con.response.headers, name, std::strlen( name ) ) );
+		return ds ? std::string( ds->value->ptr, ds->value->used - 1 ) : std::string( );
+	}
+
+	connection con;
+	async_slot slot;
+	flight_ticket ticket;
+};
+
+class single_flight_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			// Nothing is registered without srv.ev, so a blank server will do.
+			std::memset( &srv, 0, sizeof( srv ) );
+			headers = array_init( );
+
+			data_string* ds = data_string_init( );
+			buffer_copy_string( ds->key, "Content-Type" );
+			buffer_copy_string( ds->value, "text/plain" );
+			array_insert_unique( headers, reinterpret_cast< data_unset* >( ds ) );
+		}
+
+		void TearDown( )
+		{
+			array_free( headers );
+		}
+
+		server srv;
+		array* headers;
+};
+
+TEST_F( single_flight_tests, OneLeaderPerKey )
+{
+	single_flight flights;
+	flight_ticket a, b, c, d, other;
+
+	EXPECT_EQ( flight_ticket::LEAD, a.join( flights, "GET /x", 2 ) );
+	EXPECT_EQ( flight_ticket::FOLLOW, b.join( flights, "GET /x", 2 ) );
+	EXPECT_EQ( flight_ticket::FOLLOW, c.join( flights, "GET /x", 2 ) );
+	EXPECT_EQ( flight_ticket::LEAD, other.join( flights, "GET /y", 2 ) );
+
+	// Over max waiters.
+	EXPECT_EQ( flight_ticket::ALONE, d.join( flights, "GET /x", 2 ) );
+
+	EXPECT_EQ( 2u, flights.size( ) );
+	EXPECT_EQ( 2ul, flights.leaders( ) );
+	EXPECT_EQ( 2ul, flights.followers( ) );
+	EXPECT_EQ( 1ul, flights.overflows( ) );
+
+	// Done with, the next request for the key goes upstream again.
+	a.complete( );
+	EXPECT_EQ( flight_ticket::LEAD, d.join( flights, "GET /x", 2 ) );
+}
+
+TEST_F( single_flight_tests, WaitersGetTheResponse )
+{
+	single_flight flights;
+	flight_ticket leader;
+	waiter w1( srv ), w2( srv );
+
+	ASSERT_EQ( flight_ticket::LEAD, leader.join( flights, "GET /x", 0 ) );
+	ASSERT_EQ( flight_ticket::FOLLOW, w1.ticket.join( flights, "GET /x", 0 ) );
+	ASSERT_EQ( flight_ticket::FOLLOW, w2.ticket.join( flights, "GET /x", 0 ) );
+
+	// Nothing yet, park.
+	EXPECT_EQ( flight_ticket::MORE, w1.replay( srv ) );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, w1.wait( ) );
+	EXPECT_EQ( HANDLER_WAIT_FOR_EVENT, w2.wait( ) );
+	EXPECT_EQ( async_slot::WAIT_EVENT, w1.slot.wait );
+
+	leader.head( 200, headers, 11 );
+	EXPECT_TRUE( w1.slot.ready );
+	EXPECT_TRUE( w2.slot.ready );
+
+	EXPECT_EQ( flight_ticket::MORE, w1.replay( srv ) );
+	EXPECT_EQ( 200, w1.con.http_status );
+	EXPECT_EQ( "text/plain", w1.response_header( "Content-Type" ) );
+	EXPECT_EQ( 11, w1.con.response.content_length );
+	EXPECT_TRUE( w1.ticket.started( ) );
+
+	w1.wait( );
+	leader.append( "hello ", 6 );
+	EXPECT_TRUE( w1.slot.ready );
+	EXPECT_EQ( flight_ticket::MORE, w1.replay( srv ) );
+	EXPECT_EQ( "hello ", w1.written( ) );
+
+	// w2 is still to run, so nobody is waiting and this is kept back.
+	leader.append( "world", 5 );
+	w1.wait( );
+	leader.complete( );
+
+	EXPECT_EQ( flight_ticket::DONE, w1.replay( srv ) );
+	EXPECT_EQ( flight_ticket::DONE, w2.replay( srv ) );
+	EXPECT_EQ( "hello world", w1.written( ) );
+	EXPECT_EQ( "hello world", w2.written( ) );
+	EXPECT_EQ( 200, w2.con.http_status );
+	EXPECT_TRUE( w2.con.file_finished );
+}
+
+TEST_F( single_flight_tests, LateWaiterGetsItAll )
+{
+	single_flight flights;
+	flight_ticket leader;
+	waiter w( srv );
+
+	leader.join( flights, "GET /x", 0 );
+	leader.head( 200, headers, -1 );
+	leader.append( "some", 4 );
+
+	ASSERT_EQ( flight_ticket::FOLLOW, w.ticket.join( flights, "GET /x", 0 ) );
+	EXPECT_EQ( flight_ticket::MORE, w.replay( srv ) );
+	w.wait( );
+
+	leader.append( "thing", 5 );
+	leader.complete( );
+
+	EXPECT_EQ( flight_ticket::DONE, w.replay( srv ) );
+	EXPECT_EQ( "something", w.written( ) );
+}
+
+TEST_F( single_flight_tests, ChunkedWhenNoLength )
+{
+	single_flight flights;
+	flight_ticket leader;
+	waiter w( srv );
+	w.con.response.transfer_encoding = response_t::HTTP_TRANSFER_ENCODING_CHUNKED;
+
+	leader.join( flights, "GET /x", 0 );
+	w.ticket.join( flights, "GET /x", 0 );
+
+	leader.head( 200, headers, -1 );
+	leader.append( "Wikipedia", 9 );
+	leader.complete( );
+
+	EXPECT_EQ( flight_ticket::DONE, w.replay( srv ) );
+	EXPECT_EQ( "9\r\nWikipedia\r\n0\r\n\r\n", w.written( ) );
+}
+
+TEST_F( single_flight_tests, LeaderGivingUpHandsOn )
+{
+	single_flight flights;
+	waiter w1( srv ), w2( srv );
+
+	{
+		flight_ticket leader;
+		leader.join( flights, "GET /x", 0 );
+		w1.ticket.join( flights, "GET /x", 0 );
+		w2.ticket.join( flights, "GET /x", 0 );
+		w1.wait( );
+		w2.wait( );
+	}
+
+	// Nothing was sent, so join again and one of them leads.
+	EXPECT_TRUE( w1.slot.ready );
+	EXPECT_EQ( flight_ticket::RETRY, w1.replay( srv ) );
+	EXPECT_EQ( flight_ticket::RETRY, w2.replay( srv ) );
+	EXPECT_EQ( 0u, flights.size( ) );
+
+	EXPECT_EQ( flight_ticket::LEAD, w1.ticket.join( flights, "GET /x", 0 ) );
+	EXPECT_EQ( flight_ticket::FOLLOW, w2.ticket.join( flights, "GET /x", 0 ) );
+
+	// This time part way through the body, which can't be taken back.
+	w1.ticket.head( 200, headers, 100 );
+	w1.ticket.append( "part", 4 );
+	EXPECT_EQ( flight_ticket::MORE, w2.replay( srv ) );
+	w1.ticket.leave( );
+
+	EXPECT_EQ( flight_ticket::FAILED, w2.replay( srv ) );
+}
+
+TEST_F( single_flight_tests, PersonalResponsesNotShared )
+{
+	const char* personal[][2] = {
+		{ "Set-Cookie", "session=1" },
+		{ "Cache-Control", "max-age=60, private" },
+		{ "cache-control", "No-Store" },
+		{ "Cache-Control", "private=\"Set-Cookie\"" } };
+
+	for( std::size_t i = 0; i < sizeof( personal ) / sizeof( personal[0] ); ++i )
+	{
+		single_flight flights;
+		flight_ticket leader;
+		waiter w( srv );
+
+		leader.join( flights, "GET /x", 0 );
+		w.ticket.join( flights, "GET /x", 0 );
+		w.wait( );
+
+		array* h = array_init( );
+		data_string* ds = data_string_init( );
+		buffer_copy_string( ds->key, personal[i][0] );
+		buffer_copy_string( ds->value, personal[i][1] );
+		array_insert_unique( h, reinterpret_cast< data_unset* >( ds ) );
+
+		leader.head( 200, h, 4 );
+		leader.append( "mine", 4 );
+		leader.complete( );
+		array_free( h );
+
+		EXPECT_TRUE( w.slot.ready ) << i;
+		EXPECT_EQ( flight_ticket::RETRY, w.replay( srv ) ) << i;
+		EXPECT_EQ( "", w.written( ) ) << i;
+		EXPECT_EQ( 0u, flights.size( ) ) << i;
+	}
+
+	// Public is fine.
+	single_flight flights;
+	flight_ticket leader;
+	waiter w( srv );
+	leader.join( flights, "GET /x", 0 );
+	w.ticket.join( flights, "GET /x", 0 );
+
+	data_string* ds = data_string_init( );
+	buffer_copy_string( ds->key, "Cache-Control" );
+	buffer_copy_string( ds->value, "public, max-age=60" );
+	array_insert_unique( headers, reinterpret_cast< data_unset* >( ds ) );
+
+	leader.head( 200, headers, 4 );
+	leader.append( "ours", 4 );
+	leader.complete( );
+	EXPECT_EQ( flight_ticket::DONE, w.replay( srv ) );
+	EXPECT_EQ( "ours", w.written( ) );
+}
+
+TEST_F( single_flight_tests, BigPiecesGoByFile )
+{
+	single_flight flights;
+	flight_ticket leader;
+	waiter w1( srv ), w2( srv );
+
+	leader.join( flights, "GET /x", 0 );
+	w1.ticket.join( flights, "GET /x", 0 );
+	w2.ticket.join( flights, "GET /x", 0 );
+	w1.wait( );
+
+	std::string body( 64 * 1024, 'x' );
+	leader.head( 200, headers, body.size( ) );
+	leader.append( body.data( ), body.size( ) );
+	leader.complete( );
+
+	EXPECT_EQ( flight_ticket::DONE, w1.replay( srv ) );
+	EXPECT_EQ( flight_ticket::DONE, w2.replay( srv ) );
+
+	// Written once, each waiter sends it from the same file.
+	EXPECT_TRUE( w1.has_file_chunk( ) );
+	EXPECT_EQ( body, w1.written( ) );
+	EXPECT_EQ( body, w2.written( ) );
+}
+
+TEST_F( single_flight_tests, BigBodiesStopTakingWaiters )
+{
+	single_flight flights( 1024 );
+	flight_ticket leader, late;
+	waiter w( srv );
+
+	leader.join( flights, "GET /x", 0 );
+	w.ticket.join( flights, "GET /x", 0 );
+	leader.head( 200, headers, -1 );
+	w.wait( );
+
+	std::string piece( 600, 'x' );
+	leader.append( piece.data( ), piece.size( ) );
+	EXPECT_EQ( flight_ticket::MORE, w.replay( srv ) );
+	w.wait( );
+	leader.append( piece.data( ), piece.size( ) );
+
+	// Past max_shared: the waiter already here is still served, but
+	// the next request leads a flight of its own.
+	EXPECT_EQ( flight_ticket::LEAD, late.join( flights, "GET /x", 0 ) );
+
+	leader.complete( );
+	EXPECT_EQ( flight_ticket::DONE, w.replay( srv ) );
+	EXPECT_EQ( piece + piece, w.written( ) );
+}
+
+TEST_F( single_flight_tests, Keys )
+{
+	connection con;
+	std::memset( &con, 0, sizeof( con ) );
+	con.request.http_method = HTTP_METHOD_GET;
+	con.request.uri = buffer_init( );
+	con.request.http_host = buffer_init( );
+	con.request.headers = array_init( );
+	buffer_copy_string( con.request.uri, "/a?b" );
+	buffer_copy_string( con.request.http_host, "example.com" );
+
+	data_string* ds = data_string_init( );
+	buffer_copy_string( ds->key, "Accept-Encoding" );
+	buffer_copy_string( ds->value, "gzip" );
+	array_insert_unique( con.request.headers, reinterpret_cast< data_unset* >( ds ) );
+
+	EXPECT_EQ( "", flight_key( "", con ) );
+	EXPECT_EQ( std::string( "GET\0/a?b", 8 ), flight_key( "uri", con ) );
+	EXPECT_EQ( std::string( "GET\0example.com\0/a?b\0gzip", 25 ), flight_key( "host uri header:Accept-Encoding", con ) );
+	EXPECT_EQ( std::string( "GET\0/a?b\0", 9 ), flight_key( "uri header:Cookie", con ) );
+
+	// Different methods never share.
+	con.request.http_method = HTTP_METHOD_HEAD;
+	EXPECT_NE( flight_key( "uri", con ), std::string( "GET\0/a?b", 8 ) );
+
+	buffer_free( con.request.uri );
+	buffer_free( con.request.http_host );
+	array_free( con.request.headers );
+}
@@ -0,0 +1,210 @@
+/**
+ * Test that the URI normalizer gives exactly what lighttpd's
+ * buffer_urldecode_path and buffer_path_simplify give, and how much
+ * faster.
+ *
+ * The benchmark runs over the paths in the file named by URI_CORPUS (one
+ * per line, e.g. cut out of an access log) if it is set, otherwise over a
+ * made up mix.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <sys/time.h>
+
+#include <lighttpd-cpp/uri_normalizer.hpp>
+
+static std::string lighttpd_normalize( const std::string& s )
+{
+	buffer* b = buffer_init( );
+	buffer_copy_string_len( b, s.data( ), s.size( ) );
+	buffer_urldecode_path( b );
+	buffer_path_simplify( b, b );
+
+	std::string r( b->ptr, b->used ? b->used - 1 : 0 );
+	buffer_free( b );
+	return r;
+}
+
+static std::string our_normalize( const std::string& s )
+{
+	buffer* b = buffer_init( );
+	buffer_copy_string_len( b, s.data( ), s.size( ) );
+	uri_normalizer::normalize( b );
+
+	std::string r( b->ptr, b->used ? b->used - 1 : 0 );
+	buffer_free( b );
+	return r;
+}
+
+TEST( uri_normalizer_tests, Examples )
+{
+	EXPECT_EQ( "/", our_normalize( "/" ) );
+	EXPECT_EQ( "/a/b/", our_normalize( "/a/b/" ) );
+	EXPECT_EQ( "/", our_normalize( "/blah/.." ) );
+	EXPECT_EQ( "/foo", our_normalize( "/blah/../foo" ) );
+	EXPECT_EQ( "/abc/xyz", our_normalize( "/abc/./xyz" ) );
+	EXPECT_EQ( "/abc/xyz", our_normalize( "//abc//xyz" ) );
+	EXPECT_EQ( "/etc/passwd", our_normalize( "/a/%2e%2E/../etc/passwd" ) );
+	EXPECT_EQ( "/a b/_", our_normalize( "/a%20b/%0a" ) );
+	EXPECT_EQ( "/%zz%4", our_normalize( "/%zz%4" ) );
+	EXPECT_EQ( "/.hidden/..x", our_normalize( "/.hidden/..x" ) );
+}
+
+TEST( uri_normalizer_tests, NormalPathsAreLeftAlone )
+{
+	EXPECT_TRUE( uri_normalizer::is_normal( "/", 1 ) );
+	EXPECT_TRUE( uri_normalizer::is_normal( "/images/2019/hero.jpg", 21 ) );
+	EXPECT_FALSE( uri_normalizer::is_normal( "/images/2019/hero%20.jpg", 24 ) );
+	EXPECT_FALSE( uri_normalizer::is_normal( "/images/2019//hero.jpg", 22 ) );
+	EXPECT_FALSE( uri_normalizer::is_normal( "/images/2019/./hero.jpg", 23 ) );
+	EXPECT_FALSE( uri_normalizer::is_normal( "images", 6 ) );
+}
+
+// Paths made mostly of the characters that matter.
+static std::string random_path( )
+{
+	static const char alphabet[] = "//////......%%%%22eEfF0aZ_ -\x01\x7f\xff";
+	static const char* pieces[] = { "/", "/..", "/.", "//", "%2e", "%2F", "%2", "%", "/index.html", "%00" };
+
+	std::string s;
+	if( std::rand( ) % 8 ) s += '/';
+
+	for( int n = std::rand( ) % 24; n; --n )
+	{
+		if( std::rand( ) % 3 )
+			s += alphabet[ std::rand( ) % ( sizeof( alphabet ) - 1 ) ];
+		else
+			s += pieces[ std::rand( ) % ( sizeof( pieces ) / sizeof( pieces[0] ) ) ];
+	}
+	return s;
+}
+
+TEST( uri_normalizer_tests, SameAsLighttpd )
+{
+	std::srand( 1 );
+
+	for( int round = 0; round < 1000000; ++round )
+	{
+		std::string s = random_path( );
+		ASSERT_EQ( lighttpd_normalize( s ), our_normalize( s ) ) << s;
+	}
+}
+
+// Long enough to go through the vector loops, with the interesting bit
+// at every offset.
+TEST( uri_normalizer_tests, SameAsLighttpdAtEveryOffset )
+{
+	const char* tails[] = { "//x", "/./x", "/../x", "%41", "%4", "/.", "/..", "/" };
+
+	for( std::size_t i = 0; i < sizeof( tails ) / sizeof( tails[0] ); ++i )
+	{
+		for( std::size_t pad = 0; pad < 80; ++pad )
+		{
+			std::string s = "/" + std::string( pad, 'a' ) + tails[i] + "/" + std::string( 40, 'b' );
+			ASSERT_EQ( lighttpd_normalize( s ), our_normalize( s ) ) << s;
+
+			s = "/" + std::string( pad, 'a' ) + tails[i];
+			ASSERT_EQ( lighttpd_normalize( s ), our_normalize( s ) ) << s;
+		}
+	}
+}
+
+static double seconds( )
+{
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::vector< std::string > corpus( )
+{
+	std::vector< std::string > paths;
+
+	if( const char* file = std::getenv( "URI_CORPUS" ) )
+	{
+		std::ifstream in( file );
+		std::string line;
+		while( std::getline( in, line ) )
+		{
+			if( !line.empty( ) ) paths.push_back( line );
+		}
+		if( !paths.empty( ) ) return paths;
+	}
+
+	const char* made_up[] =
+	{
+		"/",
+		"/index.html",
+		"/favicon.ico",
+		"/static/css/site.min.css",
+		"/static/js/vendor/jquery-3.3.1.min.js",
+		"/images/2019/03/some-rather-long-article-slug/hero-1200x630.jpg",
+		"/api/v2/users/12345/orders/67890/items",
+		"/blog/2019/03/some-rather-long-article-slug/",
+		"/search/caf%C3%A9%20cr%C3%A8me",
+		"/files/Annual%20Report%202018.pdf",
+		"/docs/./guide/../reference/index.html",
+		"//static//css/site.css",
+	};
+	for( int i = 0; i < 1000; ++i )
+		paths.push_back( made_up[ i % ( sizeof( made_up ) / sizeof( made_up[0] ) ) ] );
+	return paths;
+}
+
+TEST( uri_normalizer_tests, Throughput )
+{
+	std::vector< std::string > paths = corpus( );
+	std::vector< buffer* > ours, theirs;
+	std::size_t bytes = 0;
+
+	for( std::vector< std::string >::const_iterator i = paths.begin( ); i != paths.end( ); ++i )
+	{
+		ours.push_back( buffer_init( ) );
+		theirs.push_back( buffer_init( ) );
+		bytes += i->size( );
+	}
+
+	const int rounds = 200;
+	double our_time = 0, their_time = 0;
+
+	for( int r = 0; r < rounds; ++r )
+	{
+		for( std::size_t i = 0; i < paths.size( ); ++i )
+		{
+			buffer_copy_string_len( ours[i], paths[i].data( ), paths[i].size( ) );
+			buffer_copy_string_len( theirs[i], paths[i].data( ), paths[i].size( ) );
+		}
+
+		double start = seconds( );
+		for( std::size_t i = 0; i < paths.size( ); ++i )
+			uri_normalizer::normalize( ours[i] );
+		our_time += seconds( ) - start;
+
+		start = seconds( );
+		for( std::size_t i = 0; i < paths.size( ); ++i )
+		{
+			buffer_urldecode_path( theirs[i] );
+			buffer_path_simplify( theirs[i], theirs[i] );
+		}
+		their_time += seconds( ) - start;
+	}
+
+	for( std::size_t i = 0; i < paths.size( ); ++i )
+	{
+		EXPECT_TRUE( buffer_is_equal( ours[i], theirs[i] ) ) << paths[i];
+		buffer_free( ours[i] );
+		buffer_free( theirs[i] );
+	}
+
+	double total = double( bytes ) * rounds;
+	std::printf( "uri normalizing %lu paths: normalizer %.2f GB/s (%.1f ns/path), lighttpd %.2f GB/s (%.1f ns/path)\n",
+		static_cast< unsigned long >( paths.size( ) ),
+		total / our_time / 1e9, our_time * 1e9 / ( paths.size( ) * rounds ),
+		total / their_time / 1e9, their_time * 1e9 / ( paths.size( ) * rounds ) );
+}
@@ -0,0 +1,99 @@
+/**
+ * Test the work stealing pool runs everything it is given, wakes the
+ * right connections and keeps its tuning numbers.
+ */
+
+#include <vector>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <lighttpd-cpp/work_pool.hpp>
+
+static void add_one( boost::atomic< int >* counter )
+{
+	++*counter;
+}
+
+static void snooze( int ms )
+{
+	boost::this_thread::sleep( boost::posix_time::milliseconds( ms ) );
+}
+
+class work_pool_tests : public testing::Test
+{
+	public:
+		void SetUp( )
+		{
+			// Nothing is registered without srv.ev, so a blank server will do.
+			std::memset( &srv, 0, sizeof( srv ) );
+			std::memset( &con, 0, sizeof( con ) );
+		}
+
+		// Wait for every ticket, handing completions back as the
+		// wakeup handler would.
+		void wait_all( work_pool& pool, const std::vector< work_ticket_ptr >& tickets )
+		{
+			for( std::vector< work_ticket_ptr >::const_iterator i = tickets.begin( ); i != tickets.end( ); ++i )
+			{
+				while( !(*i)->done( ) ) snooze( 1 );
+			}
+			pool.complete( );
+		}
+
+		server srv;
+		connection con;
+};
+
+TEST_F( work_pool_tests, RunsEverything )
+{
+	work_pool pool( srv, 4 );
+	boost::atomic< int > counter( 0 );
+	std::vector< work_ticket_ptr > tickets;
+
+	EXPECT_EQ( 4u, pool.threads( ) );
+
+	for( int i = 0; i < 1000; ++i )
+		tickets.push_back( pool.submit( con, boost::bind( &add_one, &counter ) ) );
+
+	wait_all( pool, tickets );
+
+	EXPECT_EQ( 1000, counter.load( ) );
+	EXPECT_EQ( 1000u, pool.jobs_completed( ) );
+	EXPECT_EQ( 0u, pool.queue_depth( ) );
+}
+
+TEST_F( work_pool_tests, IdleWorkersSteal )
+{
+	work_pool pool( srv, 4 );
+	std::vector< work_ticket_ptr > tickets;
+
+	// Dealt round robin, but slow enough that queues back up and
+	// whoever finishes first goes looking elsewhere.
+	for( int i = 0; i < 64; ++i )
+		tickets.push_back( pool.submit( con, boost::bind( &snooze, i % 4 == 0 ? 20 : 1 ) ) );
+
+	wait_all( pool, tickets );
+
+	EXPECT_GT( pool.jobs_stolen( ), 0u );
+	EXPECT_GT( pool.max_wait_us( ), 0u );
+	EXPECT_GE( pool.max_wait_us( ), pool.mean_wait_us( ) );
+}
+
+TEST_F( work_pool_tests, CancelledTicketsStillRun )
+{
+	work_pool pool( srv, 1 );
+	boost::atomic< int > counter( 0 );
+	std::vector< work_ticket_ptr > tickets;
+
+	tickets.push_back( pool.submit( con, boost::bind( &snooze, 10 ) ) );
+	tickets.push_back( pool.submit( con, boost::bind( &add_one, &counter ) ) );
+	pool.cancel( tickets.back( ) );
+
+	wait_all( pool, tickets );
+
+	EXPECT_EQ( 1, counter.load( ) );
+	EXPECT_TRUE( tickets.back( )->cancelled );
+}
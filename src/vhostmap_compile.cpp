@@ -0,0 +1,46 @@
+/**
+ * Builds the table mod_vhostmap maps from a text map of hosts (see
+ * vhost_table.hpp), written beside the output and renamed over it, so
+ * a running server picks it up whole.
+ *
+ *  vhostmap_compile hosts.txt /etc/lighttpd/hosts.vhostmap
+ */
+
+#include <lighttpd-cpp/vhost_table.hpp>
+
+#include <fstream>
+#include <cstdio>
+
+int main( int argc, char** argv )
+{
+	if( argc != 3 )
+	{
+		std::fprintf( stderr, "usage: vhostmap_compile map.txt table.vhostmap\n" );
+		return 2;
+	}
+
+	std::ifstream in( argv[1] );
+	if( !in )
+	{
+		std::perror( argv[1] );
+		return 1;
+	}
+
+	vhost_table_builder builder;
+	std::string error;
+	if( !builder.parse( in, error ) )
+	{
+		std::fprintf( stderr, "vhostmap_compile: %s: %s\n", argv[1], error.c_str( ) );
+		return 1;
+	}
+
+	if( !builder.write( argv[2], error ) )
+	{
+		std::fprintf( stderr, "vhostmap_compile: %s\n", error.c_str( ) );
+		return 1;
+	}
+
+	std::printf( "%lu hosts, %lu wildcards\n",
+		static_cast< unsigned long >( builder.host_count( ) ), static_cast< unsigned long >( builder.wildcard_count( ) ) );
+	return 0;
+}